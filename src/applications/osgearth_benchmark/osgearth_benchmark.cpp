@@ -0,0 +1,1036 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2015 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <osgEarth/Containers>
+#include <osgEarth/Decluttering>
+#include <osgEarth/ElevationLayer>
+#include <osgEarth/Map>
+#include <osgEarth/MapNode>
+#include <osgEarth/Notify>
+#include <osgEarth/Registry>
+#include <osgEarth/SpatialReference>
+#include <osgEarth/StringUtils>
+#include <osgEarth/Terrain>
+#include <osgEarth/TileSource>
+#include <osgEarthDrivers/kml/KML>
+#include <osgEarthDrivers/mbtiles/MBTilesOptions>
+#include <osgEarthFeatures/Feature>
+#include <osgEarthSymbology/Expression>
+#include <osg/ArgumentParser>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/PagedLOD>
+#include <osgDB/ReadFile>
+#include <osgUtil/RenderStage>
+#include <osgUtil/StateGraph>
+#include <osg/Timer>
+#include <OpenThreads/Thread>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stack>
+#include <fstream>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#define LC "[benchmark] "
+
+using namespace osgEarth;
+using namespace osgEarth::Drivers;
+using namespace osgEarth::Features;
+using namespace osgEarth::Symbology;
+
+// documentation
+int usage(char** argv)
+{
+    std::cout
+        << "Runs micro-benchmarks of osgEarth internals.\n\n"
+        << argv[0]
+        << "\n    --srs                               : SRS transform throughput vs. thread count"
+        << "\n    --lru                               : LRUCache vs. ShardedLRUCache contention"
+        << "\n    --mbtiles                           : MBTiles packaging throughput (synthetic pyramid)"
+        << "\n      --levels [int]                    : number of levels to package (default = 6)"
+        << "\n      --batch [int]                     : tiles per transaction (default = 256)"
+        << "\n      --format [ext]                    : tile format (default = png)"
+        << "\n    --elevation                         : elevation tile compositing, per-sample vs. per-layer"
+        << "\n      --layers [int]                    : number of elevation layers (default = 4)"
+        << "\n      --lod [int]                       : level of detail to build (default = 6)"
+        << "\n    --expressions                       : numeric expression evaluation, interpreted vs. compiled vs. batch"
+        << "\n    --declutter                         : declutter sort time per frame vs. label count"
+        << "\n      --frames [int]                    : frames per label count (default = 100)"
+        << "\n      --coherent                        : enable frame-coherent decluttering"
+        << "\n    --terrain                           : terrain height queries, intersection vs. tile heightfields"
+        << "\n      --lod [int]                       : first terrain LOD to build (default = 4)"
+        << "\n    --kml                               : KML load time and memory, per-placemark nodes vs. batched"
+        << "\n      --count [int]                     : number of placemarks (default = 20000)"
+        << "\n    --threads [int]                     : maximum number of threads (default = 8)"
+        << "\n    --count [int]                       : number of operations per thread"
+        << std::endl;
+
+    return 0;
+}
+
+//------------------------------------------------------------------------
+
+namespace
+{
+    /** Runs a set of worker threads concurrently and returns the elapsed seconds. */
+    template<typename WORKER>
+    double runWorkers(std::vector<WORKER*>& workers)
+    {
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for(unsigned i=0; i<workers.size(); ++i)
+            workers[i]->start();
+        for(unsigned i=0; i<workers.size(); ++i)
+            workers[i]->join();
+        osg::Timer_t t1 = osg::Timer::instance()->tick();
+
+        for(unsigned i=0; i<workers.size(); ++i)
+            delete workers[i];
+        workers.clear();
+
+        return osg::Timer::instance()->delta_s(t0, t1);
+    }
+
+    void report(const std::string& name, unsigned threads, double ops, double seconds)
+    {
+        std::cout
+            << std::setw(24) << std::left << name
+            << " threads=" << std::setw(3) << threads
+            << " time=" << std::setw(10) << std::setprecision(4) << seconds << "s"
+            << " rate=" << std::fixed << std::setprecision(0) << (ops/seconds) << "/s"
+            << std::endl;
+        std::cout.unsetf(std::ios::fixed);
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace SRSBenchmark
+{
+    struct Worker : public OpenThreads::Thread
+    {
+        Worker(const SpatialReference* from, const SpatialReference* to, unsigned count)
+            : _from(from), _to(to), _count(count) { }
+
+        void run()
+        {
+            std::vector<osg::Vec3d> points(256);
+            for(unsigned i=0; i<_count; i += points.size())
+            {
+                for(unsigned j=0; j<points.size(); ++j)
+                    points[j].set(-80.0 + 0.001*(double)j, 35.0 + 0.001*(double)j, 0.0);
+                _from->transform(points, _to.get());
+            }
+        }
+
+        osg::ref_ptr<const SpatialReference> _from, _to;
+        unsigned _count;
+    };
+
+    int run(unsigned maxThreads, unsigned count)
+    {
+        osg::ref_ptr<const SpatialReference> wgs84 = SpatialReference::get("wgs84");
+        osg::ref_ptr<const SpatialReference> utm   = SpatialReference::get("+proj=utm +zone=17 +datum=WGS84");
+        osg::ref_ptr<const SpatialReference> merc  = SpatialReference::get("spherical-mercator");
+
+        // prime the SRS objects so initialization does not count.
+        osg::Vec3d temp;
+        wgs84->transform(osg::Vec3d(-80,35,0), utm.get(), temp);
+
+        for(unsigned threads = 1; threads <= maxThreads; threads *= 2)
+        {
+            std::vector<Worker*> workers;
+            for(unsigned i=0; i<threads; ++i)
+                workers.push_back(new Worker(wgs84.get(), utm.get(), count));
+            report("wgs84 -> utm", threads, (double)threads*count, runWorkers(workers));
+
+            for(unsigned i=0; i<threads; ++i)
+                workers.push_back(new Worker(wgs84.get(), merc.get(), count));
+            report("wgs84 -> mercator", threads, (double)threads*count, runWorkers(workers));
+
+            for(unsigned i=0; i<threads; ++i)
+                workers.push_back(new Worker(wgs84.get(), wgs84->getECEF(), count));
+            report("wgs84 -> ecef", threads, (double)threads*count, runWorkers(workers));
+        }
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace LRUBenchmark
+{
+    /** Mixed get/insert load (about 90% reads) on a shared cache. */
+    template<typename CACHE>
+    struct Worker : public OpenThreads::Thread
+    {
+        Worker(CACHE& cache, unsigned seed, unsigned count, unsigned numKeys)
+            : _cache(cache), _seed(seed), _count(count), _numKeys(numKeys) { }
+
+        void run()
+        {
+            unsigned r = _seed;
+            for(unsigned i=0; i<_count; ++i)
+            {
+                r = r * 1664525u + 1013904223u;
+                int key = (int)((r >> 8) % _numKeys);
+                typename CACHE::Record rec;
+                if ( !_cache.get(key, rec) || (r & 0xF) == 0 )
+                    _cache.insert(key, i);
+            }
+        }
+
+        CACHE&   _cache;
+        unsigned _seed, _count, _numKeys;
+    };
+
+    template<typename CACHE>
+    void runOne(const std::string& name, unsigned threads, unsigned count, unsigned cacheSize)
+    {
+        CACHE cache(true, cacheSize);
+        std::vector<Worker<CACHE>*> workers;
+        for(unsigned i=0; i<threads; ++i)
+            workers.push_back(new Worker<CACHE>(cache, i+1, count, cacheSize*2));
+        report(name, threads, (double)threads*count, runWorkers(workers));
+
+        CacheStats stats = cache.getStats();
+        std::cout << "    hit ratio = " << std::setprecision(3) << stats._hitRatio << std::endl;
+    }
+
+    int run(unsigned maxThreads, unsigned count)
+    {
+        const unsigned cacheSize = 4096;
+        for(unsigned threads = 1; threads <= maxThreads; threads *= 2)
+        {
+            runOne< LRUCache<int,unsigned> >       ("LRUCache",        threads, count, cacheSize);
+            runOne< ShardedLRUCache<int,unsigned> >("ShardedLRUCache", threads, count, cacheSize);
+        }
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace MBTilesBenchmark
+{
+    /** Writes every Nth tile of the pyramid to the tile source. */
+    struct Worker : public OpenThreads::Thread
+    {
+        Worker(TileSource* output, unsigned levels, unsigned index, unsigned stride)
+            : _output(output), _levels(levels), _index(index), _stride(stride), _count(0) { }
+
+        void run()
+        {
+            osg::ref_ptr<osg::Image> image = new osg::Image();
+            image->allocateImage(256, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+
+            const Profile* profile = _output->getProfile();
+            unsigned n = 0;
+            for(unsigned lod=0; lod<_levels; ++lod)
+            {
+                unsigned cols, rows;
+                profile->getNumTiles(lod, cols, rows);
+                for(unsigned y=0; y<rows; ++y)
+                {
+                    for(unsigned x=0; x<cols; ++x)
+                    {
+                        if ( (n++ % _stride) != _index )
+                            continue;
+
+                        // a different synthetic pattern for each tile:
+                        for(int t=0; t<image->t(); ++t)
+                            for(int s=0; s<image->s(); ++s)
+                                *(unsigned*)image->data(s, t) = (s*x + t*y + lod) * 2654435761u;
+
+                        if ( _output->storeImage(TileKey(lod, x, y, profile), image.get(), 0L) )
+                            ++_count;
+                    }
+                }
+            }
+        }
+
+        osg::ref_ptr<TileSource> _output;
+        unsigned _levels, _index, _stride, _count;
+    };
+
+    int runOne(unsigned threads, unsigned levels, unsigned batchSize, const std::string& format)
+    {
+        std::string filename = "osgearth_benchmark.mbtiles";
+        ::remove(filename.c_str());
+
+        MBTilesTileSourceOptions options;
+        options.filename() = URI(filename);
+        options.format()   = format;
+        options.batchSize() = batchSize;
+        options.profile()  = ProfileOptions("global-geodetic");
+
+        unsigned count = 0;
+        double seconds = 0.0;
+        {
+            osg::ref_ptr<TileSource> output = TileSourceFactory::create(options);
+            if ( !output.valid() || output->open(TileSource::MODE_WRITE | TileSource::MODE_CREATE).isError() )
+            {
+                OE_WARN << LC << "Failed to create MBTiles output" << std::endl;
+                return -1;
+            }
+
+            std::vector<Worker*> workers;
+            for(unsigned i=0; i<threads; ++i)
+                workers.push_back(new Worker(output.get(), levels, i, threads));
+
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            for(unsigned i=0; i<workers.size(); ++i)
+                workers[i]->start();
+            for(unsigned i=0; i<workers.size(); ++i)
+            {
+                workers[i]->join();
+                count += workers[i]->_count;
+                delete workers[i];
+            }
+
+            // closing the source commits the last batch.
+            output = 0L;
+            seconds = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+        }
+
+        report(Stringify() << "mbtiles batch=" << batchSize, threads, (double)count, seconds);
+        ::remove(filename.c_str());
+        return 0;
+    }
+
+    int run(unsigned maxThreads, unsigned levels, unsigned batchSize, const std::string& format)
+    {
+        for(unsigned threads = 1; threads <= maxThreads; threads *= 2)
+        {
+            if ( runOne(threads, levels, 1, format) != 0 )
+                return -1;
+            if ( batchSize > 1 && runOne(threads, levels, batchSize, format) != 0 )
+                return -1;
+        }
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace ElevationBenchmark
+{
+    /** Synthetic elevation data. All but the last layer have NO_DATA holes
+        that the layers below them fill in. */
+    class SyntheticTileSource : public TileSource
+    {
+    public:
+        SyntheticTileSource(unsigned index, bool holes)
+            : TileSource(TileSourceOptions()), _index(index), _holes(holes) { }
+
+        Status initialize(const osgDB::Options* dbOptions)
+        {
+            setProfile( Registry::instance()->getGlobalGeodeticProfile() );
+            return STATUS_OK;
+        }
+
+        CachePolicy getCachePolicyHint(const Profile* profile) const
+        {
+            return CachePolicy::NO_CACHE;
+        }
+
+        osg::HeightField* createHeightField(const TileKey& key, ProgressCallback* progress)
+        {
+            unsigned size = getPixelsPerTile();
+            const GeoExtent& ex = key.getExtent();
+            osg::HeightField* hf = new osg::HeightField();
+            hf->allocate(size, size);
+            for(unsigned r=0; r<size; ++r)
+            {
+                double lat = ex.yMin() + ex.height()*(double)r/(double)(size-1);
+                for(unsigned c=0; c<size; ++c)
+                {
+                    double lon = ex.xMin() + ex.width()*(double)c/(double)(size-1);
+                    bool hole = _holes && fmod(fabs(lon + 7.0*_index), 10.0) < 4.0;
+                    hf->setHeight(c, r, hole ? NO_DATA_VALUE :
+                        (float)(1000.0*sin(osg::DegreesToRadians(lon*3.0))*cos(osg::DegreesToRadians(lat*2.0)) + 10.0*_index));
+                }
+            }
+            return hf;
+        }
+
+        osg::Image* createImage(const TileKey& key, ProgressCallback* progress)
+        {
+            return 0L;
+        }
+
+        unsigned _index;
+        bool     _holes;
+    };
+
+    /** The compositing loop as it was before it went layer-major: column-major
+        over the output grid, one GeoHeightField::getElevation per sample and
+        layer. Used as the baseline. */
+    bool populatePerSample(const ElevationLayerVector& layers, osg::HeightField* hf, const TileKey& key)
+    {
+        std::vector<GeoHeightField> fields;
+        for(ElevationLayerVector::const_reverse_iterator i = layers.rbegin(); i != layers.rend(); ++i)
+        {
+            TileKey mappedKey = key.mapResolution(hf->getNumColumns(), i->get()->getTileSize());
+            GeoHeightField field = i->get()->createHeightField(mappedKey, 0L);
+            if ( field.valid() )
+                fields.push_back( field );
+        }
+
+        const SpatialReference* srs = key.getProfile()->getSRS();
+        const GeoExtent& ex = key.getExtent();
+        double dx = ex.width()  / (double)(hf->getNumColumns()-1);
+        double dy = ex.height() / (double)(hf->getNumRows()-1);
+
+        for(unsigned c=0; c<hf->getNumColumns(); ++c)
+        {
+            double x = ex.xMin() + dx*(double)c;
+            for(unsigned r=0; r<hf->getNumRows(); ++r)
+            {
+                double y = ex.yMin() + dy*(double)r;
+                for(unsigned i=0; i<fields.size(); ++i)
+                {
+                    float elevation;
+                    if ( fields[i].getElevation(srs, x, y, INTERP_BILINEAR, srs, elevation) && elevation != NO_DATA_VALUE )
+                    {
+                        hf->setHeight(c, r, elevation);
+                        break;
+                    }
+                }
+            }
+        }
+        return !fields.empty();
+    }
+
+    /** Builds every Nth tile at one LOD. */
+    struct Worker : public OpenThreads::Thread
+    {
+        Worker(const ElevationLayerVector& layers, const Profile* profile, unsigned lod, unsigned index, unsigned stride, bool perSample)
+            : _layers(layers), _profile(profile), _lod(lod), _index(index), _stride(stride), _perSample(perSample), _count(0) { }
+
+        void run()
+        {
+            unsigned cols, rows;
+            _profile->getNumTiles(_lod, cols, rows);
+            for(unsigned n = _index; n < cols*rows; n += _stride)
+            {
+                TileKey key(_lod, n % cols, n / cols, _profile.get());
+                osg::ref_ptr<osg::HeightField> hf = new osg::HeightField();
+                hf->allocate(32, 32);
+                hf->getFloatArray()->assign( hf->getFloatArray()->size(), NO_DATA_VALUE );
+
+                bool ok = _perSample ?
+                    populatePerSample(_layers, hf.get(), key) :
+                    _layers.populateHeightField(hf.get(), key, 0L, INTERP_BILINEAR, 0L);
+                if ( ok )
+                    ++_count;
+            }
+        }
+
+        const ElevationLayerVector&   _layers;
+        osg::ref_ptr<const Profile>   _profile;
+        unsigned _lod, _index, _stride;
+        bool     _perSample;
+        unsigned _count;
+    };
+
+    double runOne(const ElevationLayerVector& layers, const Profile* profile, unsigned threads, unsigned lod, bool perSample)
+    {
+        std::vector<Worker*> workers;
+        for(unsigned i=0; i<threads; ++i)
+            workers.push_back(new Worker(layers, profile, lod, i, threads, perSample));
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for(unsigned i=0; i<workers.size(); ++i)
+            workers[i]->start();
+        unsigned count = 0;
+        for(unsigned i=0; i<workers.size(); ++i)
+        {
+            workers[i]->join();
+            count += workers[i]->_count;
+            delete workers[i];
+        }
+        double seconds = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+
+        report(perSample ? "elevation per-sample" : "elevation per-layer", threads, (double)count, seconds);
+        return seconds;
+    }
+
+    int run(unsigned maxThreads, unsigned numLayers, unsigned lod)
+    {
+        MapOptions mapOptions;
+        mapOptions.cachePolicy() = CachePolicy::NO_CACHE;
+        osg::ref_ptr<Map> map = new Map(mapOptions);
+
+        for(unsigned i=0; i<numLayers; ++i)
+        {
+            ElevationLayerOptions options( Stringify() << "layer" << i );
+            map->addElevationLayer( new ElevationLayer(options, new SyntheticTileSource(i, i+1 < numLayers)) );
+        }
+
+        ElevationLayerVector layers;
+        map->getElevationLayers( layers );
+        const Profile* profile = map->getProfile();
+
+        for(unsigned threads = 1; threads <= maxThreads; threads *= 2)
+        {
+            double before = runOne(layers, profile, threads, lod, true);
+            double after  = runOne(layers, profile, threads, lod, false);
+            std::cout << "    speedup = " << std::setprecision(3) << (before/after) << "x" << std::endl;
+        }
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace ExpressionBenchmark
+{
+    // The benchmark expression, and the same thing in RPN for the legacy interpreter.
+    const char* EXPRESSION = "max([height], [floors] * 3.5) + [width] / 2 - 1";
+
+    enum Op { OPERAND, HEIGHT, FLOORS, WIDTH, ADD, SUB, MULT, DIV, MAX };
+    typedef std::pair<Op, double> Atom;
+
+    /** Compares each result with the interpreter's, to a relative tolerance since
+        the evaluation order (and so the rounding) may differ. */
+    bool matches(const char* name, const std::vector<double>& results, const std::vector<double>& expected)
+    {
+        for(unsigned i=0; i<expected.size(); ++i)
+        {
+            double a = results[i], b = expected[i];
+            if ( osg::absolute(a-b) > 1e-9 * osg::maximum(1.0, osg::maximum(osg::absolute(a), osg::absolute(b))) )
+            {
+                OE_WARN << LC << name << " result mismatch at " << i << ": " << a << " != " << b << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** The stack interpreter NumericExpression used before it was compiled. Used as the baseline. */
+    double legacyEval(const std::vector<Atom>& rpn, double height, double floors, double width)
+    {
+        std::stack<double> s;
+        for( unsigned i=0; i<rpn.size(); ++i )
+        {
+            const Atom& a = rpn[i];
+            if ( a.first == ADD || a.first == SUB || a.first == MULT || a.first == DIV || a.first == MAX )
+            {
+                if ( s.size() >= 2 )
+                {
+                    double op2 = s.top(); s.pop();
+                    double op1 = s.top(); s.pop();
+                    s.push(
+                        a.first == ADD  ? op1 + op2 :
+                        a.first == SUB  ? op1 - op2 :
+                        a.first == MULT ? op1 * op2 :
+                        a.first == DIV  ? op1 / op2 :
+                        std::max(op1, op2) );
+                }
+            }
+            else
+            {
+                s.push( a.first == HEIGHT ? height : a.first == FLOORS ? floors : a.first == WIDTH ? width : a.second );
+            }
+        }
+        return s.size() > 0 ? s.top() : 0.0;
+    }
+
+    int run(unsigned count)
+    {
+        std::vector<Atom> rpn;
+        rpn.push_back( Atom(HEIGHT, 0.0) );
+        rpn.push_back( Atom(FLOORS, 0.0) );
+        rpn.push_back( Atom(OPERAND, 3.5) );
+        rpn.push_back( Atom(MULT, 0.0) );
+        rpn.push_back( Atom(MAX, 0.0) );
+        rpn.push_back( Atom(WIDTH, 0.0) );
+        rpn.push_back( Atom(OPERAND, 2.0) );
+        rpn.push_back( Atom(DIV, 0.0) );
+        rpn.push_back( Atom(ADD, 0.0) );
+        rpn.push_back( Atom(OPERAND, 1.0) );
+        rpn.push_back( Atom(SUB, 0.0) );
+
+        // synthetic input, as columns and as features sharing one schema.
+        std::vector<double> height(count), floors(count), width(count);
+        osg::ref_ptr<AttributeSchema> schema = new AttributeSchema();
+        FeatureList features;
+        for(unsigned i=0; i<count; ++i)
+        {
+            height[i] = (double)(i % 97);
+            floors[i] = (double)(i % 13);
+            width[i]  = (double)(i % 31);
+            Feature* f = new Feature(0L, 0L);
+            f->setAttributeSchema( schema.get() );
+            f->set( "height", height[i] );
+            f->set( "floors", (int)floors[i] );
+            f->set( "width",  width[i] );
+            features.push_back( f );
+        }
+
+        NumericExpression expr( EXPRESSION );
+        const NumericExpression::Variables& vars = expr.variables();
+        std::vector<double> expected(count), out(count);
+        bool ok = true;
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for(unsigned i=0; i<count; ++i)
+            expected[i] = legacyEval(rpn, height[i], floors[i], width[i]);
+        double legacy = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+        report("interpreted", 1, (double)count, legacy);
+
+        t0 = osg::Timer::instance()->tick();
+        for(unsigned i=0; i<count; ++i)
+        {
+            expr.set( vars[0], height[i] );
+            expr.set( vars[1], floors[i] );
+            expr.set( vars[2], width[i] );
+            out[i] = expr.eval();
+        }
+        double scalar = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+        report("compiled", 1, (double)count, scalar);
+        ok = matches("compiled", out, expected) && ok;
+
+        std::vector<const double*> columns;
+        columns.push_back( &height[0] );
+        columns.push_back( &floors[0] );
+        columns.push_back( &width[0] );
+        t0 = osg::Timer::instance()->tick();
+        expr.eval( columns, count, &out[0] );
+        double batch = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+        report("compiled batch", 1, (double)count, batch);
+        ok = matches("compiled batch", out, expected) && ok;
+
+        t0 = osg::Timer::instance()->tick();
+        unsigned k = 0;
+        for(FeatureList::const_iterator f = features.begin(); f != features.end(); ++f, ++k)
+            out[k] = f->get()->eval( expr );
+        double perFeature = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+        report("Feature::eval", 1, (double)count, perFeature);
+        ok = matches("Feature::eval", out, expected) && ok;
+
+        t0 = osg::Timer::instance()->tick();
+        Feature::eval( expr, features, out );
+        double featureBatch = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+        report("Feature::eval batch", 1, (double)count, featureBatch);
+        ok = matches("Feature::eval batch", out, expected) && ok;
+
+        std::cout
+            << "    speedup = " << std::setprecision(3) << (legacy/scalar) << "x compiled, "
+            << (legacy/batch) << "x batch" << std::endl;
+
+        return ok ? 0 : -1;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace DeclutterBenchmark
+{
+    /** Runs the declutter bin's sort on "count" synthetic 80x16 labels scattered
+        over a 1920x1080 viewport, drifting a little each frame, without a
+        graphics context. Returns the average milliseconds per frame. */
+    double runOne(unsigned count, unsigned frames)
+    {
+        osg::ref_ptr<osg::Camera> camera = new osg::Camera();
+        camera->setViewport( 0, 0, 1920, 1080 );
+        osg::ref_ptr<osg::RefMatrix> projection = new osg::RefMatrix(
+            osg::Matrix::ortho2D(0, 1920, 0, 1080) );
+
+        osg::ref_ptr<osgUtil::RenderStage> stage = new osgUtil::RenderStage();
+        stage->setCamera( camera.get() );
+        osgUtil::RenderBin* bin = stage->find_or_insert( 13, OSGEARTH_DECLUTTER_BIN );
+
+        // one label quad per geode, like a PlaceNode.
+        osg::ref_ptr<osg::Vec3Array> verts = new osg::Vec3Array();
+        verts->push_back( osg::Vec3(-40, -8, 0) );
+        verts->push_back( osg::Vec3( 40, -8, 0) );
+        verts->push_back( osg::Vec3( 40,  8, 0) );
+        verts->push_back( osg::Vec3(-40,  8, 0) );
+
+        std::vector< osg::ref_ptr<osg::Geode> > geodes;
+        std::vector< osg::Vec2d > positions;
+        for(unsigned i=0; i<count; ++i)
+        {
+            osg::Geometry* geom = new osg::Geometry();
+            geom->setVertexArray( verts.get() );
+            geom->addPrimitiveSet( new osg::DrawArrays(GL_QUADS, 0, 4) );
+            osg::Geode* geode = new osg::Geode();
+            geode->addDrawable( geom );
+            geodes.push_back( geode );
+            positions.push_back( osg::Vec2d((i*7919) % 1920, (i*104729) % 1080) );
+        }
+
+        double total = 0.0;
+        for(unsigned f=0; f<frames; ++f)
+        {
+            bin->reset();
+            osg::ref_ptr<osgUtil::StateGraph> sg = new osgUtil::StateGraph();
+            for(unsigned i=0; i<count; ++i)
+            {
+                osg::Vec2d p = positions[i] + osg::Vec2d( (double)f, 0.5*(double)f );
+                osg::RefMatrix* modelview = new osg::RefMatrix( osg::Matrix::translate(p.x(), p.y(), 0.0) );
+                sg->addLeaf( new osgUtil::RenderLeaf(geodes[i]->getDrawable(0), projection.get(), modelview, (float)i/(float)count) );
+            }
+            bin->addStateGraph( sg.get() );
+
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            bin->sort();
+            total += osg::Timer::instance()->delta_m(t0, osg::Timer::instance()->tick());
+        }
+        bin->reset();
+
+        return total / (double)frames;
+    }
+
+    int run(unsigned frames, bool coherent)
+    {
+        DeclutteringOptions options = Decluttering::getOptions();
+        options.frameCoherent() = coherent;
+        Decluttering::setOptions( options );
+
+        unsigned counts[] = { 500, 1000, 2500, 5000, 10000, 20000 };
+        for(unsigned i=0; i<sizeof(counts)/sizeof(counts[0]); ++i)
+        {
+            double ms = runOne(counts[i], frames);
+            std::cout
+                << std::setw(24) << std::left << (coherent ? "declutter (coherent)" : "declutter")
+                << " labels=" << std::setw(6) << counts[i]
+                << " time=" << std::fixed << std::setprecision(3) << ms << "ms/frame"
+                << std::endl;
+            std::cout.unsetf(std::ios::fixed);
+        }
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace TerrainBenchmark
+{
+    double timeQueries(Terrain* terrain, const std::vector<osg::Vec3d>& points, std::vector<double>& out_heights, unsigned& out_hits)
+    {
+        const SpatialReference* wgs84 = SpatialReference::get("wgs84");
+        out_heights.assign( points.size(), NO_DATA_VALUE );
+        out_hits = 0;
+
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        for(unsigned i=0; i<points.size(); ++i)
+        {
+            if ( terrain->getHeight(wgs84, points[i].x(), points[i].y(), &out_heights[i]) )
+                ++out_hits;
+        }
+        return osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+    }
+
+    int run(unsigned count, unsigned lod)
+    {
+        MapOptions mapOptions;
+        mapOptions.cachePolicy() = CachePolicy::NO_CACHE;
+        osg::ref_ptr<Map> map = new Map(mapOptions);
+        map->addElevationLayer( new ElevationLayer(
+            ElevationLayerOptions("elevation"),
+            new ElevationBenchmark::SyntheticTileSource(0, false)) );
+
+        // The root tiles are built synchronously at the first LOD, so raising
+        // it gives us a populated terrain without a viewer.
+        TerrainOptions terrainOptions;
+        terrainOptions.firstLOD() = lod;
+        osg::ref_ptr<MapNode> mapNode = new MapNode( map.get(), MapNodeOptions(terrainOptions) );
+
+        Terrain* terrain = mapNode->getTerrain();
+        if ( !terrain )
+        {
+            OE_WARN << "No terrain" << std::endl;
+            return -1;
+        }
+
+        osg::ref_ptr<TerrainHeightSource> source = terrain->getHeightSource();
+        if ( !source.valid() )
+        {
+            OE_WARN << "The terrain engine did not install a height source" << std::endl;
+            return -1;
+        }
+
+        std::vector<osg::Vec3d> points( count );
+        for(unsigned i=0; i<count; ++i)
+        {
+            points[i].set(
+                -180.0 + 360.0*(double)::rand()/(double)RAND_MAX,
+                 -85.0 + 170.0*(double)::rand()/(double)RAND_MAX,
+                   0.0 );
+        }
+
+        unsigned hits;
+        std::vector<double> intersected, sampled;
+
+        terrain->setHeightSource( 0L );
+        double intersect = timeQueries(terrain, points, intersected, hits);
+        report("height intersect", 1, (double)count, intersect);
+
+        terrain->setHeightSource( source.get() );
+        double single = timeQueries(terrain, points, sampled, hits);
+        report("height heightfield", 1, (double)count, single);
+
+        std::vector<osg::Vec3d> batch( points );
+        osg::Timer_t t0 = osg::Timer::instance()->tick();
+        unsigned batchHits = terrain->getHeights(SpatialReference::get("wgs84"), batch);
+        double batched = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+        report("height heightfield batch", 1, (double)count, batched);
+
+        // the heightfield and the tile mesh built from it should agree closely.
+        double maxError = 0.0;
+        for(unsigned i=0; i<count; ++i)
+        {
+            if ( intersected[i] != NO_DATA_VALUE && sampled[i] != NO_DATA_VALUE )
+                maxError = std::max( maxError, fabs(intersected[i] - sampled[i]) );
+        }
+
+        std::cout
+            << "    resolved = " << hits << "/" << batchHits << " of " << count
+            << ", max difference = " << std::setprecision(3) << maxError << "m" << std::endl
+            << "    speedup = " << (intersect/single) << "x (single), "
+            << (intersect/batched) << "x (batch)" << std::endl;
+
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+namespace KMLBenchmark
+{
+    /** Resident set size of the process in bytes, where we can tell. */
+    double residentBytes()
+    {
+#ifdef __linux__
+        std::ifstream statm("/proc/self/statm");
+        double size = 0.0, resident = 0.0;
+        statm >> size >> resident;
+        return resident * (double)sysconf(_SC_PAGESIZE);
+#else
+        return 0.0;
+#endif
+    }
+
+    /** Writes a document of shared-style icons and lines, like a large export. */
+    void writeDocument(const std::string& filename, unsigned count)
+    {
+        std::ofstream out( filename.c_str() );
+        out << std::fixed << std::setprecision(6)
+            << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            << "<kml xmlns=\"http://www.opengis.net/kml/2.2\">\n<Document>\n";
+
+        const unsigned numStyles = 8;
+        for(unsigned s=0; s<numStyles; ++s)
+        {
+            out << "<Style id=\"s" << s << "\">"
+                << "<IconStyle><scale>" << (1.0 + 0.1*s) << "</scale></IconStyle>"
+                << "<LineStyle><color>ff00" << std::hex << std::setw(2) << std::setfill('0') << (s*32) << std::dec << std::setfill(' ')
+                << "ff</color><width>2</width></LineStyle>"
+                << "</Style>\n";
+        }
+
+        for(unsigned i=0; i<count; ++i)
+        {
+            double lon = -180.0 + 360.0*(double)::rand()/(double)RAND_MAX;
+            double lat =  -80.0 + 160.0*(double)::rand()/(double)RAND_MAX;
+
+            out << "<Placemark><name>p" << i << "</name><styleUrl>#s" << (i%numStyles) << "</styleUrl>";
+            if ( i % 5 == 4 )
+            {
+                out << "<LineString><tessellate>1</tessellate><coordinates>"
+                    << lon << "," << lat << ",0 "
+                    << std::min(lon+0.05, 180.0) << "," << lat+0.05 << ",0 "
+                    << std::min(lon+0.10, 180.0) << "," << lat << ",0"
+                    << "</coordinates></LineString>";
+            }
+            else
+            {
+                out << "<Point><coordinates>" << lon << "," << lat << ",0</coordinates></Point>";
+            }
+            out << "</Placemark>\n";
+        }
+
+        out << "</Document>\n</kml>\n";
+    }
+
+    /** Pages in every batch tile under "node", as the pager would; returns the number loaded. */
+    unsigned loadAllTiles(osg::Node* node)
+    {
+        unsigned count = 0;
+        osg::PagedLOD* plod = dynamic_cast<osg::PagedLOD*>( node );
+        if ( plod && plod->getNumFileNames() > 0 && plod->getNumChildren() == 0 )
+        {
+            osg::ref_ptr<osg::Node> tile = osgDB::readNodeFile( plod->getFileName(0) );
+            if ( tile.valid() )
+            {
+                plod->addChild( tile.get() );
+                ++count;
+            }
+        }
+
+        osg::Group* group = node ? node->asGroup() : 0L;
+        for(unsigned i=0; group && i<group->getNumChildren(); ++i)
+            count += loadAllTiles( group->getChild(i) );
+
+        return count;
+    }
+
+    int run(unsigned count)
+    {
+        std::string filename = "osgearth_benchmark_kml.kml";
+        writeDocument( filename, count );
+
+        osg::ref_ptr<Map> map = new Map();
+        osg::ref_ptr<MapNode> mapNode = new MapNode( map.get() );
+
+        // an in-memory icon, so neither mode waits on the network.
+        osg::ref_ptr<osg::Image> image = new osg::Image();
+        image->allocateImage(16, 16, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+        memset(image->data(), 0xff, image->getTotalSizeInBytes());
+        osg::ref_ptr<IconSymbol> icon = new IconSymbol();
+        icon->setImage( image.get() );
+
+        for(int batched=0; batched<2; ++batched)
+        {
+            KMLOptions options;
+            options.defaultIconSymbol() = icon.get();
+            options.declutter() = false;
+            options.batch() = batched == 1;
+
+            double mem0 = residentBytes();
+            osg::Timer_t t0 = osg::Timer::instance()->tick();
+            osg::ref_ptr<osg::Node> node = KML::load( URI(filename), mapNode.get(), options );
+            double load = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+            double mem1 = residentBytes();
+
+            if ( !node.valid() )
+            {
+                OE_WARN << "Failed to load " << filename << std::endl;
+                return -1;
+            }
+
+            report(batched ? "kml batched load" : "kml nodes load", 1, (double)count, load);
+
+            std::cout << "    memory = " << std::setprecision(4) << (mem1-mem0)/1048576.0 << "MB";
+
+            if ( batched )
+            {
+                t0 = osg::Timer::instance()->tick();
+                unsigned tiles = loadAllTiles( node.get() );
+                double build = osg::Timer::instance()->delta_s(t0, osg::Timer::instance()->tick());
+                std::cout
+                    << ", all " << tiles << " tiles built in " << build << "s"
+                    << ", memory = " << (residentBytes()-mem0)/1048576.0 << "MB";
+            }
+            std::cout << std::endl;
+        }
+
+        ::remove( filename.c_str() );
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------
+
+int
+main(int argc, char** argv)
+{
+    osg::ArgumentParser args(&argc, argv);
+
+    if ( args.read("--help") || argc == 1 )
+        return usage(argv);
+
+    unsigned threads = 8;
+    args.read("--threads", threads);
+
+    if ( args.read("--srs") )
+    {
+        unsigned count = 1000000;
+        args.read("--count", count);
+        return SRSBenchmark::run(threads, count);
+    }
+
+    if ( args.read("--lru") )
+    {
+        unsigned count = 1000000;
+        args.read("--count", count);
+        return LRUBenchmark::run(threads, count);
+    }
+
+    if ( args.read("--mbtiles") )
+    {
+        unsigned levels = 6, batchSize = 256;
+        std::string format = "png";
+        args.read("--levels", levels);
+        args.read("--batch", batchSize);
+        args.read("--format", format);
+        return MBTilesBenchmark::run(threads, levels, batchSize, format);
+    }
+
+    if ( args.read("--elevation") )
+    {
+        unsigned layers = 4, lod = 6;
+        args.read("--layers", layers);
+        args.read("--lod", lod);
+        return ElevationBenchmark::run(threads, layers, lod);
+    }
+
+    if ( args.read("--expressions") )
+    {
+        unsigned count = 1000000;
+        args.read("--count", count);
+        return ExpressionBenchmark::run(count);
+    }
+
+    if ( args.read("--declutter") )
+    {
+        unsigned frames = 100;
+        args.read("--frames", frames);
+        bool coherent = args.read("--coherent");
+        return DeclutterBenchmark::run(frames, coherent);
+    }
+
+    if ( args.read("--terrain") )
+    {
+        unsigned count = 10000, lod = 4;
+        args.read("--count", count);
+        args.read("--lod", lod);
+        return TerrainBenchmark::run(count, lod);
+    }
+
+    if ( args.read("--kml") )
+    {
+        unsigned count = 20000;
+        args.read("--count", count);
+        return KMLBenchmark::run(count);
+    }
+
+    return usage(argv);
+}
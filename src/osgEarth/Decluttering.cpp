@@ -30,11 +30,15 @@
 #include <osg/UserDataContainer>
 #include <set>
 #include <algorithm>
+#include <cmath>
 
 #define LC "[Declutter] "
 
 #define FADE_UNIFORM_NAME "oe_declutter_fade"
 
+// size (in pixels) of the cells of the screen-space occupancy grid
+#define GRID_CELL_SIZE 64.0f
+
 using namespace osgEarth;
 
 //----------------------------------------------------------------------------
@@ -81,18 +85,119 @@ namespace
     // TODO: a way to clear out this list when drawables go away
     struct DrawableInfo
     {
-        DrawableInfo() : _lastAlpha(1.0), _lastScale(1.0) { }
+        DrawableInfo() : _lastAlpha(1.0), _lastScale(1.0), _acceptedFrame(0) { }
         float _lastAlpha, _lastScale;
+        unsigned _acceptedFrame; // last pass in which the drawable was visible (0 = never)
     };
 
     typedef std::map<const osg::Drawable*, DrawableInfo> DrawableMemory;
     
     typedef std::pair<const osg::Node*, osg::BoundingBox> RenderLeafBox;
 
+    // Screen-space uniform grid over the boxes that passed the occlusion test.
+    // Each cell lists the boxes that overlap it, so testing a new box only
+    // involves the boxes in the cells it covers. Boxes that fall (partly)
+    // outside the viewport go into the border cells.
+    struct OccupancyGrid
+    {
+        OccupancyGrid() : _cols(0), _rows(0) { }
+
+        // sizes the grid to the viewport and empties it.
+        void reset( float width, float height )
+        {
+            unsigned cols = std::max( 1u, (unsigned)ceil(width/GRID_CELL_SIZE) );
+            unsigned rows = std::max( 1u, (unsigned)ceil(height/GRID_CELL_SIZE) );
+            if ( cols != _cols || rows != _rows )
+            {
+                _cols = cols;
+                _rows = rows;
+                _cells.clear();
+                _cells.resize( _cols*_rows );
+                _touched.clear();
+            }
+            else
+            {
+                for( std::vector<unsigned>::const_iterator i = _touched.begin(); i != _touched.end(); ++i )
+                    _cells[*i].clear();
+                _touched.clear();
+            }
+        }
+
+        // whether "box" doesn't overlap any of the boxes in "used" (other than
+        // those from the same parent).
+        bool isClear( const osg::BoundingBox& box, const osg::Node* parent, const std::vector<RenderLeafBox>& used ) const
+        {
+            unsigned c0, c1, r0, r1;
+            range( box, c0, c1, r0, r1 );
+            for( unsigned r = r0; r <= r1; ++r )
+            {
+                for( unsigned c = c0; c <= c1; ++c )
+                {
+                    const std::vector<unsigned>& cell = _cells[r*_cols + c];
+                    for( std::vector<unsigned>::const_iterator i = cell.begin(); i != cell.end(); ++i )
+                    {
+                        const RenderLeafBox& j = used[*i];
+
+                        // only need a 2D test since we're in clip space
+                        bool isClear =
+                            box.xMin() > j.second.xMax() ||
+                            box.xMax() < j.second.xMin() ||
+                            box.yMin() > j.second.yMax() ||
+                            box.yMax() < j.second.yMin();
+
+                        // if there's an overlap (and the conflict isn't from the same drawable
+                        // parent, which is acceptable), then the leaf is culled.
+                        if ( !isClear && parent != j.first )
+                            return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        // adds box number "index" to the grid.
+        void insert( const osg::BoundingBox& box, unsigned index )
+        {
+            unsigned c0, c1, r0, r1;
+            range( box, c0, c1, r0, r1 );
+            for( unsigned r = r0; r <= r1; ++r )
+            {
+                for( unsigned c = c0; c <= c1; ++c )
+                {
+                    std::vector<unsigned>& cell = _cells[r*_cols + c];
+                    if ( cell.empty() )
+                        _touched.push_back( r*_cols + c );
+                    cell.push_back( index );
+                }
+            }
+        }
+
+        // range of cells covered by a box. A degenerate (NaN) box covers all of them.
+        void range( const osg::BoundingBox& box, unsigned& c0, unsigned& c1, unsigned& r0, unsigned& r1 ) const
+        {
+            c0 = cell( box.xMin(), _cols, 0 );
+            c1 = cell( box.xMax(), _cols, _cols-1 );
+            r0 = cell( box.yMin(), _rows, 0 );
+            r1 = cell( box.yMax(), _rows, _rows-1 );
+        }
+
+        static unsigned cell( float v, unsigned count, unsigned nanCell )
+        {
+            if ( osg::isNaN(v) ) return nanCell;
+            if ( v <= 0.0f ) return 0;
+            float c = v / GRID_CELL_SIZE;
+            return c >= (float)(count-1) ? count-1 : (unsigned)c;
+        }
+
+        unsigned                             _cols, _rows;
+        std::vector< std::vector<unsigned> > _cells;
+        std::vector<unsigned>                _touched;
+    };
+
     // Data structure stored one-per-View.
     struct PerCamInfo
     {
-        PerCamInfo() : _firstFrame(true) { }
+        PerCamInfo() : _firstFrame(true), _frame(0) { }
 
         // remembers the state of each drawable from the previous pass
         DrawableMemory _memory;
@@ -101,6 +206,10 @@ namespace
         osgUtil::RenderBin::RenderLeafList _passed;
         osgUtil::RenderBin::RenderLeafList _failed;
         std::vector<RenderLeafBox>         _used;
+        OccupancyGrid                      _grid;
+
+        // number of the current pass, for frame coherence
+        unsigned _frame;
 
         // time stamp of the previous pass, for calculating animation speed
         //double _lastTimeStamp;
@@ -108,6 +217,18 @@ namespace
         bool _firstFrame;
     };
 
+    // Whether a leaf's drawable was visible in the previous pass.
+    struct AcceptedLastFrame
+    {
+        AcceptedLastFrame( const PerCamInfo& local ) : _local(local) { }
+        bool operator()( const osgUtil::RenderLeaf* leaf ) const
+        {
+            DrawableMemory::const_iterator i = _local._memory.find( leaf->getDrawable() );
+            return i != _local._memory.end() && i->second._acceptedFrame != 0 && i->second._acceptedFrame+1 == _local._frame;
+        }
+        const PerCamInfo& _local;
+    };
+
     static bool s_enabledGlobally = true;
 
     static const char* s_faderFS =
@@ -130,6 +251,7 @@ DeclutteringOptions::fromConfig( const Config& conf )
     conf.getIfSet( "out_animation_time",  _outAnimTime );
     conf.getIfSet( "sort_by_priority",    _sortByPriority );
     conf.getIfSet( "max_objects",         _maxObjects );
+    conf.getIfSet( "frame_coherent",      _frameCoherent );
 }
 
 Config
@@ -142,6 +264,7 @@ DeclutteringOptions::getConfig() const
     conf.addIfSet( "out_animation_time",  _outAnimTime );
     conf.addIfSet( "sort_by_priority",    _sortByPriority );
     conf.addIfSet( "max_objects",         _maxObjects );
+    conf.addIfSet( "frame_coherent",      _frameCoherent );
     return conf;
 }
 
@@ -163,6 +286,9 @@ DeclutteringOptions::getConfig() const
  * Drawables with the same parent (i.e., Geode) are treated as a group. As
  * soon as one passes the occlusion test, all its siblings will automatically
  * pass as well.
+ *
+ * The occupied real estate is tracked in a screen-space grid, so each test
+ * only looks at the objects that are nearby on the screen.
  */
 struct /*internal*/ DeclutterSort : public osgUtil::RenderBin::SortCallback
 {
@@ -209,6 +335,16 @@ struct /*internal*/ DeclutterSort : public osgUtil::RenderBin::SortCallback
         // access the view-specific persistent data:
         osg::Camera* cam   = bin->getStage()->getCamera();                
         PerCamInfo& local = _perCam.get( cam );
+        ++local._frame;
+
+        const DeclutteringOptions& options = _context->_options;
+
+        // in frame-coherent mode, give the objects that were visible last time
+        // first claim on the screen (keeping their relative order).
+        if ( options.frameCoherent() == true && s_enabledGlobally )
+        {
+            std::stable_partition( leaves.begin(), leaves.end(), AcceptedLastFrame(local) );
+        }
 
         osg::Timer_t now = osg::Timer::instance()->tick();
         if (local._firstFrame)
@@ -234,6 +370,8 @@ struct /*internal*/ DeclutterSort : public osgUtil::RenderBin::SortCallback
 
         osg::Matrix windowMatrix = vp->computeWindowMatrix();
 
+        local._grid.reset( vp->width(), vp->height() );
+
         osg::Vec3f  refCamScale(1.0f, 1.0f, 1.0f);
         osg::Matrix refCamScaleMat;
         osg::Matrix refWindowMatrix = windowMatrix;
@@ -255,7 +393,6 @@ struct /*internal*/ DeclutterSort : public osgUtil::RenderBin::SortCallback
         // will be culled as a group.
         std::set<const osg::Node*> culledParents;
 
-        const DeclutteringOptions& options = _context->_options;
         unsigned limit = *options.maxObjects();
 
         // Go through each leaf and test for visibility.
@@ -305,25 +442,7 @@ struct /*internal*/ DeclutterSort : public osgUtil::RenderBin::SortCallback
                 else
                 {
                     // weed out any drawables that are obscured by closer drawables.
-                    // TODO: think about a more efficient algorithm - right now we are just using
-                    // brute force to compare all bbox's
-                    for( std::vector<RenderLeafBox>::const_iterator j = local._used.begin(); j != local._used.end(); ++j )
-                    {
-                        // only need a 2D test since we're in clip space
-                        bool isClear =
-                            box.xMin() > j->second.xMax() ||
-                            box.xMax() < j->second.xMin() ||
-                            box.yMin() > j->second.yMax() ||
-                            box.yMax() < j->second.yMin();
-
-                        // if there's an overlap (and the conflict isn't from the same drawable
-                        // parent, which is acceptable), then the leaf is culled.
-                        if ( !isClear && drawableParent != j->first )
-                        {
-                            visible = false;
-                            break;
-                        }
-                    }
+                    visible = local._grid.isClear( box, drawableParent, local._used );
                 }
             }
 
@@ -331,7 +450,7 @@ struct /*internal*/ DeclutterSort : public osgUtil::RenderBin::SortCallback
             {
                 // passed the test, so add the leaf's bbox to the "used" list, and add the leaf
                 // to the final draw list.
-                //local._used.push_back( std::make_pair(drawableParent, box) );
+                local._grid.insert( box, local._used.size() );
                 local._used.push_back( std::make_pair(drawableParent, box) );
                 local._passed.push_back( leaf );
             }
@@ -370,6 +489,7 @@ struct /*internal*/ DeclutterSort : public osgUtil::RenderBin::SortCallback
                 if ( culledParents.find( drawable->getParent(0) ) == culledParents.end() )
                 {
                     DrawableInfo& info = local._memory[drawable];
+                    info._acceptedFrame = local._frame;
 
                     bool fullyIn = true;
 
@@ -23,6 +23,7 @@
 #include <osgEarth/MemCache>
 #include <osg/Version>
 #include <iterator>
+#include <algorithm>
 
 using namespace osgEarth;
 using namespace OpenThreads;
@@ -157,7 +158,12 @@ _runtimeOptions( options )
 void
 ElevationLayer::init()
 {
-    //nop
+    // heightfields are never modified once created (see createHeightField),
+    // so the L2 cache can share them instead of returning deep clones.
+    if ( _memCache.valid() )
+    {
+        _memCache->setShareObjects( true );
+    }
 }
 
 std::string
@@ -510,15 +516,9 @@ ElevationLayer::createHeightField(const TileKey&    key,
         }
     }
 
-    // write to mem cache if needed:
-    if ( result.valid() && !fromMemCache && _memCache.valid() )
-    {
-        CacheBin* bin = _memCache->getOrCreateBin( key.getProfile()->getFullSignature() ); 
-        bin->write(key.str(), result.getHeightField());
-    }
-
-    // post-processing:
-    if ( result.valid() )
+    // post-processing. This happens before writing to the mem cache, since the
+    // cache shares its heightfields and they must not be modified afterwards.
+    if ( result.valid() && !fromMemCache )
     {
         if ( _runtimeOptions.noDataPolicy() == NODATA_MSL )
         {
@@ -544,6 +544,13 @@ ElevationLayer::createHeightField(const TileKey&    key,
         }
     }
 
+    // write to mem cache if needed:
+    if ( result.valid() && !fromMemCache && _memCache.valid() )
+    {
+        CacheBin* bin = _memCache->getOrCreateBin( key.getProfile()->getFullSignature() ); 
+        bin->write(key.str(), result.getHeightField());
+    }
+
     return result;
 }
 
@@ -578,6 +585,168 @@ namespace
     typedef osg::ref_ptr<ElevationLayer>          RefElevationLayer;
     typedef std::pair<RefElevationLayer, TileKey> LayerAndKey;
     typedef std::vector<LayerAndKey>              LayerAndKeyVector;
+
+    /**
+     * A row-major grid of sample points in the SRS of the tile being built,
+     * plus scratch space for sampling one layer at a time.
+     */
+    struct SampleGrid
+    {
+        SampleGrid(const GeoExtent& extent, unsigned numColumns, unsigned numRows) :
+            _srs  ( extent.getSRS() ),
+            _count( numColumns*numRows ),
+            _x    ( _count ),
+            _y    ( _count ),
+            _localX( _count ),
+            _localY( _count ),
+            _samples( _count )
+        {
+            double dx = extent.width()  / (double)(numColumns-1);
+            double dy = extent.height() / (double)(numRows-1);
+
+            for(unsigned r=0, k=0; r<numRows; ++r)
+            {
+                double y = extent.yMin() + dy*(double)r;
+                for(unsigned c=0; c<numColumns; ++c, ++k)
+                {
+                    _x[k] = extent.xMin() + dx*(double)c;
+                    _y[k] = y;
+                }
+            }
+        }
+
+        const SpatialReference* _srs;
+        unsigned                _count;
+        std::vector<double>     _x, _y;
+        std::vector<double>     _localX, _localY;
+        std::vector<float>      _samples;
+    };
+
+    /**
+     * Samples a layer heightfield at every grid point whose mask entry is set,
+     * into grid._samples. Points that fall outside the heightfield, or on
+     * NO_DATA, get NO_DATA_VALUE. The whole grid goes through one batch SRS
+     * transform, and the bilinear case is interpolated inline in a single
+     * row-major pass; the results match GeoHeightField::getElevation.
+     */
+    void sampleHeightField(const GeoHeightField&    geoHF,
+                           SampleGrid&              grid,
+                           const std::vector<char>& mask,
+                           ElevationInterpolation   interp)
+    {
+        const GeoExtent&        extent = geoHF.getExtent();
+        const SpatialReference* hfSRS  = extent.getSRS();
+        const osg::HeightField* hf     = geoHF.getHeightField();
+
+        // bring the grid into the heightfield's SRS:
+        const double* x = &grid._x[0];
+        const double* y = &grid._y[0];
+
+        if ( !grid._srs->isHorizEquivalentTo(hfSRS) )
+        {
+            std::copy( grid._x.begin(), grid._x.end(), grid._localX.begin() );
+            std::copy( grid._y.begin(), grid._y.end(), grid._localY.begin() );
+
+            if ( !grid._srs->transform(&grid._localX[0], &grid._localY[0], 0L, grid._count, hfSRS) )
+            {
+                // some points failed to transform; sample them one at a time instead.
+                for(unsigned k=0; k<grid._count; ++k)
+                {
+                    if ( mask[k] && !geoHF.getElevation(grid._srs, grid._x[k], grid._y[k], interp, grid._srs, grid._samples[k]) )
+                        grid._samples[k] = NO_DATA_VALUE;
+                }
+                return;
+            }
+
+            x = &grid._localX[0];
+            y = &grid._localY[0];
+        }
+
+        const osg::HeightField::HeightList& heights = hf->getHeightList();
+        int    numColumns = hf->getNumColumns();
+        int    numRows    = hf->getNumRows();
+        double xMin       = extent.xMin();
+        double yMin       = extent.yMin();
+        double xInterval  = extent.width()  / (double)(numColumns-1);
+        double yInterval  = extent.height() / (double)(numRows-1);
+        double maxC       = (double)(numColumns-1);
+        double maxR       = (double)(numRows-1);
+
+        for(unsigned k=0; k<grid._count; ++k)
+        {
+            if ( !mask[k] )
+                continue;
+
+            if ( !extent.contains(x[k], y[k]) )
+            {
+                grid._samples[k] = NO_DATA_VALUE;
+                continue;
+            }
+
+            double c = osg::clampBetween( (x[k]-xMin)/xInterval, 0.0, maxC );
+            double r = osg::clampBetween( (y[k]-yMin)/yInterval, 0.0, maxR );
+
+            if ( interp != INTERP_BILINEAR )
+            {
+                grid._samples[k] = HeightFieldUtils::getHeightAtPixel( hf, c, r, interp );
+                continue;
+            }
+
+            int colMin = (int)c;
+            int rowMin = (int)r;
+            int colMax = osg::minimum( (int)ceil(c), numColumns-1 );
+            int rowMax = osg::minimum( (int)ceil(r), numRows-1 );
+
+            float llHeight = heights[rowMin*numColumns + colMin];
+            float lrHeight = heights[rowMin*numColumns + colMax];
+            float ulHeight = heights[rowMax*numColumns + colMin];
+            float urHeight = heights[rowMax*numColumns + colMax];
+
+            if ( !HeightFieldUtils::validateSamples(urHeight, llHeight, ulHeight, lrHeight) )
+            {
+                grid._samples[k] = NO_DATA_VALUE;
+            }
+            else if ( colMax == colMin && rowMax == rowMin )
+            {
+                grid._samples[k] = llHeight;
+            }
+            else if ( colMax == colMin )
+            {
+                grid._samples[k] = ((double)rowMax - r) * llHeight + (r - (double)rowMin) * ulHeight;
+            }
+            else if ( rowMax == rowMin )
+            {
+                grid._samples[k] = ((double)colMax - c) * llHeight + (c - (double)colMin) * lrHeight;
+            }
+            else
+            {
+                float r1 = ((double)colMax - c) * llHeight + (c - (double)colMin) * lrHeight;
+                float r2 = ((double)colMax - c) * ulHeight + (c - (double)colMin) * urHeight;
+                grid._samples[k] = ((double)rowMax - r) * r1 + (r - (double)rowMin) * r2;
+            }
+        }
+
+        // if the vertical datums don't match, convert the heights. This requires
+        // lat/long points.
+        if ( !hfSRS->isVertEquivalentTo(grid._srs) )
+        {
+            std::vector<double> lon( x, x+grid._count );
+            std::vector<double> lat( y, y+grid._count );
+            if ( !hfSRS->isGeographic() )
+                hfSRS->transform( &lon[0], &lat[0], 0L, grid._count, hfSRS->getGeographicSRS() );
+
+            for(unsigned k=0; k<grid._count; ++k)
+            {
+                if ( mask[k] && grid._samples[k] != NO_DATA_VALUE )
+                {
+                    VerticalDatum::transform(
+                        hfSRS->getVerticalDatum(),
+                        grid._srs->getVerticalDatum(),
+                        lat[k], lon[k], grid._samples[k] );
+                }
+            }
+        }
+    }
 }
 
 bool
@@ -678,145 +847,79 @@ ElevationLayerVector::populateHeightField(osg::HeightField*      hf,
         return false;
     }
     
-    // Sample the layers into our target.
+    // Sample the layers into our target. Each layer is sampled over the
+    // whole grid in one pass, highest priority first; later layers only fill
+    // in the points that are still NO_DATA.
     unsigned numColumns = hf->getNumColumns();
-    unsigned numRows    = hf->getNumRows();    
-    double   xmin       = key.getExtent().xMin();
-    double   ymin       = key.getExtent().yMin();
-    double   dx         = key.getExtent().width() / (double)(numColumns-1);
-    double   dy         = key.getExtent().height() / (double)(numRows-1);
-    
-    // We will load the actual heightfields on demand. We might not need them all.
-    GeoHeightFieldVector heightFields(contenders.size());
-    GeoHeightFieldVector offsetFields(offsets.size());
-    std::vector<bool>    heightFallback(contenders.size(), false);
-    std::vector<bool>    heightFailed(contenders.size(), false);
-    std::vector<bool>    offsetFailed(offsets.size(), false);
+    unsigned numRows    = hf->getNumRows();
 
-    // The maximum number of heightfields to keep in this local cache
-    unsigned int maxHeightFields = 50;
-    unsigned numHeightFieldsInCache = 0;
+    SampleGrid grid( keyToUse.getExtent(), numColumns, numRows );
+    osg::HeightField::HeightList& heights = hf->getHeightList();
 
-    const SpatialReference* keySRS = keyToUse.getProfile()->getSRS();
+    // Points that do not yet have an elevation.
+    std::vector<char> unresolved( grid._count, 1 );
+    unsigned numUnresolved = grid._count;
 
     bool realData = false;
 
-    unsigned int total = numColumns * numRows;
-    unsigned int completed = 0;
-    int nodataCount = 0;
-
-    for (unsigned c = 0; c < numColumns; ++c)
+    for(unsigned i=0; i<contenders.size() && numUnresolved > 0; ++i)
     {
-        double x = xmin + (dx * (double)c);
-        for (unsigned r = 0; r < numRows; ++r)
-        {
-            double y = ymin + (dy * (double)r);
-
-            // Collect elevations from each layer as necessary.
-            bool resolved = false;
+        ElevationLayer* layer = contenders[i].first.get();
+        TileKey actualKey = contenders[i].second;
 
-            for(int i=0; i<contenders.size() && !resolved; ++i)
+        // Fall back on parent keys to make sure that we have data at the
+        // location even if it's fallback.
+        GeoHeightField layerHF;
+        while (!layerHF.valid() && actualKey.valid())
+        {
+            layerHF = layer->createHeightField(actualKey, progress);
+            if (!layerHF.valid())
             {
-                if ( heightFailed[i] )
-                    continue;
-
-                ElevationLayer* layer = contenders[i].first.get();
-
-                GeoHeightField& layerHF = heightFields[i];
-                TileKey actualKey = contenders[i].second;
-
-                if (!layerHF.valid())
-                {
-                    // We couldn't get the heightfield from the cache, so try to create it.
-                    // We also fallback on parent layers to make sure that we have data at the location even if it's fallback.
-                    while (!layerHF.valid() && actualKey.valid())
-                    {
-                        layerHF = layer->createHeightField(actualKey, progress);
-                        if (!layerHF.valid())
-                        {
-                            actualKey = actualKey.createParentKey();
-                        }
-                    }
-
-                    // Mark this layer as fallback if necessary.
-                    if (layerHF.valid())
-                    {
-                        heightFallback[i] = actualKey != contenders[i].second;
-                        numHeightFieldsInCache++;
-                    }
-                    else
-                    {
-                        heightFailed[i] = true;
-                        continue;
-                    }
-                }
-
-                if (layerHF.valid())
-                {
-                    bool isFallback = heightFallback[i];
+                actualKey = actualKey.createParentKey();
+            }
+        }
 
-                    // We only have real data if this is not a fallback heightfield.
-                    if (!isFallback)
-                    {
-                        realData = true;
-                    }
+        if ( !layerHF.valid() )
+            continue;
 
-                    float elevation;
-                    if (layerHF.getElevation(keySRS, x, y, interpolation, keySRS, elevation))
-                    {
-                        if ( elevation != NO_DATA_VALUE )
-                        {
-                            resolved = true;                    
-                            hf->setHeight(c, r, elevation);
-                        }
-                        else
-                        {
-                            ++nodataCount;
-                        }
-                    }
-                }
+        // We only have real data if this is not a fallback heightfield.
+        if ( actualKey == contenders[i].second )
+        {
+            realData = true;
+        }
 
+        sampleHeightField( layerHF, grid, unresolved, interpolation );
 
-                // Clear the heightfield cache if we have too many heightfields in the cache.
-                if (numHeightFieldsInCache >= maxHeightFields)
-                {
-                    //OE_NOTICE << "Clearing cache" << std::endl;
-                    for (unsigned int k = 0; k < heightFields.size(); k++)
-                    {
-                        heightFields[k] = GeoHeightField::INVALID;
-                        heightFallback[k] = false;
-                    }
-                    numHeightFieldsInCache = 0;
-                }
+        for(unsigned k=0; k<grid._count; ++k)
+        {
+            if ( unresolved[k] && grid._samples[k] != NO_DATA_VALUE )
+            {
+                heights[k] = grid._samples[k];
+                unresolved[k] = 0;
+                --numUnresolved;
             }
+        }
+    }
 
-            for(int i=offsets.size()-1; i>=0; --i)
-            {
-                if ( offsetFailed[i] )
-                    continue;
+    // Offsets apply to every point.
+    std::vector<char> all( grid._count, 1 );
 
-                GeoHeightField& layerHF = offsetFields[i];
-                if ( !layerHF.valid() )
-                {
-                    ElevationLayer* offset = offsets[i].first.get();
+    for(int i=offsets.size()-1; i>=0; --i)
+    {
+        GeoHeightField layerHF = offsets[i].first->createHeightField(offsets[i].second, progress);
+        if ( !layerHF.valid() )
+            continue;
 
-                    layerHF = offset->createHeightField(offsets[i].second, progress);
-                    if ( !layerHF.valid() )
-                    {
-                        offsetFailed[i] = true;
-                        continue;
-                    }
-                }
+        // If we actually got a layer then we have real data
+        realData = true;
 
-                // If we actually got a layer then we have real data
-                realData = true;
+        sampleHeightField( layerHF, grid, all, interpolation );
 
-                float elevation = 0.0f;
-                if (layerHF.getElevation(keySRS, x, y, interpolation, keySRS, elevation) &&
-                    elevation != NO_DATA_VALUE)
-                {                    
-                    hf->getHeight(c, r) += elevation;
-                }
+        for(unsigned k=0; k<grid._count; ++k)
+        {
+            if ( grid._samples[k] != NO_DATA_VALUE )
+            {
+                heights[k] += grid._samples[k];
             }
         }
     }
@@ -20,15 +20,39 @@
 #include <osgEarth/Locators>
 #include <osgEarth/HeightFieldUtils>
 #include <osgEarth/DPLineSegmentIntersector>
+#include <osgEarth/Registry>
 #include <osgUtil/IntersectionVisitor>
+#include <OpenThreads/Thread>
 
 #define LC "[ElevationQuery] "
 
 using namespace osgEarth;
 using namespace OpenThreads;
 
+// batches of fewer tiles than this are fetched on the calling thread.
+#define MIN_PARALLEL_TILES 4
+
 namespace
 {
+    // All queries fetch on the same service, which takes its threads from the
+    // Registry's shared pool; queries are created all over (often on pager
+    // threads), so a service of their own would grow the thread count unbounded.
+    Threading::Mutex s_serviceMutex;
+    UID              s_serviceUID = -1;
+
+    TaskService* getSharedService(unsigned weight)
+    {
+        Threading::ScopedMutexLock lock( s_serviceMutex );
+        if ( s_serviceUID < 0 )
+        {
+            s_serviceUID = Registry::instance()->createUID();
+        }
+
+        TaskService* service = Registry::instance()->getTaskServiceManager()->getOrAdd( s_serviceUID, (float)weight );
+        service->setName( "ElevationQuery" );
+        return service;
+    }
+
     int nextPowerOf2(int x) {
         --x;
         x |= x >> 1;
@@ -38,8 +62,26 @@ namespace
         x |= x >> 16;
         return x+1;
     }
+
+    // resolution of elevation tiles
+    const unsigned s_tileSize = 33; // ???
 }
 
+/** Fetches one elevation tile on a TaskService thread. */
+struct ElevationQuery::FetchTask
+{
+    FetchTask() : _query(0L), _result(0L) { }
+
+    void execute()
+    {
+        *_result = _query->getHeightField( _key );
+    }
+
+    ElevationQuery* _query;
+    TileKey         _key;
+    GeoHeightField* _result;
+};
+
 ElevationQueryCacheReadCallback::ElevationQueryCacheReadCallback()
 {
     _maxNumFilesToCache = 2000;
@@ -109,13 +151,15 @@ osg::Node* ElevationQueryCacheReadCallback::readNodeFile(const std::string& file
 }
 
 ElevationQuery::ElevationQuery(const Map* map) :
-_mapf( map, (Map::ModelParts)(Map::TERRAIN_LAYERS | Map::MODEL_LAYERS) )
+_mapf ( map, (Map::ModelParts)(Map::TERRAIN_LAYERS | Map::MODEL_LAYERS) ),
+_cache( true, 500 )
 {
     postCTOR();
 }
 
 ElevationQuery::ElevationQuery(const MapFrame& mapFrame) :
-_mapf( mapFrame )
+_mapf ( mapFrame ),
+_cache( true, 500 )
 {
     postCTOR();
 }
@@ -128,7 +172,7 @@ ElevationQuery::postCTOR()
     _queries          = 0.0;
     _totalTime        = 0.0;
     _fallBackOnNoData = false;
-    _cache.setMaxSize( 500 );
+    _numThreads       = (unsigned)osg::maximum( OpenThreads::GetNumberOfProcessors(), 1 );
 
     // set read callback for IntersectionVisitor
     setElevationQueryCacheReadCallback(new ElevationQueryCacheReadCallback);
@@ -140,11 +184,23 @@ ElevationQuery::postCTOR()
 void
 ElevationQuery::sync()
 {
-    if ( _mapf.needsSync() )
+    // Queries hold a read lock on the frame while they run, so only take the
+    // write lock when the map has actually changed.
+    bool needsSync;
     {
-        _mapf.sync();
-        _cache.clear();
-        gatherPatchLayers();
+        Threading::ScopedReadLock shared( _frameMutex );
+        needsSync = _mapf.needsSync();
+    }
+
+    if ( needsSync )
+    {
+        Threading::ScopedWriteLock exclusive( _frameMutex );
+        if ( _mapf.needsSync() )
+        {
+            _mapf.sync();
+            _cache.clear();
+            gatherPatchLayers();
+        }
     }
 }
 
@@ -284,6 +340,13 @@ ElevationQuery::getMaxLevelOverride() const
     return _maxLevelOverride;
 }
 
+double
+ElevationQuery::getAverageQueryTime() const
+{
+    Threading::ScopedMutexLock lock( _statsMutex );
+    return _queries > 0.0 ? _totalTime/_queries : 0.0;
+}
+
 bool
 ElevationQuery::getElevation(const GeoPoint&         point,
                              double&                 out_elevation,
@@ -291,6 +354,8 @@ ElevationQuery::getElevation(const GeoPoint&         point,
                              double*                 out_actualResolution)
 {
     sync();
+    Threading::ScopedReadLock shared( _frameMutex );
+
     if ( point.altitudeMode() == ALTMODE_ABSOLUTE )
     {
         return getElevationImpl( point, out_elevation, desiredResolution, out_actualResolution );
@@ -310,14 +375,17 @@ ElevationQuery::getElevations(std::vector<osg::Vec3d>& points,
                               double                   desiredResolution )
 {
     sync();
-    for( osg::Vec3dArray::iterator i = points.begin(); i != points.end(); ++i )
+    Threading::ScopedReadLock shared( _frameMutex );
+
+    std::vector<double> elevations;
+    std::vector<bool>   valid;
+    getElevationsImpl( points, pointsSRS, desiredResolution, elevations, valid );
+
+    for( unsigned i=0; i<points.size(); ++i )
     {
-        double elevation;
-        double z = (*i).z();
-        GeoPoint p(pointsSRS, *i, ALTMODE_ABSOLUTE);
-        if ( getElevationImpl( p, elevation, desiredResolution ) )
+        if ( valid[i] )
         {
-            (*i).z() = ignoreZ ? elevation : elevation + z;
+            points[i].z() = ignoreZ ? elevations[i] : elevations[i] + points[i].z();
         }
     }
     return true;
@@ -330,21 +398,197 @@ ElevationQuery::getElevations(const std::vector<osg::Vec3d>& points,
                               double                         desiredResolution )
 {
     sync();
-    for( osg::Vec3dArray::const_iterator i = points.begin(); i != points.end(); ++i )
+    Threading::ScopedReadLock shared( _frameMutex );
+
+    std::vector<double> elevations;
+    std::vector<bool>   valid;
+    getElevationsImpl( points, pointsSRS, desiredResolution, elevations, valid );
+
+    out_elevations.reserve( out_elevations.size() + points.size() );
+
+    for( unsigned i=0; i<points.size(); ++i )
+    {
+        out_elevations.push_back( valid[i] ? elevations[i] : 0.0 );
+    }
+    return true;
+}
+
+void
+ElevationQuery::getElevationsImpl(const std::vector<osg::Vec3d>& points,
+                                  const SpatialReference*        pointsSRS,
+                                  double                         desiredResolution,
+                                  std::vector<double>&           out_elevations,
+                                  std::vector<bool>&             out_valid)
+{
+    out_elevations.assign( points.size(), 0.0 );
+    out_valid.assign( points.size(), false );
+
+    // transform all the points into the map SRS in one pass:
+    const SpatialReference* querySRS = pointsSRS;
+    std::vector<osg::Vec3d> queryPoints;
+    toMapSRS( points, pointsSRS, queryPoints, querySRS );
+    const std::vector<osg::Vec3d>& input = queryPoints.empty() ? points : queryPoints;
+
+    const Profile* profile = _mapf.getProfile();
+
+    // Terrain patches need an intersection per point, and points that did not
+    // make it into the map SRS need a transform each; query those one at a time.
+    if ( !_patchLayers.empty() || !querySRS || !profile || !querySRS->isHorizEquivalentTo(profile->getSRS()) )
+    {
+        for( unsigned i=0; i<input.size(); ++i )
+        {
+            double elevation;
+            GeoPoint p(querySRS, input[i], ALTMODE_ABSOLUTE);
+            if ( getElevationImpl(p, elevation, desiredResolution) )
+            {
+                out_elevations[i] = elevation;
+                out_valid[i] = true;
+            }
+        }
+        return;
+    }
+
+    if ( _mapf.elevationLayers().empty() )
+    {
+        // this means there are no heightfields.
+        out_valid.assign( points.size(), true );
+        return;
+    }
+
+    osg::Timer_t begin = osg::Timer::instance()->tick();
+
+    int desiredLevel = -1;
+    if ( desiredResolution > 0.0 )
+    {
+        desiredLevel = profile->getLevelOfDetailForHorizResolution( desiredResolution, s_tileSize );
+    }
+
+    // The best available level only varies from point to point when a layer
+    // reports data extents; otherwise compute it once.
+    bool levelVaries = false;
+    for( ElevationLayerVector::const_iterator i = _mapf.elevationLayers().begin(); i != _mapf.elevationLayers().end(); ++i )
+    {
+        TileSource* ts = i->get()->getTileSource();
+        if ( ts && ts->getDataExtents().size() > 0 )
+            levelVaries = true;
+    }
+
+    // Group the points by the tile that covers them.
+    typedef std::map< TileKey, std::vector<unsigned> > Buckets;
+    Buckets buckets;
+
+    int bestAvailLevel = -1;
+    for( unsigned i=0; i<input.size(); ++i )
     {
-        double elevation;
-        GeoPoint p(pointsSRS, *i, ALTMODE_ABSOLUTE);
+        const osg::Vec3d& p = input[i];
 
-        if ( getElevationImpl(p, elevation, desiredResolution) )
+        if ( i == 0 || levelVaries )
+            bestAvailLevel = getMaxLevel( p.x(), p.y(), querySRS, profile, s_tileSize );
+
+        // A negative value means that no data is avaialble at that point at any resolution.
+        if ( bestAvailLevel < 0 )
+            continue;
+
+        int level = (desiredLevel >= 0 && desiredLevel < bestAvailLevel) ? desiredLevel : bestAvailLevel;
+
+        TileKey key = profile->createTileKey( p.x(), p.y(), level );
+        if ( key.valid() )
+            buckets[key].push_back( i );
+    }
+
+    ElevationInterpolation interp = _mapf.getMapInfo().getElevationInterpolation();
+
+    // Fetch each tile once and sample all of its points. Points that need
+    // lower resolution data move on to the parent tile in the next round.
+    while ( !buckets.empty() )
+    {
+        std::vector<TileKey> keys;
+        keys.reserve( buckets.size() );
+        for( Buckets::const_iterator b = buckets.begin(); b != buckets.end(); ++b )
+            keys.push_back( b->first );
+
+        std::vector<GeoHeightField> fields( keys.size() );
+
+        if ( keys.size() >= MIN_PARALLEL_TILES && _numThreads > 1 )
         {
-            out_elevations.push_back( elevation );
+            TaskService* service = getSharedService( _numThreads );
+
+            Threading::MultiEvent semaphore( keys.size() );
+            for( unsigned k=0; k<keys.size(); ++k )
+            {
+                ParallelTask<FetchTask>* task = new ParallelTask<FetchTask>( &semaphore );
+                task->_query  = this;
+                task->_key    = keys[k];
+                task->_result = &fields[k];
+                service->add( task );
+            }
+            semaphore.wait();
         }
         else
         {
-            out_elevations.push_back( 0.0 );
+            for( unsigned k=0; k<keys.size(); ++k )
+                fields[k] = getHeightField( keys[k] );
         }
+
+        Buckets parents;
+        unsigned k = 0;
+        for( Buckets::const_iterator b = buckets.begin(); b != buckets.end(); ++b, ++k )
+        {
+            const GeoHeightField& geoHF = fields[k];
+
+            for( std::vector<unsigned>::const_iterator j = b->second.begin(); j != b->second.end(); ++j )
+            {
+                const osg::Vec3d& p = input[*j];
+                float elevation = 0.0f;
+
+                if ( geoHF.valid() &&
+                     geoHF.getElevation(querySRS, p.x(), p.y(), interp, querySRS, elevation) &&
+                     elevation != NO_DATA_VALUE )
+                {
+                    out_elevations[*j] = (double)elevation;
+                    out_valid[*j] = true;
+                }
+                else if ( !geoHF.valid() || _fallBackOnNoData )
+                {
+                    TileKey parent = b->first.createParentKey();
+                    if ( parent.valid() )
+                        parents[parent].push_back( *j );
+                }
+            }
+        }
+
+        buckets.swap( parents );
+    }
+
+    osg::Timer_t end = osg::Timer::instance()->tick();
+    Threading::ScopedMutexLock lock( _statsMutex );
+    _queries += (double)points.size();
+    _totalTime += osg::Timer::instance()->delta_s( begin, end );
+}
+
+void
+ElevationQuery::toMapSRS(const std::vector<osg::Vec3d>& points,
+                         const SpatialReference*        pointsSRS,
+                         std::vector<osg::Vec3d>&       out_points,
+                         const SpatialReference*&       out_srs) const
+{
+    // getElevationImpl would transform each point into the map SRS individually;
+    // doing it here as a batch means one trip through the transform pipeline.
+    // Horizontally equivalent points are left alone, same as in getElevationImpl.
+    const Profile* profile = _mapf.getProfile();
+    if ( !pointsSRS || !profile || points.empty() || pointsSRS->isHorizEquivalentTo(profile->getSRS()) )
+        return;
+
+    out_points = points;
+    if ( pointsSRS->transform(out_points, profile->getSRS()) )
+    {
+        out_srs = profile->getSRS();
+    }
+    else
+    {
+        // fall back on point-by-point so the failure is localized.
+        out_points.clear();
     }
-    return true;
 }
 
 bool
@@ -365,6 +609,8 @@ ElevationQuery::getElevationImpl(const GeoPoint& point, /* abs */
     // first try the terrain patches.
     if ( _patchLayers.size() > 0 )
     {
+        Threading::ScopedMutexLock lock( _patchMutex );
+
         osgUtil::IntersectionVisitor iv;
 
         if ( _eqcrc.valid() )
@@ -436,8 +682,7 @@ ElevationQuery::getElevationImpl(const GeoPoint& point, /* abs */
         return true;        
     }
 
-    // tile size (resolution of elevation tiles) 
-    unsigned tileSize = 33; // ???
+    unsigned tileSize = s_tileSize;
 
     // This is the max resolution that we actually have data at this point
     int bestAvailLevel = getMaxLevel( point.x(), point.y(), point.getSRS(), _mapf.getProfile(), tileSize );
@@ -483,29 +728,7 @@ ElevationQuery::getElevationImpl(const GeoPoint& point, /* abs */
 
     while ( !result && key.valid() )
     {
-        GeoHeightField geoHF;
-        
-        // Try to get the hf from the cache
-        TileCache::Record record;
-        if ( _cache.get( key, record ) )
-        {                        
-            geoHF = record.value();
-        }
-        else
-        {
-            // Create it            
-            osg::ref_ptr<osg::HeightField> hf = new osg::HeightField();
-            hf->allocate( tileSize, tileSize );
-
-            // Initialize the heightfield to nodata
-            hf->getFloatArray()->assign( hf->getFloatArray()->size(), NO_DATA_VALUE );
-
-            if (_mapf.populateHeightField(hf, key, false /*heightsAsHAE*/, 0L))
-            {                
-                geoHF = GeoHeightField( hf.get(), key.getExtent() );
-                _cache.insert( key, geoHF );
-            }
-        }
+        GeoHeightField geoHF = getHeightField( key );
 
         if (geoHF.valid())
         {            
@@ -537,12 +760,42 @@ ElevationQuery::getElevationImpl(const GeoPoint& point, /* abs */
          
 
     osg::Timer_t end = osg::Timer::instance()->tick();
-    _queries++;
-    _totalTime += osg::Timer::instance()->delta_s( begin, end );
+    {
+        Threading::ScopedMutexLock lock( _statsMutex );
+        _queries++;
+        _totalTime += osg::Timer::instance()->delta_s( begin, end );
+    }
 
     return result;
 }
 
+GeoHeightField
+ElevationQuery::getHeightField(const TileKey& key)
+{
+    // Try to get the hf from the cache
+    TileCache::Record record;
+    if ( _cache.get( key, record ) )
+    {
+        return record.value();
+    }
+
+    // Create it
+    osg::ref_ptr<osg::HeightField> hf = new osg::HeightField();
+    hf->allocate( s_tileSize, s_tileSize );
+
+    // Initialize the heightfield to nodata
+    hf->getFloatArray()->assign( hf->getFloatArray()->size(), NO_DATA_VALUE );
+
+    if (_mapf.populateHeightField(hf, key, false /*heightsAsHAE*/, 0L))
+    {
+        GeoHeightField geoHF( hf.get(), key.getExtent() );
+        _cache.insert( key, geoHF );
+        return geoHF;
+    }
+
+    return GeoHeightField::INVALID;
+}
+
 void ElevationQuery::setElevationQueryCacheReadCallback(ElevationQueryCacheReadCallback* eqcrc)
 {
     _eqcrc = eqcrc;
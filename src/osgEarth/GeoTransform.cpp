@@ -23,7 +23,9 @@ using namespace osgEarth;
 
 GeoTransform::GeoTransform() :
 _autoRecompute     ( false ),
-_autoRecomputeReady( false )
+_autoRecomputeReady( false ),
+_autoRecomputeX    ( 0.0 ),
+_autoRecomputeY    ( 0.0 )
 {
    //nop
 }
@@ -36,6 +38,15 @@ osg::MatrixTransform(rhs, op)
     _terrain            = rhs._terrain.get();
     _autoRecompute      = rhs._autoRecompute;
     _autoRecomputeReady = false;
+    _autoRecomputeX     = 0.0;
+    _autoRecomputeY     = 0.0;
+}
+
+GeoTransform::~GeoTransform()
+{
+    osg::ref_ptr<Terrain> terrain;
+    if ( _autoRecomputeCallback.valid() && _terrain.lock(terrain) )
+        terrain->removeTerrainCallback( _autoRecomputeCallback.get() );
 }
 
 void
@@ -100,14 +111,25 @@ GeoTransform::setPosition(const GeoPoint& position)
     // install auto-recompute?
     if (_autoRecompute &&
         _position.altitudeMode() == ALTMODE_RELATIVE &&
-        !_autoRecomputeReady)
+        terrain.valid())
     {
-        // by using the adapter, there's no need to remove
-        // the callback then this object destructs.
-        terrain->addTerrainCallback(
-           new TerrainCallbackAdapter<GeoTransform>(this) );
-
-        _autoRecomputeReady = true;
+        // the adapter only holds an observer, so the callback goes away
+        // on its own if the terrain outlives this object.
+        if ( !_autoRecomputeCallback.valid() )
+            _autoRecomputeCallback = new TerrainCallbackAdapter<GeoTransform>(this);
+
+        // register at the position so only the tiles under it call back;
+        // re-register when the position moves.
+        if ( !_autoRecomputeReady || p.x() != _autoRecomputeX || p.y() != _autoRecomputeY )
+        {
+            terrain->addTerrainCallback(
+                _autoRecomputeCallback.get(),
+                GeoExtent(p.getSRS(), p.x(), p.y(), p.x(), p.y()) );
+
+            _autoRecomputeX     = p.x();
+            _autoRecomputeY     = p.y();
+            _autoRecomputeReady = true;
+        }
     }
 
     return true;
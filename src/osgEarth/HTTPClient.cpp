@@ -21,6 +21,7 @@
 #include <osgEarth/Version>
 #include <osgEarth/Progress>
 #include <osgEarth/StringUtils>
+#include <osgEarth/Profiler>
 #include <osgDB/ReadFile>
 #include <osgDB/Registry>
 #include <osgDB/FileNameUtils>
@@ -699,7 +700,8 @@ HTTPResponse
 HTTPClient::doGet(const HTTPRequest&    request,
                   const osgDB::Options* options, 
                   ProgressCallback*     progress) const
-{    
+{
+    OE_PROFILE_SCOPE("http.get");
     initialize();
 
     OE_START_TIMER(http_get);
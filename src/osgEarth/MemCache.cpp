@@ -20,6 +20,8 @@
 #include <osgEarth/StringUtils>
 #include <osgEarth/ThreadingUtils>
 #include <osgEarth/Containers>
+#include <osg/Image>
+#include <osg/Shape>
 
 using namespace osgEarth;
 
@@ -30,15 +32,34 @@ using namespace osgEarth;
 namespace
 {
     typedef std::pair<osg::ref_ptr<const osg::Object>, Config> MemCacheEntry;
-    typedef LRUCache<std::string, MemCacheEntry> MemCacheLRU;
+    typedef ShardedLRUCache<std::string, MemCacheEntry> MemCacheLRU;
+
+    // approximate memory footprint of a cached object, for the byte budget.
+    unsigned getSizeInBytes(const osg::Object* object)
+    {
+        const osg::Image* image = dynamic_cast<const osg::Image*>(object);
+        if ( image )
+            return image->getTotalSizeInBytesIncludingMipmaps();
+
+        const osg::HeightField* hf = dynamic_cast<const osg::HeightField*>(object);
+        if ( hf )
+            return hf->getNumColumns() * hf->getNumRows() * sizeof(float);
+
+        const StringObject* so = dynamic_cast<const StringObject*>(object);
+        if ( so )
+            return so->getString().size();
+
+        return sizeof(osg::Object);
+    }
 
     struct MemCacheBin : public CacheBin
     {
-        MemCacheBin( const std::string& id, unsigned maxSize )
+        MemCacheBin( const std::string& id, unsigned maxSize, unsigned maxBytes, bool shareObjects )
             : CacheBin( id ),
-              _lru    ( true /* MT-safe */, maxSize )
+              _lru    ( true /* MT-safe */, maxSize ),
+              _shareObjects( shareObjects )
         {
-            //nop
+            _lru.setMaxBytes( maxBytes );
         }
 
         ReadResult readObject(const std::string& key )
@@ -46,12 +67,20 @@ namespace
             MemCacheLRU::Record rec;
             _lru.get(key, rec);
 
-            // clone required since the cache is in memory
-
             if ( rec.valid() )
             {
                 //OE_INFO << LC << "hits: " << _lru.getStats()._hitRatio*100.0f << "%" << std::endl;
 
+                // in shared mode the caller gets the cached object itself, and is
+                // responsible for cloning it before making any changes.
+                if ( _shareObjects )
+                {
+                    return ReadResult(
+                        const_cast<osg::Object*>(rec.value().first.get()),
+                        rec.value().second );
+                }
+
+                // otherwise a clone is required since the cache is in memory
                 return ReadResult( 
                    osg::clone(rec.value().first.get(), osg::CopyOp::DEEP_COPY_ALL),
                    rec.value().second );
@@ -77,7 +106,7 @@ namespace
         {
             if ( object ) 
             {
-                _lru.insert( key, std::make_pair(object, meta) );
+                _lru.insert( key, std::make_pair(object, meta), getSizeInBytes(object) );
                 return true;
             }
             else
@@ -92,7 +121,7 @@ namespace
 
         bool touch(const std::string& key)
         {
-            // just doing a get will put it at the front of the LRU list
+            // just doing a get will mark it as recently used
             MemCacheLRU::Record dummy;
             return _lru.get(key, dummy);
         }
@@ -110,6 +139,7 @@ namespace
         }
 
         MemCacheLRU _lru;
+        bool        _shareObjects;
     };
     
 
@@ -119,7 +149,9 @@ namespace
 //------------------------------------------------------------------------
 
 MemCache::MemCache( unsigned maxBinSize ) :
-_maxBinSize( std::max(maxBinSize, 1u) )
+_maxBinSize  ( std::max(maxBinSize, 1u) ),
+_maxBinBytes ( 0u ),
+_shareObjects( false )
 {
     //nop
 }
@@ -127,7 +159,7 @@ _maxBinSize( std::max(maxBinSize, 1u) )
 CacheBin*
 MemCache::addBin( const std::string& binID )
 {
-    return _bins.getOrCreate( binID, new MemCacheBin(binID, _maxBinSize) );
+    return _bins.getOrCreate( binID, new MemCacheBin(binID, _maxBinSize, _maxBinBytes, _shareObjects) );
 }
 
 CacheBin*
@@ -148,7 +180,7 @@ MemCache::getOrCreateDefaultBin()
         // double check
         if ( !_defaultBin.valid() )
         {
-            _defaultBin = new MemCacheBin("__default", _maxBinSize);
+            _defaultBin = new MemCacheBin("__default", _maxBinSize, _maxBinBytes, _shareObjects);
         }
     }
 
@@ -156,10 +188,19 @@ MemCache::getOrCreateDefaultBin()
 }
 
 
+CacheStats
+MemCache::getStats(const std::string& binID)
+{
+    MemCacheBin* bin = static_cast<MemCacheBin*>(getBin(binID));
+    return bin ? bin->_lru.getStats() : CacheStats(0, _maxBinSize, 0, 0.0f);
+}
+
 void
 MemCache::dumpStats(const std::string& binID)
 {
-    MemCacheBin* bin = static_cast<MemCacheBin*>(getBin(binID));
-    CacheStats stats = bin->_lru.getStats();
-    OE_INFO << LC << "hit ratio = " << stats._hitRatio << std::endl;
+    CacheStats stats = getStats(binID);
+    OE_INFO << LC
+        << "hits = " << stats._hits << ", misses = " << stats._misses
+        << ", hit ratio = " << stats._hitRatio
+        << ", bytes = " << stats._bytes << std::endl;
 }
@@ -18,58 +18,532 @@
  */
 
 #include <osgEarth/Profiler>
+#include <osgEarth/ThreadingUtils>
 
-#include <map>
 #include <osg/Timer>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+
+#define LC "[Profiler] "
+
+// Compiler thread-local storage; holds only a POD pointer so it works
+// with both GCC/Clang and MSVC.
+#if defined(_MSC_VER)
+#  define OE_PROFILER_TLS __declspec(thread)
+#else
+#  define OE_PROFILER_TLS __thread
+#endif
 
 using namespace osgEarth;
 
-typedef std::map< std::string, osg::Timer_t > StartTimeMap;
-static StartTimeMap S_START_TIMES;
+volatile bool Profiler::_enabled      = false;
+volatile bool Profiler::_traceEnabled = false;
+
+namespace
+{
+    const unsigned MAX_ZONES = 1024;
+    const unsigned MAX_DEPTH = 128;
+
+    // Histogram buckets: SUBS linear steps per power of two of microseconds,
+    // covering 2^MIN_EXP us up to 2^MAX_EXP us.
+    const int      SUBS        = 4;
+    const int      MIN_EXP     = -4;
+    const int      MAX_EXP     = 36;
+    const unsigned NUM_BUCKETS = (MAX_EXP - MIN_EXP) * SUBS;
+
+    unsigned bucketOf(double us)
+    {
+        if ( !(us > 0.0) )
+            return 0;
+        int e;
+        double m = frexp(us, &e); // us = m * 2^e, m in [0.5, 1)
+        if ( e <= MIN_EXP )
+            return 0;
+        if ( e > MAX_EXP )
+            return NUM_BUCKETS-1;
+        int sub = std::min( (int)((m - 0.5) * 2.0 * SUBS), SUBS-1 );
+        return (e - MIN_EXP - 1) * SUBS + sub;
+    }
+
+    // middle of a bucket, in microseconds
+    double bucketValue(unsigned b)
+    {
+        int e   = (int)(b / SUBS) + MIN_EXP + 1;
+        int sub = (int)(b % SUBS);
+        return ldexp(0.5 + (sub + 0.5) / (2.0 * SUBS), e);
+    }
+
+    struct Zone
+    {
+        unsigned _count;
+        double   _total;
+        double   _min;
+        double   _max;
+        unsigned _hist[NUM_BUCKETS];
+
+        Zone() { clear(); }
 
-typedef std::map< std::string, double > ElapsedTimeMap;
-static ElapsedTimeMap S_ELAPSED_TIMES;
+        void clear()
+        {
+            _count = 0u;
+            _total = 0.0;
+            _min   = DBL_MAX;
+            _max   = 0.0;
+            ::memset(_hist, 0, sizeof(_hist));
+        }
+    };
 
-typedef std::map< std::string, unsigned int > CallMap;
-static CallMap S_CALL_COUNT;
+    struct TraceEvent
+    {
+        Profiler::ZoneId _zone;
+        osg::Timer_t     _start;
+        osg::Timer_t     _end;
+    };
+
+    struct Frame
+    {
+        Profiler::ZoneId _zone;
+        osg::Timer_t     _start;
+    };
+
+    // Everything one thread records. Only the owning thread writes to it;
+    // readers (stats, trace export) see a possibly slightly stale picture.
+    // It is never freed so that timings outlive short-lived threads.
+    struct ThreadData
+    {
+        unsigned              _index;
+        unsigned              _threadId;
+        Zone* volatile        _zones[MAX_ZONES];
+        Frame                 _stack[MAX_DEPTH];
+        unsigned              _depth;
+        unsigned              _overflow;
+        TraceEvent* volatile  _trace;
+        unsigned              _traceCapacity;
+        volatile unsigned     _traceCount;
+
+        ThreadData(unsigned index) :
+            _index        ( index ),
+            _threadId     ( Threading::getCurrentThreadId() ),
+            _depth        ( 0u ),
+            _overflow     ( 0u ),
+            _trace        ( 0L ),
+            _traceCapacity( 0u ),
+            _traceCount   ( 0u )
+        {
+            for(unsigned i=0; i<MAX_ZONES; ++i)
+                _zones[i] = 0L;
+        }
+    };
+
+    struct Globals
+    {
+        Threading::Mutex                  _mutex;
+        std::map<std::string, unsigned>   _ids;
+        std::deque<std::string>           _names;
+        std::vector<ThreadData*>          _threads;
+        unsigned                          _traceCapacity;
+        osg::Timer_t                      _origin;
+
+        Globals() : _traceCapacity(65536u)
+        {
+            _origin = osg::Timer::instance()->tick();
+            _names.push_back("(other)"); // zone 0 catches overflow
+        }
+    };
+
+    Globals& globals()
+    {
+        static Globals s_globals;
+        return s_globals;
+    }
+
+    OE_PROFILER_TLS ThreadData* s_threadData = 0L;
+
+    ThreadData* getThreadData()
+    {
+        if ( !s_threadData )
+        {
+            Globals& g = globals();
+            Threading::ScopedMutexLock lock( g._mutex );
+            s_threadData = new ThreadData( g._threads.size() );
+            g._threads.push_back( s_threadData );
+        }
+        return s_threadData;
+    }
 
-void Profiler::start(const std::string& name)
+    void record(ThreadData* td, Profiler::ZoneId id, osg::Timer_t start, osg::Timer_t end)
+    {
+        Zone* zone = td->_zones[id];
+        if ( !zone )
+        {
+            zone = new Zone();
+            td->_zones[id] = zone;
+        }
+
+        double us = osg::Timer::instance()->delta_u(start, end);
+        zone->_count++;
+        zone->_total += us;
+        if ( us < zone->_min ) zone->_min = us;
+        if ( us > zone->_max ) zone->_max = us;
+        zone->_hist[bucketOf(us)]++;
+
+        if ( Profiler::isTraceEnabled() )
+        {
+            if ( !td->_trace )
+            {
+                unsigned capacity;
+                {
+                    Threading::ScopedMutexLock lock( globals()._mutex );
+                    capacity = globals()._traceCapacity;
+                }
+                td->_traceCapacity = capacity;
+                td->_trace = new TraceEvent[capacity];
+            }
+            TraceEvent& e = td->_trace[td->_traceCount % td->_traceCapacity];
+            e._zone  = id;
+            e._start = start;
+            e._end   = end;
+            td->_traceCount = td->_traceCount + 1;
+        }
+    }
+
+    double percentile(const unsigned* hist, unsigned count, double p)
+    {
+        unsigned target = (unsigned)ceil(p * (double)count);
+        if ( target < 1u ) target = 1u;
+        unsigned sum = 0u;
+        for(unsigned b=0; b<NUM_BUCKETS; ++b)
+        {
+            sum += hist[b];
+            if ( sum >= target )
+                return bucketValue(b);
+        }
+        return bucketValue(NUM_BUCKETS-1);
+    }
+
+    bool sortByTotal(const Profiler::ZoneStats& lhs, const Profiler::ZoneStats& rhs)
+    {
+        return lhs._total > rhs._total;
+    }
+
+    std::string escapeJSON(const std::string& in)
+    {
+        std::string out;
+        out.reserve( in.size() );
+        for(std::string::const_iterator i = in.begin(); i != in.end(); ++i)
+        {
+            if      ( *i == '"' )  out += "\\\"";
+            else if ( *i == '\\' ) out += "\\\\";
+            else if ( (unsigned char)*i < 0x20 ) out += ' ';
+            else out += *i;
+        }
+        return out;
+    }
+
+    // Reads the environment at load time, and writes the trace at exit
+    // if one was requested.
+    struct ProfilerStartup
+    {
+        std::string _traceFile;
+
+        ProfilerStartup()
+        {
+            globals();
+            if ( ::getenv("OSGEARTH_PROFILER") )
+            {
+                Profiler::setEnabled( true );
+            }
+            const char* trace = ::getenv("OSGEARTH_PROFILER_TRACE");
+            if ( trace )
+            {
+                _traceFile = trace;
+                Profiler::setEnabled( true );
+                Profiler::setTraceEnabled( true );
+            }
+        }
+
+        ~ProfilerStartup()
+        {
+            if ( !_traceFile.empty() )
+                Profiler::writeTrace( _traceFile );
+        }
+    };
+
+    ProfilerStartup s_profilerStartup;
+}
+
+void
+Profiler::setEnabled(bool value)
 {
-    S_START_TIMES[name] = osg::Timer::instance()->tick();
+    _enabled = value;
 }
 
-void Profiler::end(const std::string& name)
+void
+Profiler::setTraceEnabled(bool value, unsigned maxEventsPerThread)
 {
-    osg::Timer_t end = osg::Timer::instance()->tick();
-    StartTimeMap::iterator startItr = S_START_TIMES.find(name);
-    if (startItr == S_START_TIMES.end())
+    if ( value )
     {
-        OE_WARN << "Can't find start time " << name << std::endl;
+        // applies to threads that have not yet allocated a trace buffer
+        Threading::ScopedMutexLock lock( globals()._mutex );
+        globals()._traceCapacity = std::max(maxEventsPerThread, 1u);
+    }
+    _traceEnabled = value;
+}
+
+Profiler::ZoneId
+Profiler::getZoneId(const std::string& name)
+{
+    Globals& g = globals();
+    Threading::ScopedMutexLock lock( g._mutex );
+
+    std::map<std::string, unsigned>::const_iterator i = g._ids.find( name );
+    if ( i != g._ids.end() )
+        return i->second;
+
+    if ( g._names.size() >= MAX_ZONES )
+    {
+        OE_WARN << LC << "Too many zones; \"" << name << "\" will be counted as " << g._names[0] << std::endl;
+        g._ids[name] = 0u;
+        return 0u;
+    }
+
+    ZoneId id = g._names.size();
+    g._names.push_back( name );
+    g._ids[name] = id;
+    return id;
+}
+
+const std::string&
+Profiler::getZoneName(ZoneId id)
+{
+    Globals& g = globals();
+    Threading::ScopedMutexLock lock( g._mutex );
+    return id < g._names.size() ? g._names[id] : g._names[0];
+}
+
+void
+Profiler::begin(ZoneId id)
+{
+    if ( !isEnabled() || id >= MAX_ZONES )
+        return;
+
+    ThreadData* td = getThreadData();
+    if ( td->_depth >= MAX_DEPTH )
+    {
+        td->_overflow++;
+        return;
+    }
+
+    Frame& frame = td->_stack[td->_depth++];
+    frame._zone  = id;
+    frame._start = osg::Timer::instance()->tick();
+}
+
+void
+Profiler::end(ZoneId id)
+{
+    ThreadData* td = s_threadData;
+    if ( !td || td->_depth == 0u )
         return;
+
+    osg::Timer_t now = osg::Timer::instance()->tick();
+
+    if ( td->_overflow > 0u )
+    {
+        td->_overflow--;
+        return;
+    }
+
+    // find the matching zone; any zones left open inside it are discarded.
+    unsigned d = td->_depth;
+    while( d > 0u && td->_stack[d-1]._zone != id )
+        --d;
+    if ( d == 0u )
+        return;
+
+    td->_depth = d - 1u;
+    record( td, id, td->_stack[d-1]._start, now );
+}
+
+void
+Profiler::start(const std::string& name)
+{
+    if ( isEnabled() )
+        begin( getZoneId(name) );
+}
+
+void
+Profiler::end(const std::string& name)
+{
+    if ( s_threadData && s_threadData->_depth > 0u )
+        end( getZoneId(name) );
+}
+
+void
+Profiler::getStats(std::vector<ZoneStats>& out)
+{
+    out.clear();
+
+    Globals& g = globals();
+    std::vector<ThreadData*> threads;
+    unsigned numZones;
+    {
+        Threading::ScopedMutexLock lock( g._mutex );
+        threads  = g._threads;
+        numZones = g._names.size();
+    }
+
+    std::vector<unsigned> hist( NUM_BUCKETS );
+
+    for(unsigned id=0; id<numZones; ++id)
+    {
+        ZoneStats s;
+        s._count = 0u;
+        s._total = 0.0;
+        s._min   = DBL_MAX;
+        s._max   = 0.0;
+        std::fill( hist.begin(), hist.end(), 0u );
+
+        for(std::vector<ThreadData*>::const_iterator t = threads.begin(); t != threads.end(); ++t)
+        {
+            const Zone* zone = (*t)->_zones[id];
+            if ( zone && zone->_count > 0u )
+            {
+                s._count += zone->_count;
+                s._total += zone->_total;
+                s._min    = std::min( s._min, zone->_min );
+                s._max    = std::max( s._max, zone->_max );
+                for(unsigned b=0; b<NUM_BUCKETS; ++b)
+                    hist[b] += zone->_hist[b];
+            }
+        }
+
+        if ( s._count == 0u )
+            continue;
+
+        s._name  = getZoneName(id);
+        s._p50   = percentile( &hist[0], s._count, 0.50 ) * 1e-6;
+        s._p95   = percentile( &hist[0], s._count, 0.95 ) * 1e-6;
+        s._p99   = percentile( &hist[0], s._count, 0.99 ) * 1e-6;
+        s._total *= 1e-6;
+        s._min   *= 1e-6;
+        s._max   *= 1e-6;
+        out.push_back( s );
     }
 
-    double dt = osg::Timer::instance()->delta_s(startItr->second, end);
-    ElapsedTimeMap::iterator elapsedItr = S_ELAPSED_TIMES.find(name);
-    if (elapsedItr == S_ELAPSED_TIMES.end())
+    std::sort( out.begin(), out.end(), sortByTotal );
+}
+
+bool
+Profiler::writeTrace(const std::string& filename)
+{
+    std::ofstream out( filename.c_str() );
+    if ( !out.is_open() )
     {
-        S_ELAPSED_TIMES[name] = 0.0;
+        OE_WARN << LC << "Failed to open trace file \"" << filename << "\"" << std::endl;
+        return false;
     }
-    S_ELAPSED_TIMES[name] += dt;
 
-    // Increment the number of calls for the task
-    CallMap::iterator callItr = S_CALL_COUNT.find(name);
-    if (callItr == S_CALL_COUNT.end())
+    Globals& g = globals();
+    std::vector<ThreadData*> threads;
+    std::vector<std::string> names;
+    osg::Timer_t origin;
     {
-        S_CALL_COUNT[name] = 0;
+        Threading::ScopedMutexLock lock( g._mutex );
+        threads = g._threads;
+        names.assign( g._names.begin(), g._names.end() );
+        origin  = g._origin;
     }
-    S_CALL_COUNT[name] += 1;
 
+    const osg::Timer* timer = osg::Timer::instance();
+    bool first = true;
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\":[\n";
+
+    for(std::vector<ThreadData*>::const_iterator t = threads.begin(); t != threads.end(); ++t)
+    {
+        const ThreadData* td = *t;
+
+        if ( !first ) out << ",\n";
+        first = false;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << td->_index
+            << ",\"args\":{\"name\":\"Thread " << td->_threadId << "\"}}";
+
+        const TraceEvent* trace = td->_trace;
+        if ( !trace )
+            continue;
+
+        unsigned count    = td->_traceCount;
+        unsigned capacity = td->_traceCapacity;
+        unsigned n        = std::min( count, capacity );
+
+        for(unsigned i = count - n; i != count; ++i)
+        {
+            const TraceEvent& e = trace[i % capacity];
+            out << ",\n{\"name\":\"" << escapeJSON(names[e._zone < names.size() ? e._zone : 0u])
+                << "\",\"cat\":\"osgEarth\",\"ph\":\"X\",\"pid\":1,\"tid\":" << td->_index
+                << ",\"ts\":" << timer->delta_u(origin, e._start)
+                << ",\"dur\":" << timer->delta_u(e._start, e._end)
+                << "}";
+        }
+    }
+
+    out << "\n]}\n";
+    out.close();
+
+    OE_INFO << LC << "Wrote trace to \"" << filename << "\"" << std::endl;
+    return true;
 }
 
-void Profiler::dump()
+void
+Profiler::reset()
 {
-    for (ElapsedTimeMap::iterator itr = S_ELAPSED_TIMES.begin(); itr != S_ELAPSED_TIMES.end(); ++itr)
+    Globals& g = globals();
+    Threading::ScopedMutexLock lock( g._mutex );
+
+    for(std::vector<ThreadData*>::iterator t = g._threads.begin(); t != g._threads.end(); ++t)
     {
-        OE_NOTICE << itr->first << ": calls=" << S_CALL_COUNT[itr->first] << "  time=" << itr->second << "s" << std::endl;
+        ThreadData* td = *t;
+        for(unsigned i=0; i<MAX_ZONES; ++i)
+        {
+            if ( td->_zones[i] )
+                td->_zones[i]->clear();
+        }
+
+        // drop the trace buffer so a new capacity takes effect.
+        TraceEvent* trace = td->_trace;
+        td->_trace = 0L;
+        td->_traceCount = 0u;
+        delete [] trace;
     }
-}
\ No newline at end of file
+
+    g._origin = osg::Timer::instance()->tick();
+}
+
+void
+Profiler::dump()
+{
+    std::vector<ZoneStats> stats;
+    getStats( stats );
+
+    for(std::vector<ZoneStats>::const_iterator i = stats.begin(); i != stats.end(); ++i)
+    {
+        OE_NOTICE << i->_name
+            << ": calls=" << i->_count
+            << "  time=" << i->_total << "s"
+            << "  avg=" << 1000.0*i->_total/(double)i->_count << "ms"
+            << "  p50=" << 1000.0*i->_p50 << "ms"
+            << "  p95=" << 1000.0*i->_p95 << "ms"
+            << "  p99=" << 1000.0*i->_p99 << "ms"
+            << "  max=" << 1000.0*i->_max << "ms"
+            << std::endl;
+    }
+}
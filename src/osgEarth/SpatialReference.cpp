@@ -26,8 +26,18 @@
 #include <osg/Notify>
 #include <ogr_api.h>
 #include <ogr_spatialref.h>
+#include <gdal.h>
 #include <algorithm>
 
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#endif
+
 #define LC "[SpatialReference] "
 
 using namespace osgEarth;
@@ -52,64 +62,153 @@ namespace
         return "";
     }    
 
+    /**
+     * OGR transform handles owned by one thread, keyed by the UIDs of the
+     * source and destination SRS. Only the owning thread ever touches its
+     * handles, so lookups and transforms need no locking. The handles are
+     * destroyed when the thread exits.
+     */
+    struct ThreadTransforms
+    {
+        typedef std::map<std::pair<UID,UID>, void*> HandleMap;
+        HandleMap _handles;
+
+        void clear()
+        {
+            GDAL_SCOPED_LOCK;
+            for (HandleMap::iterator i = _handles.begin(); i != _handles.end(); ++i)
+            {
+                if ( i->second )
+                    OCTDestroyCoordinateTransformation( i->second );
+            }
+            _handles.clear();
+        }
+    };
+
+    // A thread keeps at most this many handles. UIDs are never reused, so
+    // handles for SRSs that no longer exist are simply dead weight; dropping
+    // the whole set now and then keeps them from piling up.
+    const unsigned MAX_THREAD_TRANSFORMS = 128;
+
+#ifdef _WIN32
+    VOID WINAPI destroyThreadTransforms( PVOID ptr )
+#else
+    void destroyThreadTransforms( void* ptr )
+#endif
+    {
+        ThreadTransforms* tt = static_cast<ThreadTransforms*>( ptr );
+        if ( tt )
+        {
+            tt->clear();
+            delete tt;
+        }
+    }
+
+    /** Thread-local slot holding each thread's ThreadTransforms. */
+    struct ThreadTransformsSlot
+    {
+#ifdef _WIN32
+        // fiber-local storage, unlike TlsAlloc, calls back on thread exit.
+        DWORD _index;
+        ThreadTransformsSlot() : _index( FlsAlloc(destroyThreadTransforms) ) { }
+        bool valid() const { return _index != FLS_OUT_OF_INDEXES; }
+        ThreadTransforms* get() const { return static_cast<ThreadTransforms*>( FlsGetValue(_index) ); }
+        void set( ThreadTransforms* tt ) { FlsSetValue(_index, tt); }
+#else
+        pthread_key_t _key;
+        bool          _valid;
+        ThreadTransformsSlot() : _valid( pthread_key_create(&_key, destroyThreadTransforms) == 0 ) { }
+        bool valid() const { return _valid; }
+        ThreadTransforms* get() const { return static_cast<ThreadTransforms*>( pthread_getspecific(_key) ); }
+        void set( ThreadTransforms* tt ) { pthread_setspecific(_key, tt); }
+#endif
+    };
+
+    ThreadTransformsSlot s_threadTransforms;
+
+    /** The calling thread's transform handles, or NULL if thread-local storage is unavailable. */
+    ThreadTransforms* getThreadTransforms()
+    {
+        if ( !s_threadTransforms.valid() )
+            return 0L;
+
+        ThreadTransforms* tt = s_threadTransforms.get();
+        if ( !tt )
+        {
+            tt = new ThreadTransforms();
+            s_threadTransforms.set( tt );
+        }
+        return tt;
+    }
+
+    // Number of points to process per pass when copying strided coordinates
+    // into temporary arrays; keeps the temporaries on the stack.
+    const unsigned TRANSFORM_CHUNK = 128;
+
     // http://en.wikipedia.org/wiki/Mercator_projection#Mathematics_of_the_projection
-    bool sphericalMercatorToGeographic( std::vector<osg::Vec3d>& points )
+    bool sphericalMercatorToGeographic( double* x, double* y, unsigned count, unsigned stride )
     {
-        for( unsigned i=0; i<points.size(); ++i )
+        for( unsigned i=0, j=0; i<count; ++i, j+=stride )
         {
-            double x = osg::clampBetween(points[i].x(), MERC_MINX, MERC_MAXX);
-            double y = osg::clampBetween(points[i].y(), MERC_MINY, MERC_MAXY);
-            double xr = -osg::PI + ((x-MERC_MINX)/MERC_WIDTH)*2.0*osg::PI;
-            double yr = -osg::PI + ((y-MERC_MINY)/MERC_HEIGHT)*2.0*osg::PI;
-            points[i].x() = osg::RadiansToDegrees( xr );
-            points[i].y() = osg::RadiansToDegrees( 2.0 * atan( exp(yr) ) - osg::PI_2 );
+            double mx = osg::clampBetween(x[j], MERC_MINX, MERC_MAXX);
+            double my = osg::clampBetween(y[j], MERC_MINY, MERC_MAXY);
+            double xr = -osg::PI + ((mx-MERC_MINX)/MERC_WIDTH)*2.0*osg::PI;
+            double yr = -osg::PI + ((my-MERC_MINY)/MERC_HEIGHT)*2.0*osg::PI;
+            x[j] = osg::RadiansToDegrees( xr );
+            y[j] = osg::RadiansToDegrees( 2.0 * atan( exp(yr) ) - osg::PI_2 );
             // z doesn't change here.
         }
         return true;
     }
 
     // http://en.wikipedia.org/wiki/Mercator_projection#Mathematics_of_the_projection
-    bool geographicToSphericalMercator( std::vector<osg::Vec3d>& points )
+    bool geographicToSphericalMercator( double* x, double* y, unsigned count, unsigned stride )
     {
-        for( unsigned i=0; i<points.size(); ++i )
+        for( unsigned i=0, j=0; i<count; ++i, j+=stride )
         {
-            double lon = osg::clampBetween(points[i].x(), -180.0, 180.0);
-            double lat = osg::clampBetween(points[i].y(), -90.0, 90.0);
+            double lon = osg::clampBetween(x[j], -180.0, 180.0);
+            double lat = osg::clampBetween(y[j], -90.0, 90.0);
             double xr = (osg::DegreesToRadians(lon) - (-osg::PI)) / (2.0*osg::PI);
             double sinLat = sin(osg::DegreesToRadians(lat));
             double oneMinusSinLat = 1-sinLat;
             if ( oneMinusSinLat != 0.0 )
             {
                 double yr = ((0.5 * log( (1+sinLat)/oneMinusSinLat )) - (-osg::PI)) / (2.0*osg::PI);
-                points[i].x() = osg::clampBetween(MERC_MINX + (xr * MERC_WIDTH), MERC_MINX, MERC_MAXX);
-                points[i].y() = osg::clampBetween(MERC_MINY + (yr * MERC_HEIGHT), MERC_MINY, MERC_MAXY);
+                x[j] = osg::clampBetween(MERC_MINX + (xr * MERC_WIDTH), MERC_MINX, MERC_MAXX);
+                y[j] = osg::clampBetween(MERC_MINY + (yr * MERC_HEIGHT), MERC_MINY, MERC_MAXY);
                 // z doesn't change here.
             }
         }
         return true;
     }
 
-    void geodeticToECEF(std::vector<osg::Vec3d>& points, const osg::EllipsoidModel* em)
+    // z may be NULL, in which case heights are taken as zero.
+    void geodeticToECEF( double* x, double* y, double* z, unsigned count, unsigned stride, const osg::EllipsoidModel* em )
     {
-        for( unsigned i=0; i<points.size(); ++i )
+        for( unsigned i=0, j=0; i<count; ++i, j+=stride )
         {
-            double x, y, z;
+            double ex, ey, ez;
             em->convertLatLongHeightToXYZ(
-                osg::DegreesToRadians( points[i].y() ), osg::DegreesToRadians( points[i].x() ), points[i].z(),
-                x, y, z );
-            points[i].set( x, y, z );
+                osg::DegreesToRadians( y[j] ), osg::DegreesToRadians( x[j] ), z ? z[j] : 0.0,
+                ex, ey, ez );
+            x[j] = ex;
+            y[j] = ey;
+            if ( z ) z[j] = ez;
         }
     }
 
-    void ECEFtoGeodetic(std::vector<osg::Vec3d>& points, const osg::EllipsoidModel* em)
+    // z may be NULL, in which case the input points are taken to have z=0.
+    void ECEFtoGeodetic( double* x, double* y, double* z, unsigned count, unsigned stride, const osg::EllipsoidModel* em )
     {
-        for( unsigned i=0; i<points.size(); ++i )
+        for( unsigned i=0, j=0; i<count; ++i, j+=stride )
         {
             double lat, lon, alt;
             em->convertXYZToLatLongHeight(
-                points[i].x(), points[i].y(), points[i].z(),
+                x[j], y[j], z ? z[j] : 0.0,
                 lat, lon, alt );
-            points[i].set( osg::RadiansToDegrees(lon), osg::RadiansToDegrees(lat), alt );
+            x[j] = osg::RadiansToDegrees(lon);
+            y[j] = osg::RadiansToDegrees(lat);
+            if ( z ) z[j] = alt;
         }
     }
 }
@@ -384,6 +483,7 @@ SpatialReference::SpatialReference(void*              handle,
                                    const std::string& init_type) :
 osg::Referenced ( true ),
 _initialized    ( false ),
+_uid            ( Registry::instance()->createUID() ),
 _handle         ( handle ),
 _owns_handle    ( true ),
 _init_type      ( init_type ),
@@ -405,6 +505,7 @@ _is_spherical_mercator( false )
 SpatialReference::SpatialReference(void* handle, bool ownsHandle) :
 osg::Referenced( true ),
 _initialized   ( false ),
+_uid           ( Registry::instance()->createUID() ),
 _handle        ( handle ),
 _owns_handle   ( ownsHandle ),
 _is_ltp        ( false ),
@@ -420,11 +521,6 @@ SpatialReference::~SpatialReference()
     {
         GDAL_SCOPED_LOCK;
 
-        for (TransformHandleCache::iterator itr = _transformHandleCache.begin(); itr != _transformHandleCache.end(); ++itr)
-        {
-            OCTDestroyCoordinateTransformation(itr->second);
-        }
-
         if ( _owns_handle )
         {
             OSRDestroySpatialReference( _handle );
@@ -980,11 +1076,11 @@ SpatialReference::transform(const osg::Vec3d&       input,
     if ( !outputSRS )
         return false;
 
-    std::vector<osg::Vec3d> v(1, input);
+    osg::Vec3d temp( input );
 
-    if ( transform(v, outputSRS) )
+    if ( transform(&temp.x(), &temp.y(), &temp.z(), 1, outputSRS) )
     {
-        output = v[0];
+        output = temp;
         return true;
     }
     return false;
@@ -1002,105 +1098,202 @@ SpatialReference::transform(std::vector<osg::Vec3d>& points,
         const_cast<SpatialReference*>(this)->init();
 
     // trivial equivalency:
-    if ( isEquivalentTo(outputSRS) )
+    if ( isEquivalentTo(outputSRS) || points.empty() )
         return true;
-    
-    bool success = false;
 
     // do the pre-transformation pass:
     const SpatialReference* inputSRS = preTransform( points );
     if ( !inputSRS )
         return false;
 
+    // osg::Vec3d is three packed doubles, so transform the vector in place:
+    bool success = inputSRS->transformArrays(
+        &points[0].x(), &points[0].y(), &points[0].z(),
+        points.size(), 3, outputSRS );
+
+    // run the user post-transform code
+    outputSRS->postTransform( points );
+
+    return success;
+}
+
+
+bool
+SpatialReference::transform(double*                 x,
+                            double*                 y,
+                            double*                 z,
+                            unsigned                count,
+                            const SpatialReference* outputSRS,
+                            unsigned                stride) const
+{
+    if ( !outputSRS )
+        return false;
+
+    if ( !_initialized )
+        const_cast<SpatialReference*>(this)->init();
+
+    // trivial equivalency:
+    if ( count == 0 || isEquivalentTo(outputSRS) )
+        return true;
+
+    // user-defined SRS's may have pre/post-transform hooks, and those operate on
+    // point vectors; so copy into one and use the vector path.
+    if ( isUserDefined() || outputSRS->isUserDefined() )
+    {
+        std::vector<osg::Vec3d> points( count );
+        for( unsigned i=0, j=0; i<count; ++i, j+=stride )
+            points[i].set( x[j], y[j], z ? z[j] : 0.0 );
+
+        bool success = transform( points, outputSRS );
+
+        if ( success )
+        {
+            for( unsigned i=0, j=0; i<count; ++i, j+=stride )
+            {
+                x[j] = points[i].x();
+                y[j] = points[i].y();
+                if ( z ) z[j] = points[i].z();
+            }
+        }
+        return success;
+    }
+
+    // the array path works in place a chunk at a time, so save the input first;
+    // that way a failure part-way through leaves the caller's arrays untouched.
+    // Batches that fit in one chunk use the stack.
+    unsigned dims = z ? 3u : 2u;
+    double   stackCopy[3*TRANSFORM_CHUNK];
+    std::vector<double> heapCopy;
+    double*  saved = stackCopy;
+    if ( count > TRANSFORM_CHUNK )
+    {
+        heapCopy.resize( dims*count );
+        saved = &heapCopy[0];
+    }
+
+    for( unsigned i=0, j=0, k=0; i<count; ++i, j+=stride, k+=dims )
+    {
+        saved[k]   = x[j];
+        saved[k+1] = y[j];
+        if ( z ) saved[k+2] = z[j];
+    }
+
+    bool success = transformArrays( x, y, z, count, stride, outputSRS );
+
+    if ( !success )
+    {
+        for( unsigned i=0, j=0, k=0; i<count; ++i, j+=stride, k+=dims )
+        {
+            x[j] = saved[k];
+            y[j] = saved[k+1];
+            if ( z ) z[j] = saved[k+2];
+        }
+    }
+
+    return success;
+}
+
+
+bool
+SpatialReference::transformArrays(double*                 x,
+                                  double*                 y,
+                                  double*                 z,
+                                  unsigned                count,
+                                  unsigned                stride,
+                                  const SpatialReference* outputSRS) const
+{
+    bool success = false;
+
     // Spherical Mercator is a special case transformation, because we want to bypass
     // any normal horizontal datum conversion. In other words we ignore the ellipsoid
     // of the other SRS and just do a straight spherical conversion.
-    if ( inputSRS->isGeographic() && outputSRS->isSphericalMercator() )
+    if ( isGeographic() && outputSRS->isSphericalMercator() )
     {        
-        inputSRS->transformZ( points, outputSRS, true );
-        success = geographicToSphericalMercator( points );
+        transformZ( x, y, z, count, stride, outputSRS, true );
+        success = geographicToSphericalMercator( x, y, count, stride );
         return success;
     }
 
-    else if ( inputSRS->isSphericalMercator() && outputSRS->isGeographic() )
+    else if ( isSphericalMercator() && outputSRS->isGeographic() )
     {     
-        success = sphericalMercatorToGeographic( points );
-        inputSRS->transformZ( points, outputSRS, true );
+        success = sphericalMercatorToGeographic( x, y, count, stride );
+        transformZ( x, y, z, count, stride, outputSRS, true );
         return success;
     }
 
-    else if ( inputSRS->isECEF() && !outputSRS->isECEF() )
+    else if ( isECEF() && !outputSRS->isECEF() )
     {
         const SpatialReference* outputGeoSRS = outputSRS->getGeodeticSRS();
-        ECEFtoGeodetic(points, outputGeoSRS->getEllipsoid());
-        return outputGeoSRS->transform(points, outputSRS);
+        ECEFtoGeodetic( x, y, z, count, stride, outputGeoSRS->getEllipsoid() );
+        return
+            outputGeoSRS->isEquivalentTo(outputSRS) ||
+            outputGeoSRS->transformArrays( x, y, z, count, stride, outputSRS );
     }
 
-    else if ( !inputSRS->isECEF() && outputSRS->isECEF() )
+    else if ( !isECEF() && outputSRS->isECEF() )
     {
         const SpatialReference* outputGeoSRS = outputSRS->getGeodeticSRS();
-        success = inputSRS->transform(points, outputGeoSRS);
-        geodeticToECEF(points, outputGeoSRS->getEllipsoid());
+        success =
+            isEquivalentTo(outputGeoSRS) ||
+            transformArrays( x, y, z, count, stride, outputGeoSRS );
+        geodeticToECEF( x, y, z, count, stride, outputGeoSRS->getEllipsoid() );
         return success;
     }
 
+    // horizontally equivalent (e.g. differing only in vertical datum): the XY
+    // values do not change, so skip OGR entirely and just do the Z's.
+    else if (getVerticalDatum() != outputSRS->getVerticalDatum() &&
+             isHorizEquivalentTo(outputSRS) )
+    {
+        return transformZ( x, y, z, count, stride, outputSRS, isGeographic() );
+    }
+
     // if the points are starting as geographic, do the Z's first to avoid an unneccesary
     // transformation in the case of differing vdatums.
     bool z_done = false;
-    if ( inputSRS->isGeographic() )
+    if ( isGeographic() )
     {
-        z_done = inputSRS->transformZ( points, outputSRS, true );
+        z_done = transformZ( x, y, z, count, stride, outputSRS, true );
     }
 
-    // move the xy data into straight arrays that OGR can use
-    unsigned count = points.size();
-    double* x = new double[count];
-    double* y = new double[count];
+    // special case: when going from projected to geographic, clamp the 
+    // points to the maximum geographic extent. Sometimes the conversion from
+    // a global/projected SRS (like mercator) will result in *slightly* invalid
+    // geographic points (like long=180.000003), so this addresses that issue.
+    bool clamp = isProjected() && outputSRS->isGeographic();
 
-    for( unsigned i=0; i<count; i++ )
-    {
-        x[i] = points[i].x();
-        y[i] = points[i].y();
-    }
+    // move the xy data into straight arrays that OGR can use, a chunk at a time.
+    double cx[TRANSFORM_CHUNK], cy[TRANSFORM_CHUNK];
 
-    success = inputSRS->transformXYPointArrays( x, y, count, outputSRS );
-
-    if ( success )
+    success = true;
+    for( unsigned start=0; start<count && success; start += TRANSFORM_CHUNK )
     {
-        if ( inputSRS->isProjected() && outputSRS->isGeographic() )
+        unsigned num = std::min( count-start, TRANSFORM_CHUNK );
+
+        for( unsigned i=0, j=start*stride; i<num; ++i, j+=stride )
         {
-            // special case: when going from projected to geographic, clamp the 
-            // points to the maximum geographic extent. Sometimes the conversion from
-            // a global/projected SRS (like mercator) will result in *slightly* invalid
-            // geographic points (like long=180.000003), so this addresses that issue.
-            for( unsigned i=0; i<count; i++ )
-            {
-                points[i].x() = osg::clampBetween( x[i], -180.0, 180.0 );
-                points[i].y() = osg::clampBetween( y[i],  -90.0,  90.0 );
-            }
+            cx[i] = x[j];
+            cy[i] = y[j];
         }
-        else
+
+        success = transformXYPointArrays( cx, cy, num, outputSRS );
+
+        if ( success )
         {
-            for( unsigned i=0; i<count; i++ )
+            for( unsigned i=0, j=start*stride; i<num; ++i, j+=stride )
             {
-                points[i].x() = x[i];
-                points[i].y() = y[i];
+                x[j] = clamp ? osg::clampBetween( cx[i], -180.0, 180.0 ) : cx[i];
+                y[j] = clamp ? osg::clampBetween( cy[i],  -90.0,  90.0 ) : cy[i];
             }
         }
     }
 
-    delete[] x;
-    delete[] y;
-
     // calculate the Zs if we haven't already done so
     if ( !z_done )
     {
-        z_done = inputSRS->transformZ( points, outputSRS, outputSRS->isGeographic() );
+        z_done = transformZ( x, y, z, count, stride, outputSRS, outputSRS->isGeographic() );
     }   
 
-    // run the user post-transform code
-    outputSRS->postTransform( points );
-
     return success;
 }
 
@@ -1110,11 +1303,11 @@ SpatialReference::transform2D(double x, double y,
                               const SpatialReference* outputSRS,
                               double& out_x, double& out_y ) const
 {
-    osg::Vec3d temp(x,y,0);
-    bool ok = transform(temp, outputSRS, temp);
+    double tx = x, ty = y;
+    bool ok = transform(&tx, &ty, 0L, 1, outputSRS);
     if ( ok ) {
-        out_x = temp.x();
-        out_y = temp.y();
+        out_x = tx;
+        out_y = ty;
     }
     return ok;
 }
@@ -1126,21 +1319,32 @@ SpatialReference::transformXYPointArrays(double*  x,
                                          unsigned count,
                                          const SpatialReference* out_srs) const
 {  
-    // Transform the X and Y values inside an exclusive GDAL/OGR lock
-    GDAL_SCOPED_LOCK;
+    // Each thread has its own transform handles. Since no other thread can
+    // touch them, neither the lookup nor the transformation needs a lock.
+    // (OGR clones both SRSs into the handle, so it outlives them safely.)
+    ThreadTransforms* tt = getThreadTransforms();
+    std::pair<UID,UID> key( _uid, out_srs->getUID() );
 
     void* xform_handle = NULL;
-    TransformHandleCache::const_iterator itr = _transformHandleCache.find(out_srs->getWKT());
-    if (itr != _transformHandleCache.end())
+    bool  ownHandle    = false;
+    ThreadTransforms::HandleMap::const_iterator itr;
+    if ( tt && (itr = tt->_handles.find(key)) != tt->_handles.end() )
     {
-        //OE_DEBUG << LC << "using cached transform handle" << std::endl;
         xform_handle = itr->second;
     }
     else
     {
+        if ( tt && tt->_handles.size() >= MAX_THREAD_TRANSFORMS )
+            tt->clear();
+
+        // creating the handle reads the shared OGR SRS handles, so lock that part.
+        GDAL_SCOPED_LOCK;
         OE_DEBUG << LC << "allocating new OCT Transform" << std::endl;
         xform_handle = OCTNewCoordinateTransformation( _handle, out_srs->_handle);
-        const_cast<SpatialReference*>(this)->_transformHandleCache[out_srs->getWKT()] = xform_handle;
+        if ( tt )
+            tt->_handles[key] = xform_handle;
+        else
+            ownHandle = true;
     }
 
     if ( !xform_handle )
@@ -1152,19 +1356,38 @@ SpatialReference::transformXYPointArrays(double*  x,
         return false;
     }
 
-    return OCTTransform( xform_handle, count, x, y, 0L ) > 0;
+    bool ok;
+    {
+#if GDAL_VERSION_NUM < 1900
+        // Before GDAL 1.9, all OGR transforms shared one PROJ.4 context.
+        GDAL_SCOPED_LOCK;
+#endif
+        ok = OCTTransform( xform_handle, count, x, y, 0L ) > 0;
+    }
+
+    if ( ownHandle )
+    {
+        GDAL_SCOPED_LOCK;
+        OCTDestroyCoordinateTransformation( xform_handle );
+    }
+
+    return ok;
 }
 
 
 bool
-SpatialReference::transformZ(std::vector<osg::Vec3d>& points,
-                             const SpatialReference*  outputSRS,
-                             bool                     pointsAreLatLong) const
+SpatialReference::transformZ(double*                 x,
+                             double*                 y,
+                             double*                 z,
+                             unsigned                count,
+                             unsigned                stride,
+                             const SpatialReference* outputSRS,
+                             bool                    pointsAreLatLong) const
 {
     const VerticalDatum* outVDatum = outputSRS->getVerticalDatum();
 
-    // same vdatum, no xformation necessary.
-    if ( _vdatum.get() == outVDatum )
+    // same vdatum, or no Z's at all; no xformation necessary.
+    if ( _vdatum.get() == outVDatum || z == 0L )
         return true;
 
     Units inUnits = _vdatum.valid() ? _vdatum->getUnits() : Units::METERS;
@@ -1172,46 +1395,61 @@ SpatialReference::transformZ(std::vector<osg::Vec3d>& points,
 
     if ( isGeographic() || pointsAreLatLong )
     {
-        for( unsigned i=0; i<points.size(); ++i )
+        for( unsigned i=0, j=0; i<count; ++i, j+=stride )
         {
             if ( _vdatum.valid() )
             {
                 // to HAE:
-                points[i].z() = _vdatum->msl2hae( points[i].y(), points[i].x(), points[i].z() );
+                z[j] = _vdatum->msl2hae( y[j], x[j], z[j] );
             }
 
             // do the units conversion:
-            points[i].z() = inUnits.convertTo(outUnits, points[i].z());
+            z[j] = inUnits.convertTo(outUnits, z[j]);
 
             if ( outVDatum )
             {
                 // to MSL:
-                points[i].z() = outVDatum->hae2msl( points[i].y(), points[i].x(), points[i].z() );
+                z[j] = outVDatum->hae2msl( y[j], x[j], z[j] );
             }
         }
     }
 
     else // need to xform input points
     {
-        // copy the points and convert them to geographic coordinates (lat/long with the same Z):
-        std::vector<osg::Vec3d> geopoints(points);
-        transform( geopoints, getGeographicSRS() );
+        // copy the points a chunk at a time and convert them to geographic
+        // coordinates (lat/long with the same Z):
+        const SpatialReference* geoSRS = getGeographicSRS();
+        double gx[TRANSFORM_CHUNK], gy[TRANSFORM_CHUNK], gz[TRANSFORM_CHUNK];
 
-        for( unsigned i=0; i<geopoints.size(); ++i )
+        for( unsigned start=0; start<count; start += TRANSFORM_CHUNK )
         {
-            if ( _vdatum.valid() )
+            unsigned num = std::min( count-start, TRANSFORM_CHUNK );
+
+            for( unsigned i=0, j=start*stride; i<num; ++i, j+=stride )
             {
-                // to HAE:
-                points[i].z() = _vdatum->msl2hae( geopoints[i].y(), geopoints[i].x(), points[i].z() );
+                gx[i] = x[j];
+                gy[i] = y[j];
+                gz[i] = z[j];
             }
 
-            // do the units conversion:
-            points[i].z() = inUnits.convertTo(outUnits, points[i].z());
+            transform( gx, gy, gz, num, geoSRS );
 
-            if ( outVDatum )
+            for( unsigned i=0, j=start*stride; i<num; ++i, j+=stride )
             {
-                // to MSL:
-                points[i].z() = outVDatum->hae2msl( geopoints[i].y(), geopoints[i].x(), points[i].z() );
+                if ( _vdatum.valid() )
+                {
+                    // to HAE:
+                    z[j] = _vdatum->msl2hae( gy[i], gx[i], z[j] );
+                }
+
+                // do the units conversion:
+                z[j] = inUnits.convertTo(outUnits, z[j]);
+
+                if ( outVDatum )
+                {
+                    // to MSL:
+                    z[j] = outVDatum->hae2msl( gy[i], gx[i], z[j] );
+                }
             }
         }
     }
@@ -1367,15 +1605,19 @@ SpatialReference::transformExtentToMBR(const SpatialReference* to_srs,
         return true;
     }
 #else
-    // Transform all points and take the maximum bounding rectangle the resulting points
-    std::vector<osg::Vec3d> v;
+    // Transform all points and take the maximum bounding rectangle the resulting points.
+    // 4 corners plus numSamples points along each edge:
+    const unsigned int numSamples = 5;
+    double x[4 + 4*numSamples];
+    double y[4 + 4*numSamples];
+    unsigned int n = 0;
 
     double height = in_out_ymax - in_out_ymin;
     double width = in_out_xmax - in_out_xmin;
-    v.push_back( osg::Vec3d(in_out_xmin, in_out_ymin, 0) ); // ll    
-    v.push_back( osg::Vec3d(in_out_xmin, in_out_ymax, 0) ); // ul
-    v.push_back( osg::Vec3d(in_out_xmax, in_out_ymax, 0) ); // ur
-    v.push_back( osg::Vec3d(in_out_xmax, in_out_ymin, 0) ); // lr
+    x[n] = in_out_xmin; y[n++] = in_out_ymin; // ll
+    x[n] = in_out_xmin; y[n++] = in_out_ymax; // ul
+    x[n] = in_out_xmax; y[n++] = in_out_ymax; // ur
+    x[n] = in_out_xmax; y[n++] = in_out_ymin; // lr
 
     //We also sample along the edges of the bounding box and include them in the 
     //MBR computation in case you are dealing with a projection that will cause the edges
@@ -1383,55 +1625,51 @@ SpatialReference::transformExtentToMBR(const SpatialReference* to_srs,
     //Hotline Oblique Mercator to WGS84
    
     //Sample the edges
-    unsigned int numSamples = 5;    
     double dWidth  = width / (numSamples - 1 );
     double dHeight = height / (numSamples - 1 );
     
     //Left edge
     for (unsigned int i = 0; i < numSamples; i++)
     {
-        v.push_back( osg::Vec3d(in_out_xmin, in_out_ymin + dHeight * (double)i, 0) );
+        x[n] = in_out_xmin; y[n++] = in_out_ymin + dHeight * (double)i;
     }
 
     //Right edge
     for (unsigned int i = 0; i < numSamples; i++)
     {
-        v.push_back( osg::Vec3d(in_out_xmax, in_out_ymin + dHeight * (double)i, 0) );
+        x[n] = in_out_xmax; y[n++] = in_out_ymin + dHeight * (double)i;
     }
 
     //Top edge
     for (unsigned int i = 0; i < numSamples; i++)
     {
-        v.push_back( osg::Vec3d(in_out_xmin + dWidth * (double)i, in_out_ymax, 0) );
+        x[n] = in_out_xmin + dWidth * (double)i; y[n++] = in_out_ymax;
     }
 
     //Bottom edge
     for (unsigned int i = 0; i < numSamples; i++)
     {
-        v.push_back( osg::Vec3d(in_out_xmin + dWidth * (double)i, in_out_ymin, 0) );
+        x[n] = in_out_xmin + dWidth * (double)i; y[n++] = in_out_ymin;
     }
     
-    
-    
-    if ( transform(v, to_srs) )
+    if ( transform(x, y, 0L, n, to_srs) )
     {
         in_out_xmin = DBL_MAX;
         in_out_ymin = DBL_MAX;
         in_out_xmax = -DBL_MAX;
         in_out_ymax = -DBL_MAX;
 
-        for (unsigned int i = 0; i < v.size(); i++)
+        for (unsigned int i = 0; i < n; i++)
         {
-            in_out_xmin = std::min( v[i].x(), in_out_xmin );
-            in_out_ymin = std::min( v[i].y(), in_out_ymin );
-            in_out_xmax = std::max( v[i].x(), in_out_xmax );
-            in_out_ymax = std::max( v[i].y(), in_out_ymax );
+            in_out_xmin = std::min( x[i], in_out_xmin );
+            in_out_ymin = std::min( y[i], in_out_ymin );
+            in_out_xmax = std::max( x[i], in_out_xmax );
+            in_out_ymax = std::max( y[i], in_out_ymax );
         }
 
         return true;
     }
 
-   
 #endif
 
     return false;
@@ -1443,11 +1681,10 @@ bool SpatialReference::transformExtentPoints(const SpatialReference* to_srs,
                                              double* x, double* y,
                                              unsigned int numx, unsigned int numy ) const
 {
-    std::vector<osg::Vec3d> points;
-
     const double dx = (in_xmax - in_xmin) / (numx - 1);
     const double dy = (in_ymax - in_ymin) / (numy - 1);
 
+    // build the sample grid directly in the output arrays and transform it in place.
     unsigned int pixel = 0;
     double fc = 0.0;
     for (unsigned int c = 0; c < numx; ++c, ++fc)
@@ -1456,25 +1693,13 @@ bool SpatialReference::transformExtentPoints(const SpatialReference* to_srs,
         double fr = 0.0;
         for (unsigned int r = 0; r < numy; ++r, ++fr)
         {
-            const double dest_y = in_ymin + fr * dy;
-
-            points.push_back(osg::Vec3d(dest_x, dest_y, 0));
-            //x[pixel] = dest_x;
-            //y[pixel] = dest_y;
+            x[pixel] = dest_x;
+            y[pixel] = in_ymin + fr * dy;
             pixel++;     
         }
     }
 
-    if ( transform( points, to_srs ) )
-    {
-        for( unsigned i=0; i<points.size(); ++i )
-        {
-            x[i] = points[i].x();
-            y[i] = points[i].y();
-        }
-        return true;
-    }
-    return false;
+    return transform( x, y, 0L, pixel, to_srs );
 }
 
 void
@@ -19,9 +19,11 @@
 
 #include <osgEarth/Terrain>
 #include <osgEarth/DPLineSegmentIntersector>
+#include <osgEarth/VerticalDatum>
 #include <osgUtil/IntersectionVisitor>
 #include <osgUtil/LineSegmentIntersector>
 #include <osgViewer/View>
+#include <algorithm>
 
 #define LC "[Terrain] "
 
@@ -37,43 +39,390 @@ namespace
         osg::observer_ptr<Terrain> _terrain;
     };
 
-    struct OnTileAddedOperation : public BaseOp
+    // Announces the tiles queued by notifyTileAdded, once per frame, until
+    // none are left waiting.
+    struct OnTilesAddedOperation : public BaseOp
     {
-        TileKey _key;
-        osg::observer_ptr<osg::Node> _node;
-        unsigned _count;
-
-        OnTileAddedOperation(const TileKey& key, osg::Node* node, Terrain* terrain)
-            : BaseOp(terrain, true), _key(key), _node(node), _count(0) { }
+        OnTilesAddedOperation(Terrain* terrain)
+            : BaseOp(terrain, true) { }
 
         void operator()(osg::Object*)
         {
             if ( getKeep() == false )
                 return;
 
-            ++_count;
-            osg::ref_ptr<Terrain>   terrain;
-            osg::ref_ptr<osg::Node> node;
+            osg::ref_ptr<Terrain> terrain;
+            if ( !_terrain.lock(terrain) || !terrain->firePendingTilesAdded() )
+            {
+                this->setKeep( false );
+            }
+        }
+    };
+
+    // a cell holding more callbacks than this splits into four
+    const unsigned CELL_CAPACITY = 8u;
+
+    // depth of the deepest cell
+    const unsigned MAX_CELL_DEPTH = 20u;
+}
+
+//---------------------------------------------------------------------------
+
+namespace osgEarth
+{
+    /**
+     * The terrain callbacks. Callbacks registered with an extent live in a
+     * quadtree laid over the map profile's tiling, each in the deepest cell
+     * that contains its whole extent. A new tile only visits the cells along
+     * its own quadtree path plus the subtree under its own cell. Also holds
+     * the tiles waiting to be announced.
+     */
+    class TerrainCallbackIndex : public osg::Referenced
+    {
+    public:
+        struct Cell;
+
+        struct Entry : public osg::Referenced
+        {
+            Entry(TerrainCallback* callback) :
+                _callback(callback), _cell(0L), _wide(false), _index(0u),
+                _removed(false), _batch(0u), _slot(0u) { }
+
+            osg::ref_ptr<TerrainCallback> _callback;
+            double   _xmin, _ymin, _xmax, _ymax;
+            Cell*    _cell;     // quadtree cell, if any
+            bool     _wide;     // spans several root cells
+            unsigned _index;    // position in its cell or in the wide list
+            bool     _removed;
+            unsigned _batch;    // last dispatch batch that included this entry
+            unsigned _slot;     // position in that batch
+        };
+
+        struct Cell
+        {
+            Cell(Cell* parent) : _parent(parent), _count(0u)
+            {
+                _children[0] = _children[1] = _children[2] = _children[3] = 0L;
+            }
+            ~Cell()
+            {
+                for(unsigned i=0; i<4; ++i)
+                    delete _children[i];
+            }
+
+            Cell*               _parent;
+            Cell*               _children[4];
+            std::vector<Entry*> _entries;
+            unsigned            _count;     // entries in this cell and below
+        };
+
+        // Callbacks collected for one dispatch, with the batch tiles each one gets.
+        struct Dispatch
+        {
+            osg::ref_ptr<Entry>   _entry;
+            std::vector<unsigned> _tiles;
+        };
+        typedef std::vector<Dispatch> DispatchList;
 
-            if ( _terrain.lock(terrain) && _node.lock(node) )
+        struct PendingTile
+        {
+            PendingTile(const TileKey& key, osg::Node* node) : _key(key), _node(node) { }
+            TileKey                      _key;
+            osg::observer_ptr<osg::Node> _node;
+        };
+
+    public:
+        TerrainCallbackIndex(const Profile* profile) :
+            _profile         ( profile ),
+            _batch           ( 0u ),
+            _pendingScheduled( false )
+        {
+            _profile->getNumTiles( 0, _rootCols, _rootRows );
+            _xmin = _profile->getExtent().xMin();
+            _ymax = _profile->getExtent().yMax();
+            for(unsigned d=0; d<=MAX_CELL_DEPTH; ++d)
             {
-                if ( node->getNumParents() > 0 )
+                double w, h;
+                _profile->getTileDimensions( d, w, h );
+                _cellWidth.push_back( w );
+                _cellHeight.push_back( h );
+            }
+            _roots.resize( _rootCols*_rootRows, 0L );
+        }
+
+        ~TerrainCallbackIndex()
+        {
+            for(unsigned i=0; i<_roots.size(); ++i)
+                delete _roots[i];
+        }
+
+        /** Number of registered callbacks. */
+        unsigned size() const { return _entries.size(); }
+
+        /** Adds a callback, or moves it if already registered. Call with the lock held. */
+        void insert(TerrainCallback* callback, const GeoExtent& extent)
+        {
+            osg::ref_ptr<Entry>& entry = _entries[callback];
+            if ( entry.valid() )
+                unlink( entry.get() );
+            else
+                entry = new Entry( callback );
+
+            GeoExtent e;
+            if ( extent.isValid() && !extent.getSRS()->isHorizEquivalentTo(_profile->getSRS()) )
+                extent.transform( _profile->getSRS(), e );
+            else
+                e = extent;
+
+            if ( !e.isValid() || e.crossesAntimeridian() )
+            {
+                _global.push_back( entry.get() );
+                return;
+            }
+
+            entry->_xmin = e.xMin();
+            entry->_ymin = e.yMin();
+            entry->_xmax = e.xMax();
+            entry->_ymax = e.yMax();
+
+            unsigned col, row;
+            if ( !cellOf(entry.get(), 0u, col, row) )
+            {
+                entry->_wide  = true;
+                entry->_index = _wide.size();
+                _wide.push_back( entry.get() );
+                return;
+            }
+
+            Cell*& root = _roots[row*_rootCols + col];
+            if ( !root )
+                root = new Cell( 0L );
+
+            // descend as far as the cells already go.
+            Cell* cell = root;
+            unsigned depth = 0u;
+            while( cell->_children[0] && cellOf(entry.get(), depth+1, col, row) )
+            {
+                cell = cell->_children[(col & 1u) + 2u*(row & 1u)];
+                ++depth;
+            }
+
+            add( entry.get(), cell );
+
+            if ( cell->_entries.size() > CELL_CAPACITY && !cell->_children[0] && depth < MAX_CELL_DEPTH )
+                split( cell, depth );
+        }
+
+        /** Removes a callback. Call with the lock held. */
+        void remove(TerrainCallback* callback)
+        {
+            EntryMap::iterator i = _entries.find( callback );
+            if ( i != _entries.end() )
+            {
+                unlink( i->second.get() );
+                i->second->_removed = true;
+                _entries.erase( i );
+            }
+        }
+
+        /**
+         * Starts collecting a dispatch list: every callback registered
+         * without an extent gets every one of "numTiles" tiles. Call with
+         * the lock held.
+         */
+        void beginDispatch(unsigned numTiles, DispatchList& out)
+        {
+            ++_batch;
+            for(unsigned i=0; i<_global.size(); ++i)
+            {
+                Dispatch& d = touch( _global[i], out );
+                for(unsigned t=0; t<numTiles; ++t)
+                    d._tiles.push_back( t );
+            }
+        }
+
+        /**
+         * Adds tile "tile" (with key "key") to the dispatch list of every
+         * callback whose extent intersects it. Call with the lock held.
+         */
+        void collect(const TileKey& key, unsigned tile, DispatchList& out)
+        {
+            const GeoExtent& e = key.getExtent();
+            double xmin = e.xMin(), ymin = e.yMin(), xmax = e.xMax(), ymax = e.yMax();
+
+            for(unsigned i=0; i<_wide.size(); ++i)
+            {
+                if ( intersects(_wide[i], xmin, ymin, xmax, ymax) )
+                    touch( _wide[i], out )._tiles.push_back( tile );
+            }
+
+            unsigned lod = key.getLOD();
+            unsigned kx, ky;
+            key.getTileXY( kx, ky );
+
+            unsigned rx = kx >> lod, ry = ky >> lod;
+            if ( lod >= 32u || rx >= _rootCols || ry >= _rootRows )
+                return;
+
+            Cell* cell = _roots[ry*_rootCols + rx];
+            for(unsigned depth = 0u; cell && cell->_count > 0u; ++depth)
+            {
+                if ( depth == lod )
+                {
+                    // everything at or under the tile's own cell lies inside the tile.
+                    collectAll( cell, tile, out );
+                    break;
+                }
+
+                for(unsigned i=0; i<cell->_entries.size(); ++i)
+                {
+                    Entry* entry = cell->_entries[i];
+                    if ( intersects(entry, xmin, ymin, xmax, ymax) )
+                        touch( entry, out )._tiles.push_back( tile );
+                }
+
+                unsigned shift = lod - depth - 1u;
+                cell = cell->_children[((kx >> shift) & 1u) + 2u*((ky >> shift) & 1u)];
+            }
+        }
+
+        Threading::Mutex         _mutex;
+
+        Threading::Mutex         _pendingMutex;
+        std::vector<PendingTile> _pending;
+        bool                     _pendingScheduled;
+
+    private:
+        typedef std::map<TerrainCallback*, osg::ref_ptr<Entry> > EntryMap;
+
+        osg::ref_ptr<const Profile> _profile;
+        unsigned                    _rootCols, _rootRows;
+        double                      _xmin, _ymax;
+        std::vector<double>         _cellWidth, _cellHeight;
+        std::vector<Cell*>          _roots;
+        std::vector<Entry*>         _global;
+        std::vector<Entry*>         _wide;
+        EntryMap                    _entries;
+        unsigned                    _batch;
+
+        // Finds the cell at "depth" that holds the entry's whole extent.
+        bool cellOf(const Entry* entry, unsigned depth, unsigned& out_col, unsigned& out_row) const
+        {
+            unsigned maxCol = (_rootCols << depth) - 1u;
+            unsigned maxRow = (_rootRows << depth) - 1u;
+            unsigned c0 = index( (entry->_xmin - _xmin) / _cellWidth[depth],  maxCol );
+            unsigned c1 = index( (entry->_xmax - _xmin) / _cellWidth[depth],  maxCol );
+            unsigned r0 = index( (_ymax - entry->_ymax) / _cellHeight[depth], maxRow );
+            unsigned r1 = index( (_ymax - entry->_ymin) / _cellHeight[depth], maxRow );
+            out_col = c0;
+            out_row = r0;
+            return c0 == c1 && r0 == r1;
+        }
+
+        static unsigned index(double f, unsigned max)
+        {
+            return f <= 0.0 ? 0u : std::min( (unsigned)f, max );
+        }
+
+        static bool intersects(const Entry* entry, double xmin, double ymin, double xmax, double ymax)
+        {
+            return
+                entry->_xmin <= xmax && entry->_xmax >= xmin &&
+                entry->_ymin <= ymax && entry->_ymax >= ymin;
+        }
+
+        void add(Entry* entry, Cell* cell)
+        {
+            entry->_cell  = cell;
+            entry->_index = cell->_entries.size();
+            cell->_entries.push_back( entry );
+            for(Cell* c = cell; c; c = c->_parent)
+                c->_count++;
+        }
+
+        // Pushes a cell's entries down into new child cells where they fit.
+        void split(Cell* cell, unsigned depth)
+        {
+            for(unsigned i=0; i<4; ++i)
+                cell->_children[i] = new Cell( cell );
+
+            std::vector<Entry*> entries;
+            entries.swap( cell->_entries );
+
+            for(unsigned i=0; i<entries.size(); ++i)
+            {
+                Entry* entry = entries[i];
+                unsigned col, row;
+                if ( cellOf(entry, depth+1, col, row) )
                 {
-                    //OE_NOTICE << LC << "FIRING onTileAdded for " << _key.str() << " (tries=" << _count << ")" << std::endl;
-                    terrain->fireTileAdded( _key, node.get() );
-                    this->setKeep( false );
+                    Cell* child = cell->_children[(col & 1u) + 2u*(row & 1u)];
+                    entry->_cell  = child;
+                    entry->_index = child->_entries.size();
+                    child->_entries.push_back( entry );
+                    child->_count++;
                 }
                 else
                 {
-                    //OE_NOTICE << LC << "Deferring onTileAdded for " << _key.str() << std::endl;
+                    entry->_index = cell->_entries.size();
+                    cell->_entries.push_back( entry );
                 }
             }
+        }
+
+        // Detaches an entry from wherever it is stored.
+        void unlink(Entry* entry)
+        {
+            if ( entry->_cell )
+            {
+                Cell* cell = entry->_cell;
+                cell->_entries[entry->_index] = cell->_entries.back();
+                cell->_entries[entry->_index]->_index = entry->_index;
+                cell->_entries.pop_back();
+                for(Cell* c = cell; c; c = c->_parent)
+                    c->_count--;
+                entry->_cell = 0L;
+            }
+            else if ( entry->_wide )
+            {
+                _wide[entry->_index] = _wide.back();
+                _wide[entry->_index]->_index = entry->_index;
+                _wide.pop_back();
+                entry->_wide = false;
+            }
             else
             {
-                // nop; tile expired; let it go.
-                //OE_NOTICE << "Tile expired before notification: " << _key.str() << std::endl;
-                this->setKeep( false );
+                // keep the global callbacks in registration order.
+                std::vector<Entry*>::iterator i = std::find( _global.begin(), _global.end(), entry );
+                if ( i != _global.end() )
+                    _global.erase( i );
+            }
+        }
+
+        void collectAll(Cell* cell, unsigned tile, DispatchList& out)
+        {
+            if ( cell->_count == 0u )
+                return;
+
+            for(unsigned i=0; i<cell->_entries.size(); ++i)
+                touch( cell->_entries[i], out )._tiles.push_back( tile );
+
+            if ( cell->_children[0] )
+            {
+                for(unsigned i=0; i<4; ++i)
+                    collectAll( cell->_children[i], tile, out );
+            }
+        }
+
+        Dispatch& touch(Entry* entry, DispatchList& out)
+        {
+            if ( entry->_batch != _batch )
+            {
+                entry->_batch = _batch;
+                entry->_slot  = out.size();
+                out.push_back( Dispatch() );
+                out.back()._entry = entry;
             }
+            return out[entry->_slot];
         }
     };
 }
@@ -85,6 +434,11 @@ _graph         ( graph ),
 _profile       ( mapProfile ),
 _geocentric    ( geocentric ),
 _terrainOptions( terrainOptions )
+{
+    _callbacks = new TerrainCallbackIndex( mapProfile );
+}
+
+Terrain::~Terrain()
 {
     //nop
 }
@@ -103,13 +457,157 @@ Terrain::getHeight(osg::Node*              patch,
     // convert to map coordinates:
     if ( srs && !srs->isHorizEquivalentTo(getSRS()) )
     {
-        srs->transform2D(x, y, getSRS(), x, y);
+        if ( !srs->transform2D(x, y, getSRS(), x, y) )
+            return false;
     }
 
     // trivially reject a point that lies outside the terrain:
     if ( !getProfile()->getExtent().contains(x, y) )
         return 0L;
 
+    // sample the tile data directly if we can (the tiles hold HAE):
+    double hae;
+    if ( _heightSource.valid() && _heightSource->getHeight(patch, x, y, hae) )
+    {
+        if ( out_hamsl )
+            *out_hamsl = toHeightAboveMSL(x, y, hae);
+        if ( out_hae )
+            *out_hae = hae;
+        return true;
+    }
+
+    return intersect( patch, x, y, out_hamsl, out_hae );
+}
+
+
+unsigned
+Terrain::getHeights(const SpatialReference*  srs,
+                    std::vector<osg::Vec3d>& points,
+                    std::vector<bool>*       out_resolved,
+                    bool                     ellipsoidal) const
+{
+    return getHeights( (osg::Node*)0L, srs, points, out_resolved, ellipsoidal );
+}
+
+
+unsigned
+Terrain::getHeights(osg::Node*               patch,
+                    const SpatialReference*  srs,
+                    std::vector<osg::Vec3d>& points,
+                    std::vector<bool>*       out_resolved,
+                    bool                     ellipsoidal) const
+{
+    std::vector<bool> resolved( points.size(), false );
+
+    if ( points.empty() || (!_graph.valid() && !patch) )
+    {
+        if ( out_resolved )
+            out_resolved->swap( resolved );
+        return 0u;
+    }
+
+    // convert to map coordinates. If the batch fails (leaving the points
+    // untouched), go point by point and leave out the ones that fail.
+    std::vector<osg::Vec3d> mapPoints( points );
+    std::vector<bool>       valid( points.size(), true );
+    if ( srs && !srs->isHorizEquivalentTo(getSRS()) )
+    {
+        if ( !srs->transform( &mapPoints[0].x(), &mapPoints[0].y(), 0L, mapPoints.size(), getSRS(), 3 ) )
+        {
+            for(unsigned i=0; i<mapPoints.size(); ++i)
+            {
+                osg::Vec3d& p = mapPoints[i];
+                valid[i] = srs->transform2D( p.x(), p.y(), getSRS(), p.x(), p.y() );
+            }
+        }
+    }
+
+    // sample the tile data directly where we can:
+    if ( _heightSource.valid() )
+    {
+        _heightSource->getHeights( patch, mapPoints, resolved );
+    }
+
+    const GeoExtent& extent = getProfile()->getExtent();
+    const bool hasDatum = getSRS()->getVerticalDatum() != 0L;
+
+    unsigned count = 0u;
+    for(unsigned i=0; i<mapPoints.size(); ++i)
+    {
+        double x = mapPoints[i].x(), y = mapPoints[i].y();
+
+        if ( !valid[i] )
+        {
+            resolved[i] = false;
+        }
+        else if ( resolved[i] )
+        {
+            // the height source returns HAE.
+            double hae = mapPoints[i].z();
+            points[i].z() = ellipsoidal || !hasDatum ? hae : toHeightAboveMSL(x, y, hae);
+            ++count;
+        }
+        else if ( extent.contains(x, y) )
+        {
+            // fall back on intersecting the graph:
+            double hamsl, hae;
+            if ( intersect(patch, x, y, &hamsl, &hae) )
+            {
+                points[i].z() = ellipsoidal ? hae : hamsl;
+                resolved[i] = true;
+                ++count;
+            }
+        }
+    }
+
+    if ( out_resolved )
+        out_resolved->swap( resolved );
+
+    return count;
+}
+
+
+double
+Terrain::toHeightAboveEllipsoid(double x, double y, double hamsl) const
+{
+    const VerticalDatum* vdatum = getSRS()->getVerticalDatum();
+    if ( !vdatum )
+        return hamsl;
+
+    if ( !getSRS()->isGeographic() )
+    {
+        getSRS()->transform2D(x, y, getSRS()->getGeographicSRS(), x, y);
+    }
+    return vdatum->msl2hae( y, x, hamsl );
+}
+
+
+double
+Terrain::toHeightAboveMSL(double x, double y, double hae) const
+{
+    const VerticalDatum* vdatum = getSRS()->getVerticalDatum();
+    if ( !vdatum )
+        return hae;
+
+    if ( !getSRS()->isGeographic() )
+    {
+        getSRS()->transform2D(x, y, getSRS()->getGeographicSRS(), x, y);
+    }
+    return vdatum->hae2msl( y, x, hae );
+}
+
+
+bool
+Terrain::intersect(osg::Node* patch,
+                   double     x,
+                   double     y,
+                   double*    out_hamsl,
+                   double*    out_hae) const
+{
+    osg::ref_ptr<osg::Node> graph;
+    if ( !patch && !_graph.lock(graph) )
+        return false;
+
     const osg::EllipsoidModel* em = getSRS()->getEllipsoid();
     double r = std::min( em->getRadiusEquator(), em->getRadiusPolar() );
 
@@ -132,7 +630,7 @@ Terrain::getHeight(osg::Node*              patch,
     if ( patch )
         patch->accept( iv );
     else
-        _graph->accept( iv );
+        graph->accept( iv );
 
     osgUtil::LineSegmentIntersector::Intersections& results = lsi->getIntersections();
     if ( !results.empty() )
@@ -272,32 +770,27 @@ Terrain::getWorldCoordsUnderMouse(osg::View* view,
 
 void
 Terrain::addTerrainCallback( TerrainCallback* cb )
+{
+    addTerrainCallback( cb, GeoExtent::INVALID );
+}
+
+void
+Terrain::addTerrainCallback( TerrainCallback* cb, const GeoExtent& extent )
 {
     if ( cb )
-    {        
-        Threading::ScopedWriteLock exclusiveLock( _callbacksMutex );
-        _callbacks.push_back( cb );
-        ++_callbacksSize; // atomic increment
+    {
+        Threading::ScopedMutexLock exclusiveLock( _callbacks->_mutex );
+        _callbacks->insert( cb, extent );
+        _callbacksSize.exchange( _callbacks->size() );
     }
 }
 
 void
 Terrain::removeTerrainCallback( TerrainCallback* cb )
 {
-    Threading::ScopedWriteLock exclusiveLock( _callbacksMutex );
-
-    for( CallbackList::iterator i = _callbacks.begin(); i != _callbacks.end(); )
-    {        
-        if ( i->get() == cb )
-        {
-            i = _callbacks.erase( i );
-            --_callbacksSize;
-        }
-        else
-        {
-            ++i;
-        }
-    }
+    Threading::ScopedMutexLock exclusiveLock( _callbacks->_mutex );
+    _callbacks->remove( cb );
+    _callbacksSize.exchange( _callbacks->size() );
 }
 
 void
@@ -311,25 +804,113 @@ Terrain::notifyTileAdded( const TileKey& key, osg::Node* node )
     osg::ref_ptr<osg::OperationQueue> queue;
     if ( _callbacksSize > 0 && _updateOperationQueue.lock(queue) )
     {
-        queue->add( new OnTileAddedOperation(key, node, this) );
+        // Tiles are announced in batches, once per frame, by a single operation.
+        Threading::ScopedMutexLock lock( _callbacks->_pendingMutex );
+        _callbacks->_pending.push_back( TerrainCallbackIndex::PendingTile(key, node) );
+        if ( !_callbacks->_pendingScheduled )
+        {
+            _callbacks->_pendingScheduled = true;
+            queue->add( new OnTilesAddedOperation(this) );
+        }
+    }
+}
+
+bool
+Terrain::firePendingTilesAdded()
+{
+    std::vector<TileKey>                   keys;
+    std::vector<osg::ref_ptr<osg::Node> >  refs;
+    bool                                   waiting;
+    {
+        Threading::ScopedMutexLock lock( _callbacks->_pendingMutex );
+
+        std::vector<TerrainCallbackIndex::PendingTile>& pending = _callbacks->_pending;
+        unsigned kept = 0u;
+        for(unsigned i=0; i<pending.size(); ++i)
+        {
+            osg::ref_ptr<osg::Node> node;
+            if ( pending[i]._node.lock(node) )
+            {
+                if ( node->getNumParents() > 0 )
+                {
+                    keys.push_back( pending[i]._key );
+                    refs.push_back( node.get() );
+                }
+                else
+                {
+                    // not in the graph yet; try again next frame.
+                    pending[kept++] = pending[i];
+                }
+            }
+            // else the tile expired before notification; let it go.
+        }
+        pending.erase( pending.begin() + kept, pending.end() );
+
+        waiting = !pending.empty();
+        if ( !waiting )
+            _callbacks->_pendingScheduled = false;
+    }
+
+    if ( !keys.empty() )
+    {
+        std::vector<osg::Node*> tiles( refs.size() );
+        for(unsigned i=0; i<refs.size(); ++i)
+            tiles[i] = refs[i].get();
+
+        fireTilesAdded( keys, tiles );
     }
+
+    return waiting;
 }
 
 void
 Terrain::fireTileAdded( const TileKey& key, osg::Node* node )
 {
-    Threading::ScopedReadLock sharedLock( _callbacksMutex );
+    fireTilesAdded( std::vector<TileKey>(1, key), std::vector<osg::Node*>(1, node) );
+}
+
+void
+Terrain::fireTilesAdded( const std::vector<TileKey>& keys, const std::vector<osg::Node*>& tiles )
+{
+    TerrainCallbackIndex::DispatchList dispatch;
+    {
+        Threading::ScopedMutexLock lock( _callbacks->_mutex );
+        _callbacks->beginDispatch( keys.size(), dispatch );
+        for(unsigned i=0; i<keys.size(); ++i)
+            _callbacks->collect( keys[i], i, dispatch );
+    }
+
+    // Call out without the lock so the callbacks may add or remove callbacks.
+    std::vector<TileKey>    subKeys;
+    std::vector<osg::Node*> subTiles;
+
+    for(TerrainCallbackIndex::DispatchList::iterator d = dispatch.begin(); d != dispatch.end(); ++d)
+    {
+        TerrainCallbackIndex::Entry* entry = d->_entry.get();
+        if ( entry->_removed )
+            continue;
 
-    for( CallbackList::iterator i = _callbacks.begin(); i != _callbacks.end(); )
-    {       
         TerrainCallbackContext context( this );
-        i->get()->onTileAdded( key, node, context );
+
+        if ( d->_tiles.size() == keys.size() )
+        {
+            entry->_callback->onTilesAdded( keys, tiles, context );
+        }
+        else
+        {
+            subKeys.clear();
+            subTiles.clear();
+            for(unsigned i=0; i<d->_tiles.size(); ++i)
+            {
+                subKeys.push_back( keys[d->_tiles[i]] );
+                subTiles.push_back( tiles[d->_tiles[i]] );
+            }
+            entry->_callback->onTilesAdded( subKeys, subTiles, context );
+        }
 
         // if the callback set the "remove" flag, discard the callback.
         if ( context.markedForRemoval() )
-            i = _callbacks.erase( i );
-        else
-            ++i;
+            removeTerrainCallback( entry->_callback.get() );
     }
 }
 
@@ -141,7 +141,7 @@ AnnotationNode::setMapNode( MapNode* mapNode )
             {
                 oldMapNode->getTerrain()->removeTerrainCallback( _autoClampCallback.get() );
                 if ( mapNode )
-                    mapNode->getTerrain()->addTerrainCallback( _autoClampCallback.get() );
+                    mapNode->getTerrain()->addTerrainCallback( _autoClampCallback.get(), getClampExtent() );
             }
         }		
 
@@ -185,9 +185,14 @@ AnnotationNode::setCPUAutoClamping( bool value )
             if ( AnnotationSettings::getContinuousClamping() )
             {
                 _autoClampCallback = new AutoClampCallback( this );
-                getMapNode()->getTerrain()->addTerrainCallback( _autoClampCallback.get() );
+                getMapNode()->getTerrain()->addTerrainCallback( _autoClampCallback.get(), getClampExtent() );
             }
         }
+        else if ( _autoclamp && value && _autoClampCallback.valid() )
+        {
+            // the node may have moved; keep the callback on its new extent.
+            getMapNode()->getTerrain()->addTerrainCallback( _autoClampCallback.get(), getClampExtent() );
+        }
         else if ( _autoclamp && !value && _autoClampCallback.valid())
         {
             getMapNode()->getTerrain()->removeTerrainCallback( _autoClampCallback );
@@ -328,12 +328,12 @@ FeatureNode::reclamp( const TileKey& key, osg::Node* tile, const Terrain* terrai
 {
     if ( _featurePolytope.contains( tile->getBound() ) )
     {
-        clampMesh( tile );
+        clampMesh( tile, key.getExtent() );
     }
 }
 
 void
-FeatureNode::clampMesh( osg::Node* terrainModel )
+FeatureNode::clampMesh( osg::Node* terrainModel, const GeoExtent& extent )
 {
     if ( getMapNode() )
     {
@@ -351,6 +351,8 @@ FeatureNode::clampMesh( osg::Node* terrainModel )
         }
 
         MeshClamper clamper( terrainModel, getMapNode()->getMapSRS(), getMapNode()->isGeocentric(), relative, scale, offset );
+        clamper.setTerrain( getMapNode()->getTerrain() );
+        clamper.setExtent( extent );
         getAttachPoint()->accept( clamper );
 
         this->dirtyBound();
@@ -723,13 +723,13 @@ ImageOverlay::reclamp( const TileKey& key, osg::Node* tile, const Terrain* )
 {
     if ( _boundingPolytope.contains( tile->getBound() ) ) // intersects, actually
     {
-        clampMesh( tile );
+        clampMesh( tile, key.getExtent() );
         OE_DEBUG << LC << "Clamped overlay mesh, tile radius = " << tile->getBound().radius() << std::endl;
     }
 }
 
 void
-ImageOverlay::clampMesh( osg::Node* terrainModel )
+ImageOverlay::clampMesh( osg::Node* terrainModel, const GeoExtent& extent )
 {
     double scale  = 1.0;
     double offset = 0.0;
@@ -747,6 +747,8 @@ ImageOverlay::clampMesh( osg::Node* terrainModel )
     }
 
     MeshClamper clamper( terrainModel, getMapNode()->getMapSRS(), getMapNode()->isGeocentric(), relative, scale, offset );
+    clamper.setTerrain( getMapNode()->getTerrain() );
+    clamper.setExtent( extent );
     this->accept( clamper );
 
     this->dirtyBound();
@@ -236,6 +236,18 @@ LocalizedNode::reclamp( const TileKey& key, osg::Node* tile, const Terrain* terr
     }
 }
 
+GeoExtent
+LocalizedNode::getClampExtent() const
+{
+    // reclamp() only cares about the tiles under the position.
+    if ( !_mapPosition.isValid() )
+        return GeoExtent::INVALID;
+
+    return GeoExtent(
+        _mapPosition.getSRS(),
+        _mapPosition.x(), _mapPosition.y(), _mapPosition.x(), _mapPosition.y() );
+}
+
 
 osg::Node*
 LocalizedNode::applyAltitudePolicy(osg::Node* node, const Style& style)
@@ -292,6 +292,8 @@ OrthoNode::updateTransforms( const GeoPoint& p, osg::Node* patch )
         _matxform->setMatrix( osg::Matrix::translate(absPos) );
     }
 
+    onWorldPositionChanged( getWorldPosition() );
+
     dirtyBound();
     return true;
 }
@@ -411,3 +413,15 @@ OrthoNode::reclamp( const TileKey& key, osg::Node* tile, const Terrain* terrain
         updateTransforms( _mapPosition, tile );
     }
 }
+
+GeoExtent
+OrthoNode::getClampExtent() const
+{
+    // reclamp() only cares about the tiles under the position.
+    if ( !_mapPosition.isValid() )
+        return GeoExtent::INVALID;
+
+    return GeoExtent(
+        _mapPosition.getSRS(),
+        _mapPosition.x(), _mapPosition.y(), _mapPosition.x(), _mapPosition.y() );
+}
@@ -0,0 +1,553 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2015 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <osgEarthAnnotation/PlaceBatch>
+#include <osgEarth/Capabilities>
+#include <osgEarth/CullingUtils>
+#include <osgEarth/ImageUtils>
+#include <osgEarth/MapNode>
+#include <osgEarth/NodeUtils>
+#include <osgEarth/Registry>
+#include <osgEarth/ShaderGenerator>
+#include <osgEarth/StringUtils>
+#include <osgEarth/VirtualProgram>
+
+#include <osg/BlendFunc>
+#include <osg/Depth>
+#include <osgUtil/CullVisitor>
+#include <osgUtil/Optimizer>
+#include <algorithm>
+
+#define LC "[PlaceBatch] "
+
+using namespace osgEarth;
+using namespace osgEarth::Annotation;
+
+// texture unit of the per-place data
+#define INSTANCE_TBO_UNIT 5
+
+// texels of per-place data: position and heading; atlas region; pixel offset and size
+#define TEXELS_PER_PLACE 3
+
+namespace
+{
+    // Moves the unit quad to the place's position and remembers where in
+    // screen space this corner goes.
+    const char* vertexModelSource =
+        "#version 130\n"
+        "#extension GL_EXT_gpu_shader4 : enable\n"
+        "#extension GL_ARB_draw_instanced : enable\n"
+        "uniform samplerBuffer oe_pb_instances; \n"
+        "varying vec2 oe_pb_texcoord; \n"
+        "vec2 oe_pb_corner; \n"
+        "void oe_pb_vertex_model(inout vec4 VertexMODEL) \n"
+        "{ \n"
+        "    int index = 3 * gl_InstanceID; \n"
+        "    vec4 position = texelFetch(oe_pb_instances, index); \n"
+        "    vec4 region   = texelFetch(oe_pb_instances, index+1); \n"
+        "    vec4 rect     = texelFetch(oe_pb_instances, index+2); \n"
+        "    vec2 unit = VertexMODEL.xy; \n"
+        "    vec2 p = unit*rect.zw + rect.xy; \n"
+        "    float c = cos(position.w), s = sin(position.w); \n"
+        "    oe_pb_corner = vec2(p.x*c + p.y*s, p.y*c - p.x*s); \n"
+        "    oe_pb_texcoord = region.xy + (unit+0.5)*region.zw; \n"
+        "    VertexMODEL = vec4(position.xyz, 1.0); \n"
+        "} \n";
+
+    // Hides places on the far side of the globe.
+    const char* vertexViewSource =
+        "#version " GLSL_VERSION_STR "\n"
+        "uniform bool  oe_pb_horizon; \n"
+        "uniform vec3  oe_pb_center; \n"
+        "uniform float oe_pb_radius; \n"
+        "bool oe_pb_visible; \n"
+        "void oe_pb_vertex_view(inout vec4 VertexVIEW) \n"
+        "{ \n"
+        "    oe_pb_visible = true; \n"
+        "    if ( oe_pb_horizon ) \n"
+        "    { \n"
+        "        vec3 vc = (gl_ModelViewMatrix * vec4(oe_pb_center, 1.0)).xyz; \n"
+        "        vec3 vt = VertexVIEW.xyz; \n"
+        "        float vhMag2 = dot(vc, vc) - oe_pb_radius*oe_pb_radius; \n"
+        "        float vtDotVc = dot(vt, vc); \n"
+        "        oe_pb_visible = vtDotVc < vhMag2 || vtDotVc*vtDotVc/dot(vt, vt) <= vhMag2; \n"
+        "    } \n"
+        "} \n";
+
+    // Expands the quad to the icon's size on screen.
+    const char* vertexClipSource =
+        "#version " GLSL_VERSION_STR "\n"
+        "uniform vec2 oe_pb_viewport; \n"
+        "vec2 oe_pb_corner; \n"
+        "bool oe_pb_visible; \n"
+        "void oe_pb_vertex_clip(inout vec4 VertexCLIP) \n"
+        "{ \n"
+        "    if ( !oe_pb_visible ) \n"
+        "        VertexCLIP = vec4(0.0, 0.0, 2.0, 1.0); \n"
+        "    else \n"
+        "        VertexCLIP.xy += oe_pb_corner * 2.0 / oe_pb_viewport * VertexCLIP.w; \n"
+        "} \n";
+
+    const char* fragmentSource =
+        "#version " GLSL_VERSION_STR "\n"
+        "uniform sampler2D oe_pb_atlas; \n"
+        "varying vec2 oe_pb_texcoord; \n"
+        "void oe_pb_fragment(inout vec4 color) \n"
+        "{ \n"
+        "    color *= texture2D(oe_pb_atlas, oe_pb_texcoord); \n"
+        "} \n";
+
+    /** Bounds of the places, which the instanced geometry cannot compute. */
+    struct PlaceBounds : public osg::Drawable::ComputeBoundingBoxCallback
+    {
+        osg::BoundingBox _bbox;
+        osg::BoundingBox computeBound(const osg::Drawable&) const { return _bbox; }
+    };
+
+    // Icons loaded from the same file share an atlas slot even when each
+    // place got its own image object.
+    std::string getIconKey(const osg::Image* image)
+    {
+        if ( !image->getFileName().empty() )
+            return image->getFileName();
+        return Stringify() << "<image " << (const void*)image << ">";
+    }
+
+    unsigned nextPowerOf2(unsigned x)
+    {
+        unsigned p = 1;
+        while( p < x )
+            p <<= 1;
+        return p;
+    }
+}
+
+
+PlaceBatch::PlaceBatch( MapNode* mapNode ) :
+_maxAtlasWidth ( 2048 ),
+_maxAtlasHeight( 2048 ),
+_numPlaces     ( 0 ),
+_originSet     ( false ),
+_atlasDirty    ( false ),
+_placesDirty   ( false )
+{
+    const Capabilities& caps = Registry::capabilities();
+    _supported =
+        caps.supportsGLSL() &&
+        caps.supportsDrawInstanced() &&
+        caps.supportsTextureBuffer();
+
+    _maxPlaces = _supported ? (unsigned)caps.getMaxTextureBufferSize() / TEXELS_PER_PLACE : 0u;
+
+    // one unit quad, drawn once per place.
+    osg::Vec3Array* verts = new osg::Vec3Array(4);
+    (*verts)[0].set( -0.5f, -0.5f, 0.0f );
+    (*verts)[1].set(  0.5f, -0.5f, 0.0f );
+    (*verts)[2].set( -0.5f,  0.5f, 0.0f );
+    (*verts)[3].set(  0.5f,  0.5f, 0.0f );
+
+    osg::Vec4Array* colors = new osg::Vec4Array(1);
+    (*colors)[0].set( 1.0f, 1.0f, 1.0f, 1.0f );
+
+    _geom = new osg::Geometry();
+    _geom->setUseDisplayList( false );
+    _geom->setUseVertexBufferObjects( true );
+    _geom->setDataVariance( osg::Object::DYNAMIC );
+    _geom->setVertexArray( verts );
+    _geom->setColorArray( colors );
+    _geom->setColorBinding( osg::Geometry::BIND_OVERALL );
+    _geom->addPrimitiveSet( new osg::DrawArrays(GL_TRIANGLE_STRIP, 0, 4) );
+    _geom->setComputeBoundingBoxCallback( new PlaceBounds() );
+
+    // the bound only covers the anchor points, since the icons are sized in
+    // pixels; a lone place has a zero radius. So don't let small-feature
+    // culling drop the batch. The shader hides places beyond the horizon.
+    _geode = new osg::Geode();
+    _geode->addDrawable( _geom.get() );
+    _geode->setNodeMask( 0 );
+    _geode->setCullingActive( false );
+
+    _xform = new osg::MatrixTransform();
+    _xform->addChild( _geode.get() );
+    _xform->setCullingActive( false );
+    this->addChild( _xform.get() );
+    this->setCullingActive( false );
+
+    _atlas = new osg::Texture2D();
+    _atlas->setFilter( osg::Texture::MIN_FILTER, osg::Texture::LINEAR );
+    _atlas->setFilter( osg::Texture::MAG_FILTER, osg::Texture::LINEAR );
+    _atlas->setWrap( osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE );
+    _atlas->setWrap( osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE );
+    _atlas->setResizeNonPowerOfTwoHint( false );
+    _atlas->setDataVariance( osg::Object::DYNAMIC );
+    ShaderGenerator::setIgnoreHint( _atlas.get(), true );
+
+    _tbo = new osg::TextureBuffer();
+    _tbo->setInternalFormat( GL_RGBA32F_ARB );
+    _tbo->setDataVariance( osg::Object::DYNAMIC );
+    ShaderGenerator::setIgnoreHint( _tbo.get(), true );
+
+    osg::StateSet* stateSet = _geode->getOrCreateStateSet();
+    stateSet->setDataVariance( osg::Object::DYNAMIC );
+    stateSet->setTextureAttribute( 0, _atlas.get() );
+    stateSet->setTextureAttribute( INSTANCE_TBO_UNIT, _tbo.get() );
+    stateSet->getOrCreateUniform( "oe_pb_atlas", osg::Uniform::SAMPLER_2D )->set( 0 );
+    stateSet->getOrCreateUniform( "oe_pb_instances", osg::Uniform::SAMPLER_BUFFER )->set( INSTANCE_TBO_UNIT );
+
+    // same treatment as a PlaceNode icon: always on top, blended.
+    stateSet->setMode( GL_LIGHTING, osg::StateAttribute::OFF );
+    stateSet->setMode( GL_CULL_FACE, osg::StateAttribute::OFF );
+    stateSet->setMode( GL_BLEND, osg::StateAttribute::ON );
+    stateSet->setAttributeAndModes( new osg::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA), osg::StateAttribute::ON );
+    stateSet->setAttributeAndModes( new osg::Depth(osg::Depth::ALWAYS, 0, 1, false), osg::StateAttribute::ON );
+    stateSet->setRenderingHint( osg::StateSet::TRANSPARENT_BIN );
+
+    bool geocentric = mapNode && mapNode->isGeocentric();
+    double radius = 0.0;
+    if ( geocentric && mapNode->getMapSRS()->getEllipsoid() )
+        radius = mapNode->getMapSRS()->getEllipsoid()->getRadiusPolar();
+
+    stateSet->getOrCreateUniform( "oe_pb_horizon", osg::Uniform::BOOL )->set( geocentric );
+    stateSet->getOrCreateUniform( "oe_pb_center", osg::Uniform::FLOAT_VEC3 )->set( osg::Vec3f(0,0,0) );
+    stateSet->getOrCreateUniform( "oe_pb_radius", osg::Uniform::FLOAT )->set( (float)radius );
+
+    if ( _supported )
+    {
+        VirtualProgram* vp = VirtualProgram::getOrCreate( stateSet );
+        vp->setName( "osgEarth.PlaceBatch" );
+        vp->setFunction( "oe_pb_vertex_model", vertexModelSource, ShaderComp::LOCATION_VERTEX_MODEL, 0.0f );
+        vp->setFunction( "oe_pb_vertex_view",  vertexViewSource,  ShaderComp::LOCATION_VERTEX_VIEW );
+        vp->setFunction( "oe_pb_vertex_clip",  vertexClipSource,  ShaderComp::LOCATION_VERTEX_CLIP );
+        vp->setFunction( "oe_pb_fragment",     fragmentSource,    ShaderComp::LOCATION_FRAGMENT_COLORING );
+    }
+
+    ADJUST_UPDATE_TRAV_COUNT( this, 1 );
+}
+
+void
+PlaceBatch::setMaxAtlasSize( unsigned width, unsigned height )
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    _maxAtlasWidth  = width;
+    _maxAtlasHeight = height;
+}
+
+unsigned
+PlaceBatch::getNumPlaces() const
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    return _numPlaces;
+}
+
+unsigned
+PlaceBatch::getNumIcons() const
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    return _iconIndex.size();
+}
+
+int
+PlaceBatch::add(osg::Image*       image,
+                const osg::Vec3d& world,
+                const osg::Vec2f& offset,
+                float             scale,
+                float             heading)
+{
+    if ( !_supported || !image )
+        return -1;
+
+    Threading::ScopedMutexLock lock( _mutex );
+
+    if ( _numPlaces >= _maxPlaces )
+        return -1;
+
+    int icon = getIcon( image );
+    if ( icon < 0 )
+        return -1;
+
+    // the first place anchors the batch, which keeps float positions precise.
+    if ( !_originSet )
+    {
+        _origin = world;
+        _originSet = true;
+    }
+
+    int id;
+    if ( !_freeIDs.empty() )
+    {
+        id = _freeIDs.back();
+        _freeIDs.pop_back();
+    }
+    else
+    {
+        id = (int)_places.size();
+        _places.push_back( Place() );
+    }
+
+    Place& place = _places[id];
+    place._active  = true;
+    place._icon    = (unsigned)icon;
+    place._world   = world;
+    place._offset  = offset;
+    place._scale   = scale;
+    place._heading = heading;
+
+    _icons[icon]._refs++;
+    _numPlaces++;
+    _placesDirty = true;
+
+    return id;
+}
+
+void
+PlaceBatch::setPosition( int id, const osg::Vec3d& world )
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    if ( id >= 0 && id < (int)_places.size() && _places[id]._active )
+    {
+        _places[id]._world = world;
+        _placesDirty = true;
+    }
+}
+
+void
+PlaceBatch::remove( int id )
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    if ( id >= 0 && id < (int)_places.size() && _places[id]._active )
+    {
+        Place& place = _places[id];
+        place._active = false;
+        _icons[place._icon]._refs--;
+        _numPlaces--;
+        _freeIDs.push_back( id );
+        _placesDirty = true;
+    }
+}
+
+int
+PlaceBatch::getIcon( osg::Image* image )
+{
+    std::string key = getIconKey( image );
+    std::map<std::string, unsigned>::const_iterator i = _iconIndex.find( key );
+    if ( i != _iconIndex.end() )
+        return (int)i->second;
+
+    osg::ref_ptr<osg::Image> rgba = ImageUtils::convertToRGBA8( image );
+    if ( !rgba.valid() )
+        return -1;
+
+    // repack the icons in use along with the new one. Icons that are no
+    // longer in use drop out of the atlas here, and their slots are reused.
+    std::vector<unsigned> icons;
+    for( unsigned k=0; k<_icons.size(); ++k )
+    {
+        if ( _icons[k]._refs > 0 )
+        {
+            icons.push_back( k );
+        }
+        else if ( _icons[k]._image.valid() )
+        {
+            _iconIndex.erase( _icons[k]._key );
+            _icons[k] = Icon();
+            _freeIcons.push_back( k );
+        }
+    }
+
+    unsigned index;
+    if ( !_freeIcons.empty() )
+    {
+        index = _freeIcons.back();
+        _freeIcons.pop_back();
+    }
+    else
+    {
+        index = _icons.size();
+        _icons.push_back( Icon() );
+    }
+
+    Icon& icon = _icons[index];
+    icon._key    = key;
+    icon._source = image;
+    icon._image  = rgba.get();
+    icons.push_back( index );
+
+    if ( !pack(icons) )
+    {
+        OE_INFO << LC << "Icon \"" << image->getFileName() << "\" does not fit in the atlas" << std::endl;
+        _icons[index] = Icon();
+        _freeIcons.push_back( index );
+        return -1;
+    }
+
+    _iconIndex[key] = index;
+    return (int)index;
+}
+
+bool
+PlaceBatch::pack( const std::vector<unsigned>& icons )
+{
+    osgUtil::Optimizer::TextureAtlasBuilder builder;
+    builder.setMaximumAtlasSize( (int)_maxAtlasWidth, (int)_maxAtlasHeight );
+    builder.setMargin( 1 );
+
+    for( unsigned i=0; i<icons.size(); ++i )
+        builder.addSource( _icons[icons[i]]._image.get() );
+
+    builder.buildAtlas();
+
+    // every icon must land in the same atlas image. The builder leaves a
+    // lone icon out of the atlas, in which case it is its own atlas.
+    osg::Image* atlas = 0L;
+    std::vector<osg::Vec4f> regions( icons.size() );
+    for( unsigned i=0; i<icons.size(); ++i )
+    {
+        osg::Image* icon = _icons[icons[i]]._image.get();
+        osg::Image* page = builder.getImageAtlas( icon );
+        if ( page )
+        {
+            osg::Matrix m = builder.getTextureMatrix( icon );
+            regions[i].set( m(3,0), m(3,1), m(0,0), m(1,1) );
+        }
+        else if ( icons.size() == 1 )
+        {
+            page = icon;
+            regions[i].set( 0.0f, 0.0f, 1.0f, 1.0f );
+        }
+
+        if ( !page || (atlas && page != atlas) )
+            return false;
+
+        atlas = page;
+    }
+
+    for( unsigned i=0; i<icons.size(); ++i )
+        _icons[icons[i]]._region = regions[i];
+
+    _atlasImage  = atlas;
+    _atlasDirty  = true;
+    _placesDirty = true;
+    return true;
+}
+
+void
+PlaceBatch::sync()
+{
+    Threading::ScopedMutexLock lock( _mutex );
+
+    if ( _atlasDirty )
+    {
+        _atlas->setImage( _atlasImage.get() );
+        _atlasDirty = false;
+    }
+
+    if ( _placesDirty )
+    {
+        _xform->setMatrix( osg::Matrix::translate(_origin) );
+        _geode->getStateSet()->getUniform( "oe_pb_center" )->set( osg::Vec3f(-_origin) );
+
+        // grow the buffer in powers of two so it isn't reallocated on every
+        // change, but never past the largest texture buffer the GPU supports.
+        unsigned capacity = std::min( nextPowerOf2(std::max(_numPlaces, 1u)), _maxPlaces );
+        if ( !_tboImage.valid() || (unsigned)_tboImage->s() < capacity*TEXELS_PER_PLACE )
+        {
+            _tboImage = new osg::Image();
+            _tboImage->allocateImage( capacity*TEXELS_PER_PLACE, 1, 1, GL_RGBA, GL_FLOAT );
+            _tbo->setImage( _tboImage.get() );
+        }
+
+        PlaceBounds* bounds = static_cast<PlaceBounds*>( _geom->getComputeBoundingBoxCallback() );
+        bounds->_bbox.init();
+
+        GLfloat* ptr = reinterpret_cast<GLfloat*>( _tboImage->data() );
+        for( unsigned i=0; i<_places.size(); ++i )
+        {
+            const Place& place = _places[i];
+            if ( !place._active )
+                continue;
+
+            const Icon& icon = _icons[place._icon];
+            osg::Vec3f local( place._world - _origin );
+
+            *ptr++ = local.x();
+            *ptr++ = local.y();
+            *ptr++ = local.z();
+            *ptr++ = place._heading;
+
+            *ptr++ = icon._region[0];
+            *ptr++ = icon._region[1];
+            *ptr++ = icon._region[2];
+            *ptr++ = icon._region[3];
+
+            *ptr++ = place._offset.x();
+            *ptr++ = place._offset.y();
+            *ptr++ = place._scale * (float)icon._image->s();
+            *ptr++ = place._scale * (float)icon._image->t();
+
+            bounds->_bbox.expandBy( local );
+        }
+        _tboImage->dirty();
+
+        // with no instances the draw call would draw one, so hide it instead.
+        _geom->getPrimitiveSet(0)->setNumInstances( _numPlaces );
+        _geode->setNodeMask( _numPlaces > 0 ? ~0 : 0 );
+        _geom->dirtyBound();
+
+        _placesDirty = false;
+    }
+}
+
+void
+PlaceBatch::traverse( osg::NodeVisitor& nv )
+{
+    if ( nv.getVisitorType() == nv.UPDATE_VISITOR )
+    {
+        sync();
+        osg::Group::traverse( nv );
+    }
+
+    else if ( nv.getVisitorType() == nv.CULL_VISITOR )
+    {
+        // icon sizes are in pixels, so the shader needs this view's viewport.
+        osgUtil::CullVisitor* cv = Culling::asCullVisitor(nv);
+        PerViewData& data = _perViewData.get(cv);
+        if ( !data._viewport.valid() )
+        {
+            data._viewport = new osg::Uniform(osg::Uniform::FLOAT_VEC2, "oe_pb_viewport");
+            data._stateSet = new osg::StateSet();
+            data._stateSet->addUniform( data._viewport.get() );
+        }
+
+        const osg::Viewport* vp = cv->getViewport();
+        if ( vp )
+            data._viewport->set( osg::Vec2f(vp->width(), vp->height()) );
+
+        cv->pushStateSet( data._stateSet.get() );
+        osg::Group::traverse( nv );
+        cv->popStateSet();
+    }
+
+    else
+    {
+        osg::Group::traverse( nv );
+    }
+}
@@ -50,7 +50,8 @@ OrthoNode( mapNode, position ),
 _image   ( image ),
 _text    ( text ),
 _style   ( style ),
-_geode   ( 0L )
+_geode   ( 0L ),
+_batchID ( -1 )
 {
     init();
 }
@@ -63,7 +64,8 @@ PlaceNode::PlaceNode(MapNode*           mapNode,
 OrthoNode( mapNode, position ),
 _text    ( text ),
 _style   ( style ),
-_geode   ( 0L )
+_geode   ( 0L ),
+_batchID ( -1 )
 {
     init();
 }
@@ -74,11 +76,18 @@ PlaceNode::PlaceNode(MapNode*              mapNode,
                      const osgDB::Options* dbOptions ) :
 OrthoNode ( mapNode, position ),
 _style    ( style ),
-_dbOptions( dbOptions )
+_dbOptions( dbOptions ),
+_batchID  ( -1 )
 {
     init();
 }
 
+PlaceNode::~PlaceNode()
+{
+    if ( _batch.valid() && _batchID >= 0 )
+        _batch->remove( _batchID );
+}
+
 void
 PlaceNode::init()
 {
@@ -86,6 +95,12 @@ PlaceNode::init()
     this->clearDecoration();
     getAttachPoint()->removeChildren(0, getAttachPoint()->getNumChildren());
 
+    if ( _batch.valid() && _batchID >= 0 )
+    {
+        _batch->remove( _batchID );
+        _batchID = -1;
+    }
+
     _geode = new osg::Geode();
 
     // ensure that (0,0,0) is the bounding sphere control/center point.
@@ -194,12 +209,26 @@ PlaceNode::init()
             heading = osg::DegreesToRadians( icon->heading()->eval() );
         }
 
+        // hand the icon to the batch if there is one; we keep only the label.
+        if ( _batch.valid() )
+        {
+            _batchID = _batch->add(
+                _image.get(),
+                getWorldPosition(),
+                osg::Vec2f(offset.x(), offset.y()),
+                (float)scale,
+                (float)heading );
+        }
+
         //We must actually rotate the geometry itself and not use a MatrixTransform b/c the 
         //decluttering doesn't respect Transforms above the drawable.
-        osg::Geometry* imageGeom = AnnotationUtils::createImageGeometry( _image.get(), offset, 0, heading, scale );
-        if ( imageGeom )
+        if ( _batchID < 0 )
         {
-            _geode->addDrawable( imageGeom );
+            osg::Geometry* imageGeom = AnnotationUtils::createImageGeometry( _image.get(), offset, 0, heading, scale );
+            if ( imageGeom )
+            {
+                _geode->addDrawable( imageGeom );
+            }
         }
 
         text = AnnotationUtils::createTextDrawable(
@@ -293,6 +322,33 @@ PlaceNode::setIconImage(osg::Image* image)
 }
 
 
+void
+PlaceNode::setPlaceBatch(PlaceBatch* batch)
+{
+    if ( batch != _batch.get() )
+    {
+        // moving the icon requires a complete rebuild.
+        if ( _batch.valid() && _batchID >= 0 )
+        {
+            _batch->remove( _batchID );
+            _batchID = -1;
+        }
+        _batch = batch;
+        init();
+    }
+}
+
+
+void
+PlaceNode::onWorldPositionChanged(const osg::Vec3d& world)
+{
+    if ( _batch.valid() && _batchID >= 0 )
+    {
+        _batch->setPosition( _batchID, world );
+    }
+}
+
+
 void
 PlaceNode::setAnnotationData( AnnotationData* data )
 {
@@ -329,7 +385,8 @@ PlaceNode::PlaceNode(MapNode*              mapNode,
                      const Config&         conf,
                      const osgDB::Options* dbOptions) :
 OrthoNode ( mapNode, conf ),
-_dbOptions( dbOptions )
+_dbOptions( dbOptions ),
+_batchID  ( -1 )
 {
     conf.getObjIfSet( "style",  _style );
     conf.getIfSet   ( "text",   _text );
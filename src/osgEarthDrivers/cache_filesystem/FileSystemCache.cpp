@@ -23,18 +23,25 @@
 #include <osgEarth/XmlUtils>
 #include <osgEarth/URI>
 #include <osgEarth/FileUtils>
+#include <osgEarth/Profiler>
 #include <osgEarth/StringUtils>
 #include <osgEarth/Registry>
+#include <osgEarth/TaskService>
 #include <osgDB/FileUtils>
 #include <osgDB/FileNameUtils>
+#include <OpenThreads/Atomic>
 #include <fstream>
+#include <cstdio>
 #include <sys/stat.h>
 
 using namespace osgEarth;
 using namespace osgEarth::Drivers;
 using namespace osgEarth::Threading;
 
-#ifndef _WIN32
+#ifdef _WIN32
+#   include <process.h>
+#   define getpid _getpid
+#else
 #   include <unistd.h>
 #endif
 
@@ -68,6 +75,7 @@ namespace
         void init();
 
         std::string _rootPath;
+        unsigned    _writeThreads;
     };
 
     /** 
@@ -77,7 +85,10 @@ namespace
     class FileSystemCacheBin : public CacheBin
     {
     public:
-        FileSystemCacheBin( const std::string& name, const std::string& rootPath );
+        FileSystemCacheBin( const std::string& name, const std::string& rootPath, unsigned writeThreads );
+
+        /** Writes the pending (write-behind) record for a key to disk; called by the write threads. */
+        void flushPending(const std::string& key);
 
     public: // CacheBin interface
 
@@ -104,8 +115,22 @@ namespace
         bool writeMetadata( const Config& meta );
 
     protected:
+        virtual ~FileSystemCacheBin();
+
         bool purgeDirectory( const std::string& dir );
 
+        /** Writes a record to disk. A queued write is dropped if the key was removed or rewritten meanwhile. */
+        bool writeNow(const std::string& key, const osg::Object* object, const Config& meta, bool queued =false);
+
+        bool readPending(const std::string& key, osg::ref_ptr<osg::Object>& out_object, Config& out_meta);
+
+        unsigned getNumPending();
+
+        /** Lock guarding the files of one key. Keys share a fixed set of locks by hash. */
+        Threading::ReadWriteMutex& getStripe(const std::string& key) {
+            return _stripes[ osgEarth::hashString(key) % NUM_STRIPES ];
+        }
+
         bool binValidForReading(bool silent =true);
 
         bool binValidForWriting(bool silent =false);
@@ -118,7 +143,34 @@ namespace
         std::string                       _binPath;        // full path to the bin's root folder
         osg::ref_ptr<osgDB::ReaderWriter> _rw;
         osg::ref_ptr<osgDB::Options>      _rwOptions;
-        Threading::ReadWriteMutex         _rwmutex;
+
+        enum { NUM_STRIPES = 64 };
+        Threading::ReadWriteMutex         _stripes[NUM_STRIPES];
+        Threading::ReadWriteMutex         _metaMutex;      // guards the bin's metadata file
+        OpenThreads::Atomic               _tmpCounter;     // for unique temporary file names
+
+        // write-behind queue: records waiting to go to disk, readable in the meantime.
+        typedef std::pair< osg::ref_ptr<osg::Object>, Config > PendingWrite;
+        typedef std::map< std::string, PendingWrite >           PendingWrites;
+        osg::ref_ptr<TaskService>         _writeService;
+        PendingWrites                     _pending;
+        Threading::Mutex                  _pendingMutex;
+    };
+
+    /** Task that flushes one pending record to disk. */
+    struct WriteRequest : public TaskRequest
+    {
+        WriteRequest(FileSystemCacheBin* bin, const std::string& key)
+            : _bin(bin), _key(key) { }
+
+        void operator()(ProgressCallback* progress)
+        {
+            _bin->flushPending( _key );
+        }
+
+        // raw pointer: the bin waits for all its pending writes before destruction.
+        FileSystemCacheBin* _bin;
+        std::string         _key;
     };
 
     void writeMeta( const std::string& fullPath, const Config& meta )
@@ -145,6 +197,19 @@ namespace
             meta.fromJSON( bufStr );
         }
     }
+
+    /**
+     * Moves a file into place, replacing any existing one. On POSIX systems
+     * this is atomic, so a reader sees either the old file or the new one.
+     */
+    bool renameFile( const std::string& from, const std::string& to )
+    {
+#ifdef _WIN32
+        // rename() will not replace an existing file on Windows.
+        ::remove( to.c_str() );
+#endif
+        return ::rename( from.c_str(), to.c_str() ) == 0;
+    }
 }
 
 
@@ -159,7 +224,8 @@ namespace
 namespace
 {
     FileSystemCache::FileSystemCache( const CacheOptions& options ) :
-    Cache( options )
+    Cache( options ),
+    _writeThreads( 0 )
     {
         FileSystemCacheOptions fsco( options );
 
@@ -172,6 +238,7 @@ namespace
         }
 
         _rootPath = URI( *fsco.rootPath(), options.referrer() ).full();
+        _writeThreads = fsco.threads().get();
         init();
     }
 
@@ -184,7 +251,7 @@ namespace
     CacheBin*
     FileSystemCache::addBin( const std::string& name )
     {
-        return _bins.getOrCreate( name, new FileSystemCacheBin( name, _rootPath ) );
+        return _bins.getOrCreate( name, new FileSystemCacheBin( name, _rootPath, _writeThreads ));
     }
 
     CacheBin*
@@ -196,7 +263,7 @@ namespace
             Threading::ScopedMutexLock lock( s_defaultBinMutex );
             if ( !_defaultBin.valid() ) // double-check
             {
-                _defaultBin = new FileSystemCacheBin( "__default", _rootPath );
+                _defaultBin = new FileSystemCacheBin( "__default", _rootPath, _writeThreads );
             }
         }
         return _defaultBin.get();
@@ -274,7 +341,8 @@ namespace
     }
 
     FileSystemCacheBin::FileSystemCacheBin(const std::string&   binID,
-                                           const std::string&   rootPath) :
+                                           const std::string&   rootPath,
+                                           unsigned             writeThreads) :
     CacheBin            ( binID ),
     _binPathExists      ( false )
     {
@@ -286,14 +354,91 @@ namespace
         _rwOptions = Registry::instance()->cloneOrCreateOptions();
         _rwOptions->setOptionString( "Compressor=zlib" );
 #endif        
+
+        if ( writeThreads > 0 )
+        {
+            _writeService = new TaskService( "FileSystemCache write-behind [" + binID + "]", writeThreads );
+        }
+    }
+
+    FileSystemCacheBin::~FileSystemCacheBin()
+    {
+        // finish the write-behind queue; the write requests point back to this bin.
+        if ( _writeService.valid() )
+        {
+            while( getNumPending() > 0 )
+                OpenThreads::Thread::microSleep( 1000 );
+            _writeService = 0L;
+        }
+    }
+
+    unsigned
+    FileSystemCacheBin::getNumPending()
+    {
+        Threading::ScopedMutexLock lock( _pendingMutex );
+        return _pending.size();
+    }
+
+    bool
+    FileSystemCacheBin::readPending(const std::string& key, osg::ref_ptr<osg::Object>& out_object, Config& out_meta)
+    {
+        if ( !_writeService.valid() )
+            return false;
+
+        osg::ref_ptr<osg::Object> object;
+        {
+            Threading::ScopedMutexLock lock( _pendingMutex );
+            PendingWrites::const_iterator i = _pending.find( key );
+            if ( i == _pending.end() )
+                return false;
+            object   = i->second.first.get();
+            out_meta = i->second.second;
+        }
+
+        // the pending copy belongs to the write queue; give the caller its own.
+        out_object = object->clone( osg::CopyOp::DEEP_COPY_ALL );
+        return out_object.valid();
+    }
+
+    void
+    FileSystemCacheBin::flushPending(const std::string& key)
+    {
+        PendingWrite entry;
+        {
+            Threading::ScopedMutexLock lock( _pendingMutex );
+            PendingWrites::iterator i = _pending.find( key );
+            if ( i == _pending.end() )
+                return; // already written by an earlier request, or removed.
+            entry = i->second;
+        }
+
+        writeNow( key, entry.first.get(), entry.second, true );
+
+        // keep the entry if the key was rewritten in the meantime; a later request will flush it.
+        Threading::ScopedMutexLock lock( _pendingMutex );
+        PendingWrites::iterator i = _pending.find( key );
+        if ( i != _pending.end() && i->second.first.get() == entry.first.get() )
+            _pending.erase( i );
     }
 
     ReadResult
     FileSystemCacheBin::readImage(const std::string& key)
     {
+        OE_PROFILE_SCOPE("cache.read");
         if ( !binValidForReading() ) 
             return ReadResult(ReadResult::RESULT_NOT_FOUND);
 
+        // a record still in the write-behind queue:
+        osg::ref_ptr<osg::Object> pending;
+        Config pendingMeta;
+        if ( readPending(key, pending, pendingMeta) )
+        {
+            if ( dynamic_cast<osg::Image*>(pending.get()) )
+                return ReadResult( pending.get(), pendingMeta );
+            else
+                return ReadResult();
+        }
+
         // mangle "key" into a legal path name
         URI fileURI( getValidKey(key), _metaPath );
         std::string path = fileURI.full() + ".osgb";
@@ -305,7 +450,7 @@ namespace
 
         osgDB::ReaderWriter::ReadResult r;
         {
-            ScopedReadLock sharedLock( _rwmutex );
+            ScopedReadLock sharedLock( getStripe(key) );
             r = _rw->readImage( path, _rwOptions.get() );
             if ( !r.success() )
                 return ReadResult();
@@ -325,9 +470,16 @@ namespace
     ReadResult
     FileSystemCacheBin::readObject(const std::string& key)
     {
+        OE_PROFILE_SCOPE("cache.read");
         if ( !binValidForReading() ) 
             return ReadResult(ReadResult::RESULT_NOT_FOUND);
 
+        // a record still in the write-behind queue:
+        osg::ref_ptr<osg::Object> pending;
+        Config pendingMeta;
+        if ( readPending(key, pending, pendingMeta) )
+            return ReadResult( pending.get(), pendingMeta );
+
         // mangle "key" into a legal path name
         URI fileURI( getValidKey(key), _metaPath );
         std::string path = fileURI.full() + ".osgb";
@@ -339,7 +491,7 @@ namespace
 
         osgDB::ReaderWriter::ReadResult r;
         {
-            ScopedReadLock sharedLock( _rwmutex );
+            ScopedReadLock sharedLock( getStripe(key) );
             r = _rw->readObject( path, _rwOptions.get() );
             if ( !r.success() )
                 return ReadResult();
@@ -362,6 +514,17 @@ namespace
         if ( !binValidForReading() ) 
             return ReadResult(ReadResult::RESULT_NOT_FOUND);
 
+        // a record still in the write-behind queue:
+        osg::ref_ptr<osg::Object> pending;
+        Config pendingMeta;
+        if ( readPending(key, pending, pendingMeta) )
+        {
+            if ( dynamic_cast<osg::Node*>(pending.get()) )
+                return ReadResult( pending.get(), pendingMeta );
+            else
+                return ReadResult();
+        }
+
         // mangle "key" into a legal path name
         URI fileURI( getValidKey(key), _metaPath );
         std::string path = fileURI.full() + ".osgb";
@@ -373,7 +536,7 @@ namespace
 
         osgDB::ReaderWriter::ReadResult r;
         {
-            ScopedReadLock sharedLock( _rwmutex );
+            ScopedReadLock sharedLock( getStripe(key) );
             r = _rw->readNode( path, _rwOptions.get() );
             if ( !r.success() )
                 return ReadResult();
@@ -413,54 +576,116 @@ namespace
         if ( !binValidForWriting() || !object ) 
             return false;
 
+        if ( _writeService.valid() )
+        {
+            // queue a private copy, since the caller may keep using the object.
+            osg::ref_ptr<osg::Object> copy = object->clone( osg::CopyOp::DEEP_COPY_ALL );
+            if ( copy.valid() )
+            {
+                {
+                    Threading::ScopedMutexLock lock( _pendingMutex );
+                    _pending[key] = PendingWrite( copy.get(), meta );
+                }
+                _writeService->add( new WriteRequest(this, key) );
+                return true;
+            }
+        }
+
+        return writeNow( key, object, meta );
+    }
+
+    bool
+    FileSystemCacheBin::writeNow( const std::string& key, const osg::Object* object, const Config& meta, bool queued )
+    {
+        OE_PROFILE_SCOPE("cache.write");
         // convert the key into a legal filename:
         URI fileURI( getValidKey(key), _metaPath );
-        
-        osgDB::ReaderWriter::WriteResult r;
+        std::string filename = fileURI.full() + ".osgb";
+        std::string metaname = fileURI.full() + ".meta";
+
+        // make a home for it..
+        if ( !osgDB::fileExists( osgDB::getFilePath(fileURI.full()) ) )
+            osgEarth::makeDirectoryForFile( fileURI.full() );
 
+        // write to temporary files first, without holding any lock, and then
+        // move them into place so that readers never see a partial record.
+        std::string suffix = Stringify() << "." << getpid() << "." << (unsigned)++_tmpCounter << ".tmp";
+        std::string tmpFilename = filename + suffix;
+        std::string tmpMetaname = metaname + suffix;
+
+        osgDB::ReaderWriter::WriteResult r;
         bool objWriteOK = false;
         {
-            // prevent cache contention:
-            ScopedWriteLock exclusiveLock( _rwmutex );
+            std::ofstream out( tmpFilename.c_str(), std::ios_base::out | std::ios_base::binary );
+            if ( out.is_open() )
+            {
+                if ( dynamic_cast<const osg::Image*>(object) )
+                {
+                    r = _rw->writeImage( *static_cast<const osg::Image*>(object), out, _rwOptions.get() );
+                }
+                else if ( dynamic_cast<const osg::Node*>(object) )
+                {
+                    r = _rw->writeNode( *static_cast<const osg::Node*>(object), out, _rwOptions.get() );
+                }
+                else
+                {
+                    r = _rw->writeObject( *object, out );
+                }
+                out.close();
+                objWriteOK = r.success() && !out.fail();
+            }
+        }
 
-            // make a home for it..
-            if ( !osgDB::fileExists( osgDB::getFilePath(fileURI.full()) ) )
-                osgEarth::makeDirectoryForFile( fileURI.full() );
+        bool writeMetaFile = objWriteOK && !meta.empty();
+        if ( writeMetaFile )
+        {
+            writeMeta( tmpMetaname, meta );
+        }
 
+        bool canceled = false;
+        if ( objWriteOK )
+        {
+            ScopedWriteLock exclusiveLock( getStripe(key) );
 
-            if ( dynamic_cast<const osg::Image*>(object) )
+            // a queued record that was removed (or replaced) while we were writing
+            // it must not be moved into place. remove() drops the pending entry
+            // under this same stripe lock, so the check cannot race it.
+            if ( queued )
             {
-                std::string filename = fileURI.full() + ".osgb";
-                r = _rw->writeImage( *static_cast<const osg::Image*>(object), filename, _rwOptions.get() );
-                objWriteOK = r.success();
+                Threading::ScopedMutexLock lock( _pendingMutex );
+                PendingWrites::const_iterator i = _pending.find( key );
+                canceled = i == _pending.end() || i->second.first.get() != object;
             }
-            else if ( dynamic_cast<const osg::Node*>(object) )
+
+            if ( canceled )
             {
-                std::string filename = fileURI.full() + ".osgb";
-                r = _rw->writeNode( *static_cast<const osg::Node*>(object), filename, _rwOptions.get() );
-                objWriteOK = r.success();
+                objWriteOK = false;
             }
             else
             {
-                std::string filename = fileURI.full() + ".osgb";
-                r = _rw->writeObject( *object, filename );
-                objWriteOK = r.success();
-            }
-
-            // write metadata
-            if ( !meta.empty() && objWriteOK )
-            {
-                std::string metaname = fileURI.full() + ".meta";
-                writeMeta( metaname, meta );
+                // the metadata goes first so that it is in place when the record appears.
+                if ( writeMetaFile )
+                    renameFile( tmpMetaname, metaname );
+                objWriteOK = renameFile( tmpFilename, filename );
             }
         }
 
-        if ( objWriteOK )
+        if ( canceled )
+        {
+            ::remove( tmpFilename.c_str() );
+            ::remove( tmpMetaname.c_str() );
+
+            OE_DEBUG << LC << "Dropped stale write of \"" << key << "\" to cache bin " << getID() << std::endl;
+        }
+        else if ( objWriteOK )
         {
             OE_DEBUG << LC << "Wrote \"" << key << "\" to cache bin " << getID() << std::endl;
         }
         else
         {
+            ::remove( tmpFilename.c_str() );
+            ::remove( tmpMetaname.c_str() );
+
             OE_WARN << LC << "FAILED to write \"" << key << "\" to cache bin " << getID()
                 << "; msg = \"" << r.message() << "\"" << std::endl;
         }
@@ -474,6 +699,13 @@ namespace
         if ( !binValidForReading() ) 
             return STATUS_NOT_FOUND;
 
+        if ( _writeService.valid() )
+        {
+            Threading::ScopedMutexLock lock( _pendingMutex );
+            if ( _pending.find(key) != _pending.end() )
+                return STATUS_OK;
+        }
+
         URI fileURI( getValidKey(key), _metaPath );
         std::string path( fileURI.full() + ".osgb" );
         if ( !osgDB::fileExists(path) )
@@ -486,9 +718,22 @@ namespace
     FileSystemCacheBin::remove(const std::string& key)
     {
         if ( !binValidForReading() ) return false;
+
         URI fileURI( getValidKey(key), _metaPath );
         std::string path( fileURI.full() + ".osgb" );
-        return ::unlink( path.c_str() ) == 0;
+
+        // drop any pending write under the stripe lock, so that a write-behind
+        // already in flight sees the removal and cannot recreate the file.
+        ScopedWriteLock exclusiveLock( getStripe(key) );
+
+        bool wasPending = false;
+        if ( _writeService.valid() )
+        {
+            Threading::ScopedMutexLock lock( _pendingMutex );
+            wasPending = _pending.erase( key ) > 0;
+        }
+
+        return ::unlink( path.c_str() ) == 0 || wasPending;
     }
 
     bool
@@ -547,9 +792,23 @@ namespace
         if ( !binValidForReading() )
             return false;
 
-        ScopedWriteLock exclusiveLock( _rwmutex );
+        {
+            Threading::ScopedMutexLock lock( _pendingMutex );
+            _pending.clear();
+        }
+
+        // hold every stripe so no record is moved into place during the purge.
+        // (writers only ever hold one stripe at a time, so this cannot deadlock.)
+        for( unsigned i=0; i<NUM_STRIPES; ++i )
+            _stripes[i].writeLock();
+
         std::string binDir = osgDB::getFilePath( _metaPath );
-        return purgeDirectory( binDir );
+        bool ok = purgeDirectory( binDir );
+
+        for( unsigned i=0; i<NUM_STRIPES; ++i )
+            _stripes[i].writeUnlock();
+
+        return ok;
     }
 
     Config
@@ -557,8 +816,8 @@ namespace
     {
         if ( !binValidForReading() ) return Config();
 
-        ScopedReadLock sharedLock( _rwmutex );
-        
+        ScopedReadLock sharedLock( _metaMutex );
+
         Config conf;
         conf.fromJSON( URI(_metaPath).getString(_rwOptions.get()) );
 
@@ -570,7 +829,7 @@ namespace
     {
         if ( !binValidForWriting() ) return false;
 
-        ScopedWriteLock exclusiveLock( _rwmutex );
+        ScopedWriteLock exclusiveLock( _metaMutex );
 
         std::fstream output( _metaPath.c_str(), std::ios_base::out );
         if ( output.is_open() )
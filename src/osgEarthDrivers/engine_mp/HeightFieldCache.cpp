@@ -28,8 +28,9 @@ using namespace osgEarth;
 
 
 HeightFieldCache::HeightFieldCache(const MPTerrainEngineOptions& options) :
-_cache   ( true, 128 ),
-_tileSize( options.tileSize().get() )
+_cache      ( true, 128 ),
+_tileSize   ( options.tileSize().get() ),
+_liveInserts( 0 )
 {
     _useParentAsReferenceHF = (options.elevationSmoothing() == true);
 }
@@ -57,7 +58,7 @@ HeightFieldCache::getOrCreateHeightField(const MapFrame&                 frame,
     if (progress)
         progress->stats()["hfcache_try_count"] += 1;
 
-    LRUCache<HFKey,HFValue>::Record rec;
+    ShardedLRUCache<HFKey,HFValue>::Record rec;
     if ( _cache.get(cachekey, rec) )
     {
         // Found it in the cache.
@@ -69,77 +70,185 @@ HeightFieldCache::getOrCreateHeightField(const MapFrame&                 frame,
             progress->stats()["hfcache_hit_count"] += 1;
             progress->stats()["hfcache_hit_rate"] = progress->stats()["hfcache_hit_count"]/progress->stats()["hfcache_try_count"];
         }
+        return true;
     }
 
-    else
+    // Not in the cache. See whether it's still in use by a live tile, or
+    // whether another thread is already building it.
+    osg::ref_ptr<Pending> pending;
+    bool builder = false;
     {
-        // Not in the cache, so we need to create a HF.
-        TileKey parentKey = key.createParentKey();
-
-        // Elevation "smoothing" uses the parent HF as the starting point for building
-        // a new tile. This will cause lower-resolution data to propagate down the tree
-        // and fill in any gaps in higher-resolution data. The result will be an elevation
-        // grid that is "smoother" but not neccessarily as accurate.
-        if ( _useParentAsReferenceHF && parent_hf && parentKey.valid() )
+        Threading::ScopedMutexLock lock( _mutex );
+
+        std::map<HFKey, LiveHF>::iterator i = _live.find( cachekey );
+        if ( i != _live.end() )
         {
-            out_hf = HeightFieldUtils::createSubSample(
-                parent_hf,
-                parentKey.getExtent(),
-                key.getExtent(),
-                interp );
+            if ( i->second._hf.lock(out_hf) )
+            {
+                out_isFallback = i->second._isFallback;
+                if (progress)
+                    progress->stats()["hfcache_live_hit_count"] += 1;
+                return true;
+            }
+            _live.erase( i );
         }
 
-        // If we are not smoothing, or we have no parent data, start with a basic
-        // MSL=0 reference heightfield instead.
-        if ( !out_hf.valid() )
+        osg::ref_ptr<Pending>& entry = _pending[cachekey];
+        if ( !entry.valid() )
         {
-            out_hf = HeightFieldUtils::createReferenceHeightField( key.getExtent(), _tileSize, _tileSize );
+            entry = new Pending();
+            builder = true;
         }
+        pending = entry.get();
+    }
 
-        // Next, populate it with data from the Map. The map will overwrite our starting
-        // data with real data from the elevation stack.
-        bool populated = frame.populateHeightField(
-            out_hf,
-            key,
-            true, // convertToHAE
-            progress );
-
-        // If the map failed to provide any suitable data sources at all, replace the
-        // heightfield with data from its parent (if available). 
-        if ( !populated )
+    if ( !builder )
+    {
+        // wait for the other thread's result, but give up if our own request
+        // is canceled in the meantime.
+        bool ok = false;
+        for( bool done = false; !done; )
         {
-            if ( parentKey.valid() && parent_hf )
-            {        
-                out_hf = HeightFieldUtils::createSubSample(
-                    parent_hf,
-                    parentKey.getExtent(),
-                    key.getExtent(),
-                    interp );
-            }
+            if ( progress && progress->isCanceled() )
+                return false;
+
+            pending->_event.wait( 50 );
 
-            if ( !out_hf.valid() )
+            Threading::ScopedMutexLock lock( pending->_mutex );
+            done = pending->_done;
+            if ( done && pending->_ok )
             {
-                // NOTE: This is probably no longer be possible, but check anyway for completeness.
-                return false;
+                out_hf         = pending->_value._hf.get();
+                out_isFallback = pending->_value._isFallback;
+                ok = true;
             }
         }
 
-        // ONLY cache the new heightfield if a parent HF existed. Otherwise the new HF
-        // may contain invalid data. This can happen if this task runs to completion
-        // while the tile's parent expires from the scene graph. In that case the result
-        // of this task will be discarded. Therefore we should not cache the result here.
-        // This was causing intermittent rare "flat tiles" to appear in the terrain.
-        if ( parent_hf )
+        if (progress)
+            progress->stats()["hfcache_wait_count"] += 1;
+
+        // only share a result that was good enough to cache (see below).
+        if ( ok )
+            return true;
+
+        // the other build failed or had no parent; build it ourselves.
+        return createHeightField(frame, key, parent_hf, out_hf, out_isFallback, interp, progress);
+    }
+
+    bool ok = createHeightField(frame, key, parent_hf, out_hf, out_isFallback, interp, progress);
+
+    // ONLY cache the new heightfield if a parent HF existed. Otherwise the new HF
+    // may contain invalid data. This can happen if this task runs to completion
+    // while the tile's parent expires from the scene graph. In that case the result
+    // of this task will be discarded. Therefore we should not cache the result here.
+    // This was causing intermittent rare "flat tiles" to appear in the terrain.
+    if ( ok && parent_hf )
+    {
+        // cache it.
+        HFValue cacheval;
+        cacheval._hf = out_hf.get();
+        cacheval._isFallback = out_isFallback;
+        _cache.insert( cachekey, cacheval );
+    }
+
+    {
+        Threading::ScopedMutexLock lock( _mutex );
+
+        if ( ok && parent_hf )
         {
-            // cache it.
-            HFValue cacheval;
-            cacheval._hf = out_hf.get();
-            cacheval._isFallback = !populated;
-            _cache.insert( cachekey, cacheval );
+            LiveHF& live = _live[cachekey];
+            live._hf         = out_hf.get();
+            live._isFallback = out_isFallback;
+
+            // every so often, drop the entries whose heightfields are gone.
+            if ( ++_liveInserts % 256 == 0 )
+            {
+                for( std::map<HFKey, LiveHF>::iterator i = _live.begin(); i != _live.end(); )
+                {
+                    if ( !i->second._hf.valid() )
+                        _live.erase( i++ );
+                    else
+                        ++i;
+                }
+            }
+        }
+
+        _pending.erase( cachekey );
+    }
+
+    {
+        Threading::ScopedMutexLock lock( pending->_mutex );
+        pending->_ok          = ok && parent_hf;
+        pending->_value._hf   = out_hf.get();
+        pending->_value._isFallback = out_isFallback;
+        pending->_done        = true;
+    }
+    pending->_event.set();
+
+    return ok;
+}
+
+
+bool
+HeightFieldCache::createHeightField(const MapFrame&                 frame,
+                                    const TileKey&                  key,
+                                    const osg::HeightField*         parent_hf,
+                                    osg::ref_ptr<osg::HeightField>& out_hf,
+                                    bool&                           out_isFallback,
+                                    ElevationInterpolation          interp,
+                                    ProgressCallback*               progress )
+{
+    // Not in the cache, so we need to create a HF.
+    TileKey parentKey = key.createParentKey();
+
+    // Elevation "smoothing" uses the parent HF as the starting point for building
+    // a new tile. This will cause lower-resolution data to propagate down the tree
+    // and fill in any gaps in higher-resolution data. The result will be an elevation
+    // grid that is "smoother" but not neccessarily as accurate.
+    if ( _useParentAsReferenceHF && parent_hf && parentKey.valid() )
+    {
+        out_hf = HeightFieldUtils::createSubSample(
+            parent_hf,
+            parentKey.getExtent(),
+            key.getExtent(),
+            interp );
+    }
+
+    // If we are not smoothing, or we have no parent data, start with a basic
+    // MSL=0 reference heightfield instead.
+    if ( !out_hf.valid() )
+    {
+        out_hf = HeightFieldUtils::createReferenceHeightField( key.getExtent(), _tileSize, _tileSize );
+    }
+
+    // Next, populate it with data from the Map. The map will overwrite our starting
+    // data with real data from the elevation stack.
+    bool populated = frame.populateHeightField(
+        out_hf,
+        key,
+        true, // convertToHAE
+        progress );
+
+    // If the map failed to provide any suitable data sources at all, replace the
+    // heightfield with data from its parent (if available). 
+    if ( !populated )
+    {
+        if ( parentKey.valid() && parent_hf )
+        {        
+            out_hf = HeightFieldUtils::createSubSample(
+                parent_hf,
+                parentKey.getExtent(),
+                key.getExtent(),
+                interp );
         }
 
-        out_isFallback = !populated;
+        if ( !out_hf.valid() )
+        {
+            // NOTE: This is probably no longer be possible, but check anyway for completeness.
+            return false;
+        }
     }
 
+    out_isFallback = !populated;
     return true;
 }
@@ -24,6 +24,7 @@
 #include "TerrainNode"
 #include "TileModelFactory"
 #include "TileModelCompiler"
+#include "TileHeightSource"
 #include "TilePagedLOD"
 #include "MPShaders"
 
@@ -38,6 +39,7 @@
 #include <osgEarth/ShaderLoader>
 #include <osgEarth/Utils>
 #include <osgEarth/ObjectIndex>
+#include <osgEarth/NodeUtils>
 
 #include <osg/TexEnv>
 #include <osg/TexEnvCombine>
@@ -230,6 +232,10 @@ _stateUpdateRequired  ( false )
 
 MPTerrainEngineNode::~MPTerrainEngineNode()
 {
+    // stop the background threads first; they build tiles through this engine.
+    _prefetcher = 0L;
+    _scheduler  = 0L;
+
     unregisterEngine( _uid );
 
     osgUtil::RenderBin::removeRenderBinPrototype( _terrainRenderBinPrototype.get() );
@@ -291,6 +297,24 @@ MPTerrainEngineNode::postInitialize( const Map* map, const TerrainOptions& optio
     // initialize the model factory:
     _tileModelFactory = new TileModelFactory(_liveTiles.get(), _terrainOptions, this);
 
+    // page in subtiles with our own scheduler if requested. It merges new tiles
+    // during the update traversal.
+    if ( _terrainOptions.nativePaging() == true )
+    {
+        _scheduler = new TileRequestScheduler(
+            this,
+            _terrainOptions.pagingThreads().get(),
+            _terrainOptions.mergesPerFrame().get() );
+
+        ADJUST_UPDATE_TRAV_COUNT( this, 1 );
+    }
+
+    // load data ahead of the camera if requested.
+    if ( _terrainOptions.prefetch() == true )
+    {
+        _prefetcher = new TilePrefetcher( this, _tileModelFactory.get(), _liveTiles.get(), _terrainOptions );
+    }
+
     // handle an already-established map profile:
     if ( _update_mapf->getProfile() )
     {
@@ -390,6 +414,13 @@ MPTerrainEngineNode::onMapInfoEstablished( const MapInfo& mapInfo )
 {
     if ( _update_mapf != 0L )
     {
+        // answer terrain height queries straight from the live tiles.
+        getTerrain()->setHeightSource( new TileHeightSource(
+            _liveTiles.get(),
+            mapInfo.getProfile(),
+            _terrainOptions.firstLOD().get(),
+            _update_mapf->getMapOptions().elevationInterpolation().get()) );
+
         dirtyTerrain();
     }
 }
@@ -449,6 +480,17 @@ MPTerrainEngineNode::dirtyTerrain()
         _tileModelFactory->clearCaches();
     }
 
+    // forget requests from the old terrain.
+    if ( _scheduler.valid() )
+    {
+        _scheduler->clear();
+    }
+
+    if ( _prefetcher.valid() )
+    {
+        _prefetcher->clear();
+    }
+
     // remove existing:
     if ( _terrain )
     {
@@ -562,6 +604,16 @@ MPTerrainEngineNode::traverse(osg::NodeVisitor& nv)
         {
             _liveTiles->setTraversalFrame( nv.getFrameStamp()->getFrameNumber() );
         }
+
+        if ( _prefetcher.valid() )
+        {
+            _prefetcher->cull( nv );
+        }
+    }
+
+    else if ( nv.getVisitorType() == nv.UPDATE_VISITOR && _scheduler.valid() )
+    {
+        _scheduler->update( nv );
     }
 
 #if 0
@@ -624,6 +676,11 @@ MPTerrainEngineNode::createNode(const TileKey&    key,
     bool accumulate    = true;  // use parent data to help build tiles if neccesary
     bool setupChildren = true;  // prepare the tile for subdivision
 
+    if ( _prefetcher.valid() )
+    {
+        _prefetcher->touch( key );
+    }
+
     // create the node:
     osg::ref_ptr<osg::Node> node = getKeyNodeFactory()->createNode(key, accumulate, setupChildren, progress);
 
@@ -631,6 +688,15 @@ MPTerrainEngineNode::createNode(const TileKey&    key,
     return node.release();
 }
 
+void
+MPTerrainEngineNode::prefetch(const GeoPoint& focalPoint, double range)
+{
+    if ( _prefetcher.valid() )
+    {
+        _prefetcher->prefetch( focalPoint, range );
+    }
+}
+
 osg::Node*
 MPTerrainEngineNode::createStandaloneNode(const TileKey&    key,
                                           ProgressCallback* progress)
@@ -291,15 +291,21 @@ SingleKeyNodeFactory::createNode(const TileKey&    key,
     
     OE_START_TIMER(create_model);
 
-    osg::ref_ptr<TileModel> model[4];
+    // Build all four quadrants at once; the factory fetches their data in parallel.
+    std::vector<TileKey> childKeys(4);
     for(unsigned q=0; q<4; ++q)
     {
-        if ( progress && progress->isCanceled() )
-            return 0L;
-        
-        TileKey child = key.createChildKey(q);
-        _modelFactory->createTileModel( child, _frame, accumulate, model[q], progress );
+        childKeys[q] = key.createChildKey(q);
+    }
 
+    std::vector< osg::ref_ptr<TileModel> > model;
+    _modelFactory->createTileModels( childKeys, _frame, accumulate, model, progress );
+
+    if ( progress && progress->isCanceled() )
+        return 0L;
+
+    for(unsigned q=0; q<4; ++q)
+    {
         // if any one of the TileModel creations fail, we will be unable to build
         // this quadtile. So goodbye.
         if ( !model[q].valid() )
@@ -0,0 +1,257 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2015 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+#include "TileHeightSource"
+#include "TileGroup"
+#include "TilePagedLOD"
+#include <osg/Math>
+#include <algorithm>
+#include <cmath>
+
+using namespace osgEarth::Drivers::MPTerrainEngine;
+using namespace osgEarth;
+
+#define LC "[TileHeightSource] "
+
+namespace
+{
+    // number of quadtree levels we will descend through
+    const unsigned MAX_LEVELS = 30u;
+
+    struct SampleOperation : public TileNodeRegistry::AddressOperation
+    {
+        SampleOperation(const std::vector<TileHeightSource::Level>& levels,
+                        const GeoExtent&                            profileExtent,
+                        unsigned                                    firstLOD,
+                        ElevationInterpolation                      interp,
+                        const TileKey*                              patchKey,
+                        osg::Vec3d*                                 points,
+                        unsigned                                    count,
+                        char*                                       resolved) :
+            _levels  ( levels ),
+            _xmin    ( profileExtent.xMin() ),
+            _ymin    ( profileExtent.yMin() ),
+            _xmax    ( profileExtent.xMax() ),
+            _ymax    ( profileExtent.yMax() ),
+            _firstLOD( firstLOD ),
+            _interp  ( interp ),
+            _patchKey( patchKey ),
+            _points  ( points ),
+            _count   ( count ),
+            _resolved( resolved ),
+            _numResolved( 0u ) { }
+
+        void operator()(const TileNodeRegistry::TileAddressMap& tiles) const
+        {
+            // The descent path of the previous point. Nearby points share most
+            // of it, so those levels can skip the registry lookup.
+            TileNode* pathTiles[MAX_LEVELS];
+            unsigned  pathX[MAX_LEVELS], pathY[MAX_LEVELS];
+            unsigned  pathSize = 0u;
+
+            unsigned startLOD = _patchKey ? _patchKey->getLOD() : _firstLOD;
+
+            for(unsigned i=0; i<_count; ++i)
+            {
+                _resolved[i] = 0;
+
+                double x = _points[i].x(), y = _points[i].y();
+                if ( x < _xmin || x > _xmax || y < _ymin || y > _ymax )
+                    continue;
+
+                TileNode* best = 0L;
+
+                for(unsigned lod = startLOD; lod < _levels.size(); ++lod)
+                {
+                    const TileHeightSource::Level& level = _levels[lod];
+
+                    double fx = floor( (x - _xmin) / level._width );
+                    double fy = floor( (_ymax - y) / level._height );
+                    unsigned tx = fx <= 0.0 ? 0u : std::min( (unsigned)fx, level._cols-1u );
+                    unsigned ty = fy <= 0.0 ? 0u : std::min( (unsigned)fy, level._rows-1u );
+
+                    // a patch only answers for points inside its own tile.
+                    if ( lod == startLOD && _patchKey && (tx != _patchKey->getTileX() || ty != _patchKey->getTileY()) )
+                        break;
+
+                    unsigned d = lod - startLOD;
+                    TileNode* tile;
+                    if ( d < pathSize && pathX[d] == tx && pathY[d] == ty )
+                    {
+                        tile = pathTiles[d];
+                    }
+                    else
+                    {
+                        TileNodeRegistry::TileAddressMap::const_iterator t = tiles.find(
+                            TileNodeRegistry::TileAddress(lod, tx, ty) );
+                        tile = t != tiles.end() ? t->second : 0L;
+
+                        pathTiles[d] = tile;
+                        pathX[d]     = tx;
+                        pathY[d]     = ty;
+                        pathSize     = d + 1u;
+                    }
+
+                    if ( !tile )
+                        break;
+
+                    best = tile;
+                }
+
+                if ( best && sample(best, x, y, _points[i].z()) )
+                {
+                    _resolved[i] = 1;
+                    ++_numResolved;
+                }
+            }
+        }
+
+        bool sample(TileNode* tile, double x, double y, double& out_height) const
+        {
+            const TileModel* model = tile->getTileModel();
+            if ( !model )
+                return false;
+
+            const osg::HeightField* hf = model->_elevationData.getHeightField();
+            if ( !hf )
+                return false;
+
+            // The MP heightfield covers exactly the tile's extent.
+            const GeoExtent& e = tile->getKey().getExtent();
+            double nx = osg::clampBetween( (x - e.xMin()) / e.width(),  0.0, 1.0 );
+            double ny = osg::clampBetween( (y - e.yMin()) / e.height(), 0.0, 1.0 );
+
+            out_height = HeightFieldUtils::getHeightAtNormalizedLocation( hf, nx, ny, _interp );
+            return true;
+        }
+
+        const std::vector<TileHeightSource::Level>& _levels;
+        double                 _xmin, _ymin, _xmax, _ymax;
+        unsigned               _firstLOD;
+        ElevationInterpolation _interp;
+        const TileKey*         _patchKey;
+        osg::Vec3d*            _points;
+        unsigned               _count;
+        char*                  _resolved;
+        mutable unsigned       _numResolved;
+    };
+}
+
+//----------------------------------------------------------------------------
+
+TileHeightSource::TileHeightSource(TileNodeRegistry*      liveTiles,
+                                   const Profile*         profile,
+                                   unsigned               firstLOD,
+                                   ElevationInterpolation interp) :
+_liveTiles( liveTiles ),
+_profile  ( profile ),
+_firstLOD ( firstLOD ),
+_interp   ( interp )
+{
+    _levels.resize( MAX_LEVELS );
+    for(unsigned lod=0; lod<MAX_LEVELS; ++lod)
+    {
+        Level& level = _levels[lod];
+        _profile->getTileDimensions( lod, level._width, level._height );
+        _profile->getNumTiles( lod, level._cols, level._rows );
+    }
+}
+
+
+bool
+TileHeightSource::getPatchKey(osg::Node* patch, TileKey& out_key) const
+{
+    if ( TileGroup* group = dynamic_cast<TileGroup*>(patch) )
+    {
+        out_key = group->getKey();
+    }
+    else if ( TileNode* tile = dynamic_cast<TileNode*>(patch) )
+    {
+        out_key = tile->getKey();
+    }
+    else if ( TilePagedLOD* plod = dynamic_cast<TilePagedLOD*>(patch) )
+    {
+        if ( !plod->getTileNode() )
+            return false;
+        out_key = plod->getTileNode()->getKey();
+    }
+    else
+    {
+        return false;
+    }
+    return out_key.valid();
+}
+
+
+unsigned
+TileHeightSource::sample(const TileKey* patchKey,
+                         osg::Vec3d*    points,
+                         unsigned       count,
+                         char*          out_resolved) const
+{
+    SampleOperation op(
+        _levels, _profile->getExtent(), _firstLOD, _interp,
+        patchKey, points, count, out_resolved );
+
+    _liveTiles->run( op );
+    return op._numResolved;
+}
+
+
+bool
+TileHeightSource::getHeight(osg::Node* patch,
+                            double     x,
+                            double     y,
+                            double&    out_height) const
+{
+    TileKey patchKey;
+    if ( patch && !getPatchKey(patch, patchKey) )
+        return false;
+
+    osg::Vec3d point(x, y, 0.0);
+    char resolved;
+    if ( sample(patch ? &patchKey : 0L, &point, 1u, &resolved) == 0u )
+        return false;
+
+    out_height = point.z();
+    return true;
+}
+
+
+unsigned
+TileHeightSource::getHeights(osg::Node*               patch,
+                             std::vector<osg::Vec3d>& points,
+                             std::vector<bool>&       out_resolved) const
+{
+    out_resolved.assign( points.size(), false );
+
+    TileKey patchKey;
+    if ( points.empty() || (patch && !getPatchKey(patch, patchKey)) )
+        return 0u;
+
+    std::vector<char> resolved( points.size() );
+    unsigned count = sample( patch ? &patchKey : 0L, &points[0], points.size(), &resolved[0] );
+
+    for(unsigned i=0; i<points.size(); ++i)
+        out_resolved[i] = resolved[i] != 0;
+
+    return count;
+}
@@ -31,6 +31,7 @@
 #include <osgEarth/Utils>
 #include <osgEarth/ECEF>
 #include <osgEarth/ObjectIndex>
+#include <osgEarth/Profiler>
 #include <osgEarthSymbology/Geometry>
 #include <osgEarthSymbology/MeshConsolidator>
 
@@ -2082,6 +2083,7 @@ TileModelCompiler::compile(TileModel*        model,
                            const MapFrame&   frame,
                            ProgressCallback* progress)
 {
+    OE_PROFILE_SCOPE("mp.compileTileModel");
 
     // Working data for the build.
     Data d(model, frame, _maskLayers, _modelLayers);
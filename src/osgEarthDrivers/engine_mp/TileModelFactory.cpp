@@ -26,6 +26,8 @@
 #include <osgEarth/HeightFieldUtils>
 #include <osgEarth/Progress>
 #include <osgEarth/TerrainEngineNode>
+#include <osgEarth/Profiler>
+#include <osgEarth/Registry>
 
 using namespace osgEarth::Drivers::MPTerrainEngine;
 using namespace osgEarth;
@@ -38,23 +40,25 @@ using namespace OpenThreads;
 
 namespace
 {
+    // Every factory (one per map) fetches on the same service, which takes
+    // its threads from the Registry's shared pool, so the thread count does
+    // not grow with the number of maps.
+    Threading::Mutex s_fetchServiceMutex;
+    UID              s_fetchServiceUID = -1;
+
     struct BuildColorData
     {
         void init( const TileKey&                      key, 
                    ImageLayer*                         layer, 
-                   unsigned                            order,
                    const MapInfo&                      mapInfo,
                    const MPTerrainEngineOptions&       opt, 
-                   TileNodeRegistry*                   tiles,
-                   TileModel*                          model)
+                   TileNodeRegistry*                   tiles)
         {
             _key      = key;
             _layer    = layer;
-            _order    = order;
             _mapInfo  = &mapInfo;
             _opt      = &opt;
             _tiles    = tiles;
-            _model    = model;
         }
 
         bool execute(ProgressCallback* progress)
@@ -159,10 +163,11 @@ namespace
                 else
                     locator = GeoLocator::createForExtent(geoImage.getExtent(), *_mapInfo);
 
-                // add the color layer to the repo.
-                _model->_colorData[_layer->getUID()] = TileModel::ColorData(
+                // store the color layer; the caller adds it to the model and
+                // assigns its order.
+                _result = TileModel::ColorData(
                     _layer,
-                    _order,
+                    0,
                     geoImage.getImage(),
                     locator,
                     isFallback ); // isFallbackData
@@ -183,10 +188,8 @@ namespace
                         TileModel::ColorData parentColorData;
                         if ( parentModel->getColorData(_layer->getUID(), parentColorData) )
                         {
-                            TileModel::ColorData& colorData = _model->_colorData[_layer->getUID()];
-                            colorData = TileModel::ColorData(parentColorData);
-                            colorData._order = _order;
-                            colorData.setIsFallbackData( true );
+                            _result = TileModel::ColorData(parentColorData);
+                            _result.setIsFallbackData( true );
                             
                             ok = true;
                         }
@@ -197,18 +200,101 @@ namespace
             return ok;
         }
 
-        TileKey           _key;
-        const MapInfo*    _mapInfo;
-        TileNodeRegistry* _tiles;
-        ImageLayer*       _layer;
-        unsigned          _order;
-        TileModel*        _model;
+        TileKey              _key;
+        const MapInfo*       _mapInfo;
+        TileNodeRegistry*    _tiles;
+        ImageLayer*          _layer;
+        TileModel::ColorData _result;
         const MPTerrainEngineOptions* _opt;
     };
+
+    /**
+     * Progress callback for one fetch task. Cancelation comes from the tile
+     * request's callback, but the stats and retry flag are kept per task (the
+     * tasks run concurrently) and merged into the request's callback later.
+     */
+    struct FetchProgress : public ProgressCallback
+    {
+        FetchProgress(ProgressCallback* parent) : _parent(parent) { }
+
+        bool isCanceled()
+        {
+            return ProgressCallback::isCanceled() || _parent->isCanceled();
+        }
+
+        ProgressCallback* _parent;
+    };
 }
 
 //------------------------------------------------------------------------
 
+/**
+ * One unit of data fetching for a tile model: an image layer, the elevation
+ * data or the normal map. Each task writes to its own part of the model, so
+ * all the tasks for a set of tiles can run at once.
+ */
+struct TileModelFactory::FetchTask : public TaskRequest
+{
+    enum Type { COLOR, ELEVATION, NORMALS };
+
+    FetchTask(Type type, float priority) : TaskRequest(priority),
+        _type      ( type ),
+        _factory   ( 0L ),
+        _frame     ( 0L ),
+        _index     ( 0 ),
+        _accumulate( false ),
+        _callback  ( 0L ),
+        _semaphore ( 0L ),
+        _ok        ( false ),
+        _time      ( 0.0 ) { }
+
+    void operator()(ProgressCallback* unused)
+    {
+        execute();
+        if ( _semaphore )
+            _semaphore->notify();
+    }
+
+    void execute()
+    {
+        // honor cancelation of the whole tile request:
+        if ( _callback.valid() && _callback->isCanceled() )
+            return;
+
+        OE_START_TIMER(fetch);
+
+        if ( _type == COLOR )
+        {
+            _ok = _color.execute( _callback.get() );
+        }
+        else if ( _type == ELEVATION )
+        {
+            _factory->buildElevation(_key, *_frame, _accumulate, _factory->_terrainReqs->elevationTexturesRequired(), _model.get(), _callback.get());
+        }
+        else
+        {
+            _factory->buildNormalMap(_key, *_frame, _accumulate, _model.get(), _callback.get());
+        }
+
+        _time = OE_STOP_TIMER(fetch);
+    }
+
+    Type                    _type;
+    TileModelFactory*       _factory;
+    const MapFrame*         _frame;
+    TileKey                 _key;
+    unsigned                _index;       // index of the model in the request
+    osg::ref_ptr<TileModel> _model;
+    bool                    _accumulate;
+    BuildColorData          _color;
+    osg::ref_ptr<ProgressCallback> _callback;
+    Threading::MultiEvent*  _semaphore;
+    bool                    _ok;
+    double                  _time;
+};
+
+//------------------------------------------------------------------------
+
 TileModelFactory::TileModelFactory(TileNodeRegistry*             liveTiles,
                                    const MPTerrainEngineOptions& terrainOptions,
                                    TerrainEngineRequirements*    terrainReqs) :
@@ -231,6 +317,46 @@ TileModelFactory::clearCaches()
     _normalHFCache->clear();
 }
 
+bool
+TileModelFactory::prefetchTileModel(const TileKey&                  key,
+                                    const MapFrame&                 frame,
+                                    const osg::HeightField*         parentHF,
+                                    osg::ref_ptr<osg::HeightField>& out_hf,
+                                    ProgressCallback*               progress)
+{
+    // nothing to do if the tile is already live.
+    osg::ref_ptr<TileNode> node;
+    if ( _liveTiles->get(key, node) && node->getTileModel() )
+    {
+        out_hf = node->getTileModel()->_elevationData.getHeightField();
+        return out_hf.valid();
+    }
+
+    const osgEarth::ElevationInterpolation& interp =
+        frame.getMapOptions().elevationInterpolation().get();
+
+    bool isFallback = false;
+    if ( !_meshHFCache->getOrCreateHeightField(frame, key, parentHF, out_hf, isFallback, SAMPLE_FIRST_VALID, interp, progress) )
+        return false;
+
+    // fetch the imagery the same way the real build will, so it lands in the same caches.
+    for( ImageLayerVector::const_iterator i = frame.imageLayers().begin(); i != frame.imageLayers().end(); ++i )
+    {
+        if ( progress && progress->isCanceled() )
+            return false;
+
+        ImageLayer* layer = i->get();
+        if ( layer->getEnabled() && layer->isKeyInRange(key) )
+        {
+            BuildColorData color;
+            color.init( key, layer, frame.getMapInfo(), _terrainOptions, _liveTiles.get() );
+            color.execute( progress );
+        }
+    }
+
+    return true;
+}
+
 void
 TileModelFactory::buildElevation(const TileKey&    key,
                                  const MapFrame&   frame,
@@ -421,6 +547,23 @@ TileModelFactory::buildNormalMap(const TileKey&    key,
 }
 
 
+TaskService*
+TileModelFactory::getFetchService()
+{
+    Threading::ScopedMutexLock lock( s_fetchServiceMutex );
+    if ( s_fetchServiceUID < 0 )
+    {
+        s_fetchServiceUID = Registry::instance()->createUID();
+    }
+
+    // the thread count is this service's share of the pool.
+    TaskService* service = Registry::instance()->getTaskServiceManager()->getOrAdd(
+        s_fetchServiceUID,
+        (float)_terrainOptions.fetchThreads().get() );
+    service->setName( "MP tile data fetch" );
+    return service;
+}
+
 void
 TileModelFactory::createTileModel(const TileKey&           key, 
                                   const MapFrame&          frame,
@@ -428,62 +571,179 @@ TileModelFactory::createTileModel(const TileKey&           key,
                                   osg::ref_ptr<TileModel>& out_model,
                                   ProgressCallback*        progress)
 {
+    std::vector<TileKey> keys( 1, key );
+    std::vector< osg::ref_ptr<TileModel> > models;
+    createTileModels( keys, frame, accumulate, models, progress );
+    out_model = models[0].get();
+}
 
-    osg::ref_ptr<TileModel> model = new TileModel( frame.getRevision(), frame.getMapInfo() );
+void
+TileModelFactory::createTileModels(const std::vector<TileKey>&             keys,
+                                   const MapFrame&                         frame,
+                                   bool                                    accumulate,
+                                   std::vector< osg::ref_ptr<TileModel> >& out_models,
+                                   ProgressCallback*                       progress)
+{
+    OE_PROFILE_SCOPE("mp.createTileModel");
+    out_models.assign( keys.size(), osg::ref_ptr<TileModel>() );
 
-    model->_useParentData = _terrainReqs->parentTexturesRequired();
+    std::vector< osg::ref_ptr<TileModel> > models( keys.size() );
+    std::vector< osg::ref_ptr<FetchTask> > tasks;
 
-    model->_tileKey = key;
-    model->_tileLocator = GeoLocator::createForKey(key, frame.getMapInfo());
+    for( unsigned k=0; k<keys.size(); ++k )
+    {
+        const TileKey& key = keys[k];
 
-    OE_START_TIMER(fetch_imagery);
+        TileModel* model = new TileModel( frame.getRevision(), frame.getMapInfo() );
+        models[k] = model;
 
-    // Fetch the image data and make color layers.
-    unsigned index = 0;
-    unsigned order = 0;
-    for( ImageLayerVector::const_iterator i = frame.imageLayers().begin(); i != frame.imageLayers().end(); ++i )
-    {
-        ImageLayer* layer = i->get();
+        model->_useParentData = _terrainReqs->parentTexturesRequired();
 
-        if ( layer->getEnabled() && layer->isKeyInRange(key) )
+        model->_tileKey = key;
+        model->_tileLocator = GeoLocator::createForKey(key, frame.getMapInfo());
+
+        // lower LODs first; they are the ones that are visible soonest.
+        float priority = (float)key.getLOD();
+        unsigned firstTask = tasks.size();
+
+        // Fetch the image data and make color layers.
+        for( ImageLayerVector::const_iterator i = frame.imageLayers().begin(); i != frame.imageLayers().end(); ++i )
         {
-            BuildColorData build;
-            build.init( key, layer, order, frame.getMapInfo(), _terrainOptions, _liveTiles.get(), model.get() );
+            ImageLayer* layer = i->get();
 
-            bool addedToModel = build.execute(progress);
-            if ( addedToModel )
+            if ( layer->getEnabled() && layer->isKeyInRange(key) )
+            {
+                FetchTask* task = new FetchTask( FetchTask::COLOR, priority );
+                task->_color.init( key, layer, frame.getMapInfo(), _terrainOptions, _liveTiles.get() );
+                tasks.push_back( task );
+            }
+        }
+
+        // make an elevation layer.
+        tasks.push_back( new FetchTask(FetchTask::ELEVATION, priority) );
+
+        // make a normal map layer (if necessary)
+        if ( _terrainReqs->normalTexturesRequired() )
+        {
+            tasks.push_back( new FetchTask(FetchTask::NORMALS, priority) );
+        }
+
+        for( unsigned t=firstTask; t<tasks.size(); ++t )
+        {
+            FetchTask* task = tasks[t].get();
+            task->_factory    = this;
+            task->_frame      = &frame;
+            task->_key        = key;
+            task->_index      = k;
+            task->_model      = model;
+            task->_accumulate = accumulate;
+
+            if ( progress )
+                task->_callback = new FetchProgress( progress );
+        }
+    }
+
+    // Run all the tasks in parallel and wait for them to complete.
+    unsigned numThreads = _terrainOptions.fetchThreads().get();
+    if ( numThreads > 1 && tasks.size() > 1 )
+    {
+        TaskService* service = getFetchService();
+        Threading::MultiEvent semaphore( tasks.size() );
+        for( unsigned t=0; t<tasks.size(); ++t )
+        {
+            tasks[t]->_semaphore = &semaphore;
+            service->add( tasks[t].get() );
+        }
+        semaphore.wait();
+    }
+    else
+    {
+        for( unsigned t=0; t<tasks.size(); ++t )
+        {
+            tasks[t]->execute();
+        }
+    }
+
+    // Add the color layers to the models in layer order, and total up the
+    // time spent on each kind of data.
+    std::vector<unsigned> order( keys.size(), 0u );
+    double imageryTime = 0.0, elevationTime = 0.0, normalMapTime = 0.0;
+
+    for( unsigned t=0; t<tasks.size(); ++t )
+    {
+        FetchTask* task = tasks[t].get();
+        if ( task->_type == FetchTask::COLOR )
+        {
+            imageryTime += task->_time;
+            if ( task->_ok )
             {
                 // only bump the order if we added something to the data model.
-                order++;
+                TileModel::ColorData& colorData = task->_model->_colorData[task->_color._layer->getUID()];
+                colorData = task->_color._result;
+                colorData._order = order[task->_index]++;
             }
         }
+        else if ( task->_type == FetchTask::ELEVATION )
+        {
+            elevationTime += task->_time;
+        }
+        else
+        {
+            normalMapTime += task->_time;
+        }
     }
 
-    if (progress)
-        progress->stats()["fetch_imagery_time"] += OE_STOP_TIMER(fetch_imagery);
+    if ( progress )
+    {
+        progress->stats()["fetch_imagery_time"]   += imageryTime;
+        progress->stats()["fetch_elevation_time"] += elevationTime;
+        progress->stats()["fetch_normalmap_time"] += normalMapTime;
+        progress->stats()["fetch_tasks"]          += (double)tasks.size();
 
-    
-    // make an elevation layer.
-    OE_START_TIMER(fetch_elevation);
-    buildElevation(key, frame, accumulate, _terrainReqs->elevationTexturesRequired(), model.get(), progress);
-    if (progress)
-        progress->stats()["fetch_elevation_time"] += OE_STOP_TIMER(fetch_elevation);
-    
-    // make a normal map layer (if necessary)
-    if ( _terrainReqs->normalTexturesRequired() )
+        // merge the tasks' own stats and retry flags.
+        for( unsigned t=0; t<tasks.size(); ++t )
+        {
+            ProgressCallback* taskProgress = tasks[t]->_callback.get();
+
+            fast_map<std::string,double>& stats = taskProgress->stats();
+            for( fast_map<std::string,double>::iterator i = stats.begin(); i != stats.end(); ++i )
+                progress->stats()[i->first] += i->second;
+
+            if ( taskProgress->needsRetry() )
+                progress->setNeedsRetry( true );
+        }
+
+        // ratios don't add up; recompute.
+        if ( progress->stats()["hfcache_try_count"] > 0.0 )
+        {
+            progress->stats()["hfcache_hit_rate"] =
+                progress->stats()["hfcache_hit_count"] / progress->stats()["hfcache_try_count"];
+        }
+
+        if ( progress->isCanceled() )
+            return;
+    }
+
+    for( unsigned k=0; k<keys.size(); ++k )
     {
-        OE_START_TIMER(fetch_normalmap);
-        buildNormalMap(key, frame, accumulate, model.get(), progress);
-        if (progress)
-            progress->stats()["fetch_normalmap_time"] += OE_STOP_TIMER(fetch_normalmap);
+        if ( finishTileModel(keys[k], frame, models[k].get()) )
+        {
+            out_models[k] = models[k].get();
+        }
     }
+}
 
+bool
+TileModelFactory::finishTileModel(const TileKey&  key,
+                                  const MapFrame& frame,
+                                  TileModel*      model)
+{
     // If nothing was added, not even a fallback heightfield, something went
     // horribly wrong. Leave without a tile model. Chances are that a parent tile
     // not not found in the live-tile registry.
     if ( model->_colorData.size() == 0 && !model->_elevationData.getHeightField() )
     {
-        return;
+        return false;
     }
 
     // OK we are making a tile, so if there's no heightfield yet, make an empty one (and mark it
@@ -504,5 +764,5 @@ TileModelFactory::createTileModel(const TileKey&           key,
         model->_parentModel = parentTile->getTileModel();
     }
 
-    out_model = model.release();
+    return true;
 }
@@ -29,6 +29,16 @@ using namespace osgEarth;
 #define OE_TEST OE_NULL
 //#define OE_TEST OE_INFO
 
+namespace
+{
+    TileNodeRegistry::TileAddress addressOf(const TileKey& key)
+    {
+        unsigned x, y;
+        key.getTileXY( x, y );
+        return TileNodeRegistry::TileAddress( key.getLOD(), x, y );
+    }
+}
+
 
 //----------------------------------------------------------------------------
 
@@ -104,6 +114,7 @@ TileNodeRegistry::add( TileNode* tile )
     {
         Threading::ScopedWriteLock exclusive( _tilesMutex );
         _tiles[ tile->getKey() ] = tile;
+        _addresses[ addressOf(tile->getKey()) ] = tile;
         if ( _revisioningEnabled )
             tile->setMapRevision( _maprev );
 
@@ -144,6 +155,7 @@ TileNodeRegistry::remove( TileNode* tile )
     {
         Threading::ScopedWriteLock exclusive( _tilesMutex );
         _tiles.erase( tile->getKey() );
+        _addresses.erase( addressOf(tile->getKey()) );
         OE_TEST << LC << _name << ": tiles=" << _tiles.size() << std::endl;
     }
 }
@@ -188,6 +200,7 @@ TileNodeRegistry::take( const TileKey& key, osg::ref_ptr<TileNode>& out_tile )
     {
         out_tile = i->second.get();
         _tiles.erase( i );
+        _addresses.erase( addressOf(key) );
         OE_TEST << LC << _name << ": tiles=" << _tiles.size() << std::endl;
         return true;
     }
@@ -201,11 +214,34 @@ TileNodeRegistry::run( TileNodeRegistry::Operation& op )
     Threading::ScopedWriteLock lock( _tilesMutex );
     unsigned size = _tiles.size();
     op.operator()( _tiles );
+
+    // the operation may have changed the tile set.
+    rebuildAddresses();
+
     if ( size != _tiles.size() )
         OE_TEST << LC << _name << ": tiles=" << _tiles.size() << std::endl;
 }
 
 
+void
+TileNodeRegistry::run( const TileNodeRegistry::AddressOperation& op ) const
+{
+    Threading::ScopedReadLock lock( _tilesMutex );
+    op.operator()( _addresses );
+}
+
+
+void
+TileNodeRegistry::rebuildAddresses()
+{
+    _addresses.clear();
+    for( TileNodeMap::const_iterator i = _tiles.begin(); i != _tiles.end(); ++i )
+    {
+        _addresses[ addressOf(i->first) ] = i->second.get();
+    }
+}
+
+
 void
 TileNodeRegistry::run( const TileNodeRegistry::ConstOperation& op ) const
 {
@@ -108,6 +108,11 @@ _live     ( live ),
 _dead     ( dead ),
 _debug    ( false )
 {
+    // look up the engine once here, rather than on every cull.
+    osg::ref_ptr<MPTerrainEngineNode> engine;
+    MPTerrainEngineNode::getEngineByUID( _engineUID, engine );
+    _engine = engine.get();
+
     if ( live )
     {
         _progress = new MyProgressCallback();
@@ -232,8 +237,16 @@ TilePagedLOD::traverse(osg::NodeVisitor& nv)
             break;
         case(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN):
         {
+            // osgEarth: root tiles are created before the engine registers itself,
+            // so they may need to look it up.
             osg::ref_ptr<MPTerrainEngineNode> engine;
-            MPTerrainEngineNode::getEngineByUID( _engineUID, engine );
+            if ( !_engine.lock(engine) )
+                MPTerrainEngineNode::getEngineByUID( _engineUID, engine );
+
+            if ( !engine.valid() )
+                break;
+
+            TileRequestScheduler* scheduler = engine->getTileRequestScheduler();
  
             // Compute the required range.
             float required_range = -1.0;
@@ -309,7 +322,7 @@ TilePagedLOD::traverse(osg::NodeVisitor& nv)
 
                 // now request the loading of the next unloaded child.
                 if (!_disableExternalChildrenPaging &&
-                    nv.getDatabaseRequestHandler() &&
+                    (scheduler || nv.getDatabaseRequestHandler()) &&
                     numChildren<_perRangeDataList.size())
                 {
                     // osgEarth: Perform a tile visibility check before requesting the new tile.
@@ -329,7 +342,17 @@ TilePagedLOD::traverse(osg::NodeVisitor& nv)
                         cv->popModelViewMatrix();
                     }
 
-                    if ( tileIsVisible )
+                    // osgEarth: with native paging, the engine's scheduler takes the request.
+                    if ( tileIsVisible && scheduler )
+                    {
+                        TileNode* tilenode = getTileNode();
+                        if ( tilenode )
+                        {
+                            scheduler->request( tilenode->getKey(), this, computeSchedulerPriority(nv), nv );
+                        }
+                    }
+
+                    else if ( tileIsVisible )
                     {
                         // [end:osgEarth]
 
@@ -368,6 +391,29 @@ TilePagedLOD::traverse(osg::NodeVisitor& nv)
 
 
 
+// Priority of this tile's subtile request in the native scheduler.
+// Coarser tiles come first; within a level, tiles nearer the center of the view.
+float
+TilePagedLOD::computeSchedulerPriority(osg::NodeVisitor& nv)
+{
+    float priority = -(float)getTileNode()->getKey().getLOD();
+
+    osgUtil::CullVisitor* cv = Culling::asCullVisitor( nv );
+    if ( cv )
+    {
+        osg::Vec3d center = osg::Vec3d(getCenter()) * (*cv->getModelViewMatrix());
+        double len = center.length();
+        if ( len > 0.0 )
+        {
+            // cosine of the angle between the view direction and the tile.
+            priority += 0.5f * (float)(-center.z()/len);
+        }
+    }
+
+    return priority;
+}
+
+
 // The osgDB::DatabasePager will call this automatically to purge expired
 // tiles from the scene graph.
 bool
@@ -0,0 +1,362 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2015 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+#include "TilePrefetcher"
+#include "MPTerrainEngineNode"
+#include <osgEarth/MapFrame>
+#include <osgEarth/Map>
+
+using namespace osgEarth::Drivers::MPTerrainEngine;
+using namespace osgEarth;
+
+#define LC "[TilePrefetcher] "
+
+// background threads that do the prefetching.
+#define PREFETCH_THREADS 2
+
+// maximum number of focal points waiting to be prefetched.
+#define MAX_PENDING_TARGETS (2*PREFETCH_THREADS)
+
+namespace
+{
+    // Each task keeps its own stats, but cancels with the prefetcher.
+    struct TaskProgress : public ProgressCallback
+    {
+        TaskProgress(ProgressCallback* parent) : _parent(parent) { }
+
+        bool isCanceled()
+        {
+            return ProgressCallback::isCanceled() || _parent->isCanceled();
+        }
+
+        osg::ref_ptr<ProgressCallback> _parent;
+    };
+}
+
+//------------------------------------------------------------------------
+
+/** Warms the tiles from the root down to one LOD at one focal point. */
+struct TilePrefetcher::Task : public TaskRequest
+{
+    Task(TilePrefetcher* prefetcher, const GeoPoint& focalPoint, unsigned lod, ProgressCallback* parent) :
+        _prefetcher( prefetcher ),
+        _focalPoint( focalPoint ),
+        _lod       ( lod )
+    {
+        _taskProgress = new TaskProgress( parent );
+    }
+
+    void operator()(ProgressCallback*)
+    {
+        execute();
+
+        Threading::ScopedMutexLock lock( _prefetcher->_mutex );
+        _prefetcher->_numTasks--;
+    }
+
+    void execute()
+    {
+        const Map*     map     = _prefetcher->_engine->getMap();
+        const Profile* profile = map->getProfile();
+        MapFrame       frame( map );
+
+        double x = _focalPoint.x(), y = _focalPoint.y();
+
+        // start from the root tile, which is always in the scene graph.
+        TileKey key = profile->createTileKey( x, y, _prefetcher->_options.firstLOD().get() );
+        osg::ref_ptr<TileNode> root;
+        if ( !key.valid() || !_prefetcher->_liveTiles->get(key, root) || !root->getTileModel() )
+            return;
+
+        osg::ref_ptr<osg::HeightField> hf = root->getTileModel()->_elevationData.getHeightField();
+
+        for( ; key.valid() && key.getLOD() <= _lod && hf.valid(); )
+        {
+            if ( _taskProgress->isCanceled() )
+                return;
+
+            // the engine will build the four subtiles of "key" in one request.
+            // Warm them all, unless they are already built or prefetched; either
+            // way, get the heightfield of the one under the focal point to continue.
+            TileKey next = profile->createTileKey( x, y, key.getLOD()+1 );
+            if ( !next.valid() )
+                return;
+
+            osg::ref_ptr<TileNode> nextNode;
+            bool warm =
+                !_prefetcher->_liveTiles->get(next, nextNode) &&
+                _prefetcher->track(key);
+
+            osg::ref_ptr<osg::HeightField> nextHF;
+
+            for(unsigned q=0; q<4; ++q)
+            {
+                TileKey child = key.createChildKey( q );
+                if ( warm || child == next )
+                {
+                    osg::ref_ptr<osg::HeightField> childHF;
+                    _prefetcher->_factory->prefetchTileModel( child, frame, hf.get(), childHF, _taskProgress.get() );
+                    if ( child == next )
+                        nextHF = childHF.get();
+                }
+            }
+
+            key = next;
+            hf  = nextHF.get();
+        }
+    }
+
+    TilePrefetcher*                _prefetcher;
+    GeoPoint                       _focalPoint;
+    unsigned                       _lod;
+    osg::ref_ptr<ProgressCallback> _taskProgress;
+};
+
+//------------------------------------------------------------------------
+
+TilePrefetcher::Stats::Stats() :
+_targets( 0 ),
+_tiles  ( 0 ),
+_hits   ( 0 ),
+_misses ( 0 ),
+_pending( 0 )
+{
+    //nop
+}
+
+//------------------------------------------------------------------------
+
+TilePrefetcher::TilePrefetcher(MPTerrainEngineNode*          engine,
+                               TileModelFactory*             factory,
+                               TileNodeRegistry*             liveTiles,
+                               const MPTerrainEngineOptions& options) :
+_engine   ( engine ),
+_factory  ( factory ),
+_liveTiles( liveTiles ),
+_options  ( options ),
+_lookahead( std::max(options.prefetchLookahead().get(), 0.0f) ),
+_maxTiles ( std::max(options.prefetchMaxTiles().get(), 1u) ),
+_lastFrame( 0 ),
+_lastTime ( -1.0 ),
+_serial   ( 0 ),
+_numTasks ( 0 )
+{
+    _service  = new TaskService( "MP Tile Prefetcher", PREFETCH_THREADS );
+    _progress = new ProgressCallback();
+
+    OE_INFO << LC << "Prefetching " << _lookahead << "s ahead of the camera, up to "
+        << _maxTiles << " tiles" << std::endl;
+}
+
+TilePrefetcher::~TilePrefetcher()
+{
+    clear();
+
+    // waits for the running tasks to finish.
+    _service = 0L;
+}
+
+void
+TilePrefetcher::cull(osg::NodeVisitor& nv)
+{
+    if ( !nv.getFrameStamp() || _lookahead <= 0.0 )
+        return;
+
+    unsigned   frame = nv.getFrameStamp()->getFrameNumber();
+    double     time  = nv.getFrameStamp()->getReferenceTime();
+    osg::Vec3d eye   = nv.getEyePoint();
+    osg::Vec3d ahead;
+    {
+        Threading::ScopedMutexLock lock( _motionMutex );
+
+        // one sample per frame, from whichever camera culls first.
+        if ( frame == _lastFrame && _lastTime >= 0.0 )
+            return;
+
+        double dt = time - _lastTime;
+        if ( _lastTime >= 0.0 && dt > 0.0 )
+        {
+            // smooth out the velocity so jitter doesn't send us all over the place.
+            osg::Vec3d velocity = (eye - _lastEye) / dt;
+            _velocity = _velocity*0.7 + velocity*0.3;
+        }
+
+        _lastFrame = frame;
+        _lastTime  = time;
+        _lastEye   = eye;
+        ahead      = _velocity * _lookahead;
+    }
+
+    const SpatialReference* srs = _engine->getMap()->getSRS();
+
+    GeoPoint predicted;
+    if ( !predicted.fromWorld(srs, eye + ahead) )
+        return;
+
+    // skip it if the camera isn't really going anywhere.
+    double range = std::max( predicted.z(), 1.0 );
+    if ( ahead.length() < 0.1*range )
+        return;
+
+    predicted.z() = 0.0;
+    prefetch( predicted, range );
+}
+
+void
+TilePrefetcher::prefetch(const GeoPoint& focalPoint, double range)
+{
+    const Profile* profile = _engine->getMap()->getProfile();
+
+    GeoPoint point;
+    if ( !focalPoint.transform(profile->getSRS(), point) )
+        return;
+
+    unsigned lod = computeLOD( point, range );
+
+    TileKey target = profile->createTileKey( point.x(), point.y(), lod );
+    if ( !target.valid() )
+        return;
+
+    Threading::ScopedMutexLock lock( _mutex );
+
+    // already on it, or too busy (in which case a later frame will try again).
+    if ( target == _lastTarget || _numTasks >= MAX_PENDING_TARGETS )
+        return;
+
+    _lastTarget = target;
+    _numTasks++;
+    _stats._targets++;
+
+    _service->add( new Task(this, point, lod, _progress.get()) );
+}
+
+void
+TilePrefetcher::touch(const TileKey& key)
+{
+    Threading::ScopedMutexLock lock( _mutex );
+
+    std::map<TileKey, unsigned>::iterator i = _tracked.find( key );
+    if ( i != _tracked.end() )
+    {
+        _tracked.erase( i );
+        _stats._hits++;
+    }
+
+    // drop the order entries of tiles that are no longer tracked.
+    while( !_order.empty() )
+    {
+        i = _tracked.find( _order.front().second );
+        if ( i != _tracked.end() && i->second == _order.front().first )
+            break;
+        _order.pop_front();
+    }
+}
+
+void
+TilePrefetcher::clear()
+{
+    Threading::ScopedMutexLock lock( _mutex );
+
+    _progress->cancel();
+    _progress = new ProgressCallback();
+
+    _tracked.clear();
+    _order.clear();
+    _lastTarget = TileKey();
+}
+
+TilePrefetcher::Stats
+TilePrefetcher::getStats() const
+{
+    Threading::ScopedMutexLock lock( _mutex );
+    Stats stats = _stats;
+    stats._pending = _tracked.size();
+    return stats;
+}
+
+// Starts tracking a prefetched tile; false if it's already tracked.
+bool
+TilePrefetcher::track(const TileKey& key)
+{
+    Threading::ScopedMutexLock lock( _mutex );
+
+    if ( _tracked.find(key) != _tracked.end() )
+        return false;
+
+    unsigned serial = ++_serial;
+    _tracked[key] = serial;
+    _order.push_back( std::make_pair(serial, key) );
+    _stats._tiles++;
+
+    // enforce the ceiling; the oldest prefetched tiles were never used.
+    while( _tracked.size() > _maxTiles && !_order.empty() )
+    {
+        std::map<TileKey, unsigned>::iterator i = _tracked.find( _order.front().second );
+        if ( i != _tracked.end() && i->second == _order.front().first )
+        {
+            _tracked.erase( i );
+            _stats._misses++;
+        }
+        _order.pop_front();
+    }
+
+    return true;
+}
+
+// Deepest LOD the engine will subdivide when the camera is "range" meters
+// from the focal point. The engine splits a tile when the camera is closer
+// than min_tile_range_factor times the tile's radius.
+unsigned
+TilePrefetcher::computeLOD(const GeoPoint& point, double range) const
+{
+    const Profile*          profile = _engine->getMap()->getProfile();
+    const SpatialReference* srs     = profile->getSRS();
+
+    double factor = _options.minTileRangeFactor().get();
+
+    unsigned firstLOD = _options.firstLOD().get();
+    unsigned maxLOD   = _options.maxLOD().get();
+    unsigned target   = firstLOD;
+
+    for(unsigned lod = firstLOD; lod < maxLOD; ++lod)
+    {
+        TileKey key = profile->createTileKey( point.x(), point.y(), lod );
+        if ( !key.valid() )
+            break;
+
+        double width  = key.getExtent().width();
+        double height = key.getExtent().height();
+        if ( srs->isGeographic() )
+        {
+            double R = srs->getEllipsoid()->getRadiusEquator();
+            width  = osg::DegreesToRadians(width) * R * cos(osg::DegreesToRadians(point.y()));
+            height = osg::DegreesToRadians(height) * R;
+        }
+
+        double radius = 0.5 * sqrt(width*width + height*height);
+        if ( range >= factor * radius )
+            break;
+
+        target = lod;
+    }
+
+    return target;
+}
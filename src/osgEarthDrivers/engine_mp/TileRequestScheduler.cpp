@@ -0,0 +1,388 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+* Copyright 2015 Pelican Mapping
+* http://osgearth.org
+*
+* osgEarth is free software; you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+* FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+* IN THE SOFTWARE.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+#include "TileRequestScheduler"
+#include "TilePagedLOD"
+#include "MPTerrainEngineNode"
+#include <osgEarth/Terrain>
+#include <osg/Timer>
+#include <algorithm>
+
+using namespace osgEarth::Drivers::MPTerrainEngine;
+using namespace osgEarth;
+
+#define LC "[TileRequestScheduler] "
+
+// A request that isn't renewed for this many frames is no longer wanted.
+#define STALE_FRAMES 2
+
+//------------------------------------------------------------------------
+
+struct TileRequestScheduler::Request : public TaskRequest
+{
+    enum Stage { QUEUED, RUNNING, MERGING };
+
+    Request(TileRequestScheduler* scheduler, const TileKey& key) :
+        _scheduler   ( scheduler ),
+        _key         ( key ),
+        _stage       ( QUEUED ),
+        _rank        ( 0.0f ),
+        _lastFrame   ( 0 ),
+        _requestTime ( osg::Timer::instance()->tick() ),
+        _buildTime   ( 0.0 )
+    {
+        _buildProgress = new ProgressCallback();
+    }
+
+    // runs in a scheduler thread.
+    void operator()(ProgressCallback*)
+    {
+        if ( !_buildProgress->isCanceled() )
+        {
+            osg::Timer_t start = osg::Timer::instance()->tick();
+
+            MPTerrainEngineNode* engine = _scheduler->_engine;
+            _node = engine->createNode( _key, _buildProgress.get() );
+
+            if ( !_node.valid() )
+            {
+                // Same rules as the pager plugin: a root tile (or a canceled one) will
+                // ask again; otherwise mark the slot so the parent never asks again.
+                if ( _key.getLOD() > 0 && !_buildProgress->isCanceled() )
+                {
+                    _node = new InvalidTileNode( _key );
+                }
+            }
+            else
+            {
+                engine->getTerrain()->notifyTileAdded( _key, _node.get() );
+            }
+
+            _buildTime = osg::Timer::instance()->delta_s( start, osg::Timer::instance()->tick() );
+        }
+
+        _scheduler->finished( this );
+    }
+
+    TileRequestScheduler*             _scheduler;
+    TileKey                           _key;
+    osg::observer_ptr<TilePagedLOD>   _plod;
+    Stage                             _stage;
+    float                             _rank;
+    unsigned                          _lastFrame;
+    osg::Timer_t                      _requestTime;
+    double                            _buildTime;
+    osg::ref_ptr<ProgressCallback>    _buildProgress;
+    osg::ref_ptr<osg::Node>           _node;
+};
+
+namespace
+{
+    typedef TileRequestScheduler::Stats Stats;
+
+    struct HigherRank
+    {
+        template<typename T>
+        bool operator()(const T* lhs, const T* rhs) const {
+            return lhs->_rank > rhs->_rank;
+        }
+    };
+
+    // running average that weights recent samples more heavily.
+    void accumulate(double& average, double sample, unsigned count)
+    {
+        average = count <= 1 ? sample : average*0.9 + sample*0.1;
+    }
+}
+
+//------------------------------------------------------------------------
+
+TileRequestScheduler::Stats::Stats() :
+_queued      ( 0 ),
+_running     ( 0 ),
+_merging     ( 0 ),
+_requested   ( 0 ),
+_coalesced   ( 0 ),
+_canceled    ( 0 ),
+_merged      ( 0 ),
+_avgLatency  ( 0.0 ),
+_maxLatency  ( 0.0 ),
+_avgBuildTime( 0.0 )
+{
+    //nop
+}
+
+//------------------------------------------------------------------------
+
+TileRequestScheduler::TileRequestScheduler(MPTerrainEngineNode* engine,
+                                           unsigned             numThreads,
+                                           unsigned             mergesPerFrame) :
+_engine        ( engine ),
+_numThreads    ( std::max(numThreads, 1u) ),
+_mergesPerFrame( std::max(mergesPerFrame, 1u) ),
+_frame         ( 0 ),
+_numRunning    ( 0 ),
+_numBuilt      ( 0 )
+{
+    _service = new TaskService( "MP Tile Scheduler", (int)_numThreads );
+
+    OE_INFO << LC << "Native paging with " << _numThreads << " threads, "
+        << _mergesPerFrame << " merges per frame" << std::endl;
+}
+
+TileRequestScheduler::~TileRequestScheduler()
+{
+    clear();
+
+    // waits for the running builds to finish; they still call finished().
+    _service = 0L;
+}
+
+void
+TileRequestScheduler::request(const TileKey&    key,
+                              TilePagedLOD*     plod,
+                              float             priority,
+                              osg::NodeVisitor& nv)
+{
+    unsigned frame = nv.getFrameStamp() ? nv.getFrameStamp()->getFrameNumber() : 0u;
+
+    Threading::ScopedMutexLock lock( _mutex );
+
+    // remember the pager so merged subgraphs can be registered for expiration.
+    if ( !_pager.valid() )
+    {
+        _pager = dynamic_cast<osgDB::DatabasePager*>( nv.getDatabaseRequestHandler() );
+    }
+
+    osg::ref_ptr<Request>& r = _requests[key];
+    if ( !r.valid() )
+    {
+        r = new Request( this, key );
+        r->_plod      = plod;
+        r->_rank      = priority;
+        r->_lastFrame = frame;
+        _stats._requested++;
+    }
+    else
+    {
+        // another cull (view or thread) already asked for this tile this frame.
+        if ( r->_lastFrame == frame )
+        {
+            r->_rank = std::max( r->_rank, priority );
+            _stats._coalesced++;
+        }
+        else
+        {
+            r->_rank = priority;
+        }
+
+        r->_lastFrame = frame;
+
+        if ( r->_plod.get() != plod )
+            r->_plod = plod;
+    }
+}
+
+void
+TileRequestScheduler::update(osg::NodeVisitor& nv)
+{
+    if ( nv.getFrameStamp() )
+    {
+        _frame = nv.getFrameStamp()->getFrameNumber();
+    }
+
+    // pull this frame's share of completed tiles, and keep the threads busy.
+    std::vector< osg::ref_ptr<Request> > toMerge;
+    osg::ref_ptr<osgDB::DatabasePager>   pager;
+    {
+        Threading::ScopedMutexLock lock( _mutex );
+
+        while( !_mergeQueue.empty() && toMerge.size() < _mergesPerFrame )
+        {
+            osg::ref_ptr<Request> r = _mergeQueue.front();
+            _mergeQueue.pop_front();
+
+            RequestTable::iterator i = _requests.find( r->_key );
+            if ( i != _requests.end() && i->second.get() == r.get() )
+                _requests.erase( i );
+
+            if ( isStale(r.get()) )
+                _stats._canceled++;
+            else
+                toMerge.push_back( r.get() );
+        }
+
+        dispatch();
+
+        _pager.lock( pager );
+    }
+
+    osg::Timer_t now = osg::Timer::instance()->tick();
+
+    for(unsigned i=0; i<toMerge.size(); ++i)
+    {
+        Request* r = toMerge[i].get();
+
+        // only merge if the paged node is still in the scene and still needs its children.
+        osg::ref_ptr<TilePagedLOD> plod;
+        bool merged =
+            r->_plod.lock( plod ) &&
+            plod->getNumParents() > 0 &&
+            plod->getNumChildren() == 1;
+
+        if ( merged )
+        {
+            plod->addChild( r->_node.get() );
+
+            // let the pager expire the new paged nodes as it would its own.
+            if ( pager.valid() )
+            {
+                pager->registerPagedLODs( r->_node.get() );
+            }
+        }
+
+        Threading::ScopedMutexLock lock( _mutex );
+        if ( merged )
+        {
+            double latency = osg::Timer::instance()->delta_s( r->_requestTime, now );
+            _stats._merged++;
+            accumulate( _stats._avgLatency, latency, _stats._merged );
+            _stats._maxLatency = std::max( _stats._maxLatency, latency );
+        }
+        else
+        {
+            _stats._canceled++;
+        }
+    }
+}
+
+void
+TileRequestScheduler::clear()
+{
+    Threading::ScopedMutexLock lock( _mutex );
+
+    for(RequestTable::iterator i = _requests.begin(); i != _requests.end(); ++i)
+    {
+        i->second->_buildProgress->cancel();
+    }
+
+    _stats._canceled += _requests.size();
+    _requests.clear();
+    _mergeQueue.clear();
+}
+
+TileRequestScheduler::Stats
+TileRequestScheduler::getStats() const
+{
+    Threading::ScopedMutexLock lock( _mutex );
+
+    Stats stats = _stats;
+    stats._running = _numRunning;
+    stats._merging = _mergeQueue.size();
+
+    for(RequestTable::const_iterator i = _requests.begin(); i != _requests.end(); ++i)
+    {
+        if ( i->second->_stage == Request::QUEUED )
+            stats._queued++;
+    }
+
+    return stats;
+}
+
+bool
+TileRequestScheduler::isStale(const Request* r) const
+{
+    return (int)_frame - (int)r->_lastFrame > STALE_FRAMES;
+}
+
+// call with _mutex held.
+void
+TileRequestScheduler::dispatch()
+{
+    std::vector<Request*> queued;
+
+    for(RequestTable::iterator i = _requests.begin(); i != _requests.end(); )
+    {
+        Request* r = i->second.get();
+
+        if ( r->_stage != Request::MERGING && isStale(r) )
+        {
+            if ( r->_stage == Request::QUEUED )
+            {
+                _requests.erase( i++ );
+                _stats._canceled++;
+                continue;
+            }
+
+            // still building; it will clean up after itself in finished().
+            r->_buildProgress->cancel();
+        }
+        else if ( r->_stage == Request::QUEUED )
+        {
+            queued.push_back( r );
+        }
+        ++i;
+    }
+
+    if ( _numRunning >= _numThreads || queued.empty() )
+        return;
+
+    // start the most important requests; the rest wait, with their priorities
+    // still being updated by the cull traversal.
+    unsigned count = std::min( _numThreads - _numRunning, (unsigned)queued.size() );
+    std::partial_sort( queued.begin(), queued.begin()+count, queued.end(), HigherRank() );
+
+    for(unsigned i=0; i<count; ++i)
+    {
+        Request* r = queued[i];
+        r->_stage = Request::RUNNING;
+        r->setPriority( -r->_rank ); // the service runs lower values first
+        _numRunning++;
+        _service->add( r );
+    }
+}
+
+// runs in a scheduler thread.
+void
+TileRequestScheduler::finished(Request* r)
+{
+    Threading::ScopedMutexLock lock( _mutex );
+
+    _numRunning--;
+
+    RequestTable::iterator i = _requests.find( r->_key );
+    bool current = i != _requests.end() && i->second.get() == r;
+
+    if ( current && r->_node.valid() && !r->_buildProgress->isCanceled() )
+    {
+        r->_stage = Request::MERGING;
+        _mergeQueue.push_back( r );
+        accumulate( _stats._avgBuildTime, r->_buildTime, ++_numBuilt );
+    }
+    else if ( current )
+    {
+        // canceled, or failed in a way that warrants asking again later.
+        _requests.erase( i );
+        _stats._canceled++;
+    }
+
+    dispatch();
+}
@@ -26,6 +26,8 @@
 #include <osgEarth/ImageUtils>
 #include <osgEarth/URI>
 #include <osgEarth/HeightFieldUtils>
+#include <osgEarth/ThreadingUtils>
+#include <osgEarth/Profiler>
 
 #include <osgDB/FileNameUtils>
 #include <osgDB/FileUtils>
@@ -630,15 +632,30 @@ public:
       TileSource( options ),
       _srcDS(NULL),
       _warpedDS(NULL),
+      _warpMode(WARP_NONE),
+      _numHandles(0u),
+      _handlesFailed(false),
       _options(options),
       _maxDataLevel(30)
     {
+        // enough handles for the CPUs to read in parallel, but no more, since
+        // each one holds a file descriptor and its own block cache.
+        _maxHandles = osg::clampBetween( (unsigned)OpenThreads::GetNumberOfProcessors(), 2u, 8u );
     }
 
     virtual ~GDALTileSource()
     {
         GDAL_SCOPED_LOCK;
 
+        // Close the pooled handles. None are checked out once the source is
+        // no longer referenced.
+        {
+            Threading::ScopedMutexLock lock( _handlesMutex );
+            for (unsigned i = 0; i < _idleHandles.size(); ++i)
+                closeDataset( _idleHandles[i] );
+            _idleHandles.clear();
+        }
+
         // Close the _warpedDS dataset if :
         // - it exists
         // - and is different from _srcDS
@@ -787,6 +804,7 @@ public:
                         if (_srcDS)
                         {
                             OE_INFO << LC << INDENT << "Read VRT from cache!" << std::endl;
+                            _srcOpenString = result.getString();
                         }
                     }
                 }
@@ -802,6 +820,11 @@ public:
 
                     if (_srcDS)
                     {
+                        // The VRT's XML description reopens it on other threads.
+                        char** vrtXML = _srcDS->GetMetadata( "xml:VRT" );
+                        if ( vrtXML && vrtXML[0] )
+                            _srcOpenString = vrtXML[0];
+
                         //Cache the VRT so we don't have to build it next time.
                         if (_cacheBin)
                         {
@@ -842,6 +865,7 @@ public:
                 //If we couldn't build a VRT, just try opening the file directly
                 //Open the dataset
                 _srcDS = (GDALDataset*)GDALOpen( files[0].c_str(), GA_ReadOnly );
+                _srcOpenString = files[0];
 
                 if (_srcDS)
                 {
@@ -859,6 +883,7 @@ public:
                         char *pszSubdatasetName = CPLStrdup( CSLFetchNameValue( subDatasets, buf.str().c_str() ) );
                         GDALClose( _srcDS );
                         _srcDS = (GDALDataset*)GDALOpen( pszSubdatasetName, GA_ReadOnly ) ;
+                        _srcOpenString = pszSubdatasetName;
                         CPLFree( pszSubdatasetName );
                     }
                 }
@@ -990,21 +1015,26 @@ public:
         {
             if ( profile && profile->getSRS()->isGeographic() && (src_srs->isNorthPolar() || src_srs->isSouthPolar()) )
             {
+                _warpMode   = WARP_POLAR;
+                _warpSrcWKT = src_srs->getWKT();
+                _warpDstWKT = profile->getSRS()->getWKT();
                 _warpedDS = (GDALDataset*)GDALAutoCreateWarpedVRTforPolarStereographic(
                     _srcDS,
-                    src_srs->getWKT().c_str(),
-                    profile->getSRS()->getWKT().c_str(),
+                    _warpSrcWKT.c_str(),
+                    _warpDstWKT.c_str(),
                     GRA_NearestNeighbour,
                     5.0,
                     NULL);
             }
             else
             {
-                std::string destWKT = profile ? profile->getSRS()->getWKT() : src_srs->getWKT();
+                _warpMode   = WARP_AUTO;
+                _warpSrcWKT = src_srs->getWKT();
+                _warpDstWKT = profile ? profile->getSRS()->getWKT() : src_srs->getWKT();
                 _warpedDS = (GDALDataset*)GDALAutoCreateWarpedVRT(
                     _srcDS,
-                    src_srs->getWKT().c_str(),
-                    destWKT.c_str(),
+                    _warpSrcWKT.c_str(),
+                    _warpDstWKT.c_str(),
                     GRA_NearestNeighbour,
                     5.0,
                     0);
@@ -1153,8 +1183,6 @@ public:
     */
     static GDALRasterBand* findBandByColorInterp(GDALDataset *ds, GDALColorInterp colorInterp)
     {
-        GDAL_SCOPED_LOCK;
-
         for (int i = 1; i <= ds->GetRasterCount(); ++i)
         {
             if (ds->GetRasterBand(i)->GetColorInterpretation() == colorInterp) return ds->GetRasterBand(i);
@@ -1164,8 +1192,6 @@ public:
 
     static GDALRasterBand* findBandByDataType(GDALDataset *ds, GDALDataType dataType)
     {
-        GDAL_SCOPED_LOCK;
-
         for (int i = 1; i <= ds->GetRasterCount(); ++i)
         {
             if (ds->GetRasterBand(i)->GetRasterDataType() == dataType) return ds->GetRasterBand(i);
@@ -1271,9 +1297,145 @@ public:
 
     }
 
+    /** A dataset opened for the exclusive use of one reader at a time. */
+    struct DatasetHandle
+    {
+        DatasetHandle() : _srcDS(0L), _warpedDS(0L) { }
+        GDALDataset* _srcDS;
+        GDALDataset* _warpedDS;
+    };
+
+    /**
+     * The dataset to read from for the duration of one read. GDAL datasets
+     * are safe to use from one thread at a time, so a reader checks a handle
+     * on the source (and its warping VRT) out of a bounded pool and reads
+     * through it without a lock. If the pool is exhausted, or the source
+     * cannot be reopened (e.g. an external dataset), the reader uses the
+     * shared dataset under the GDAL lock instead.
+     */
+    class ScopedDataset
+    {
+    public:
+        ScopedDataset(GDALTileSource* source) : _source(source)
+        {
+            _shared = !_source->checkoutDataset( _handle );
+            if ( _shared )
+                Registry::instance()->getGDALMutex().lock();
+        }
+
+        ~ScopedDataset()
+        {
+            if ( _shared )
+                Registry::instance()->getGDALMutex().unlock();
+            else
+                _source->returnDataset( _handle );
+        }
+
+        GDALDataset* get() const { return _shared ? _source->_warpedDS : _handle._warpedDS; }
+
+    private:
+        GDALTileSource* _source;
+        DatasetHandle   _handle;
+        bool            _shared;
+    };
+
+    /** Takes an idle handle from the pool, or opens a new one if the pool has room. */
+    bool checkoutDataset(DatasetHandle& out_handle)
+    {
+        if ( _srcOpenString.empty() )
+            return false;
+
+        {
+            Threading::ScopedMutexLock lock( _handlesMutex );
+            if ( !_idleHandles.empty() )
+            {
+                out_handle = _idleHandles.back();
+                _idleHandles.pop_back();
+                return true;
+            }
+
+            if ( _handlesFailed || _numHandles >= _maxHandles )
+                return false;
+
+            // reserve the slot, then open without holding the pool lock.
+            ++_numHandles;
+        }
+
+        bool ok;
+        {
+            GDAL_SCOPED_LOCK;
+            ok = openDataset( out_handle );
+        }
+
+        if ( !ok )
+        {
+            Threading::ScopedMutexLock lock( _handlesMutex );
+            --_numHandles;
+            _handlesFailed = true;
+        }
+        return ok;
+    }
+
+    /** Puts a handle back in the pool for the next reader. */
+    void returnDataset(const DatasetHandle& handle)
+    {
+        Threading::ScopedMutexLock lock( _handlesMutex );
+        _idleHandles.push_back( handle );
+    }
+
+    /** Opens a new handle on the source, set up the same way as in initialize(). */
+    bool openDataset(DatasetHandle& handle)
+    {
+        handle._srcDS = (GDALDataset*)GDALOpen( _srcOpenString.c_str(), GA_ReadOnly );
+        if ( handle._srcDS )
+        {
+            if ( _warpMode == WARP_POLAR )
+            {
+                handle._warpedDS = (GDALDataset*)GDALAutoCreateWarpedVRTforPolarStereographic(
+                    handle._srcDS, _warpSrcWKT.c_str(), _warpDstWKT.c_str(), GRA_NearestNeighbour, 5.0, NULL);
+            }
+            else if ( _warpMode == WARP_AUTO )
+            {
+                handle._warpedDS = (GDALDataset*)GDALAutoCreateWarpedVRT(
+                    handle._srcDS, _warpSrcWKT.c_str(), _warpDstWKT.c_str(), GRA_NearestNeighbour, 5.0, 0);
+            }
+            else
+            {
+                handle._warpedDS = handle._srcDS;
+            }
+        }
+
+        // The geotransform and extents were computed from the shared dataset;
+        // a handle with a different layout cannot use them.
+        if ( !handle._warpedDS ||
+             handle._warpedDS->GetRasterXSize() != _warpedDS->GetRasterXSize() ||
+             handle._warpedDS->GetRasterYSize() != _warpedDS->GetRasterYSize() ||
+             handle._warpedDS->GetRasterCount() != _warpedDS->GetRasterCount() )
+        {
+            OE_WARN << LC << "Failed to open another handle on " << _options.url()->full()
+                << "; reads will be serialized" << std::endl;
+
+            closeDataset( handle );
+            return false;
+        }
+        return true;
+    }
+
+    /** Closes a handle. Call with the GDAL lock held, or during destruction. */
+    void closeDataset(DatasetHandle& handle)
+    {
+        if (handle._warpedDS && (handle._warpedDS != handle._srcDS))
+            GDALClose( handle._warpedDS );
+        if (handle._srcDS)
+            GDALClose( handle._srcDS );
+        handle._srcDS = 0L;
+        handle._warpedDS = 0L;
+    }
+
     osg::Image* createImage( const TileKey&        key,
                              ProgressCallback*     progress)
     {
+        OE_PROFILE_SCOPE("gdal.createImage");
         if (key.getLevelOfDetail() > _maxDataLevel)
         {
             OE_DEBUG << LC << "" << getName() << ": Reached maximum data resolution key="
@@ -1281,7 +1443,8 @@ public:
             return NULL;
         }
 
-        GDAL_SCOPED_LOCK;
+        ScopedDataset scopedDS( this );
+        GDALDataset* ds = scopedDS.get();
 
         int tileSize = _options.tileSize().value();
 
@@ -1348,44 +1511,44 @@ public:
 
 
 
-            GDALRasterBand* bandRed = findBandByColorInterp(_warpedDS, GCI_RedBand);
-            GDALRasterBand* bandGreen = findBandByColorInterp(_warpedDS, GCI_GreenBand);
-            GDALRasterBand* bandBlue = findBandByColorInterp(_warpedDS, GCI_BlueBand);
-            GDALRasterBand* bandAlpha = findBandByColorInterp(_warpedDS, GCI_AlphaBand);
+            GDALRasterBand* bandRed = findBandByColorInterp(ds, GCI_RedBand);
+            GDALRasterBand* bandGreen = findBandByColorInterp(ds, GCI_GreenBand);
+            GDALRasterBand* bandBlue = findBandByColorInterp(ds, GCI_BlueBand);
+            GDALRasterBand* bandAlpha = findBandByColorInterp(ds, GCI_AlphaBand);
 
-            GDALRasterBand* bandGray = findBandByColorInterp(_warpedDS, GCI_GrayIndex);
+            GDALRasterBand* bandGray = findBandByColorInterp(ds, GCI_GrayIndex);
 
-            GDALRasterBand* bandPalette = findBandByColorInterp(_warpedDS, GCI_PaletteIndex);
+            GDALRasterBand* bandPalette = findBandByColorInterp(ds, GCI_PaletteIndex);
 
             if (!bandRed && !bandGreen && !bandBlue && !bandAlpha && !bandGray && !bandPalette)
             {
                 OE_DEBUG << LC << "Could not determine bands based on color interpretation, using band count" << std::endl;
                 //We couldn't find any valid bands based on the color interp, so just make an educated guess based on the number of bands in the file
                 //RGB = 3 bands
-                if (_warpedDS->GetRasterCount() == 3)
+                if (ds->GetRasterCount() == 3)
                 {
-                    bandRed   = _warpedDS->GetRasterBand( 1 );
-                    bandGreen = _warpedDS->GetRasterBand( 2 );
-                    bandBlue  = _warpedDS->GetRasterBand( 3 );
+                    bandRed   = ds->GetRasterBand( 1 );
+                    bandGreen = ds->GetRasterBand( 2 );
+                    bandBlue  = ds->GetRasterBand( 3 );
                 }
                 //RGBA = 4 bands
-                else if (_warpedDS->GetRasterCount() == 4)
+                else if (ds->GetRasterCount() == 4)
                 {
-                    bandRed   = _warpedDS->GetRasterBand( 1 );
-                    bandGreen = _warpedDS->GetRasterBand( 2 );
-                    bandBlue  = _warpedDS->GetRasterBand( 3 );
-                    bandAlpha = _warpedDS->GetRasterBand( 4 );
+                    bandRed   = ds->GetRasterBand( 1 );
+                    bandGreen = ds->GetRasterBand( 2 );
+                    bandBlue  = ds->GetRasterBand( 3 );
+                    bandAlpha = ds->GetRasterBand( 4 );
                 }
                 //Gray = 1 band
-                else if (_warpedDS->GetRasterCount() == 1)
+                else if (ds->GetRasterCount() == 1)
                 {
-                    bandGray = _warpedDS->GetRasterBand( 1 );
+                    bandGray = ds->GetRasterBand( 1 );
                 }
                 //Gray + alpha = 2 bands
-                else if (_warpedDS->GetRasterCount() == 2)
+                else if (ds->GetRasterCount() == 2)
                 {
-                    bandGray  = _warpedDS->GetRasterBand( 1 );
-                    bandAlpha = _warpedDS->GetRasterBand( 2 );
+                    bandGray  = ds->GetRasterBand( 1 );
+                    bandAlpha = ds->GetRasterBand( 2 );
                 }
             }
 
@@ -1451,20 +1614,29 @@ public:
                 }
                 else
                 {
+                    // Read each band once and sample it in memory.
+                    BandWindow winRed, winGreen, winBlue, winAlpha;
+                    readBandWindow(bandRed,   xmin, ymin, xmax, ymax, tileSize, winRed);
+                    readBandWindow(bandGreen, xmin, ymin, xmax, ymax, tileSize, winGreen);
+                    readBandWindow(bandBlue,  xmin, ymin, xmax, ymax, tileSize, winBlue);
+                    if (bandAlpha != NULL)
+                        readBandWindow(bandAlpha, xmin, ymin, xmax, ymax, tileSize, winAlpha);
+
                     //Sample each point exactly
-                    for (unsigned int c = 0; c < (unsigned int)tileSize; ++c)
+                    for (unsigned int r = 0; r < (unsigned int)tileSize; ++r)
                     {
-                        double geoX = xmin + (dx * (double)c);
-                        for (unsigned int r = 0; r < (unsigned int)tileSize; ++r)
+                        double geoY = ymin + (dy * (double)r);
+                        for (unsigned int c = 0; c < (unsigned int)tileSize; ++c)
                         {
-                            double geoY = ymin + (dy * (double)r);
-                            *(image->data(c,r) + 0) = (unsigned char)getInterpolatedValue(bandRed,  geoX,geoY,false);
-                            *(image->data(c,r) + 1) = (unsigned char)getInterpolatedValue(bandGreen,geoX,geoY,false);
-                            *(image->data(c,r) + 2) = (unsigned char)getInterpolatedValue(bandBlue, geoX,geoY,false);
+                            double geoX = xmin + (dx * (double)c);
+                            unsigned char* pixel = image->data(c,r);
+                            pixel[0] = (unsigned char)getInterpolatedValue(winRed,  geoX,geoY);
+                            pixel[1] = (unsigned char)getInterpolatedValue(winGreen,geoX,geoY);
+                            pixel[2] = (unsigned char)getInterpolatedValue(winBlue, geoX,geoY);
                             if (bandAlpha != NULL)
-                                *(image->data(c,r) + 3) = (unsigned char)getInterpolatedValue(bandAlpha,geoX, geoY, false);
+                                pixel[3] = (unsigned char)getInterpolatedValue(winAlpha,geoX,geoY);
                             else
-                                *(image->data(c,r) + 3) = 255;
+                                pixel[3] = 255;
                         }
                     }
                 }
@@ -1607,6 +1779,12 @@ public:
                     }
                     else
                     {
+                        // Read each band once and sample it in memory.
+                        BandWindow winGray, winAlpha;
+                        readBandWindow(bandGray, xmin, ymin, xmax, ymax, tileSize, winGray);
+                        if (bandAlpha != NULL)
+                            readBandWindow(bandAlpha, xmin, ymin, xmax, ymax, tileSize, winAlpha);
+
                         for (int r = 0; r < tileSize; ++r)
                         {
                             double geoY   = ymin + (dy * (double)r);
@@ -1614,15 +1792,16 @@ public:
                             for (int c = 0; c < tileSize; ++c)
                             {
                                 double geoX = xmin + (dx * (double)c);
-                                float  color = getInterpolatedValue(bandGray,geoX,geoY,false);
+                                float  color = getInterpolatedValue(winGray,geoX,geoY);
 
-                                *(image->data(c,r) + 0) = (unsigned char)color;
-                                *(image->data(c,r) + 1) = (unsigned char)color;
-                                *(image->data(c,r) + 2) = (unsigned char)color;
+                                unsigned char* pixel = image->data(c,r);
+                                pixel[0] = (unsigned char)color;
+                                pixel[1] = (unsigned char)color;
+                                pixel[2] = (unsigned char)color;
                                 if (bandAlpha != NULL)
-                                    *(image->data(c,r) + 3) = (unsigned char)getInterpolatedValue(bandAlpha,geoX,geoY,false);
+                                    pixel[3] = (unsigned char)getInterpolatedValue(winAlpha,geoX,geoY);
                                 else
-                                    *(image->data(c,r) + 3) = 255;
+                                    pixel[3] = 255;
                             }
                         }
                     }
@@ -1738,9 +1917,10 @@ public:
         return true;
     }
 
+    // Bands come from a handle checked out by the caller, or the caller holds
+    // the GDAL lock (see ScopedDataset), so no locking is necessary here.
     bool isValidValue(float v, GDALRasterBand* band)
     {
-        GDAL_SCOPED_LOCK;
         return isValidValue_noLock( v, band );
     }
 
@@ -1869,18 +2049,189 @@ public:
         return result;
     }
 
+    /**
+     * One band's pixels under a tile, read with a single RasterIO call
+     * so that the tile can be resampled in memory.
+     */
+    struct BandWindow
+    {
+        BandWindow() : _band(0L), _loaded(false), _x0(0), _y0(0), _width(0), _height(0), _noData(-32767.0f) { }
+
+        GDALRasterBand*    _band;
+        bool               _loaded;   // false = sample the band directly
+        int                _x0, _y0;
+        int                _width, _height;
+        float              _noData;
+        std::vector<float> _data;
+
+        float get(int col, int row) const { return _data[(row-_y0)*_width + (col-_x0)]; }
+    };
+
+    /**
+     * Reads the pixels of a band that bilinear samples within the extent
+     * will touch, padded by one pixel for rounding. When the extent covers far
+     * more source pixels than the tile samples (low LODs), the window is not
+     * loaded and samples go to the band one at a time, as before.
+     */
+    void readBandWindow(GDALRasterBand* band, double xmin, double ymin, double xmax, double ymax, int tileSize, BandWindow& out)
+    {
+        out._band   = band;
+        out._loaded = false;
+
+        int success;
+        float value = band->GetNoDataValue(&success);
+        if (success)
+            out._noData = value;
+
+        // the pixel transform is affine, so the corners bound the extent.
+        double cx[4], cy[4];
+        geoToPixel(xmin, ymin, cx[0], cy[0]);
+        geoToPixel(xmin, ymax, cx[1], cy[1]);
+        geoToPixel(xmax, ymin, cx[2], cy[2]);
+        geoToPixel(xmax, ymax, cx[3], cy[3]);
+
+        double cmin = cx[0], cmax = cx[0], rmin = cy[0], rmax = cy[0];
+        for (int i = 1; i < 4; ++i)
+        {
+            cmin = osg::minimum(cmin, cx[i]); cmax = osg::maximum(cmax, cx[i]);
+            rmin = osg::minimum(rmin, cy[i]); rmax = osg::maximum(rmax, cy[i]);
+        }
+
+        int rasterWidth  = _warpedDS->GetRasterXSize();
+        int rasterHeight = _warpedDS->GetRasterYSize();
+
+        int x0 = osg::clampBetween((int)floor(cmin) - 1, 0, rasterWidth-1);
+        int x1 = osg::clampBetween((int)ceil(cmax)  + 1, 0, rasterWidth-1);
+        int y0 = osg::clampBetween((int)floor(rmin) - 1, 0, rasterHeight-1);
+        int y1 = osg::clampBetween((int)ceil(rmax)  + 1, 0, rasterHeight-1);
+
+        int width  = x1 - x0 + 1;
+        int height = y1 - y0 + 1;
+
+        // each sample reads at most 2x2 pixels; past that, a window reads
+        // more than the per-sample path would.
+        if ( (double)width * (double)height > 4.0 * (double)tileSize * (double)tileSize )
+            return;
+
+        out._data.resize(width * height);
+        if ( band->RasterIO(GF_Read, x0, y0, width, height, &out._data[0], width, height, GDT_Float32, 0, 0) != CE_None )
+        {
+            out._data.clear();
+            return;
+        }
+
+        out._x0     = x0;
+        out._y0     = y0;
+        out._width  = width;
+        out._height = height;
+        out._loaded = true;
+    }
+
+    bool isValidValue(float v, const BandWindow& win)
+    {
+        return
+            v != win._noData         &&
+            v != getNoDataValue()    &&
+            v >= getMinValidValue()  &&
+            v <= getMaxValidValue();
+    }
+
+    /**
+     * Same as getInterpolatedValue(band, x, y, false) but reads from a
+     * window loaded by readBandWindow.
+     */
+    float getInterpolatedValue(const BandWindow& win, double x, double y)
+    {
+        if ( !win._loaded )
+            return getInterpolatedValue(win._band, x, y, false);
+
+        double r, c;
+        geoToPixel( x, y, c, r );
+
+        int rasterWidth  = _warpedDS->GetRasterXSize();
+        int rasterHeight = _warpedDS->GetRasterYSize();
+
+        //If the location is outside of the pixel values of the dataset, just return 0
+        if (c < 0 || r < 0 || c > rasterWidth-1 || r > rasterHeight-1)
+            return NO_DATA_VALUE;
+
+        if ( _options.interpolation() == INTERP_NEAREST )
+        {
+            float result = win.get((int)osg::round(c), (int)osg::round(r));
+            return isValidValue(result, win) ? result : NO_DATA_VALUE;
+        }
+
+        int rowMin = osg::maximum((int)floor(r), 0);
+        int rowMax = osg::maximum(osg::minimum((int)ceil(r), rasterHeight-1), 0);
+        int colMin = osg::maximum((int)floor(c), 0);
+        int colMax = osg::maximum(osg::minimum((int)ceil(c), rasterWidth-1), 0);
+
+        if (rowMin > rowMax) rowMin = rowMax;
+        if (colMin > colMax) colMin = colMax;
+
+        float llHeight = win.get(colMin, rowMin);
+        float ulHeight = win.get(colMin, rowMax);
+        float lrHeight = win.get(colMax, rowMin);
+        float urHeight = win.get(colMax, rowMax);
+
+        if (!isValidValue(urHeight, win) || !isValidValue(llHeight, win) || !isValidValue(ulHeight, win) || !isValidValue(lrHeight, win))
+        {
+            return NO_DATA_VALUE;
+        }
+
+        float result = 0.0f;
+
+        if ( _options.interpolation() == INTERP_AVERAGE )
+        {
+            double x_rem = c - (int)c;
+            double y_rem = r - (int)r;
+
+            double w00 = (1.0 - y_rem) * (1.0 - x_rem) * (double)llHeight;
+            double w01 = (1.0 - y_rem) * x_rem * (double)lrHeight;
+            double w10 = y_rem * (1.0 - x_rem) * (double)ulHeight;
+            double w11 = y_rem * x_rem * (double)urHeight;
+
+            result = (float)(w00 + w01 + w10 + w11);
+        }
+        else if ( _options.interpolation() == INTERP_BILINEAR )
+        {
+            if ((colMax == colMin) && (rowMax == rowMin))
+            {
+                result = llHeight;
+            }
+            else if (colMax == colMin)
+            {
+                result = ((float)rowMax - r) * llHeight + (r - (float)rowMin) * ulHeight;
+            }
+            else if (rowMax == rowMin)
+            {
+                result = ((float)colMax - c) * llHeight + (c - (float)colMin) * lrHeight;
+            }
+            else
+            {
+                float r1 = ((float)colMax - c) * llHeight + (c - (float)colMin) * lrHeight;
+                float r2 = ((float)colMax - c) * ulHeight + (c - (float)colMin) * urHeight;
+                result = ((float)rowMax - r) * r1 + (r - (float)rowMin) * r2;
+            }
+        }
+
+        return result;
+    }
+
 
 #if 1
     osg::HeightField* createHeightField( const TileKey&        key,
                                          ProgressCallback*     progress)
     {
+        OE_PROFILE_SCOPE("gdal.createHeightField");
         if (key.getLevelOfDetail() > _maxDataLevel)
         {
             //OE_NOTICE << "Reached maximum data resolution key=" << key.getLevelOfDetail() << " max=" << _maxDataLevel <<  std::endl;
             return NULL;
         }
 
-        GDAL_SCOPED_LOCK;
+        ScopedDataset scopedDS( this );
+        GDALDataset* ds = scopedDS.get();
 
         int tileSize = _options.tileSize().value();
 
@@ -1895,11 +2246,11 @@ public:
             key.getExtent().getBounds(xmin, ymin, xmax, ymax);
 
             // Try to find a FLOAT band
-            GDALRasterBand* band = findBandByDataType(_warpedDS, GDT_Float32);
+            GDALRasterBand* band = findBandByDataType(ds, GDT_Float32);
             if (band == NULL)
             {
                 // Just get first band
-                band = _warpedDS->GetRasterBand(1);
+                band = ds->GetRasterBand(1);
             }
 
             double dx = (xmax - xmin) / (tileSize-1);
@@ -1955,13 +2306,15 @@ public:
      osg::HeightField* createHeightField( const TileKey&        key,
                                          ProgressCallback*     progress)
     {
+        OE_PROFILE_SCOPE("gdal.createHeightField");
         if (key.getLevelOfDetail() > _maxDataLevel)
         {
             //OE_NOTICE << "Reached maximum data resolution key=" << key.getLevelOfDetail() << " max=" << _maxDataLevel <<  std::endl;
             return NULL;
         }
 
-        GDAL_SCOPED_LOCK;
+        ScopedDataset scopedDS( this );
+        GDALDataset* ds = scopedDS.get();
 
         int tileSize = _options.tileSize().value();
 
@@ -2149,11 +2502,11 @@ public:
             OE_DEBUG << LC << "Read extents " << read_min_x << ", " << read_min_y << " to " << read_max_x << ", " << read_max_y << std::endl;
 
             // Try to find a FLOAT band
-            GDALRasterBand* band = findBandByDataType(_warpedDS, GDT_Float32);
+            GDALRasterBand* band = findBandByDataType(ds, GDT_Float32);
             if (band == NULL)
             {
                 // Just get first band
-                band = _warpedDS->GetRasterBand(1);
+                band = ds->GetRasterBand(1);
             }
 
             float *heights = new float[target_width * target_height];
@@ -2227,6 +2580,20 @@ private:
 
     GDALDataset* _srcDS;
     GDALDataset* _warpedDS;
+
+    // How to open more handles on the dataset (see ScopedDataset).
+    enum WarpMode { WARP_NONE, WARP_AUTO, WARP_POLAR };
+    std::string  _srcOpenString;      // filename, subdataset name, or VRT XML; empty = can't reopen
+    WarpMode     _warpMode;
+    std::string  _warpSrcWKT;
+    std::string  _warpDstWKT;
+    friend class ScopedDataset;
+    Threading::Mutex           _handlesMutex;
+    std::vector<DatasetHandle> _idleHandles;
+    unsigned                   _numHandles;     // open handles, idle or checked out
+    unsigned                   _maxHandles;
+    bool                       _handlesFailed;  // reopening failed; always use the shared dataset
+
     double       _geotransform[6];
     double       _invtransform[6];
 
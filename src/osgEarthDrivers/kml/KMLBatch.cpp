@@ -0,0 +1,676 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2015 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "KMLBatch"
+#include "KML_Geometry"
+#include "KML_Style"
+
+#include <osgEarth/Registry>
+#include <osgEarth/ShaderGenerator>
+#include <osgEarth/StringUtils>
+#include <osgEarth/Terrain>
+#include <osgEarth/ThreadingUtils>
+#include <osgEarthAnnotation/FeatureNode>
+#include <osgEarthFeatures/Feature>
+
+#include <osg/Depth>
+#include <osg/Geometry>
+#include <osg/Geode>
+#include <osg/MatrixTransform>
+#include <osg/PagedLOD>
+#include <osg/Point>
+#include <osg/PointSprite>
+#include <osg/Texture2D>
+#include <osgDB/FileNameUtils>
+#include <osgDB/ReaderWriter>
+#include <osgDB/Registry>
+
+#include <algorithm>
+#include <sstream>
+#include <cstdio>
+#include <climits>
+
+using namespace osgEarth_kml;
+using namespace osgEarth::Features;
+using namespace osgEarth::Annotation;
+
+// Tiles never split below this level.
+#define MAX_BATCH_LOD 16
+
+// A tile pages in when the camera is within this many tile radii.
+#define RANGE_FACTOR 6.0
+
+// Marks a style key whose placemarks cannot be batched.
+#define NOT_BATCHED UINT_MAX
+
+//---------------------------------------------------------------------------
+
+namespace
+{
+    UID                       s_uid = 0;
+    Threading::ReadWriteMutex s_batchesMutex;
+    typedef std::map<UID, osg::observer_ptr<KMLBatch> > BatchRegistry;
+    BatchRegistry             s_batches;
+
+    std::string makeURI( UID uid, const TileKey& key )
+    {
+        std::stringstream buf;
+        buf << uid << "." << key.getLOD() << "_" << key.getTileX() << "_" << key.getTileY() << ".osgearth_pseudo_kml";
+        std::string str;
+        str = buf.str();
+        return str;
+    }
+
+    // Appends the names and values of a markup subtree to "out", as a key.
+    void appendMarkup( xml_node<>* node, std::string& out )
+    {
+        out.append( node->name(), node->name_size() );
+        out += '=';
+        for( xml_attribute<>* a = node->first_attribute(); a; a = a->next_attribute() )
+        {
+            out.append( a->name(), a->name_size() );
+            out += ':';
+            out.append( a->value(), a->value_size() );
+            out += ';';
+        }
+        if ( node->first_node() == 0L )
+        {
+            out.append( node->value(), node->value_size() );
+        }
+        for( xml_node<>* n = node->first_node(); n; n = n->next_sibling() )
+        {
+            if ( n->type() == node_element )
+            {
+                out += '{';
+                appendMarkup( n, out );
+                out += '}';
+            }
+        }
+    }
+
+    /**
+     * The icons of one style in one tile. Computes their world positions,
+     * clamping them to the terrain if the style asks for it, and clamps them
+     * again as new terrain tiles arrive under them.
+     */
+    class PointSet : public TerrainCallback
+    {
+    public:
+        PointSet(const SpatialReference* srs, const SpatialReference* mapSRS, bool clamp, bool relative) :
+            _srs( srs ), _mapSRS( mapSRS ), _clamp( clamp ), _relative( relative ) { }
+
+        /** Writes the positions, relative to _origin, into "verts". */
+        void update(const Terrain* terrain, osg::Vec3Array* verts) const
+        {
+            std::vector<osg::Vec3d> points( _coords );
+
+            if ( _clamp && terrain )
+            {
+                std::vector<osg::Vec3d> heights( _coords );
+                std::vector<bool>       resolved;
+                terrain->getHeights( _srs.get(), heights, &resolved );
+
+                for(unsigned i=0; i<points.size(); ++i)
+                {
+                    if ( resolved[i] )
+                        points[i].z() = heights[i].z() + (_relative ? _coords[i].z() : 0.0);
+                    else if ( !_relative )
+                        points[i].z() = 0.0;
+                }
+            }
+
+            if ( !_srs->isHorizEquivalentTo(_mapSRS.get()) )
+            {
+                _srs->transform( points, _mapSRS.get() );
+            }
+
+            for(unsigned i=0; i<points.size(); ++i)
+            {
+                osg::Vec3d world;
+                _mapSRS->transformToWorld( points[i], world );
+                (*verts)[i] = world - _origin;
+            }
+        }
+
+        void onTilesAdded(const std::vector<TileKey>&    keys,
+                          const std::vector<osg::Node*>& tiles,
+                          TerrainCallbackContext&        context)
+        {
+            osg::ref_ptr<osg::Geometry> geom;
+            if ( !_geom.lock(geom) )
+            {
+                // the batch tile paged out.
+                context.remove();
+                return;
+            }
+
+            osg::Vec3Array* verts = static_cast<osg::Vec3Array*>( geom->getVertexArray() );
+            update( context.getTerrain(), verts );
+            verts->dirty();
+            geom->dirtyBound();
+        }
+
+        std::vector<osg::Vec3d>          _coords;   // longitude, latitude, altitude
+        osg::Vec3d                       _origin;
+        osg::observer_ptr<osg::Geometry> _geom;
+
+    protected:
+        virtual ~PointSet() { }
+
+        osg::ref_ptr<const SpatialReference> _srs;
+        osg::ref_ptr<const SpatialReference> _mapSRS;
+        bool                                 _clamp;
+        bool                                 _relative;
+    };
+}
+
+//---------------------------------------------------------------------------
+
+/**
+ * A pseudo-loader for the tiles of a KML batch.
+ */
+struct osgEarthKMLBatchPseudoLoader : public osgDB::ReaderWriter
+{
+    osgEarthKMLBatchPseudoLoader()
+    {
+        supportsExtension( "osgearth_pseudo_kml", "KML batch pseudo-loader" );
+    }
+
+    const char* className()
+    { // override
+        return "osgEarth KML Batch Pseudo-Loader";
+    }
+
+    ReadResult readNode(const std::string& uri, const Options* options) const
+    {
+        if ( !acceptsExtension( osgDB::getLowerCaseFileExtension(uri) ) )
+            return ReadResult::FILE_NOT_HANDLED;
+
+        UID uid;
+        unsigned lod, x, y;
+        if ( sscanf( uri.c_str(), "%d.%u_%u_%u.%*s", &uid, &lod, &x, &y ) != 4 )
+            return ReadResult::ERROR_IN_READING_FILE;
+
+        osg::ref_ptr<KMLBatch> batch;
+        {
+            Threading::ScopedReadLock lock( s_batchesMutex );
+            BatchRegistry::const_iterator i = s_batches.find( uid );
+            if ( i != s_batches.end() )
+                i->second.lock( batch );
+        }
+
+        if ( batch.valid() )
+        {
+            osg::Node* node = batch->createTile( lod, x, y );
+            if ( node )
+                return ReadResult( node );
+        }
+
+        return ReadResult::ERROR_IN_READING_FILE;
+    }
+};
+
+REGISTER_OSGPLUGIN(osgearth_pseudo_kml, osgEarthKMLBatchPseudoLoader)
+
+//---------------------------------------------------------------------------
+
+KMLBatch::KMLBatch( const KMLContext& cx ) :
+_mapNode      ( cx._mapNode ),
+_options      ( *cx._options ),
+_srs          ( cx._srs.get() ),
+_maxPerTile   ( std::max(*cx._options->maxPlacemarksPerTile(), 1u) ),
+_numPlacemarks( 0u )
+{
+    _profile = Registry::instance()->getGlobalGeodeticProfile();
+
+    Threading::ScopedWriteLock lock( s_batchesMutex );
+    _uid = ++s_uid;
+    s_batches[_uid] = this;
+}
+
+KMLBatch::~KMLBatch()
+{
+    Threading::ScopedWriteLock lock( s_batchesMutex );
+    s_batches.erase( _uid );
+}
+
+unsigned
+KMLBatch::getBucket( const std::string& key, const Style& style, bool points )
+{
+    std::map<std::string, unsigned>::const_iterator i = _bucketIndex.find( key );
+    if ( i != _bucketIndex.end() )
+        return i->second;
+
+    unsigned index = _buckets.size();
+    _buckets.push_back( Bucket() );
+    _buckets.back()._style  = style;
+    _buckets.back()._points = points;
+    _bucketIndex[key] = index;
+    return index;
+}
+
+bool
+KMLBatch::add( xml_node<>* node, KMLContext& cx )
+{
+    // find the geometry. Multi-geometries and models go the usual way.
+    xml_node<>* geomNode = 0L;
+    std::string geomName;
+    for( xml_node<>* n = node->first_node(); n && !geomNode; n = n->next_sibling() )
+    {
+        std::string name = toLower( n->name() );
+        if ( name == "point" || name == "linestring" || name == "linearring" || name == "polygon" )
+        {
+            geomNode = n;
+            geomName = name;
+        }
+        else if ( name == "multigeometry" || name == "model" || name == "gx:latlonquad" )
+        {
+            return false;
+        }
+    }
+
+    if ( !geomNode )
+        return false;
+
+    std::string styleUrl    = getValue( node, "styleurl" );
+    xml_node<>* inlineStyle = node->first_node( "style", 0, false );
+
+    // Points and lines resolve to the same style whenever these all match, so
+    // the style is only resolved once per combination. A polygon's altitude
+    // settings depend on its own elevations, so polygons always resolve.
+    bool isPoly = geomName == "polygon";
+    std::string key;
+    if ( !isPoly )
+    {
+        key = styleUrl;
+        key += '\n';
+        key += geomName;
+        key += '\n';
+        key += getValue( geomNode, "altitudemode" );
+        key += '\n';
+        key += getValue( geomNode, "extrude" );
+        key += '\n';
+        key += getValue( geomNode, "tessellate" );
+        if ( inlineStyle )
+        {
+            key += '\n';
+            appendMarkup( inlineStyle, key );
+        }
+    }
+
+    KML_Geometry geometry;
+    unsigned     bucket;
+
+    std::map<std::string, unsigned>::const_iterator i = isPoly ? _bucketIndex.end() : _bucketIndex.find( key );
+    if ( i != _bucketIndex.end() )
+    {
+        if ( i->second == NOT_BATCHED )
+            return false;
+
+        Style scratch;
+        geometry.build( node, cx, scratch );
+        bucket = i->second;
+    }
+    else
+    {
+        // resolve the style just like KML_Placemark does.
+        Style style;
+        if ( !styleUrl.empty() )
+        {
+            const Style* ref_style = cx._sheet->getStyle( styleUrl, false );
+            if ( ref_style )
+                style = style.combineWith( *ref_style );
+            else if ( _missingStyles.insert(styleUrl).second )
+                OE_WARN << LC << "Style \"" << styleUrl << "\" not found (it must precede the placemarks that use it); using the default style" << std::endl;
+        }
+        if ( inlineStyle )
+        {
+            KML_Style kmlStyle;
+            kmlStyle.scan( inlineStyle, cx );
+            style = style.combineWith( cx._activeStyle );
+        }
+
+        geometry.build( node, cx, style );
+        if ( !geometry._geom.valid() )
+            return false;
+
+        bool points = geometry._geom->getComponentType() == Geometry::TYPE_POINTSET;
+        bool batched = true;
+        if ( points )
+        {
+            // icons only; models and bare labels go the usual way.
+            if ( style.get<ModelSymbol>() )
+            {
+                batched = false;
+            }
+            else if ( !style.get<IconSymbol>() )
+            {
+                IconSymbol* icon = cx._options->defaultIconSymbol().get();
+                if ( icon )
+                    style.add( icon );
+                else
+                    batched = false;
+            }
+        }
+        else
+        {
+            style.remove<ModelSymbol>();
+            style.remove<IconSymbol>();
+            style.remove<TextSymbol>();
+        }
+
+        if ( isPoly )
+            key = style.getConfig().toJSON( false );
+
+        if ( !batched )
+        {
+            if ( !isPoly )
+                _bucketIndex[key] = NOT_BATCHED;
+            return false;
+        }
+
+        bucket = getBucket( key, style, points );
+    }
+
+    Geometry* geom = geometry._geom.get();
+    if ( !geom || geom->getTotalPointCount() == 0 )
+        return false;
+
+    Placemark placemark;
+    placemark._bucket = bucket;
+
+    GeoExtent bounds;
+    if ( _buckets[bucket]._points )
+    {
+        placemark._point = (*geom)[0];
+        bounds = GeoExtent( _srs.get(), placemark._point.x(), placemark._point.y(), placemark._point.x(), placemark._point.y() );
+    }
+    else
+    {
+        placemark._geom = geom;
+        Bounds b = geom->getBounds();
+        bounds = GeoExtent( _srs.get(), b.xMin(), b.yMin(), b.xMax(), b.yMax() );
+    }
+
+    insert( placemark, bounds );
+    ++_numPlacemarks;
+    return true;
+}
+
+void
+KMLBatch::insert( const Placemark& placemark, const GeoExtent& bounds )
+{
+    const GeoExtent& pe = _profile->getExtent();
+
+    double x, y;
+    bounds.getCentroid( x, y );
+    x = osg::clampBetween( x, pe.xMin(), pe.xMax() );
+    y = osg::clampBetween( y, pe.yMin(), pe.yMax() );
+
+    TileKey key = _profile->createTileKey( x, y, 0 );
+    for( unsigned lod = 0; ; ++lod )
+    {
+        Tile& tile = _tiles[key];
+        if ( tile._placemarks.size() < _maxPerTile || lod == MAX_BATCH_LOD )
+        {
+            tile._placemarks.push_back( placemark );
+            return;
+        }
+
+        // a placemark that spills out of the child tile stays here, so that
+        // the tile's paging bound covers it.
+        TileKey child = _profile->createTileKey( x, y, lod+1 );
+        const GeoExtent& ce = child.getExtent();
+        if ( bounds.xMin() < ce.xMin() || bounds.xMax() > ce.xMax() ||
+             bounds.yMin() < ce.yMin() || bounds.yMax() > ce.yMax() )
+        {
+            tile._placemarks.push_back( placemark );
+            return;
+        }
+
+        key = child;
+    }
+}
+
+osg::Node*
+KMLBatch::createNode()
+{
+    osg::Group* root = new osg::Group();
+
+    // the root keeps the batch alive for the pager.
+    root->setUserData( this );
+
+    for( TileMap::const_iterator t = _tiles.begin(); t != _tiles.end(); ++t )
+    {
+        if ( t->first.getLOD() == 0 )
+            root->addChild( createPagedNode(t->first) );
+    }
+
+    OE_INFO << LC << "Batched " << _numPlacemarks << " placemarks in "
+        << _buckets.size() << " styles and " << _tiles.size() << " tiles" << std::endl;
+
+    return root;
+}
+
+osg::Node*
+KMLBatch::createPagedNode( const TileKey& key ) const
+{
+    osg::ref_ptr<MapNode> mapNode;
+    _mapNode.lock( mapNode );
+
+    // bound the tile in world space.
+    const GeoExtent& e = key.getExtent();
+    double cx, cy;
+    e.getCentroid( cx, cy );
+
+    std::vector<osg::Vec3d> corners;
+    corners.push_back( osg::Vec3d(e.xMin(), e.yMin(), 0.0) );
+    corners.push_back( osg::Vec3d(e.xMax(), e.yMin(), 0.0) );
+    corners.push_back( osg::Vec3d(e.xMin(), e.yMax(), 0.0) );
+    corners.push_back( osg::Vec3d(e.xMax(), e.yMax(), 0.0) );
+    corners.push_back( osg::Vec3d(cx, cy, 0.0) );
+
+    const SpatialReference* mapSRS = mapNode.valid() ? mapNode->getMapSRS() : _srs.get();
+    if ( !e.getSRS()->isHorizEquivalentTo(mapSRS) )
+        e.getSRS()->transform( corners, mapSRS );
+
+    osg::BoundingSphered bs;
+    for( unsigned i=0; i<corners.size(); ++i )
+    {
+        osg::Vec3d world;
+        mapSRS->transformToWorld( corners[i], world );
+        bs.expandBy( world );
+    }
+
+    osg::PagedLOD* p = new osg::PagedLOD();
+    p->setCenter( bs.center() );
+    p->setRadius( bs.radius() );
+    p->setFileName( 0, makeURI(_uid, key) );
+    p->setRange( 0, 0.0f, (float)(bs.radius() * RANGE_FACTOR) );
+    return p;
+}
+
+osg::Node*
+KMLBatch::createTile( unsigned lod, unsigned x, unsigned y )
+{
+    osg::ref_ptr<MapNode> mapNode;
+    if ( !_mapNode.lock(mapNode) )
+        return 0L;
+
+    TileKey key( lod, x, y, _profile.get() );
+    TileMap::const_iterator t = _tiles.find( key );
+    if ( t == _tiles.end() )
+        return 0L;
+
+    // group the tile's placemarks by style:
+    std::map<unsigned, std::vector<const Placemark*> > byBucket;
+    const std::vector<Placemark>& placemarks = t->second._placemarks;
+    for( unsigned i=0; i<placemarks.size(); ++i )
+    {
+        byBucket[placemarks[i]._bucket].push_back( &placemarks[i] );
+    }
+
+    osg::Group* group = new osg::Group();
+
+    for( std::map<unsigned, std::vector<const Placemark*> >::const_iterator b = byBucket.begin(); b != byBucket.end(); ++b )
+    {
+        Bucket& bucket = _buckets[b->first];
+        osg::Node* node = bucket._points ?
+            createPoints( bucket, b->second, key ) :
+            createFeatures( bucket, b->second );
+
+        if ( node )
+            group->addChild( node );
+    }
+
+    for( unsigned q=0; q<4; ++q )
+    {
+        TileKey child = key.createChildKey( q );
+        if ( _tiles.find(child) != _tiles.end() )
+            group->addChild( createPagedNode(child) );
+    }
+
+    return group;
+}
+
+osg::StateSet*
+KMLBatch::getPointStateSet( Bucket& bucket )
+{
+    Threading::ScopedMutexLock lock( _stateSetMutex );
+
+    if ( !bucket._stateSet.valid() )
+    {
+        osg::StateSet* stateSet = new osg::StateSet();
+
+        IconSymbol* icon  = bucket._style.get<IconSymbol>();
+        osg::Image* image = icon ? icon->getImage( *_options.iconMaxSize() ) : 0L;
+
+        // an IconStyle may set a scale without naming an icon.
+        if ( !image && _options.defaultIconSymbol().valid() )
+            image = _options.defaultIconSymbol()->getImage( *_options.iconMaxSize() );
+
+        float size = 8.0f;
+        if ( image )
+        {
+            osg::Texture2D* texture = new osg::Texture2D( image );
+            texture->setResizeNonPowerOfTwoHint( false );
+            texture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::LINEAR );
+            texture->setFilter( osg::Texture::MAG_FILTER, osg::Texture::LINEAR );
+            texture->setWrap( osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE );
+            texture->setWrap( osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE );
+            stateSet->setTextureAttributeAndModes( 0, texture, osg::StateAttribute::ON );
+            stateSet->setTextureAttributeAndModes( 0, new osg::PointSprite(), osg::StateAttribute::ON );
+            size = (float)std::max( image->s(), image->t() );
+        }
+
+        float scale = *_options.iconBaseScale();
+        if ( icon && icon->scale().isSet() )
+            scale *= (float)icon->scale()->eval();
+
+        stateSet->setAttributeAndModes( new osg::Point(size * scale), osg::StateAttribute::ON );
+        stateSet->setAttributeAndModes( new osg::Depth(osg::Depth::LEQUAL, 0.0, 1.0, false), osg::StateAttribute::ON );
+        stateSet->setMode( GL_LIGHTING, osg::StateAttribute::OFF );
+        stateSet->setMode( GL_BLEND, osg::StateAttribute::ON );
+        stateSet->setRenderingHint( osg::StateSet::TRANSPARENT_BIN );
+
+        bucket._stateSet = stateSet;
+    }
+
+    return bucket._stateSet.get();
+}
+
+osg::Node*
+KMLBatch::createPoints( Bucket& bucket, const std::vector<const Placemark*>& placemarks, const TileKey& key )
+{
+    osg::ref_ptr<MapNode> mapNode;
+    if ( !_mapNode.lock(mapNode) )
+        return 0L;
+
+    const AltitudeSymbol* alt = bucket._style.get<AltitudeSymbol>();
+    bool clamp    = !alt || alt->clamping() != AltitudeSymbol::CLAMP_NONE;
+    bool relative = alt && alt->clamping() == AltitudeSymbol::CLAMP_RELATIVE_TO_TERRAIN;
+
+    osg::ref_ptr<PointSet> points = new PointSet( _srs.get(), mapNode->getMapSRS(), clamp, relative );
+    points->_coords.reserve( placemarks.size() );
+    for( unsigned i=0; i<placemarks.size(); ++i )
+        points->_coords.push_back( placemarks[i]->_point );
+
+    // a local origin keeps the float vertices precise.
+    const GeoExtent& e = key.getExtent();
+    double cx, cy;
+    e.getCentroid( cx, cy );
+    GeoPoint center( e.getSRS(), cx, cy, 0.0, ALTMODE_ABSOLUTE );
+    center.transform( mapNode->getMapSRS() ).toWorld( points->_origin );
+
+    osg::Vec3Array* verts = new osg::Vec3Array( placemarks.size() );
+    points->update( mapNode->getTerrain(), verts );
+
+    osg::Vec4Array* colors = new osg::Vec4Array( 1 );
+    (*colors)[0].set( 1.0f, 1.0f, 1.0f, 1.0f );
+
+    // all the icons of the style draw at once, as point sprites.
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects( true );
+    geom->setUseDisplayList( false );
+    geom->setDataVariance( clamp ? osg::Object::DYNAMIC : osg::Object::STATIC );
+    geom->setVertexArray( verts );
+    geom->setColorArray( colors );
+    geom->setColorBinding( osg::Geometry::BIND_OVERALL );
+    geom->addPrimitiveSet( new osg::DrawArrays(GL_POINTS, 0, verts->size()) );
+
+    // the bound only covers the anchor points (a lone icon has a zero radius),
+    // so don't let small-feature culling drop the sprites. The tile's PagedLOD
+    // still culls on the extent.
+    osg::Geode* geode = new osg::Geode();
+    geode->addDrawable( geom );
+    geode->setStateSet( getPointStateSet(bucket) );
+    geode->setCullingActive( false );
+
+    osg::MatrixTransform* xform = new osg::MatrixTransform( osg::Matrix::translate(points->_origin) );
+    xform->addChild( geode );
+    xform->setCullingActive( false );
+
+    Registry::shaderGenerator().run( xform, "osgEarth.KMLBatch", Registry::stateSetCache() );
+
+    // keep the icons on the terrain as better tiles arrive beneath them.
+    if ( clamp )
+    {
+        points->_geom = geom;
+        mapNode->getTerrain()->addTerrainCallback( points.get(), e );
+    }
+
+    return xform;
+}
+
+osg::Node*
+KMLBatch::createFeatures( Bucket& bucket, const std::vector<const Placemark*>& placemarks )
+{
+    osg::ref_ptr<MapNode> mapNode;
+    if ( !_mapNode.lock(mapNode) )
+        return 0L;
+
+    // the compiler works on the geometry in place, and the tile may page in
+    // again later, so hand it copies.
+    FeatureList features;
+    for( unsigned i=0; i<placemarks.size(); ++i )
+    {
+        features.push_back( new Feature(placemarks[i]->_geom->clone(), _srs.get(), bucket._style) );
+    }
+
+    return new FeatureNode( mapNode.get(), features, bucket._style );
+}
@@ -19,6 +19,15 @@
 #include "KMLReader"
 #include "KML_Root"
 #include "KML_Geometry"
+#include "KML_Style"
+#include "KML_StyleMap"
+#include "KML_Placemark"
+#include "KML_GroundOverlay"
+#include "KML_ScreenOverlay"
+#include "KML_PhotoOverlay"
+#include "KML_NetworkLink"
+#include "KMLStream"
+#include "KMLBatch"
 #include <osgEarth/Registry>
 #include <osgEarth/Capabilities>
 #include <osgEarth/XmlUtils>
@@ -30,6 +39,91 @@
 using namespace osgEarth_kml;
 using namespace osgEarth;
 
+namespace
+{
+    /**
+     * Handles the streamed elements of a batched KML document. Styles go
+     * into the style sheet as they arrive; placemarks go into the batch,
+     * and whatever the batch cannot take is built the usual way.
+     */
+    class BatchHandler : public KMLStream::Handler
+    {
+    public:
+        BatchHandler( KMLContext& cx, KMLBatch* batch ) :
+            _cx( cx ), _batch( batch ), _numFallbacks( 0u ) { }
+
+        bool wants( const std::string& name )
+        {
+            return
+                name == "style"         ||
+                name == "stylemap"      ||
+                name == "placemark"     ||
+                name == "groundoverlay" ||
+                name == "screenoverlay" ||
+                name == "photooverlay"  ||
+                name == "networklink";
+        }
+
+        void element( const std::string& name, std::string& xml )
+        {
+            xml_document<> doc;
+            doc.parse<0>( &xml[0] );
+            xml_node<>* node = doc.first_node();
+            if ( !node )
+                return;
+
+            if ( name == "style" )
+            {
+                KML_Style style;
+                style.scan( node, _cx );
+            }
+            else if ( name == "stylemap" )
+            {
+                KML_StyleMap styleMap;
+                styleMap.scan2( node, _cx );
+            }
+            else if ( name == "placemark" )
+            {
+                if ( !_batch->add(node, _cx) )
+                {
+                    KML_Placemark placemark;
+                    placemark.scan( node, _cx );
+                    placemark.build( node, _cx );
+                    ++_numFallbacks;
+                }
+            }
+            else if ( name == "groundoverlay" )
+            {
+                KML_GroundOverlay overlay;
+                overlay.scan( node, _cx );
+                overlay.build( node, _cx );
+            }
+            else if ( name == "screenoverlay" )
+            {
+                KML_ScreenOverlay overlay;
+                overlay.scan( node, _cx );
+                overlay.build( node, _cx );
+            }
+            else if ( name == "photooverlay" )
+            {
+                KML_PhotoOverlay overlay;
+                overlay.scan( node, _cx );
+                overlay.build( node, _cx );
+            }
+            else if ( name == "networklink" )
+            {
+                KML_NetworkLink link;
+                link.scan( node, _cx );
+                link.build( node, _cx );
+            }
+        }
+
+        KMLContext& _cx;
+        KMLBatch*   _batch;
+        unsigned    _numFallbacks;
+    };
+}
+
 
 KMLReader::KMLReader( MapNode* mapNode, const KMLOptions* options ) :
 _mapNode( mapNode ),
@@ -41,6 +135,9 @@ _options( options )
 osg::Node*
 KMLReader::read( std::istream& in, const osgDB::Options* dbOptions )
 {
+    if ( _options && _options->batch() == true )
+        return readBatched( in, dbOptions );
+
     // pull the URI context out of the DB options:
     URIContext context(dbOptions);
 
@@ -64,17 +161,13 @@ KMLReader::read( std::istream& in, const osgDB::Options* dbOptions )
 	return node;
 }
 
-osg::Node*
-KMLReader::read( xml_document<>& doc, const osgDB::Options* dbOptions )
+void
+KMLReader::initContext( KMLContext& cx, osg::Group* root, const osgDB::Options* dbOptions, URIResultCache& uriCache )
 {
-    osg::Group* root = new osg::Group();
-    root->ref();
-
     URIContext context(dbOptions);
 
 	root->setName( context.referrer() );
 
-    KMLContext cx;
     cx._mapNode   = _mapNode;
     cx._sheet     = new StyleSheet();
     cx._options   = _options;
@@ -86,11 +179,10 @@ KMLReader::read( xml_document<>& doc, const osgDB::Options* dbOptions )
 
 
     // clone the dbOptions, and install a resource cache if there isn't one already:
-    URIResultCache defaultUriCache;
     if ( !URIResultCache::from(dbOptions) )
     {
         osgDB::Options* newOptions = Registry::instance()->cloneOrCreateOptions();
-        defaultUriCache.apply( newOptions );
+        uriCache.apply( newOptions );
         cx._dbOptions = newOptions;
     }
     else
@@ -99,14 +191,24 @@ KMLReader::read( xml_document<>& doc, const osgDB::Options* dbOptions )
     }
 
     // intialize the KML options with the defaults if necessary:
-    KMLOptions blankOptions;
     if ( cx._options == 0L )
-        cx._options = &blankOptions;
+        cx._options = &_defaultOptions;
 
     if ( cx._options->iconAndLabelGroup().valid() && cx._options->declutter() == true )
     {
         Decluttering::setEnabled( cx._options->iconAndLabelGroup()->getOrCreateStateSet(), true );
     }
+}
+
+osg::Node*
+KMLReader::read( xml_document<>& doc, const osgDB::Options* dbOptions )
+{
+    osg::Group* root = new osg::Group();
+    root->ref();
+
+    KMLContext cx;
+    URIResultCache defaultUriCache;
+    initContext( cx, root, dbOptions, defaultUriCache );
 
     //const Config* top = conf.hasChild("kml" ) ? conf.child_ptr("kml") : &conf;
 	xml_node<> *top = doc.first_node("kml", 0, false);
@@ -140,3 +242,45 @@ KMLReader::read( xml_document<>& doc, const osgDB::Options* dbOptions )
 
     return root;
 }
+
+osg::Node*
+KMLReader::readBatched( std::istream& in, const osgDB::Options* dbOptions )
+{
+    osg::Group* root = new osg::Group();
+    root->ref();
+
+    KMLContext cx;
+    URIResultCache defaultUriCache;
+    initContext( cx, root, dbOptions, defaultUriCache );
+
+    // Documents and folders are not kept; everything lands under the root.
+    osg::ref_ptr<KMLBatch> batch = new KMLBatch( cx );
+    BatchHandler handler( cx, batch.get() );
+    KMLStream stream( in );
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    if ( !stream.read(handler) )
+    {
+        OE_WARN << LC << "KML stream is malformed or truncated; keeping what was read" << std::endl;
+    }
+    osg::Timer_t end = osg::Timer::instance()->tick();
+
+    OE_INFO << LC << "Streamed " << stream.getNumElements() << " elements in "
+        << osg::Timer::instance()->delta_s(start, end) << "s, peak buffer "
+        << stream.getPeakBufferSize() << " bytes; "
+        << handler._numFallbacks << " placemarks not batched" << std::endl;
+
+    if ( batch->getNumPlacemarks() > 0 )
+    {
+        root->addChild( batch->createNode() );
+    }
+
+    URIResultCache* cacheUsed = URIResultCache::from(cx._dbOptions.get());
+    CacheStats stats = cacheUsed->getStats();
+    OE_INFO << LC << "URI Cache: " << stats._queries << " reads, " << (stats._hitRatio*100.0) << "% hits" << std::endl;
+
+    // Make sure the KML gets rendered after the terrain.
+    root->getOrCreateStateSet()->setRenderBinDetails(2, "RenderBin");
+
+    return root;
+}
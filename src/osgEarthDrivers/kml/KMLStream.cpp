@@ -0,0 +1,231 @@
+/* -*-c++-*- */
+/* osgEarth - Dynamic map generation toolkit for OpenSceneGraph
+ * Copyright 2015 Pelican Mapping
+ * http://osgearth.org
+ *
+ * osgEarth is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "KMLStream"
+#include <osgEarth/StringUtils>
+#include <algorithm>
+#include <cstring>
+
+using namespace osgEarth_kml;
+
+namespace
+{
+    bool startsWith( const std::string& buf, std::string::size_type pos, const char* prefix )
+    {
+        return buf.compare( pos, strlen(prefix), prefix ) == 0;
+    }
+
+    bool isNameEnd( char c )
+    {
+        return c == '>' || c == '/' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+}
+
+KMLStream::KMLStream( std::istream& in, unsigned chunkSize ) :
+_in            ( in ),
+_chunk         ( std::max(chunkSize, 1024u) ),
+_eof           ( false ),
+_numElements   ( 0u ),
+_peakBufferSize( 0u )
+{
+    //nop
+}
+
+bool
+KMLStream::fill()
+{
+    if ( _eof )
+        return false;
+
+    _in.read( &_chunk[0], _chunk.size() );
+    std::streamsize n = _in.gcount();
+    if ( n <= 0 )
+    {
+        _eof = true;
+        return false;
+    }
+
+    _buf.append( &_chunk[0], (std::string::size_type)n );
+    return true;
+}
+
+bool
+KMLStream::findMarkupEnd( std::string::size_type pos, std::string::size_type& out_end ) const
+{
+    std::string::size_type i;
+
+    if ( startsWith(_buf, pos, "<!--") )
+    {
+        i = _buf.find( "-->", pos+4 );
+        out_end = i + 3;
+    }
+    else if ( startsWith(_buf, pos, "<![CDATA[") )
+    {
+        i = _buf.find( "]]>", pos+9 );
+        out_end = i + 3;
+    }
+    else if ( startsWith(_buf, pos, "<?") )
+    {
+        i = _buf.find( "?>", pos+2 );
+        out_end = i + 2;
+    }
+    else if ( startsWith(_buf, pos, "<!") )
+    {
+        // a declaration, which may carry an internal subset in brackets.
+        int brackets = 0;
+        for( i = pos+2; i < _buf.size(); ++i )
+        {
+            char c = _buf[i];
+            if      ( c == '[' ) ++brackets;
+            else if ( c == ']' ) --brackets;
+            else if ( c == '>' && brackets <= 0 ) break;
+        }
+        if ( i == _buf.size() )
+            i = std::string::npos;
+        out_end = i + 1;
+    }
+    else
+    {
+        // a tag; attribute values may contain '>'.
+        char quote = 0;
+        for( i = pos+1; i < _buf.size(); ++i )
+        {
+            char c = _buf[i];
+            if ( quote )
+            {
+                if ( c == quote ) quote = 0;
+            }
+            else if ( c == '"' || c == '\'' ) quote = c;
+            else if ( c == '>' ) break;
+        }
+        if ( i == _buf.size() )
+            i = std::string::npos;
+        out_end = i + 1;
+    }
+
+    return i != std::string::npos;
+}
+
+bool
+KMLStream::read( Handler& handler )
+{
+    std::string            capture;      // markup of the element being handed over
+    std::string            captureName;
+    unsigned               depth = 0u;   // open elements within the capture
+    std::string::size_type pos   = 0u;
+
+    _buf.clear();
+    _numElements = 0u;
+
+    while( true )
+    {
+        _peakBufferSize = std::max( _peakBufferSize, (unsigned)(_buf.size() + capture.size()) );
+
+        // need more data? drop what we have consumed first.
+        if ( pos >= _buf.size() || (_buf[pos] == '<' && _buf.size() - pos < 9u && !_eof) )
+        {
+            _buf.erase( 0, pos );
+            pos = 0u;
+            if ( !fill() && _buf.empty() )
+                break;
+            continue;
+        }
+
+        // character data runs to the next markup, and may be taken in pieces.
+        if ( _buf[pos] != '<' )
+        {
+            std::string::size_type end = _buf.find( '<', pos );
+            if ( end == std::string::npos )
+                end = _buf.size();
+            if ( depth > 0u )
+                capture.append( _buf, pos, end-pos );
+            pos = end;
+            continue;
+        }
+
+        // markup must be whole before we look at it.
+        std::string::size_type end;
+        if ( !findMarkupEnd(pos, end) )
+        {
+            _buf.erase( 0, pos );
+            pos = 0u;
+            if ( !fill() )
+                return false;
+            continue;
+        }
+
+        if ( _buf[pos+1] == '/' )
+        {
+            // end tag
+            if ( depth > 0u )
+            {
+                capture.append( _buf, pos, end-pos );
+                if ( --depth == 0u )
+                {
+                    handler.element( captureName, capture );
+                    ++_numElements;
+                    capture.clear();
+                }
+            }
+        }
+        else if ( _buf[pos+1] == '!' || _buf[pos+1] == '?' )
+        {
+            // comment, CDATA, processing instruction or declaration
+            if ( depth > 0u )
+                capture.append( _buf, pos, end-pos );
+        }
+        else
+        {
+            // start tag
+            bool selfClosing = _buf[end-2] == '/';
+            if ( depth > 0u )
+            {
+                capture.append( _buf, pos, end-pos );
+                if ( !selfClosing )
+                    ++depth;
+            }
+            else
+            {
+                std::string::size_type nameEnd = pos+1;
+                while( nameEnd < end && !isNameEnd(_buf[nameEnd]) )
+                    ++nameEnd;
+                std::string name = osgEarth::toLower( _buf.substr(pos+1, nameEnd-pos-1) );
+
+                if ( handler.wants(name) )
+                {
+                    capture.assign( _buf, pos, end-pos );
+                    captureName = name;
+                    if ( selfClosing )
+                    {
+                        handler.element( captureName, capture );
+                        ++_numElements;
+                        capture.clear();
+                    }
+                    else
+                    {
+                        depth = 1u;
+                    }
+                }
+            }
+        }
+
+        pos = end;
+    }
+
+    return depth == 0u;
+}
@@ -63,11 +63,44 @@ _options  ( options ),
 _database ( NULL ),
 _minLevel ( 0 ),
 _maxLevel ( 20 ),
-_forceRGB ( false )
+_forceRGB ( false ),
+_insert   ( 0L ),
+_select   ( 0L ),
+_numPendingWrites( 0 )
 {
     //nop
 }
 
+MBTilesTileSource::~MBTilesTileSource()
+{
+    {
+        Threading::ScopedMutexLock exclusiveLock(_mutex);
+        commit();
+    }
+
+    for(unsigned i=0; i<_readers.size(); ++i)
+    {
+        sqlite3_finalize( _readers[i]->_select );
+        sqlite3_close( _readers[i]->_db );
+        delete _readers[i];
+    }
+    _readers.clear();
+
+    if ( _insert )
+        sqlite3_finalize( _insert );
+    if ( _select )
+        sqlite3_finalize( _select );
+
+    if ( _database )
+    {
+        // leave the file in the default journal mode so other tools can open it read-only.
+        if ( (MODE_WRITE & (int)getMode()) != 0 )
+            sqlite3_exec( _database, "PRAGMA journal_mode=DELETE", 0L, 0L, 0L );
+        sqlite3_close( _database );
+        _database = 0L;
+    }
+}
+
 TileSource::Status
 MBTilesTileSource::initialize(const osgDB::Options* dbOptions)
 {    
@@ -75,7 +108,8 @@ MBTilesTileSource::initialize(const osgDB::Options* dbOptions)
     
     bool readWrite = (MODE_WRITE & (int)getMode()) != 0;
 
-    std::string fullFilename = _options.filename()->full();   
+    std::string fullFilename = _options.filename()->full();
+    _fullFilename = fullFilename;
     bool isNewDatabase = readWrite && !osgDB::fileExists(fullFilename);
 
     if ( isNewDatabase )
@@ -112,7 +146,16 @@ MBTilesTileSource::initialize(const osgDB::Options* dbOptions)
         return Status::Error( Stringify()
             << "Database \"" << fullFilename << "\": " << sqlite3_errmsg(_database) );
     }
-    
+
+    sqlite3_busy_timeout( _database, 10000 );
+
+    if ( readWrite )
+    {
+        // WAL mode lets the reader connections run while a write transaction is open.
+        sqlite3_exec( _database, "PRAGMA journal_mode=WAL", 0L, 0L, 0L );
+        sqlite3_exec( _database, "PRAGMA synchronous=NORMAL", 0L, 0L, 0L );
+    }
+
     // New database setup:
     if ( isNewDatabase )
     {
@@ -252,6 +295,21 @@ MBTilesTileSource::initialize(const osgDB::Options* dbOptions)
     unsigned char *data = _emptyImage->data(0,0);
     memset(data, 0, 4 * size * size);
 
+    if ( readWrite )
+    {
+        std::string query = "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)";
+        if ( sqlite3_prepare_v2(_database, query.c_str(), -1, &_insert, 0L) != SQLITE_OK )
+        {
+            return Status::Error( Stringify() << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_database) );
+        }
+
+        query = "SELECT tile_data from tiles where zoom_level = ? AND tile_column = ? AND tile_row = ?";
+        if ( sqlite3_prepare_v2(_database, query.c_str(), -1, &_select, 0L) != SQLITE_OK )
+        {
+            return Status::Error( Stringify() << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_database) );
+        }
+    }
+
     return STATUS_OK;
 }    
 
@@ -266,92 +324,162 @@ MBTilesTileSource::getCachePolicyHint(const Profile* targetProfile) const
 }
 
 
-osg::Image*
-MBTilesTileSource::createImage(const TileKey&    key,
-                               ProgressCallback* progress)
+MBTilesTileSource::Reader*
+MBTilesTileSource::acquireReader()
 {
-    Threading::ScopedMutexLock exclusiveLock(_mutex);
+    {
+        Threading::ScopedMutexLock lock(_readersMutex);
+        if ( !_readers.empty() )
+        {
+            Reader* reader = _readers.back();
+            _readers.pop_back();
+            return reader;
+        }
+    }
 
-    int z = key.getLevelOfDetail();
-    int x = key.getTileX();
-    int y = key.getTileY();
+    // no idle connection; open a new one. The pool grows to the number of
+    // threads reading at the same time.
+    Reader* reader = new Reader();
+    reader->_db     = 0L;
+    reader->_select = 0L;
 
-    if (z < (int)_minLevel)
+    int rc = sqlite3_open_v2( _fullFilename.c_str(), &reader->_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0L );
+    if ( rc == SQLITE_OK )
     {
-        return _emptyImage.get();            
-    }
+        sqlite3_busy_timeout( reader->_db, 10000 );
 
-    if (z > (int)_maxLevel)
+        std::string query = "SELECT tile_data from tiles where zoom_level = ? AND tile_column = ? AND tile_row = ?";
+        rc = sqlite3_prepare_v2( reader->_db, query.c_str(), -1, &reader->_select, 0L );
+        if ( rc != SQLITE_OK )
+        {
+            OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(reader->_db) << std::endl;
+        }
+    }
+    else
     {
-        //If we're at the max level, just return NULL
-        return NULL;
+        OE_WARN << LC << "Failed to open reader for \"" << _fullFilename << "\": " << sqlite3_errmsg(reader->_db) << std::endl;
     }
 
-    unsigned int numRows, numCols;
-    key.getProfile()->getNumTiles(key.getLevelOfDetail(), numCols, numRows);
-    y  = numRows - y - 1;
-
-    //Get the image
-    sqlite3_stmt* select = NULL;
-    std::string query = "SELECT tile_data from tiles where zoom_level = ? AND tile_column = ? AND tile_row = ?";
-    int rc = sqlite3_prepare_v2( _database, query.c_str(), -1, &select, 0L );
     if ( rc != SQLITE_OK )
     {
-        OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_database) << std::endl;
-        return NULL;
+        sqlite3_close( reader->_db );
+        delete reader;
+        return 0L;
     }
 
-    bool valid = true;        
+    return reader;
+}
 
+void
+MBTilesTileSource::releaseReader(Reader* reader)
+{
+    Threading::ScopedMutexLock lock(_readersMutex);
+    _readers.push_back( reader );
+}
+
+bool
+MBTilesTileSource::selectTile(sqlite3* db, sqlite3_stmt* select, int z, int x, int y, std::string& out_data)
+{
     sqlite3_bind_int( select, 1, z );
     sqlite3_bind_int( select, 2, x );
     sqlite3_bind_int( select, 3, y );
 
-    osg::Image* result = NULL;
-    rc = sqlite3_step( select );
-    if ( rc == SQLITE_ROW)
-    {                     
+    bool found = false;
+    int rc = sqlite3_step( select );
+    if ( rc == SQLITE_ROW )
+    {
         // the pointer returned from _blob gets freed internally by sqlite, supposedly
         const char* data = (const char*)sqlite3_column_blob( select, 0 );
         int dataLen = sqlite3_column_bytes( select, 0 );
+        out_data.assign( data, dataLen );
+        found = true;
+    }
+    else if ( rc != SQLITE_DONE )
+    {
+        OE_DEBUG << LC << "SQL QUERY failed: " << sqlite3_errmsg(db) << std::endl;
+    }
 
-        std::string dataBuffer( data, dataLen );
+    // ready the cached statement for its next use.
+    sqlite3_reset( select );
+    sqlite3_clear_bindings( select );
+    return found;
+}
 
-        // decompress if necessary:
-        if ( _compressor.valid() )
+osg::Image*
+MBTilesTileSource::decodeTile(std::string& dataBuffer)
+{
+    // decompress if necessary:
+    if ( _compressor.valid() )
+    {
+        std::istringstream inputStream(dataBuffer);
+        std::string value;
+        if ( !_compressor->decompress(inputStream, value) )
         {
-            std::istringstream inputStream(dataBuffer);
-            std::string value;
-            if ( !_compressor->decompress(inputStream, value) )
-            {
-                OE_WARN << LC << "Decompression failed" << std::endl;
-                valid = false;
-            }
-            else
-            {
-                dataBuffer = value;
-            }
+            OE_WARN << LC << "Decompression failed" << std::endl;
+            return NULL;
         }
+        dataBuffer = value;
+    }
+
+    // decode the raw image data:
+    std::istringstream inputStream(dataBuffer);
+    osgDB::ReaderWriter::ReadResult rr = _rw->readImage( inputStream );
+    if (rr.validImage())
+    {
+        return rr.takeImage();
+    }
+    return NULL;
+}
 
-        // decode the raw image data:
-        if ( valid )
+osg::Image*
+MBTilesTileSource::createImage(const TileKey&    key,
+                               ProgressCallback* progress)
+{
+    int z = key.getLevelOfDetail();
+    int x = key.getTileX();
+    int y = key.getTileY();
+
+    if (z < (int)_minLevel)
+    {
+        return _emptyImage.get();            
+    }
+
+    if (z > (int)_maxLevel)
+    {
+        //If we're at the max level, just return NULL
+        return NULL;
+    }
+
+    unsigned int numRows, numCols;
+    key.getProfile()->getNumTiles(key.getLevelOfDetail(), numCols, numRows);
+    y  = numRows - y - 1;
+
+    std::string dataBuffer;
+    bool found = false;
+    bool done = false;
+
+    // Tiles in an uncommitted write batch are only visible to the main connection.
+    if ( _select )
+    {
+        Threading::ScopedMutexLock exclusiveLock(_mutex);
+        if ( _numPendingWrites > 0 )
         {
-            std::istringstream inputStream(dataBuffer);
-            osgDB::ReaderWriter::ReadResult rr = _rw->readImage( inputStream );
-            if (rr.validImage())
-            {
-                result = rr.takeImage();                
-            }
+            found = selectTile( _database, _select, z, x, y, dataBuffer );
+            done = true;
         }
     }
-    else
+
+    if ( !done )
     {
-        OE_DEBUG << LC << "SQL QUERY failed for " << query << ": " << std::endl;
-        valid = false;
+        Reader* reader = acquireReader();
+        if ( !reader )
+            return NULL;
+
+        found = selectTile( reader->_db, reader->_select, z, x, y, dataBuffer );
+        releaseReader( reader );
     }
 
-    sqlite3_finalize( select );
-    return result;
+    return found ? decodeTile( dataBuffer ) : NULL;
 }
 
 bool 
@@ -359,11 +487,9 @@ MBTilesTileSource::storeImage(const TileKey&    key,
                               osg::Image*       image,
                               ProgressCallback* progress)
 {
-    if ( (getMode() & MODE_WRITE) == 0 )
+    if ( (getMode() & MODE_WRITE) == 0 || !_insert )
         return false;
 
-    Threading::ScopedMutexLock exclusiveLock(_mutex);
-
     // encode the data stream:
     std::stringstream buf;
     osgDB::ReaderWriter::WriteResult wr;
@@ -406,47 +532,90 @@ MBTilesTileSource::storeImage(const TileKey&    key,
     key.getProfile()->getNumTiles(key.getLevelOfDetail(), numCols, numRows);
     y  = numRows - y - 1;
 
-    // Prep the insert statement:
-    sqlite3_stmt* insert = NULL;
-    std::string query = "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)";
-    int rc = sqlite3_prepare_v2( _database, query.c_str(), -1, &insert, 0L );
-    if ( rc != SQLITE_OK )
+    // encoding is done; only the database work needs the lock.
+    Threading::ScopedMutexLock exclusiveLock(_mutex);
+
+    // open a new batch:
+    if ( _numPendingWrites == 0 )
     {
-        OE_WARN << LC << "Failed to prepare SQL: " << query << "; " << sqlite3_errmsg(_database) << std::endl;
-        return NULL;
+        char* errorMsg = 0L;
+        if ( SQLITE_OK != sqlite3_exec(_database, "BEGIN IMMEDIATE", 0L, 0L, &errorMsg) )
+        {
+            OE_WARN << LC << "Failed to begin transaction: " << errorMsg << std::endl;
+            sqlite3_free( errorMsg );
+            return false;
+        }
     }
 
     // bind parameters:
-    sqlite3_bind_int( insert, 1, z );
-    sqlite3_bind_int( insert, 2, x );
-    sqlite3_bind_int( insert, 3, y );
+    sqlite3_bind_int( _insert, 1, z );
+    sqlite3_bind_int( _insert, 2, x );
+    sqlite3_bind_int( _insert, 3, y );
 
     // bind the data blob:
-    sqlite3_bind_blob( insert, 4, value.c_str(), value.length(), SQLITE_STATIC );
+    sqlite3_bind_blob( _insert, 4, value.c_str(), value.length(), SQLITE_STATIC );
 
     // run the sql.
     bool ok = true;
     int tries = 0;
+    int rc;
     do {
-        rc = sqlite3_step(insert);
+        rc = sqlite3_step(_insert);
     }
     while (++tries < 100 && (rc == SQLITE_BUSY || rc == SQLITE_LOCKED));
 
     if (SQLITE_OK != rc && SQLITE_DONE != rc)
     {
 #if SQLITE_VERSION_NUMBER >= 3007015
-        OE_WARN << LC << "Failed query: " << query << "(" << rc << ")" << sqlite3_errstr(rc) << "; " << sqlite3_errmsg(_database) << std::endl;
+        OE_WARN << LC << "Failed to insert tile (" << rc << ")" << sqlite3_errstr(rc) << "; " << sqlite3_errmsg(_database) << std::endl;
 #else
-        OE_WARN << LC << "Failed query: " << query << "(" << rc << ")" << rc << "; " << sqlite3_errmsg(_database) << std::endl;
+        OE_WARN << LC << "Failed to insert tile (" << rc << ")" << rc << "; " << sqlite3_errmsg(_database) << std::endl;
 #endif        
         ok = false;
     }
 
-    sqlite3_finalize( insert );
+    sqlite3_reset( _insert );
+    sqlite3_clear_bindings( _insert );
+
+    // the open transaction stays pending until the batch is full.
+    ++_numPendingWrites;
+    if ( _numPendingWrites >= std::max(1u, _options.batchSize().get()) )
+    {
+        ok = commit() && ok;
+    }
 
     return ok;
 }
 
+bool
+MBTilesTileSource::commit()
+{
+    if ( _numPendingWrites == 0 )
+        return true;
+
+    // retry while another connection holds the database, like the inserts do.
+    int tries = 0;
+    int rc;
+    do {
+        rc = sqlite3_exec(_database, "COMMIT", 0L, 0L, 0L);
+    }
+    while (++tries < 100 && (rc == SQLITE_BUSY || rc == SQLITE_LOCKED));
+
+    if ( SQLITE_OK != rc )
+    {
+        OE_WARN << LC << "Failed to commit tiles (" << rc << "); " << sqlite3_errmsg(_database)
+            << "; discarding the last " << _numPendingWrites << " tile(s)" << std::endl;
+
+        // roll back so the next batch can begin a new transaction.
+        sqlite3_exec(_database, "ROLLBACK", 0L, 0L, 0L);
+        _numPendingWrites = 0;
+        return false;
+    }
+
+    _numPendingWrites = 0;
+    return true;
+}
+
 bool
 MBTilesTileSource::getMetaData(const std::string& key, std::string& value)
 {
@@ -35,6 +35,7 @@
 #include <osgDB/ImageOptions>
 
 #include <sstream>
+#include <cmath>
 #include <stdlib.h>
 #include <memory.h>
 
@@ -44,6 +45,122 @@
 
 #define LC "[TileIndex driver] "
 
+// number of parent tiles whose file lists are kept in memory.
+#define ENTRY_CACHE_SIZE 128
+
+namespace
+{
+    // Pixel rectangle [s0,s1) x [t0,t1) of an image.
+    struct PixelRect
+    {
+        int _s0, _t0, _s1, _t1;
+        bool empty() const { return _s0 >= _s1 || _t0 >= _t1; }
+    };
+
+    // Pixel footprint of "bounds" in an image covering "extent". Both must be
+    // in the same SRS. Pads by one pixel to account for resampling.
+    PixelRect footprint(const Bounds& bounds, const GeoExtent& extent, const osg::Image* image)
+    {
+        double sx = (double)image->s() / extent.width();
+        double sy = (double)image->t() / extent.height();
+
+        PixelRect r;
+        r._s0 = osg::clampBetween( (int)floor((bounds.xMin()-extent.xMin())*sx) - 1, 0, image->s() );
+        r._s1 = osg::clampBetween( (int)ceil ((bounds.xMax()-extent.xMin())*sx) + 1, 0, image->s() );
+        r._t0 = osg::clampBetween( (int)floor((bounds.yMin()-extent.yMin())*sy) - 1, 0, image->t() );
+        r._t1 = osg::clampBetween( (int)ceil ((bounds.yMax()-extent.yMin())*sy) + 1, 0, image->t() );
+        return r;
+    }
+
+    // Composites the images of the index front to back. Stacking the files
+    // with ImageUtils::mix, one after the other, lets each file draw over the
+    // ones before it; this gives the same result while adding the files from
+    // the last to the first, so a file can be skipped wherever the files
+    // above it are already opaque.
+    class Compositor
+    {
+    public:
+        Compositor() : _s( 0 ), _t( 0 ) { }
+
+        void init(int s, int t)
+        {
+            _s = s;
+            _t = t;
+            _color.assign( s*t, osg::Vec3f() );
+            _alpha.assign( s*t, 0.0f );
+            _clear.assign( s*t, 1.0f );
+        }
+
+        // Whether any pixel in "rect" still shows through the images added so far.
+        bool isVisible(const PixelRect& rect) const
+        {
+            for(int t=rect._t0; t<rect._t1; ++t)
+                for(int s=rect._s0; s<rect._s1; ++s)
+                    if ( _clear[t*_s+s] > 0.0f )
+                        return true;
+            return false;
+        }
+
+        // Adds an image under the ones added so far, only within "rect".
+        void addUnder(const osg::Image* image, const PixelRect& rect)
+        {
+            bool hasAlpha = ImageUtils::hasAlphaChannel( image );
+            ImageUtils::PixelReader read( image );
+            for(int t=rect._t0; t<rect._t1; ++t)
+            {
+                for(int s=rect._s0; s<rect._s1; ++s)
+                {
+                    unsigned i = t*_s+s;
+                    osg::Vec4 in = read( s, t );
+                    float a = hasAlpha ? in.a() : 1.0f;
+                    _color[i] += osg::Vec3f(in.r(), in.g(), in.b()) * (_clear[i]*a);
+                    _alpha[i]  = osg::maximum( _alpha[i], a );
+                    _clear[i] *= 1.0f - a;
+                }
+            }
+        }
+
+        // Finishes with the bottom image, which was already added with
+        // addUnder(). The sequential mix starts from a plain copy of it, so
+        // it shows through in full (not by its alpha), over the whole image.
+        void addBase(const osg::Image* image)
+        {
+            bool hasAlpha = ImageUtils::hasAlphaChannel( image );
+            ImageUtils::PixelReader read( image );
+            for(int t=0; t<_t; ++t)
+            {
+                for(int s=0; s<_s; ++s)
+                {
+                    unsigned i = t*_s+s;
+                    osg::Vec4 in = read( s, t );
+                    _color[i] += osg::Vec3f(in.r(), in.g(), in.b()) * _clear[i];
+                    _alpha[i]  = osg::maximum( _alpha[i], hasAlpha ? in.a() : 1.0f );
+                    _clear[i]  = 0.0f;
+                }
+            }
+        }
+
+        void write(osg::Image* image) const
+        {
+            ImageUtils::PixelWriter write( image );
+            for(int t=0; t<_t; ++t)
+            {
+                for(int s=0; s<_s; ++s)
+                {
+                    unsigned i = t*_s+s;
+                    write( osg::Vec4(_color[i], _alpha[i]), s, t );
+                }
+            }
+        }
+
+    private:
+        int                     _s, _t;
+        std::vector<osg::Vec3f> _color;   // accumulated color
+        std::vector<float>      _alpha;   // alpha, as ImageUtils::mix combines it
+        std::vector<float>      _clear;   // how much still shows through
+    };
+}
+
 using namespace std;
 using namespace osgEarth;
 using namespace osgEarth::Drivers;
@@ -55,7 +172,8 @@ public:
     TileIndexSource( const TileSourceOptions& options ):
       TileSource( options ),
       _options( options ),
-	  _tileSourceCache( true )
+	  _tileSourceCache( true ),
+      _entryCache( true, ENTRY_CACHE_SIZE )
     {
     }
 
@@ -78,52 +196,32 @@ public:
                              ProgressCallback*     progress)
     {        
         osg::Timer_t start = osg::Timer::instance()->tick();
-        std::vector< std::string > files;
-        _index->getFiles( key.getExtent(), files );        
+        std::vector< TileIndex::Entry > entries;
+        getEntries( key, entries );
         osg::Timer_t end = osg::Timer::instance()->tick();
-        OE_DEBUG << "Got " << files.size() << " files in " << osg::Timer::instance()->delta_m( start, end) << " ms" << std::endl;
+        OE_DEBUG << "Got " << entries.size() << " files in " << osg::Timer::instance()->delta_m( start, end) << " ms" << std::endl;
+
+        // Footprints are only usable in pixel space when the index and the
+        // tile share an SRS.
+        const GeoExtent& extent = key.getExtent();
+        bool useFootprints =
+            _index->getSRS() &&
+            _index->getSRS()->isHorizEquivalentTo( extent.getSRS() );
+
+        if ( useFootprints )
+        {
+            return compositeFrontToBack( key, entries );
+        }
 
         // The result image
         osg::Image* result = 0;
         
-        for (unsigned int i = 0; i < files.size(); i++)
+        for (unsigned int i = 0; i < entries.size(); i++)
         {            
-            osg::ref_ptr< TileSource> source;
-            {
-                //Try to get the TileSource from the cache
-                TileSourceCache::Record record;
-                if (_tileSourceCache.get( files[i], record ))
-                {
-                    source = record.value().get();                    
-                }
-                else
-                {
-                    // Couldn't get it from the cache so open it.                    
-                    GDALOptions opt;
-                    opt.url() = files[i];
-                    //Just force it to render so we don't have to worry about falling back
-                    opt.maxDataLevelOverride() = 23;           
-                    //Disable the l2 cache so that we don't run out of RAM so easily.
-                    opt.L2CacheSize() = 0;
-
-                    start = osg::Timer::instance()->tick();
-                    source = osgEarth::TileSourceFactory::create( opt );                               
-                    TileSource::Status compStatus = source->open();
-                    if (compStatus.isOK())
-                    {
-                        _tileSourceCache.insert( files[i], source.get() );                                                
-                    }
-                    else
-                    {
-                        OE_WARN << "Failed to open " << files[i] << std::endl;
-                    }
-                    end = osg::Timer::instance()->tick();
-                    //OE_NOTICE << "init took " << osg::Timer::instance()->delta_m( start, end) << "ms" << std::endl;
-                }               
-            }
+            osg::ref_ptr< TileSource> source = getSource( entries[i]._filename );
+            if ( !source.valid() )
+                continue;
 
-            
-            
             start = osg::Timer::instance()->tick();
             osg::ref_ptr< osg::Image > image = source->createImage( key);
             end = osg::Timer::instance()->tick();
@@ -143,17 +241,163 @@ public:
             }
             else
             {
-                OE_DEBUG << "Failed to create image for " << files[i] << std::endl;
+                OE_DEBUG << "Failed to create image for " << entries[i]._filename << std::endl;
+            }
+        }
+
+        return result;
+    }
+
+    // Same result as the sequential mix in createImage, but adds the files
+    // from the last to the first and skips a file when the ones above it
+    // already cover its footprint. Requires footprints in the tile's SRS.
+    osg::Image* compositeFrontToBack( const TileKey& key, const std::vector< TileIndex::Entry >& entries )
+    {
+        const GeoExtent& extent = key.getExtent();
+
+        Compositor                 compositor;
+        osg::ref_ptr< osg::Image > base;
+
+        for (int i = (int)entries.size()-1; i >= 0; --i)
+        {
+            const std::string& filename = entries[i]._filename;
+
+            PixelRect rect = { 0, 0, 0, 0 };
+            if ( base.valid() )
+            {
+                rect = footprint( entries[i]._bounds, extent, base.get() );
+                if ( rect.empty() || !compositor.isVisible(rect) )
+                {
+                    OE_DEBUG << LC << "Skipping occluded " << filename << std::endl;
+                    continue;
+                }
+            }
+
+            osg::ref_ptr< TileSource> source = getSource( filename );
+            if ( !source.valid() )
+                continue;
+
+            osg::ref_ptr< osg::Image > image = source->createImage( key );
+            if ( !image.valid() )
+            {
+                OE_DEBUG << "Failed to create image for " << filename << std::endl;
+                continue;
             }
+
+            if ( !ImageUtils::PixelReader::supports(image.get()) ||
+                 (base.valid() && (image->s() != base->s() || image->t() != base->t() || image->r() != base->r())) )
+            {
+                OE_DEBUG << LC << "Cannot composite " << filename << std::endl;
+                continue;
+            }
+
+            if ( !base.valid() )
+            {
+                compositor.init( image->s(), image->t() );
+                rect = footprint( entries[i]._bounds, extent, image.get() );
+            }
+
+            compositor.addUnder( image.get(), rect );
+            base = image.get();
         }
 
+        if ( !base.valid() )
+            return 0L;
+
+        // the bottom image sets the format, as in the sequential mix.
+        compositor.addBase( base.get() );
+
+        osg::Image* result = new osg::Image( *base.get() );
+        if ( !ImageUtils::PixelWriter::supports(result) )
+        {
+            result = new osg::Image();
+            result->allocateImage( base->s(), base->t(), 1, GL_RGBA, GL_UNSIGNED_BYTE );
+        }
+        compositor.write( result );
         return result;
     }
 
+    // Opens the source for a file in the index, through the cache.
+    osg::ref_ptr< TileSource > getSource( const std::string& filename )
+    {
+        osg::ref_ptr< TileSource> source;
+
+        //Try to get the TileSource from the cache
+        TileSourceCache::Record record;
+        if (_tileSourceCache.get( filename, record ))
+        {
+            source = record.value().get();                    
+        }
+        else
+        {
+            // Couldn't get it from the cache so open it.                    
+            GDALOptions opt;
+            opt.url() = filename;
+            //Just force it to render so we don't have to worry about falling back
+            opt.maxDataLevelOverride() = 23;           
+            //Disable the l2 cache so that we don't run out of RAM so easily.
+            opt.L2CacheSize() = 0;
+
+            source = osgEarth::TileSourceFactory::create( opt );                               
+            TileSource::Status compStatus = source->open();
+            if (compStatus.isOK())
+            {
+                _tileSourceCache.insert( filename, source.get() );                                                
+            }
+            else
+            {
+                OE_WARN << "Failed to open " << filename << std::endl;
+                source = 0L;
+            }
+        }
+
+        return source;
+    }
+
+    // Gets the files overlapping a tile. Lookups are made, and cached, for
+    // the parent tile so that siblings share one index query.
+    void getEntries( const TileKey& key, std::vector< TileIndex::Entry >& out )
+    {
+        TileKey parent = key.getLOD() > 0 ? key.createParentKey() : key;
+
+        EntryCache::Record record;
+        if ( _entryCache.get(parent, record) )
+        {
+            filterEntries( key, record.value(), out );
+            return;
+        }
+
+        std::vector< TileIndex::Entry > entries;
+        _index->getEntries( parent.getExtent(), entries );
+        _entryCache.insert( parent, entries );
+        filterEntries( key, entries, out );
+    }
+
+    void filterEntries( const TileKey& key, const std::vector< TileIndex::Entry >& in, std::vector< TileIndex::Entry >& out )
+    {
+        GeoExtent extent = key.getExtent().transform( _index->getSRS() );
+        if ( !extent.isValid() )
+            return;
+
+        Bounds bounds = extent.bounds();
+        for(unsigned i=0; i<in.size(); ++i)
+        {
+            const Bounds& b = in[i]._bounds;
+            if ( b.xMin() <= bounds.xMax() && b.xMax() >= bounds.xMin() &&
+                 b.yMin() <= bounds.yMax() && b.yMax() >= bounds.yMin() )
+            {
+                out.push_back( in[i] );
+            }
+        }
+    }
+
     //std::map< std::string, osg::ref_ptr< TileSource> > _tileSourceCache;
     typedef LRUCache< std::string, osg::ref_ptr< TileSource> > TileSourceCache;
     TileSourceCache _tileSourceCache;
 
+    typedef LRUCache< TileKey, std::vector< TileIndex::Entry > > EntryCache;
+    EntryCache _entryCache;
+
     osg::ref_ptr< TileIndex > _index;
     TileIndexOptions _options;
     osg::ref_ptr<osgDB::Options> _dbOptions;
@@ -28,13 +28,189 @@ using namespace osgEarth::Symbology;
 
 #define LC "[Feature] "
 
+namespace
+{
+    // Resolves the expression's variables to slots of the schema. The result
+    // is cached in the expression and reused as long as the schema is the
+    // same and hasn't grown, i.e. once per query for features of one source.
+    template<typename EXPR>
+    const std::vector<int>& bindVariables( EXPR& expr, const AttributeSchema* schema )
+    {
+        VariableBinding& b = expr.binding();
+        unsigned size = schema ? schema->size() : 0;
+
+        if ( b._source.get() != schema || b._sourceSize != size || b._slots.size() != expr.variables().size() )
+        {
+            b._source     = schema;
+            b._sourceSize = size;
+            b._slots.resize( expr.variables().size() );
+            for(unsigned i=0; i<b._slots.size(); ++i)
+                b._slots[i] = schema ? schema->find( expr.variables()[i].first ) : -1;
+        }
+        return b._slots;
+    }
+}
+
+//----------------------------------------------------------------------------
+
+AttributeSchema::AttributeSchema() :
+_size( 0 )
+{
+    //nop
+}
+
+int
+AttributeSchema::find( const std::string& name ) const
+{
+    Threading::ScopedReadLock shared( _mutex );
+    SlotMap::const_iterator i = _slots.find( name );
+    return i != _slots.end() ? (int)i->second : -1;
+}
+
+unsigned
+AttributeSchema::add( const std::string& name )
+{
+    int slot = find( name );
+    if ( slot >= 0 )
+        return (unsigned)slot;
+
+    Threading::ScopedWriteLock exclusive( _mutex );
+    SlotMap::const_iterator i = _slots.find( name );
+    if ( i != _slots.end() )
+        return i->second;
+
+    unsigned newSlot = _names.size();
+    _names.push_back( name );
+    _slots[name] = newSlot;
+    _size = _names.size();
+    return newSlot;
+}
+
+const std::string&
+AttributeSchema::getName( unsigned slot ) const
+{
+    // names are never removed, and deque elements never move.
+    Threading::ScopedReadLock shared( _mutex );
+    return slot < _names.size() ? _names[slot] : EMPTY_STRING;
+}
+
+//----------------------------------------------------------------------------
+
+AttributeTable::const_iterator::const_iterator( const AttributeTable* table, unsigned slot ) :
+_table ( table ),
+_slot  ( slot ),
+_loaded( -1 )
+{
+    // advance to the first attribute that is present.
+    while( _slot < _table->_values.size() && !_table->_present[_slot] )
+        ++_slot;
+}
+
+const AttributeTable::value_type*
+AttributeTable::const_iterator::operator->() const
+{
+    if ( _loaded != (int)_slot )
+    {
+        _value.first  = _table->_schema->getName( _slot );
+        _value.second = _table->_values[_slot];
+        _loaded = (int)_slot;
+    }
+    return &_value;
+}
+
+AttributeTable::const_iterator&
+AttributeTable::const_iterator::operator++()
+{
+    do { ++_slot; } while( _slot < _table->_values.size() && !_table->_present[_slot] );
+    return *this;
+}
+
+AttributeTable::AttributeTable( AttributeSchema* schema ) :
+_schema( schema ),
+_count ( 0 )
+{
+    //nop
+}
+
+void
+AttributeTable::setSchema( AttributeSchema* schema )
+{
+    if ( !schema || schema == _schema.get() )
+        return;
+
+    if ( _schema.valid() && _count > 0 && schema )
+    {
+        std::vector<AttributeValue> values;
+        std::vector<bool>           present;
+        for(unsigned i=0; i<_values.size(); ++i)
+        {
+            if ( _present[i] )
+            {
+                unsigned slot = schema->add( _schema->getName(i) );
+                if ( slot >= values.size() )
+                {
+                    values.resize( slot+1 );
+                    present.resize( slot+1, false );
+                }
+                values[slot]  = _values[i];
+                present[slot] = true;
+            }
+        }
+        _values.swap( values );
+        _present.swap( present );
+    }
+    else
+    {
+        clear();
+    }
+
+    _schema = schema;
+}
+
+AttributeValue&
+AttributeTable::operator[]( const std::string& name )
+{
+    if ( !_schema.valid() )
+        _schema = new AttributeSchema();
+
+    unsigned slot = _schema->add( name );
+    if ( slot >= _values.size() )
+    {
+        _values.resize( slot+1 );
+        _present.resize( slot+1, false );
+    }
+    if ( !_present[slot] )
+    {
+        _values[slot] = AttributeValue();
+        _present[slot] = true;
+        ++_count;
+    }
+    return _values[slot];
+}
+
+AttributeTable::const_iterator
+AttributeTable::find( const std::string& name ) const
+{
+    int slot = _schema.valid() ? _schema->find( name ) : -1;
+    return get(slot) ? const_iterator(this, (unsigned)slot) : end();
+}
+
+void
+AttributeTable::clear()
+{
+    _values.clear();
+    _present.clear();
+    _count = 0;
+}
+
 //----------------------------------------------------------------------------
 
 FeatureProfile::FeatureProfile( const GeoExtent& extent ) :
 _extent    ( extent ),
 _firstLevel( 0 ),
 _maxLevel  ( -1 ),
-_tiled     ( false )
+_tiled     ( false ),
+_schema    ( new AttributeSchema() )
 {
     //nop
 }
@@ -145,7 +321,8 @@ AttributeValue::getBool( bool defaultValue ) const
 
 Feature::Feature( FeatureID fid ) :
 _fid( fid ),
-_srs( 0L )
+_srs( 0L ),
+_geomShared( false )
 //_cachedBoundingPolytopeValid( false )
 {
     //NOP
@@ -154,7 +331,8 @@ _srs( 0L )
 Feature::Feature( Geometry* geom, const SpatialReference* srs, const Style& style, FeatureID fid ) :
 _geom ( geom ),
 _srs  ( srs ),
-_fid  ( fid )
+_fid  ( fid ),
+_geomShared( false )
 {
     if ( !style.empty() )
         _style = style;
@@ -163,14 +341,26 @@ _fid  ( fid )
 }
 
 Feature::Feature( const Feature& rhs, const osg::CopyOp& copyOp ) :
-_fid      ( rhs._fid ),
-_attrs    ( rhs._attrs ),
-_style    ( rhs._style ),
-_geoInterp( rhs._geoInterp ),
-_srs      ( rhs._srs.get() )
+_fid       ( rhs._fid ),
+_style     ( rhs._style ),
+_geoInterp ( rhs._geoInterp ),
+_srs       ( rhs._srs.get() ),
+_geomShared( false )
 {
-    if ( rhs._geom.valid() )
-        _geom = rhs._geom->clone();
+    if ( copyOp.getCopyFlags() == osg::CopyOp::SHALLOW_COPY )
+    {
+        // copy-on-write: share the geometry and attributes until someone
+        // asks for write access to them.
+        _geom       = rhs._geom.get();
+        _geomShared = true;
+        _attrSource = rhs._attrSource.valid() ? rhs._attrSource.get() : &rhs;
+    }
+    else
+    {
+        _attrs = rhs.getAttrs();
+        if ( rhs._geom.valid() )
+            _geom = rhs._geom->clone();
+    }
 
     dirty();
 }
@@ -192,9 +382,41 @@ void
 Feature::setGeometry( Geometry* geom )
 {
     _geom = geom;
+    _geomShared = false;
     dirty();
 }
 
+Geometry*
+Feature::getGeometry()
+{
+    if ( _geomShared )
+    {
+        if ( _geom.valid() )
+            _geom = _geom->clone();
+        _geomShared = false;
+    }
+    dirty();
+    return _geom.get();
+}
+
+void
+Feature::setAttributeSchema( AttributeSchema* schema )
+{
+    if ( schema != getAttrs().getSchema() )
+        mutableAttrs().setSchema( schema );
+}
+
+AttributeTable&
+Feature::mutableAttrs()
+{
+    if ( _attrSource.valid() )
+    {
+        _attrs = _attrSource->_attrs;
+        _attrSource = 0L;
+    }
+    return _attrs;
+}
+
 void
 Feature::dirty()
 {
@@ -206,7 +428,7 @@ Feature::dirty()
 void
 Feature::set( const std::string& name, const std::string& value )
 {
-    AttributeValue& a = _attrs[name];
+    AttributeValue& a = mutableAttrs()[name];
     a.first = ATTRTYPE_STRING;
     a.second.stringValue = value;
     a.second.set = true;
@@ -215,7 +437,7 @@ Feature::set( const std::string& name, const std::string& value )
 void
 Feature::set( const std::string& name, double value )
 {
-    AttributeValue& a = _attrs[name];
+    AttributeValue& a = mutableAttrs()[name];
     a.first = ATTRTYPE_DOUBLE;
     a.second.doubleValue = value;
     a.second.set = true;
@@ -224,7 +446,7 @@ Feature::set( const std::string& name, double value )
 void
 Feature::set( const std::string& name, int value )
 {
-    AttributeValue& a = _attrs[name];
+    AttributeValue& a = mutableAttrs()[name];
     a.first = ATTRTYPE_INT;
     a.second.intValue = value;
     a.second.set = true;
@@ -233,7 +455,7 @@ Feature::set( const std::string& name, int value )
 void
 Feature::set( const std::string& name, bool value )
 {
-    AttributeValue& a = _attrs[name];
+    AttributeValue& a = mutableAttrs()[name];
     a.first = ATTRTYPE_BOOL;
     a.second.boolValue = value;
     a.second.set = true;
@@ -242,14 +464,14 @@ Feature::set( const std::string& name, bool value )
 void
 Feature::setNull( const std::string& name)
 {
-    AttributeValue& a = _attrs[name];    
+    AttributeValue& a = mutableAttrs()[name];    
     a.second.set = false;
 }
 
 void
 Feature::setNull( const std::string& name, AttributeType type)
 {
-    AttributeValue& a = _attrs[name];
+    AttributeValue& a = mutableAttrs()[name];
     a.first = type;    
     a.second.set = false;
 }
@@ -260,55 +482,58 @@ Feature::setNull( const std::string& name, AttributeType type)
 bool
 Feature::hasAttr( const std::string& name ) const
 {
-    return _attrs.find(toLower(name)) != _attrs.end();
+    return getAttrs().get(name) != 0L;
 }
 
 std::string
 Feature::getString( const std::string& name ) const
 {
-    AttributeTable::const_iterator i = _attrs.find(toLower(name));
-    return i != _attrs.end()? i->second.getString() : EMPTY_STRING;
+    const AttributeValue* a = getAttrs().get(name);
+    return a ? a->getString() : EMPTY_STRING;
 }
 
 double
 Feature::getDouble( const std::string& name, double defaultValue ) const 
 {
-    AttributeTable::const_iterator i = _attrs.find(toLower(name));
-    return i != _attrs.end()? i->second.getDouble(defaultValue) : defaultValue;
+    const AttributeValue* a = getAttrs().get(name);
+    return a ? a->getDouble(defaultValue) : defaultValue;
 }
 
 int
 Feature::getInt( const std::string& name, int defaultValue ) const 
 {
-    AttributeTable::const_iterator i = _attrs.find(toLower(name));
-    return i != _attrs.end()? i->second.getInt(defaultValue) : defaultValue;
+    const AttributeValue* a = getAttrs().get(name);
+    return a ? a->getInt(defaultValue) : defaultValue;
 }
 
 bool
 Feature::getBool( const std::string& name, bool defaultValue ) const 
 {
-    AttributeTable::const_iterator i = _attrs.find(toLower(name));
-    return i != _attrs.end()? i->second.getBool(defaultValue) : defaultValue;
+    const AttributeValue* a = getAttrs().get(name);
+    return a ? a->getBool(defaultValue) : defaultValue;
 }
 
 bool
 Feature::isSet( const std::string& name) const
 {
-    AttributeTable::const_iterator i = _attrs.find(toLower(name));
-    return i != _attrs.end()? i->second.second.set : false;
+    const AttributeValue* a = getAttrs().get(name);
+    return a ? a->second.set : false;
 }
 
 double
 Feature::eval( NumericExpression& expr, FilterContext const* context ) const
 {
+    const AttributeTable& attrs = getAttrs();
+    const std::vector<int>& slots = bindVariables( expr, attrs.getSchema() );
+
     const NumericExpression::Variables& vars = expr.variables();
     for( NumericExpression::Variables::const_iterator i = vars.begin(); i != vars.end(); ++i )
     {
       double val = 0.0;
-      AttributeTable::const_iterator ai = _attrs.find(toLower(i->first));
-      if (ai != _attrs.end())
+      const AttributeValue* attr = attrs.get( slots[i - vars.begin()] );
+      if (attr)
       {
-        val = ai->second.getDouble(0.0);
+        val = attr->getDouble(0.0);
       }
       else if (context)
       {
@@ -331,17 +556,72 @@ Feature::eval( NumericExpression& expr, FilterContext const* context ) const
     return expr.eval();
 }
 
+void
+Feature::eval( NumericExpression& expr, const FeatureList& features, std::vector<double>& out, FilterContext const* context )
+{
+    unsigned numVars = expr.variables().size();
+    unsigned count   = features.size();
+
+    // gather one column of values per variable.
+    std::vector< std::vector<double> > values( numVars, std::vector<double>(count, 0.0) );
+    std::vector< unsigned > scripted;
+
+    unsigned row = 0;
+    for( FeatureList::const_iterator f = features.begin(); f != features.end(); ++f, ++row )
+    {
+        const AttributeTable& attrs = f->get()->getAttrs();
+        const std::vector<int>& slots = bindVariables( expr, attrs.getSchema() );
+
+        for( unsigned v=0; v<numVars; ++v )
+        {
+            const AttributeValue* attr = attrs.get( slots[v] );
+            if ( attr )
+            {
+                values[v][row] = attr->getDouble(0.0);
+            }
+            else if ( context )
+            {
+                // might be a script; leave it to the per-feature eval.
+                scripted.push_back( row );
+                break;
+            }
+        }
+    }
+
+    std::vector<const double*> columns( numVars );
+    for( unsigned v=0; v<numVars; ++v )
+        columns[v] = count > 0 ? &values[v][0] : 0L;
+
+    out.resize( count );
+    if ( count > 0 )
+        expr.eval( columns, count, &out[0] );
+
+    if ( !scripted.empty() )
+    {
+        std::vector<const Feature*> byRow;
+        byRow.reserve( count );
+        for( FeatureList::const_iterator f = features.begin(); f != features.end(); ++f )
+            byRow.push_back( f->get() );
+
+        for( unsigned i=0; i<scripted.size(); ++i )
+            out[scripted[i]] = byRow[scripted[i]]->eval( expr, context );
+    }
+}
+
 const std::string&
 Feature::eval( StringExpression& expr, FilterContext const* context ) const
 {
+    const AttributeTable& attrs = getAttrs();
+    const std::vector<int>& slots = bindVariables( expr, attrs.getSchema() );
+
     const StringExpression::Variables& vars = expr.variables();
     for( StringExpression::Variables::const_iterator i = vars.begin(); i != vars.end(); ++i )
     {
       std::string val = "";
-      AttributeTable::const_iterator ai = _attrs.find(toLower(i->first));
-      if (ai != _attrs.end())
+      const AttributeValue* attr = attrs.get( slots[i - vars.begin()] );
+      if (attr)
       {
-        val = ai->second.getString();
+        val = attr->getString();
       }
       else if (context)
       {
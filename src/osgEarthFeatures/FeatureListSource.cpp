@@ -17,18 +17,33 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include <osgEarthFeatures/FeatureListSource>
+#include <algorithm>
+#include <cmath>
 
+using namespace osgEarth;
 using namespace osgEarth::Features;
 
+// target average number of features per grid cell, and grid size limit.
+#define FEATURES_PER_CELL 4
+#define MAX_GRID_DIM      1024
+
 FeatureListSource::FeatureListSource():
-FeatureSource()
+FeatureSource(),
+_schema ( new AttributeSchema() ),
+_cols   ( 0 ),
+_rows   ( 0 ),
+_indexed( false )
 {
     //nop
 }
 
 FeatureListSource::FeatureListSource(const GeoExtent& defaultExtent ) :
 FeatureSource (),
-_defaultExtent( defaultExtent )
+_defaultExtent( defaultExtent ),
+_schema       ( new AttributeSchema() ),
+_cols         ( 0 ),
+_rows         ( 0 ),
+_indexed      ( false )
 {
     //nop
 }
@@ -36,15 +51,141 @@ _defaultExtent( defaultExtent )
 FeatureCursor*
 FeatureListSource::createFeatureCursor( const Symbology::Query& query )
 {
-    //Create a copy of all of the features before returning the cursor.
+    //Select the features, then hand out copies of them.
     //The processing filters in osgEarth can modify the features as they are operating and we don't want our original data destroyed.
-    FeatureList cursorFeatures;
+    //The copies are copy-on-write, so only the features a filter actually modifies get cloned.
+    FeatureList selected;
+
+    if ( query.bounds().isSet() && query.bounds()->isValid() )
+    {
+        {
+            Threading::ScopedReadLock shared( _indexMutex );
+            if ( _indexed && inSyncWith(_indexRevision) )
+            {
+                queryIndex( query.bounds().get(), selected );
+                return new FeatureListCursor( selected, false );
+            }
+        }
+
+        Threading::ScopedWriteLock exclusive( _indexMutex );
+        if ( !_indexed || outOfSyncWith(_indexRevision) )
+        {
+            buildIndex();
+        }
+        queryIndex( query.bounds().get(), selected );
+    }
+    else
+    {
+        for (FeatureList::iterator itr = _features.begin(); itr != _features.end(); ++itr)
+        {
+            selected.push_back( new osgEarth::Features::Feature(*(itr->get()), osg::CopyOp::SHALLOW_COPY) );
+        }
+    }
+
+    return new FeatureListCursor( selected, false );
+}
+
+// Call with the index mutex held exclusively.
+void
+FeatureListSource::buildIndex()
+{
+    _entries.clear();
+    _cells.clear();
+    _gridBounds = Bounds();
+    _cols = _rows = 0;
+
     for (FeatureList::iterator itr = _features.begin(); itr != _features.end(); ++itr)
     {
-        Feature* feature = new osgEarth::Features::Feature(*(itr->get()), osg::CopyOp::DEEP_COPY_ALL);        
-        cursorFeatures.push_back( feature );
-    }    
-    return new FeatureListCursor( cursorFeatures );
+        const Feature* feature = itr->get();
+        if ( !feature || !feature->getGeometry() )
+            continue;
+
+        Bounds b = feature->getGeometry()->getBounds();
+        if ( !b.isValid() )
+            continue;
+
+        IndexEntry entry = { feature, b.xMin(), b.yMin(), b.xMax(), b.yMax() };
+        _entries.push_back( entry );
+        _gridBounds.expandBy( b );
+    }
+
+    if ( !_entries.empty() )
+    {
+        unsigned dim = (unsigned)ceil( sqrt((double)_entries.size() / FEATURES_PER_CELL) );
+        _cols = _rows = osg::clampBetween( dim, 1u, (unsigned)MAX_GRID_DIM );
+        _cells.resize( _cols*_rows );
+
+        double cw = _gridBounds.width()  / _cols;
+        double ch = _gridBounds.height() / _rows;
+
+        for(unsigned i=0; i<_entries.size(); ++i)
+        {
+            const IndexEntry& e = _entries[i];
+            unsigned c0 = cw > 0.0 ? osg::clampBetween( (int)((e._xmin-_gridBounds.xMin())/cw), 0, (int)_cols-1 ) : 0;
+            unsigned c1 = cw > 0.0 ? osg::clampBetween( (int)((e._xmax-_gridBounds.xMin())/cw), 0, (int)_cols-1 ) : 0;
+            unsigned r0 = ch > 0.0 ? osg::clampBetween( (int)((e._ymin-_gridBounds.yMin())/ch), 0, (int)_rows-1 ) : 0;
+            unsigned r1 = ch > 0.0 ? osg::clampBetween( (int)((e._ymax-_gridBounds.yMin())/ch), 0, (int)_rows-1 ) : 0;
+            for(unsigned r=r0; r<=r1; ++r)
+                for(unsigned c=c0; c<=c1; ++c)
+                    _cells[r*_cols+c].push_back( i );
+        }
+    }
+
+    _indexed = true;
+    sync( _indexRevision );
+}
+
+void
+FeatureListSource::queryIndex(const Bounds& bounds, FeatureList& output) const
+{
+    if ( _entries.empty() ||
+         bounds.xMin() > _gridBounds.xMax() || bounds.xMax() < _gridBounds.xMin() ||
+         bounds.yMin() > _gridBounds.yMax() || bounds.yMax() < _gridBounds.yMin() )
+    {
+        return;
+    }
+
+    double cw = _gridBounds.width()  / _cols;
+    double ch = _gridBounds.height() / _rows;
+
+    int c0 = cw > 0.0 ? osg::clampBetween( (int)floor((bounds.xMin()-_gridBounds.xMin())/cw), 0, (int)_cols-1 ) : 0;
+    int c1 = cw > 0.0 ? osg::clampBetween( (int)floor((bounds.xMax()-_gridBounds.xMin())/cw), 0, (int)_cols-1 ) : 0;
+    int r0 = ch > 0.0 ? osg::clampBetween( (int)floor((bounds.yMin()-_gridBounds.yMin())/ch), 0, (int)_rows-1 ) : 0;
+    int r1 = ch > 0.0 ? osg::clampBetween( (int)floor((bounds.yMax()-_gridBounds.yMin())/ch), 0, (int)_rows-1 ) : 0;
+
+    // A feature spanning several cells is only reported from the first cell
+    // (lowest row and column) that both it and the query overlap.
+    std::vector<unsigned> hits;
+    for(int r=r0; r<=r1; ++r)
+    {
+        for(int c=c0; c<=c1; ++c)
+        {
+            const std::vector<unsigned>& cell = _cells[r*_cols+c];
+            for(unsigned k=0; k<cell.size(); ++k)
+            {
+                const IndexEntry& e = _entries[cell[k]];
+
+                if ( e._xmin > bounds.xMax() || e._xmax < bounds.xMin() ||
+                     e._ymin > bounds.yMax() || e._ymax < bounds.yMin() )
+                    continue;
+
+                int ec = cw > 0.0 ? osg::clampBetween( (int)((e._xmin-_gridBounds.xMin())/cw), 0, (int)_cols-1 ) : 0;
+                int er = ch > 0.0 ? osg::clampBetween( (int)((e._ymin-_gridBounds.yMin())/ch), 0, (int)_rows-1 ) : 0;
+                if ( c != std::max(ec, c0) || r != std::max(er, r0) )
+                    continue;
+
+                hits.push_back( cell[k] );
+            }
+        }
+    }
+
+    // entries are in feature list order; keep it.
+    std::sort( hits.begin(), hits.end() );
+
+    for(unsigned i=0; i<hits.size(); ++i)
+    {
+        output.push_back( new Feature(*_entries[hits[i]]._feature, osg::CopyOp::SHALLOW_COPY) );
+    }
 }
 
 const FeatureProfile*
@@ -108,6 +249,8 @@ FeatureListSource::getFeature( FeatureID fid )
 bool FeatureListSource::insertFeature(Feature* feature)
 {
     dirtyFeatureProfile();
+    if ( feature )
+        feature->setAttributeSchema( _schema.get() );
     _features.push_back( feature );
     dirty();
     return true;
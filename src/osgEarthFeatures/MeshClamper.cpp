@@ -27,13 +27,195 @@
 #include <osg/Geode>
 #include <osg/Geometry>
 #include <osg/UserDataContainer>
+#include <cfloat>
 
 #define LC "[MeshClamper] "
 
 using namespace osgEarth;
 using namespace osgEarth::Features;
 
-#define ZOFFSETS_NAME "MeshClamper::zOffsets"
+#define ZOFFSETS_NAME     "MeshClamper::zOffsets"
+#define VERTEX_INDEX_NAME "MeshClamper::vertexIndex"
+
+namespace
+{
+    // Finds a geometry's preserved-Z array, creating an empty one (and
+    // setting "created") if it does not exist yet.
+    osg::FloatArray* getZOffsets(osg::Geometry* geom, unsigned size, bool& created)
+    {
+        created = false;
+        osg::UserDataContainer* udc = geom->getOrCreateUserDataContainer();
+        unsigned n = udc->getUserObjectIndex( ZOFFSETS_NAME );
+        if ( n < udc->getNumUserObjects() )
+        {
+            return dynamic_cast<osg::FloatArray*>(udc->getUserObject(n));
+        }
+
+        osg::FloatArray* zOffsets = new osg::FloatArray();
+        zOffsets->setName( ZOFFSETS_NAME );
+        zOffsets->reserve( size );
+        udc->addUserObject( zOffsets );
+        created = true;
+        return zOffsets;
+    }
+
+    /**
+     * Map locations (x and y in the terrain SRS) of a geometry's vertices,
+     * bucketed in a uniform grid so that a clamp can visit only the
+     * vertices under a tile. Stored on the geometry; a vertex's map location
+     * does not change when it is clamped, so the index stays good until the
+     * geometry or its transform changes.
+     */
+    class VertexIndex : public osg::Object
+    {
+    public:
+        META_Object(osgEarthFeatures, VertexIndex);
+
+        VertexIndex() : _cols(0u), _rows(0u) { }
+
+        VertexIndex(const VertexIndex& rhs, const osg::CopyOp& op) :
+            osg::Object ( rhs, op ),
+            _local2world( rhs._local2world ),
+            _coords     ( rhs._coords ),
+            _xmin       ( rhs._xmin ),
+            _ymin       ( rhs._ymin ),
+            _xmax       ( rhs._xmax ),
+            _ymax       ( rhs._ymax ),
+            _cellWidth  ( rhs._cellWidth ),
+            _cellHeight ( rhs._cellHeight ),
+            _cols       ( rhs._cols ),
+            _rows       ( rhs._rows ),
+            _cellStart  ( rhs._cellStart ),
+            _cellVerts  ( rhs._cellVerts ) { }
+
+        /** Whether the index still describes these vertices. */
+        bool isCurrent(const osg::Vec3Array* verts, const osg::Matrixd& local2world) const
+        {
+            return _coords.size() == verts->size() && _local2world == local2world;
+        }
+
+        void build(const osg::Vec3Array* verts, const osg::Matrixd& local2world, const osg::EllipsoidModel* em, bool geocentric)
+        {
+            _local2world = local2world;
+            _coords.resize( verts->size() );
+
+            for(unsigned k=0; k<verts->size(); ++k)
+            {
+                osg::Vec3d vw = osg::Vec3d((*verts)[k]) * local2world;
+                if ( geocentric )
+                {
+                    double lat, lon, hae;
+                    em->convertXYZToLatLongHeight( vw.x(), vw.y(), vw.z(), lat, lon, hae );
+                    _coords[k].set( osg::RadiansToDegrees(lon), osg::RadiansToDegrees(lat) );
+                }
+                else
+                {
+                    _coords[k].set( vw.x(), vw.y() );
+                }
+            }
+
+            _xmin = _ymin = DBL_MAX;
+            _xmax = _ymax = -DBL_MAX;
+            for(unsigned k=0; k<_coords.size(); ++k)
+            {
+                _xmin = std::min( _xmin, _coords[k].x() );
+                _ymin = std::min( _ymin, _coords[k].y() );
+                _xmax = std::max( _xmax, _coords[k].x() );
+                _ymax = std::max( _ymax, _coords[k].y() );
+            }
+
+            // aim for a handful of vertices per cell.
+            unsigned side = (unsigned)sqrt( (double)_coords.size() / 8.0 );
+            _cols = _rows = osg::clampBetween( side, 1u, 256u );
+            _cellWidth  = std::max( (_xmax - _xmin) / (double)_cols, 1e-12 );
+            _cellHeight = std::max( (_ymax - _ymin) / (double)_rows, 1e-12 );
+
+            std::vector<unsigned> cellOf( _coords.size() );
+            _cellStart.assign( _cols*_rows + 1, 0u );
+            for(unsigned k=0; k<_coords.size(); ++k)
+            {
+                cellOf[k] = row( _coords[k].y() )*_cols + col( _coords[k].x() );
+                _cellStart[cellOf[k] + 1]++;
+            }
+            for(unsigned c=0; c<_cols*_rows; ++c)
+            {
+                _cellStart[c+1] += _cellStart[c];
+            }
+
+            std::vector<unsigned> fill( _cellStart.begin(), _cellStart.end()-1 );
+            _cellVerts.resize( _coords.size() );
+            for(unsigned k=0; k<_coords.size(); ++k)
+            {
+                _cellVerts[fill[cellOf[k]]++] = k;
+            }
+        }
+
+        /** Appends the vertices that lie inside an extent to "out". */
+        void query(double xmin, double ymin, double xmax, double ymax, std::vector<unsigned>& out) const
+        {
+            if ( _coords.empty() || xmin > _xmax || xmax < _xmin || ymin > _ymax || ymax < _ymin )
+                return;
+
+            unsigned c0 = col(xmin), c1 = col(xmax);
+            unsigned r0 = row(ymin), r1 = row(ymax);
+
+            for(unsigned r=r0; r<=r1; ++r)
+            {
+                for(unsigned c=c0; c<=c1; ++c)
+                {
+                    unsigned cell = r*_cols + c;
+                    for(unsigned i=_cellStart[cell]; i<_cellStart[cell+1]; ++i)
+                    {
+                        unsigned k = _cellVerts[i];
+                        const osg::Vec2d& p = _coords[k];
+                        if ( p.x() >= xmin && p.x() <= xmax && p.y() >= ymin && p.y() <= ymax )
+                            out.push_back( k );
+                    }
+                }
+            }
+        }
+
+        osg::Matrixd            _local2world;
+        std::vector<osg::Vec2d> _coords;
+
+    private:
+        double                _xmin, _ymin, _xmax, _ymax;
+        double                _cellWidth, _cellHeight;
+        unsigned              _cols, _rows;
+        std::vector<unsigned> _cellStart;   // first entry in _cellVerts for each cell
+        std::vector<unsigned> _cellVerts;   // vertex numbers, grouped by cell
+
+        unsigned col(double x) const
+        {
+            double f = (x - _xmin) / _cellWidth;
+            return f <= 0.0 ? 0u : std::min( (unsigned)f, _cols-1u );
+        }
+
+        unsigned row(double y) const
+        {
+            double f = (y - _ymin) / _cellHeight;
+            return f <= 0.0 ? 0u : std::min( (unsigned)f, _rows-1u );
+        }
+    };
+
+    VertexIndex* getVertexIndex(osg::Geometry* geom)
+    {
+        osg::UserDataContainer* udc = geom->getOrCreateUserDataContainer();
+        unsigned n = udc->getUserObjectIndex( VERTEX_INDEX_NAME );
+        if ( n < udc->getNumUserObjects() )
+        {
+            VertexIndex* index = dynamic_cast<VertexIndex*>(udc->getUserObject(n));
+            if ( index )
+                return index;
+            udc->removeUserObject( n );
+        }
+
+        VertexIndex* index = new VertexIndex();
+        index->setName( VERTEX_INDEX_NAME );
+        udc->addUserObject( index );
+        return index;
+    }
+}
 
 //-----------------------------------------------------------------------
 
@@ -89,7 +271,11 @@ MeshClamper::apply( osg::Geode& geode )
     {
         bool geomDirty = false;
         osg::Geometry* geom = geode.getDrawable(i)->asGeometry();
-        if ( geom )
+        if ( geom && _terrain.valid() )
+        {
+            geomDirty = clampToTerrain( geom, local2world, world2local );
+        }
+        else if ( geom )
         {
             osg::Vec3Array*  verts = static_cast<osg::Vec3Array*>(geom->getVertexArray());
             osg::FloatArray* zOffsets = 0L;
@@ -99,21 +285,7 @@ MeshClamper::apply( osg::Geode& geode )
             bool buildZOffsets = false;
             if ( _preserveZ )
             {
-                osg::UserDataContainer* udc = geom->getOrCreateUserDataContainer();
-                unsigned n = udc->getUserObjectIndex( ZOFFSETS_NAME );
-                if ( n < udc->getNumUserObjects() )
-                {
-                    zOffsets = dynamic_cast<osg::FloatArray*>(udc->getUserObject(n));
-                }
-
-                else
-                {
-                    zOffsets = new osg::FloatArray();
-                    zOffsets->setName( ZOFFSETS_NAME );
-                    zOffsets->reserve( verts->size() );
-                    udc->addUserObject( zOffsets );
-                    buildZOffsets = true;
-                }
+                zOffsets = getZOffsets( geom, verts->size(), buildZOffsets );
             }
 
             for( unsigned k=0; k<verts->size(); ++k )
@@ -188,20 +360,130 @@ MeshClamper::apply( osg::Geode& geode )
                     ++count;
                 }
             }
+        }
 
-            if ( geomDirty )
+        if ( geomDirty )
+        {
+            osg::Array* verts = geom->getVertexArray();
+            geom->dirtyBound();
+            if ( geom->getUseVertexBufferObjects() )
             {
-                geom->dirtyBound();
-                if ( geom->getUseVertexBufferObjects() )
+                verts->getVertexBufferObject()->setUsage( GL_DYNAMIC_DRAW_ARB );
+                verts->dirty();
+            }
+            else
+                geom->dirtyDisplayList();
+        }
+
+        //OE_NOTICE << LC << "clamped " << count << " verts." << std::endl;
+    }
+}
+
+bool
+MeshClamper::clampToTerrain(osg::Geometry*      geom,
+                            const osg::Matrixd& local2world,
+                            const osg::Matrixd& world2local)
+{
+    osg::Vec3Array* verts = dynamic_cast<osg::Vec3Array*>(geom->getVertexArray());
+    if ( !verts || verts->empty() )
+        return false;
+
+    const osg::EllipsoidModel* em = _terrainSRS->getEllipsoid();
+
+    VertexIndex* index = getVertexIndex( geom );
+    if ( !index->isCurrent(verts, local2world) )
+    {
+        index->build( verts, local2world, em, _geocentric );
+    }
+
+    osg::FloatArray* zOffsets = 0L;
+    if ( _preserveZ )
+    {
+        bool buildZOffsets;
+        zOffsets = getZOffsets( geom, verts->size(), buildZOffsets );
+        if ( buildZOffsets )
+        {
+            for( unsigned k=0; k<verts->size(); ++k )
+            {
+                osg::Vec3d vw = osg::Vec3d((*verts)[k]) * local2world;
+                if ( _geocentric )
                 {
-                    verts->getVertexBufferObject()->setUsage( GL_DYNAMIC_DRAW_ARB );
-                    verts->dirty();
+                    double lat, lon, hae;
+                    em->convertXYZToLatLongHeight( vw.x(), vw.y(), vw.z(), lat, lon, hae );
+                    zOffsets->push_back( float(hae) );
                 }
                 else
-                    geom->dirtyDisplayList();
+                {
+                    zOffsets->push_back( float(vw.z()) );
+                }
             }
         }
+        if ( !zOffsets || zOffsets->size() != verts->size() )
+            return false;
+    }
 
-        //OE_NOTICE << LC << "clamped " << count << " verts." << std::endl;
+    // select the vertices to clamp:
+    std::vector<unsigned> selected;
+    if ( _extent.isValid() )
+    {
+        GeoExtent extent = _extent;
+        if ( !extent.getSRS()->isHorizEquivalentTo(_terrainSRS.get()) )
+            extent = _extent.transform( _terrainSRS.get() );
+        if ( !extent.isValid() )
+            return false;
+
+        index->query( extent.xMin(), extent.yMin(), extent.xMax(), extent.yMax(), selected );
+    }
+    else
+    {
+        selected.resize( verts->size() );
+        for( unsigned k=0; k<selected.size(); ++k )
+            selected[k] = k;
     }
+
+    if ( selected.empty() )
+        return false;
+
+    // sample all their heights in one go:
+    std::vector<osg::Vec3d> points( selected.size() );
+    for( unsigned j=0; j<selected.size(); ++j )
+    {
+        const osg::Vec2d& p = index->_coords[selected[j]];
+        points[j].set( p.x(), p.y(), 0.0 );
+    }
+
+    // the whole terrain graph is the same as no patch at all, and lets the
+    // terrain find the tile under each point.
+    osg::Node* patch = _terrainPatch.get() == _terrain->getGraph() ? 0L : _terrainPatch.get();
+
+    std::vector<bool> resolved;
+    if ( _terrain->getHeights(patch, 0L, points, &resolved, _geocentric) == 0u )
+        return false;
+
+    for( unsigned j=0; j<selected.size(); ++j )
+    {
+        if ( !resolved[j] )
+            continue;
+
+        unsigned k = selected[j];
+        const osg::Vec3d& p = points[j];
+
+        // same scale, offset and preserved Z as the intersecting path:
+        double h = p.z();
+        if ( _scale != 1.0 )
+            h += h*_scale;
+        h += _offset;
+        if ( zOffsets )
+            h += (*zOffsets)[k];
+
+        osg::Vec3d fw;
+        if ( _geocentric )
+            em->convertLatLongHeightToXYZ( osg::DegreesToRadians(p.y()), osg::DegreesToRadians(p.x()), h, fw.x(), fw.y(), fw.z() );
+        else
+            fw.set( p.x(), p.y(), h );
+
+        (*verts)[k] = fw * world2local;
+    }
+
+    return true;
 }
@@ -269,19 +269,19 @@ OgrUtils::createFeature(OGRFeatureH handle, const FeatureProfile* profile)
     Feature* f = 0L;
     if ( profile )
     {
-        f = createFeature( handle, profile->getSRS() );
+        f = createFeature( handle, profile->getSRS(), profile->getAttributeSchema() );
         if ( f && profile->geoInterp().isSet() )
             f->geoInterp() = profile->geoInterp().get();
     }
     else
     {
-        f = createFeature( handle, (const SpatialReference*)0L );
+        f = createFeature( handle, (const SpatialReference*)0L, 0L );
     }
     return f;
 }            
 
 Feature*
-OgrUtils::createFeature( OGRFeatureH handle, const SpatialReference* srs )
+OgrUtils::createFeature( OGRFeatureH handle, const SpatialReference* srs, AttributeSchema* schema )
 {
     long fid = OGR_F_GetFID( handle );
 
@@ -295,6 +295,7 @@ OgrUtils::createFeature( OGRFeatureH handle, const SpatialReference* srs )
     }
 
     Feature* feature = new Feature( geom, srs, Style(), fid );
+    feature->setAttributeSchema( schema );
 
     int numAttrs = OGR_F_GetFieldCount(handle); 
     for (int i = 0; i < numAttrs; ++i) 
@@ -22,16 +22,21 @@
 #include <osgEarthSymbology/Expression>
 #include <osgEarth/StringUtils>
 #include <algorithm>
+#include <cmath>
 
 using namespace osgEarth;
 using namespace osgEarth::Symbology;
 
 #define LC "[Expression] "
 
+// number of rows evaluated together by the batch NumericExpression::eval
+#define BATCH_SIZE 256
+
 NumericExpression::NumericExpression( const std::string& expr ) : 
 _src  ( expr ),
 _value( 0.0 ),
-_dirty( true )
+_dirty( true ),
+_depth( 0 )
 {
     init();
 }
@@ -41,20 +46,25 @@ _src  ( rhs._src ),
 _rpn  ( rhs._rpn ),
 _vars ( rhs._vars ),
 _value( rhs._value ),
-_dirty( rhs._dirty )
+_dirty( rhs._dirty ),
+_depth   ( rhs._depth ),
+_varIndex( rhs._varIndex ),
+_stack   ( rhs._stack.size() )
 {
     //nop
 }
 
 NumericExpression::NumericExpression( double staticValue ) :
 _value( staticValue ),
-_dirty( false )
+_dirty( false ),
+_depth( 0 )
 {
     _src = Stringify() << staticValue;
     init();
 }
 
-NumericExpression::NumericExpression( const Config& conf )
+NumericExpression::NumericExpression( const Config& conf ) :
+_depth( 0 )
 {
     mergeConfig( conf );
     init();
@@ -90,6 +100,7 @@ NumericExpression::init()
 {
     _vars.clear();
     _rpn.clear();
+    _binding = VariableBinding();
 
     StringTokenizer variablesTokenizer( "", "" );
     variablesTokenizer.addDelims( "[]", true );
@@ -255,6 +266,46 @@ NumericExpression::init()
         _rpn.push_back( s.top() );
         s.pop();
     }
+
+    compile();
+}
+
+// Works out the stack depth at each step of the RPN so evaluation can use a
+// preallocated stack. Operators that would find fewer than two operands are
+// skipped, as they always have been, so they become NOPs; unmatched
+// parentheses have always pushed their (zero) value, so they become operands.
+void
+NumericExpression::compile()
+{
+    _varIndex.assign( _rpn.size(), -1 );
+    for( unsigned i=0; i<_vars.size(); ++i )
+        _varIndex[_vars[i].second] = i;
+
+    unsigned depth = 0;
+    _depth = 0;
+    for( unsigned i=0; i<_rpn.size(); ++i )
+    {
+        Atom& a = _rpn[i];
+        if ( a.first == LPAREN || a.first == RPAREN || a.first == COMMA )
+        {
+            a.first = OPERAND;
+        }
+
+        if ( a.first == OPERAND || a.first == VARIABLE )
+        {
+            _depth = std::max( _depth, ++depth );
+        }
+        else if ( depth >= 2 )
+        {
+            --depth;
+        }
+        else
+        {
+            a.first = NOP;
+        }
+    }
+
+    _stack.resize( std::max(_depth, 1u) );
 }
 
 void 
@@ -273,86 +324,84 @@ NumericExpression::eval() const
 {
     if ( _dirty )
     {
-        std::stack<double> s;
+        double* s = _stack.empty() ? 0L : &_stack[0];
+        int top = -1;
+
+        for( AtomVector::const_iterator a = _rpn.begin(); a != _rpn.end(); ++a )
+        {
+            switch( a->first )
+            {
+            case OPERAND:
+            case VARIABLE: s[++top] = a->second; break;
+            case ADD:  --top; s[top] = s[top] + s[top+1]; break;
+            case SUB:  --top; s[top] = s[top] - s[top+1]; break;
+            case MULT: --top; s[top] = s[top] * s[top+1]; break;
+            case DIV:  --top; s[top] = s[top] / s[top+1]; break;
+            case MOD:  --top; s[top] = fmod(s[top], s[top+1]); break;
+            case MIN:  --top; s[top] = std::min(s[top], s[top+1]); break;
+            case MAX:  --top; s[top] = std::max(s[top], s[top+1]); break;
+            default: break;
+            }
+        }
+
+        const_cast<NumericExpression*>(this)->_value = top >= 0 ? s[top] : 0.0;
+        const_cast<NumericExpression*>(this)->_dirty = false;
+    }
+
+    return !osg::isNaN( _value ) ? _value : 0.0;
+}
+
+void
+NumericExpression::eval( const std::vector<const double*>& columns, unsigned count, double* out ) const
+{
+    // Same as the scalar eval, but each stack entry is a block of rows and
+    // each instruction runs over the whole block, in loops that vectorize.
+    if ( _stack.size() < _depth*BATCH_SIZE )
+        _stack.resize( _depth*BATCH_SIZE );
+
+    for( unsigned first = 0; first < count; first += BATCH_SIZE )
+    {
+        unsigned n = std::min( count-first, (unsigned)BATCH_SIZE );
+        double* s = 0L;
+        int top = -1;
 
         for( unsigned i=0; i<_rpn.size(); ++i )
         {
             const Atom& a = _rpn[i];
+            if ( a.first == NOP )
+                continue;
 
-            if ( a.first == ADD )
-            {
-                if ( s.size() >= 2 )
-                {
-                    double op2 = s.top(); s.pop();
-                    double op1 = s.top(); s.pop();
-                    s.push( op1 + op2 );
-                }
-            }
-            else if ( a.first == SUB )
-            {
-                if ( s.size() >= 2 )
-                {
-                    double op2 = s.top(); s.pop();
-                    double op1 = s.top(); s.pop();
-                    s.push( op1 - op2 );
-                }
-            }
-            else if ( a.first == MULT )
+            if ( a.first == OPERAND || a.first == VARIABLE )
             {
-                if ( s.size() >= 2 )
-                {
-                    double op2 = s.top(); s.pop();
-                    double op1 = s.top(); s.pop();
-                    s.push( op1 * op2 );
-                }
-            }
-            else if ( a.first == DIV )
-            {
-                if ( s.size() >= 2 )
-                {
-                    double op2 = s.top(); s.pop();
-                    double op1 = s.top(); s.pop();
-                    s.push( op1 / op2 );
-                }
-            }
-            else if ( a.first == MOD )
-            {
-                if ( s.size() >= 2 )
-                {
-                    double op2 = s.top(); s.pop();
-                    double op1 = s.top(); s.pop();
-                    s.push( fmod(op1, op2) );
-                }
-            }
-            else if ( a.first == MIN )
-            {
-                if ( s.size() >= 2 )
-                {
-                    double op2 = s.top(); s.pop();
-                    double op1 = s.top(); s.pop();
-                    s.push( std::min(op1, op2) );
-                }
-            }
-            else if ( a.first == MAX )
-            {
-                if ( s.size() >= 2 )
-                {
-                    double op2 = s.top(); s.pop();
-                    double op1 = s.top(); s.pop();
-                    s.push( std::max(op1, op2) );
-                }
+                s = &_stack[(++top)*BATCH_SIZE];
+                int v = _varIndex[i];
+                const double* column = v >= 0 && v < (int)columns.size() ? columns[v] : 0L;
+                if ( column )
+                    std::copy( column+first, column+first+n, s );
+                else
+                    std::fill( s, s+n, a.second );
+                continue;
             }
-            else // OPERAND or VARIABLE
+
+            double* r = &_stack[(--top)*BATCH_SIZE];
+            const double* b = s;
+            switch( a.first )
             {
-                s.push( a.second );
+            case ADD:  for(unsigned j=0; j<n; ++j) r[j] = r[j] + b[j]; break;
+            case SUB:  for(unsigned j=0; j<n; ++j) r[j] = r[j] - b[j]; break;
+            case MULT: for(unsigned j=0; j<n; ++j) r[j] = r[j] * b[j]; break;
+            case DIV:  for(unsigned j=0; j<n; ++j) r[j] = r[j] / b[j]; break;
+            case MOD:  for(unsigned j=0; j<n; ++j) r[j] = fmod(r[j], b[j]); break;
+            case MIN:  for(unsigned j=0; j<n; ++j) r[j] = std::min(r[j], b[j]); break;
+            case MAX:  for(unsigned j=0; j<n; ++j) r[j] = std::max(r[j], b[j]); break;
+            default: break;
             }
+            s = r;
         }
 
-        const_cast<NumericExpression*>(this)->_value = s.size() > 0 ? s.top() : 0.0;
-        const_cast<NumericExpression*>(this)->_dirty = false;
+        for( unsigned j=0; j<n; ++j )
+            out[first+j] = top >= 0 && !osg::isNaN(s[j]) ? s[j] : 0.0;
     }
-
-    return !osg::isNaN( _value ) ? _value : 0.0;
 }
 
 //------------------------------------------------------------------------
@@ -425,6 +474,8 @@ StringExpression::getConfig() const
 void
 StringExpression::init()
 {
+    _binding = VariableBinding();
+
     bool inQuotes = false;
     int inVar = 0;
     int startPos = 0;
@@ -535,11 +586,13 @@ StringExpression::eval() const
 {
     if ( _dirty )
     {
-        std::stringstream buf;
+        // append in place so the result keeps its capacity from one
+        // evaluation to the next.
+        std::string& value = const_cast<StringExpression*>(this)->_value;
+        value.clear();
         for( AtomVector::const_iterator i = _infix.begin(); i != _infix.end(); ++i )
-            buf << i->second;
+            value.append( i->second );
 
-        const_cast<StringExpression*>(this)->_value = buf.str();
         const_cast<StringExpression*>(this)->_dirty = false;
     }
 
@@ -990,6 +990,18 @@ EarthManipulator::setViewpoint(const Viewpoint& vp, double duration_seconds)
                 _settings->getAutoViewpointDurationLimits( minDur, maxDur );
                 _setVPDuration.set( minDur + ratio*(maxDur-minDur), Units::SECONDS );
             }
+
+            // Let the terrain start loading the destination now.
+            osg::ref_ptr<MapNode> mapNode;
+            if ( _mapNode.lock(mapNode) && mapNode->getTerrainEngine() )
+            {
+                GeoPoint endPoint;
+                if ( endPoint.fromWorld(_srs.get(), endWorld) )
+                {
+                    endPoint.z() = 0.0;
+                    mapNode->getTerrainEngine()->prefetch( endPoint, range1 );
+                }
+            }
         }
 
         else
@@ -27,6 +27,10 @@
 #include <ogr_api.h>
 #include <osgEarthFeatures/OgrUtils>
 #include <osgDB/FileUtils>
+#include <osg/Timer>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 
 using namespace osgEarth;
 using namespace osgEarth::Util;
@@ -36,7 +40,69 @@ using namespace std;
 
 #define OGR_SCOPED_LOCK GDAL_SCOPED_LOCK
 
-TileIndex::TileIndex()
+// maximum number of children in an R-tree node.
+#define NODE_CAPACITY 16
+
+namespace
+{
+    typedef std::vector<TileIndex::Entry> EntryVector;
+
+    template<typename T>
+    struct LessCenterX {
+        bool operator()(const T& a, const T& b) const { return a._xmin+a._xmax < b._xmin+b._xmax; }
+    };
+
+    template<typename T>
+    struct LessCenterY {
+        bool operator()(const T& a, const T& b) const { return a._ymin+a._ymax < b._ymin+b._ymax; }
+    };
+
+    // Sort-Tile-Recursive ordering: sorts the boxes into vertical slices by X,
+    // and each slice by Y, so that consecutive runs of "capacity" boxes are
+    // spatially compact.
+    template<typename T>
+    void sortTileRecursive(typename std::vector<T>::iterator begin,
+                           typename std::vector<T>::iterator end,
+                           unsigned capacity)
+    {
+        unsigned count = end - begin;
+        if ( count <= capacity )
+            return;
+
+        unsigned numNodes  = (count + capacity - 1) / capacity;
+        unsigned numSlices = (unsigned)ceil( sqrt((double)numNodes) );
+        unsigned sliceSize = numSlices * capacity;
+
+        std::sort( begin, end, LessCenterX<T>() );
+
+        for(typename std::vector<T>::iterator slice = begin; slice < end; )
+        {
+            typename std::vector<T>::iterator sliceEnd =
+                (unsigned)(end - slice) > sliceSize ? slice + sliceSize : end;
+            std::sort( slice, sliceEnd, LessCenterY<T>() );
+            slice = sliceEnd;
+        }
+    }
+
+    struct LessOrdinal {
+        bool operator()(const TileIndex::Entry& a, const TileIndex::Entry& b) const { return a._ordinal < b._ordinal; }
+    };
+
+    template<typename A, typename B>
+    bool overlaps(const A& a, const B& b)
+    {
+        return a._xmin <= b._xmax && a._xmax >= b._xmin && a._ymin <= b._ymax && a._ymax >= b._ymin;
+    }
+
+    struct Box
+    {
+        Box(const Bounds& b) : _xmin(b.xMin()), _ymin(b.yMin()), _xmax(b.xMax()), _ymax(b.yMax()) { }
+        double _xmin, _ymin, _xmax, _ymax;
+    };
+}
+
+TileIndex::TileIndex() :
+_indexDirty( true )
 {
 }
 
@@ -105,25 +171,174 @@ TileIndex*
 }
 
 
+const SpatialReference*
+TileIndex::getSRS() const
+{
+    return _features->getFeatureProfile() ? _features->getFeatureProfile()->getSRS() : 0L;
+}
+
 void
     TileIndex::getFiles(const osgEarth::GeoExtent& extent, std::vector< std::string >& files)
 {            
     files.clear();
-    osgEarth::Symbology::Query query;    
 
-    GeoExtent transformed = extent.transform( _features->getFeatureProfile()->getSRS() );
-    query.bounds() = transformed.bounds();
-    osg::ref_ptr< osgEarth::Features::FeatureCursor> cursor = _features->createFeatureCursor( query );
+    std::vector< Entry > entries;
+    getEntries( extent, entries );
 
-    while (cursor->hasMore())
+    files.reserve( entries.size() );
+    for(unsigned i=0; i<entries.size(); ++i)
+    {
+        files.push_back( entries[i]._filename );
+    }
+}
+
+void
+TileIndex::getEntries(const osgEarth::GeoExtent& extent, std::vector< Entry >& entries)
+{
+    entries.clear();
+
+    GeoExtent transformed = extent.transform( getSRS() );
+    if ( !transformed.isValid() )
+        return;
+
+    Bounds bounds = transformed.bounds();
+
+    {
+        Threading::ScopedReadLock shared( _indexMutex );
+        if ( !_indexDirty )
+        {
+            search( bounds, entries );
+            return;
+        }
+    }
+
+    Threading::ScopedWriteLock exclusive( _indexMutex );
+    if ( _indexDirty )
+    {
+        buildIndex();
+    }
+    search( bounds, entries );
+}
+
+// Reads every file in the index and packs them into the R-tree.
+// Call with the index mutex held exclusively.
+void
+TileIndex::buildIndex()
+{
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    _entries.clear();
+    _nodes.clear();
+
+    // read all the footprints; the leaf level starts as one node per entry.
+    std::vector< Node > level;
+
+    osg::ref_ptr< osgEarth::Features::FeatureCursor> cursor = _features->createFeatureCursor( osgEarth::Symbology::Query() );
+    while (cursor.valid() && cursor->hasMore())
     {
         osg::ref_ptr< osgEarth::Features::Feature> feature = cursor->nextFeature();
-        if (feature.valid())
+        if (feature.valid() && feature->getGeometry())
+        {
+            Entry entry;
+            entry._filename = getFullPath(_filename, feature->getString("location"));
+            entry._bounds   = feature->getGeometry()->getBounds();
+            entry._ordinal  = _entries.size();
+            if ( !entry._bounds.isValid() )
+                continue;
+
+            Box box( entry._bounds );
+            Node node = { box._xmin, box._ymin, box._xmax, box._ymax, (unsigned)_entries.size(), 1, true };
+            level.push_back( node );
+            _entries.push_back( entry );
+        }
+    }
+
+    if ( !_entries.empty() )
+    {
+        // put the entries in STR order and build the leaves over them.
+        sortTileRecursive<Node>( level.begin(), level.end(), NODE_CAPACITY );
+
+        EntryVector sorted;
+        sorted.reserve( _entries.size() );
+        for(unsigned i=0; i<level.size(); ++i)
+            sorted.push_back( _entries[level[i]._first] );
+        _entries.swap( sorted );
+
+        for(unsigned i=0; i<_entries.size(); i += NODE_CAPACITY)
+        {
+            Node leaf = { DBL_MAX, DBL_MAX, -DBL_MAX, -DBL_MAX, i, std::min((unsigned)NODE_CAPACITY, (unsigned)_entries.size()-i), true };
+            for(unsigned e=leaf._first; e<leaf._first+leaf._count; ++e)
+            {
+                Box box( _entries[e]._bounds );
+                leaf._xmin = std::min(leaf._xmin, box._xmin);
+                leaf._ymin = std::min(leaf._ymin, box._ymin);
+                leaf._xmax = std::max(leaf._xmax, box._xmax);
+                leaf._ymax = std::max(leaf._ymax, box._ymax);
+            }
+            _nodes.push_back( leaf );
+        }
+
+        // pack each level into parents until one root remains.
+        unsigned levelStart = 0, levelEnd = _nodes.size();
+        while( levelEnd - levelStart > 1 )
+        {
+            sortTileRecursive<Node>( _nodes.begin()+levelStart, _nodes.begin()+levelEnd, NODE_CAPACITY );
+
+            for(unsigned i=levelStart; i<levelEnd; i += NODE_CAPACITY)
+            {
+                Node parent = { DBL_MAX, DBL_MAX, -DBL_MAX, -DBL_MAX, i, std::min((unsigned)NODE_CAPACITY, levelEnd-i), false };
+                for(unsigned c=parent._first; c<parent._first+parent._count; ++c)
+                {
+                    const Node& child = _nodes[c];
+                    parent._xmin = std::min(parent._xmin, child._xmin);
+                    parent._ymin = std::min(parent._ymin, child._ymin);
+                    parent._xmax = std::max(parent._xmax, child._xmax);
+                    parent._ymax = std::max(parent._ymax, child._ymax);
+                }
+                _nodes.push_back( parent );
+            }
+
+            levelStart = levelEnd;
+            levelEnd   = _nodes.size();
+        }
+    }
+
+    _indexDirty = false;
+
+    OE_INFO << "[TileIndex] Indexed " << _entries.size() << " files from " << _filename << " in "
+        << osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) << " ms" << std::endl;
+}
+
+void
+TileIndex::search(const Bounds& bounds, std::vector< Entry >& entries) const
+{
+    if ( _nodes.empty() )
+        return;
+
+    Box box( bounds );
+
+    std::vector<unsigned> stack;
+    stack.push_back( _nodes.size()-1 );
+
+    while( !stack.empty() )
+    {
+        const Node& node = _nodes[stack.back()];
+        stack.pop_back();
+
+        if ( !overlaps(node, box) )
+            continue;
+
+        for(unsigned i=node._first; i<node._first+node._count; ++i)
         {
-            std::string location = getFullPath(_filename, feature->getString("location"));
-            files.push_back( location );
+            if ( !node._leaf )
+                stack.push_back( i );
+            else if ( overlaps(Box(_entries[i]._bounds), box) )
+                entries.push_back( _entries[i] );
         }
-    }    
+    }
+
+    // the tree holds the entries in STR order; return them in index order.
+    std::sort( entries.begin(), entries.end(), LessOrdinal() );
 }
 
 bool TileIndex::add( const std::string& filename, const GeoExtent& extent )
@@ -141,6 +356,11 @@ bool TileIndex::add( const std::string& filename, const GeoExtent& extent )
     const SpatialReference* wgs84 = SpatialReference::create("epsg:4326");
     feature->transform( wgs84 );
 
-    return _features->insertFeature( feature.get() );    
+    if ( !_features->insertFeature( feature.get() ) )
+        return false;
+
+    // the R-tree will rebuild on the next lookup.
+    Threading::ScopedWriteLock exclusive( _indexMutex );
+    _indexDirty = true;
     return true;
 }